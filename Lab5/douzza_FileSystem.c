@@ -1,1061 +1,1339 @@
 /*
- * 简单文件系统实现
+ * 简单文件系统命令行
  *
- * 本实现在内存中创建一个虚拟磁盘，并实现一个具有多级目录结构的简单文件系统。
+ * 文件系统引擎见 douzza_fs.h / douzza_fs.c，本文件只负责解析命令、调用库接口并打印结果。
+ * 除交互使用外，还可以用 -b 从脚本文件或标准输入批量执行命令，配合 -o quiet/machine
+ * 只输出错误和数据，或输出便于程序解析的格式。
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "douzza_fs.h"
 
 /* 常量定义 */
-#define BLOCK_SIZE 1024       // 每个块的大小（字节）
-#define DISK_SIZE 1024*1024   // 虚拟磁盘总大小（1MB）
-#define BLOCK_NUM (DISK_SIZE / BLOCK_SIZE)  // 块的数量
-#define MAX_FILENAME_LENGTH 28  // 最大文件名长度
-#define MAX_OPEN_FILES 16     // 同时打开的最大文件数
-#define MAX_PATH_LENGTH 256   // 最大路径长度
-#define ROOT_BLOCK 0          // 根目录从块0开始
-#define FAT_BLOCK 1           // FAT表从块1开始
-#define DATA_BLOCK 2          // 数据块从块2开始
-#define EOF_BLOCK 0xFFFF      // FAT中的文件结束标记
+#define IMAGE_FILE "filesystem.img"   // 磁盘映像文件名
+#define JOURNAL_FILE "filesystem.jnl" // 元数据日志文件名
+#define MAX_ARGS 16                   // 一条命令最多的参数个数（含命令名）
+#define OUTPUT_BUFFER_SIZE (64 * 1024) // 批量模式下标准输出的缓冲区大小
+#define BATCH_GROUP_OPS 4096          // 批量模式下组提交的操作数阈值
+#define BATCH_GROUP_MS 1000           // 批量模式下组提交的等待时间阈值（毫秒）
+#define COPY_CHUNK_SIZE (4 * 1024 * 1024) // 导入导出时每次搬运的字节数
+#define WRITE_CHUNK_SIZE (64 * 1024)  // 多行输入时攒够这么多字节写入一次
+
+// 输出模式
+#define OUTPUT_NORMAL 0               // 完整的中文提示
+#define OUTPUT_QUIET 1                // 只输出错误和读出的数据
+#define OUTPUT_MACHINE 2              // 每条命令先输出一行状态（ok [值] 或 err 错误码 说明），再输出数据
 
 /* 结构体定义 */
 
-// FAT表条目
-typedef unsigned short FAT_ENTRY;
-
-// 文件/目录属性
+// 命令行会话
 typedef struct {
-    unsigned char is_dir : 1;     // 是否是目录
-    unsigned char read : 1;       // 读权限
-    unsigned char write : 1;      // 写权限
-    unsigned char reserved : 5;   // 保留位
-} Attributes;
-
-// 目录项结构
-typedef struct {
-    char filename[MAX_FILENAME_LENGTH];  // 文件名
-    Attributes attr;                     // 文件属性
-    unsigned short first_block;          // 第一个数据块号
-    unsigned int file_size;              // 文件大小
-    time_t create_time;                  // 创建时间
-} DirEntry;
-
-// 打开文件表项
+    fs_instance* fs;
+    FILE* in;                            // 命令来源
+    int output;                          // 输出模式（OUTPUT_*）
+    bool batch;                          // 批量模式：不显示提示符，输出整块缓冲
+    bool interactive;                    // 从终端输入：每条命令后提交日志事务
+    bool running;                        // 为false时结束命令循环
+    bool dump_stats;                     // 退出时输出运行计数
+    char* line;                          // 当前输入行（getline分配）
+    size_t line_cap;
+} Shell;
+
+// 命令表项
 typedef struct {
-    char filename[MAX_FILENAME_LENGTH];  // 文件名
-    unsigned short first_block;          // 第一个数据块号
-    unsigned int file_size;              // 文件大小
-    unsigned int current_pos;            // 当前位置
-    bool is_used;                        // 是否使用
-    bool can_read;                       // 是否可读
-    bool can_write;                      // 是否可写
-} OpenFileEntry;
-
-/* 全局变量 */
-unsigned char* virtual_disk = NULL;        // 虚拟磁盘
-FAT_ENTRY* fat = NULL;                     // 指向FAT表的指针
-OpenFileEntry open_file_table[MAX_OPEN_FILES];  // 打开文件表
-char current_dir[MAX_PATH_LENGTH] = "/";   // 当前目录
-unsigned short current_dir_block = ROOT_BLOCK; // 当前目录块
+    const char* name;                    // 命令名
+    const char* alias;                   // 兼容的旧命令名
+    int min_args;                        // 必需的参数个数（不含命令名）
+    const char* usage;                   // 用法
+    const char* help;                    // 说明
+    void (*run)(Shell* sh, int argc, char** argv);
+} Command;
 
 /* 函数声明 */
-void my_format();
-int my_mkdir(const char* dirname);
-int my_rmdir(const char* dirname);
-void my_ls();
-int my_cd(const char* dirname);
-int my_create(const char* filename);
-int my_open(const char* filename, char mode);
-int my_close(int fd);
-int my_write(int fd, const char* buffer, int length);
-int my_read(int fd, char* buffer, int length);
-int my_rm(const char* filename);
-void my_exitsys();
-
-// 辅助函数
-unsigned short alloc_block();
-void free_block(unsigned short block);
-int find_file_or_dir(const char* name, DirEntry* entry);
-int find_empty_entry();
-void save_to_file(const char* filename);
-void load_from_file(const char* filename);
-
-/* 文件系统实现 */
-
-// 格式化虚拟磁盘
-void my_format() {
-    printf("格式化文件系统...\n");
-
-    // 释放之前的虚拟磁盘（如果存在）
-    if (virtual_disk != NULL) {
-        free(virtual_disk);
-    }
-
-    // 分配虚拟磁盘空间
-    virtual_disk = (unsigned char*)malloc(DISK_SIZE);
-    if (virtual_disk == NULL) {
-        printf("内存分配失败！\n");
-        exit(1);
-    }
-
-    // 初始化所有块为0
-    memset(virtual_disk, 0, DISK_SIZE);
-
-    // 初始化FAT表
-    fat = (FAT_ENTRY*)(virtual_disk + FAT_BLOCK * BLOCK_SIZE);
-
-    // 设置已使用的块（根目录和FAT表）
-    fat[ROOT_BLOCK] = EOF_BLOCK;
-    fat[FAT_BLOCK] = EOF_BLOCK;
-
-    // 将其余块标记为空闲
-    for (int i = DATA_BLOCK; i < BLOCK_NUM; i++) {
-        fat[i] = 0;
-    }
-
-    // 初始化根目录
-    DirEntry* root_dir = (DirEntry*)(virtual_disk + ROOT_BLOCK * BLOCK_SIZE);
-    memset(root_dir, 0, BLOCK_SIZE);
-    
-    // 添加 "." 条目 (根目录指向自身)
-    strcpy(root_dir[0].filename, ".");
-    root_dir[0].attr.is_dir = 1;
-    root_dir[0].attr.read = 1;
-    root_dir[0].attr.write = 1;
-    root_dir[0].first_block = ROOT_BLOCK;
-    root_dir[0].file_size = 0;
-    root_dir[0].create_time = time(NULL);
-    
-    // 添加 ".." 条目 (根目录的父目录是自身)
-    strcpy(root_dir[1].filename, "..");
-    root_dir[1].attr.is_dir = 1;
-    root_dir[1].attr.read = 1;
-    root_dir[1].attr.write = 1;
-    root_dir[1].first_block = ROOT_BLOCK; // 根目录的父目录仍是自己
-    root_dir[1].file_size = 0;
-    root_dir[1].create_time = time(NULL);
-
-    // 设置当前目录为根目录
-    strcpy(current_dir, "/");
-    current_dir_block = ROOT_BLOCK;
-
-    // 初始化打开文件表
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        open_file_table[i].is_used = false;
-    }
-
-    printf("文件系统格式化完成！\n");
-}
-
-// 创建目录
-int my_mkdir(const char* dirname) {
-    if (strlen(dirname) >= MAX_FILENAME_LENGTH) {
-        printf("目录名过长！\n");
-        return -1;
-    }
-
-    // 检查目录是否已存在
-    DirEntry temp;
-    if (find_file_or_dir(dirname, &temp) != -1) {
-        printf("目录 %s 已存在！\n", dirname);
-        return -1;
-    }
-
-    // 查找当前目录中的空条目
-    DirEntry* current_dir_entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-    int empty_entry = -1;
-    for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-        if (current_dir_entries[i].filename[0] == '\0') {
-            empty_entry = i;
-            break;
-        }
+void say(Shell* sh, const char* fmt, ...);
+void reply_ok(Shell* sh, long long value);
+void reply_error(Shell* sh, const char* what, int err);
+void reply_usage(Shell* sh, const char* usage);
+void print_data(Shell* sh, const char* data, int length);
+int tokenize(char* line, char** argv, int max_args);
+int print_dirent(const FsDirent* entry, void* arg);
+void print_saved(Shell* sh);
+void cmd_format(Shell* sh, int argc, char** argv);
+void cmd_mkdir(Shell* sh, int argc, char** argv);
+void cmd_rmdir(Shell* sh, int argc, char** argv);
+void cmd_ls(Shell* sh, int argc, char** argv);
+void cmd_cd(Shell* sh, int argc, char** argv);
+void cmd_create(Shell* sh, int argc, char** argv);
+void cmd_open(Shell* sh, int argc, char** argv);
+void cmd_close(Shell* sh, int argc, char** argv);
+void cmd_write(Shell* sh, int argc, char** argv);
+void cmd_read(Shell* sh, int argc, char** argv);
+void cmd_import(Shell* sh, int argc, char** argv);
+void cmd_export(Shell* sh, int argc, char** argv);
+void cmd_lseek(Shell* sh, int argc, char** argv);
+void cmd_fallocate(Shell* sh, int argc, char** argv);
+void cmd_pwrite(Shell* sh, int argc, char** argv);
+void cmd_pread(Shell* sh, int argc, char** argv);
+void cmd_rm(Shell* sh, int argc, char** argv);
+void cmd_sync(Shell* sh, int argc, char** argv);
+void cmd_writeback(Shell* sh, int argc, char** argv);
+void cmd_df(Shell* sh, int argc, char** argv);
+void cmd_exit(Shell* sh, int argc, char** argv);
+void cmd_stats(Shell* sh, int argc, char** argv);
+void cmd_defrag(Shell* sh, int argc, char** argv);
+void print_fragstat(Shell* sh, const char* tag, const char* label, const FsFragStat* st);
+void cmd_dedup(Shell* sh, int argc, char** argv);
+void cmd_fsck(Shell* sh, int argc, char** argv);
+void print_fsck(Shell* sh, const FsFsckStat* st, double ms);
+void cmd_snapshot(Shell* sh, int argc, char** argv);
+int print_snapshot(const FsSnapshot* snap, void* arg);
+void cmd_help(Shell* sh, int argc, char** argv);
+unsigned long long latency_percentile(const unsigned long long* hist, unsigned long long count, double p);
+const Command* find_command(const char* name);
+void run_line(Shell* sh, char* line);
+void print_mount_info(Shell* sh);
+
+// 命令表
+static const Command commands[] = {
+    {"format", "my_format", 0, "format [fat|extent] [块大小] [块数] [16|32]",
+     "格式化文件系统（可选默认布局和卷几何参数）", cmd_format},
+    {"mkdir", "my_mkdir", 1, "mkdir <路径>", "创建目录", cmd_mkdir},
+    {"rmdir", "my_rmdir", 1, "rmdir <路径>", "删除目录", cmd_rmdir},
+    {"ls", "my_ls", 0, "ls [路径]", "显示目录内容（默认当前目录）", cmd_ls},
+    {"cd", "my_cd", 1, "cd <路径>", "切换目录", cmd_cd},
+    {"create", "my_create", 1, "create <路径> [fat|extent]", "创建文件", cmd_create},
+    {"open", "my_open", 2, "open <路径> <模式(r/w/a)> [预计大小]",
+     "打开文件（模式: r-读, w-写, a-追加；给出预计大小时预留连续的块）", cmd_open},
+    {"close", "my_close", 1, "close <文件描述符>", "关闭文件", cmd_close},
+    {"write", "my_write", 1, "write <文件描述符> [内容]",
+     "写入文件（不提供内容时进入多行输入模式，以单独一行的END结束）", cmd_write},
+    {"read", "my_read", 1, "read <文件描述符> [读取字节数]", "读取文件", cmd_read},
+    {"import", NULL, 2, "import <主机文件> <路径> [fat|extent]", "把主机文件导入为文件系统中的文件", cmd_import},
+    {"export", NULL, 2, "export <路径> <主机文件>", "把文件系统中的文件导出为主机文件", cmd_export},
+    {"lseek", "my_lseek", 2, "lseek <文件描述符> <偏移> [set|cur|end]", "移动读写位置", cmd_lseek},
+    {"pwrite", "my_pwrite", 3, "pwrite <文件描述符> <偏移> <内容>", "在指定位置写入", cmd_pwrite},
+    {"fallocate", NULL, 2, "fallocate <文件描述符> <字节数>", "为文件预留连续的块（不改变文件大小）", cmd_fallocate},
+    {"pread", "my_pread", 2, "pread <文件描述符> <偏移> [读取字节数]", "从指定位置读取", cmd_pread},
+    {"rm", "my_rm", 1, "rm <路径>", "删除文件", cmd_rm},
+    {"df", "my_df", 0, "df", "显示磁盘空间使用情况", cmd_df},
+    {"sync", "my_sync", 0, "sync", "把修改过的块写回映像文件", cmd_sync},
+    {"writeback", NULL, 0, "writeback [off|<间隔毫秒> [脏块阈值]]",
+     "设置后台回写：定期或脏块达到阈值时在后台写回映像（不带参数时显示当前设置）", cmd_writeback},
+    {"stats", NULL, 0, "stats [reset]", "显示运行计数和各接口的延迟（reset清零）", cmd_stats},
+    {"defrag", NULL, 0, "defrag [check]", "碎片整理，显示整理前后的碎片情况（check只显示不整理）", cmd_defrag},
+    {"dedup", NULL, 0, "dedup", "去重：区段布局文件中内容相同的块改为共享同一块，显示回收的空间", cmd_dedup},
+    {"fsck", NULL, 0, "fsck [repair]", "一致性检查：核对目录树、FAT和各文件占用的块（repair同时修复，需关闭所有文件）", cmd_fsck},
+    {"snapshot", NULL, 1, "snapshot create|rollback|delete <名字> / list",
+     "创建、回滚到、删除卷快照，或列出快照（回滚前需关闭所有文件）", cmd_snapshot},
+    {"exit", "my_exitsys", 0, "exit/quit", "退出文件系统", cmd_exit},
+    {"quit", NULL, 0, "quit", NULL, cmd_exit},
+    {"help", NULL, 0, "help", "显示本帮助", cmd_help},
+};
+
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+// 普通输出模式下打印提示信息
+void say(Shell* sh, const char* fmt, ...) {
+    if (sh->output != OUTPUT_NORMAL) {
+        return;
     }
-
-    if (empty_entry == -1) {
-        printf("当前目录已满！\n");
-        return -1;
-    }
-
-    // 分配新块用于目录
-    unsigned short new_block = alloc_block();
-    if (new_block == 0) {
-        printf("磁盘空间不足！\n");
-        return -1;
-    }
-
-    // 初始化新目录块
-    DirEntry* new_dir_entries = (DirEntry*)(virtual_disk + new_block * BLOCK_SIZE);
-    memset(new_dir_entries, 0, BLOCK_SIZE);
-    
-    // 添加 "." 条目 (指向自身)
-    strcpy(new_dir_entries[0].filename, ".");
-    new_dir_entries[0].attr.is_dir = 1;
-    new_dir_entries[0].attr.read = 1;
-    new_dir_entries[0].attr.write = 1; 
-    new_dir_entries[0].first_block = new_block;
-    new_dir_entries[0].file_size = 0;
-    new_dir_entries[0].create_time = time(NULL);
-    
-    // 添加 ".." 条目 (指向父目录)
-    strcpy(new_dir_entries[1].filename, "..");
-    new_dir_entries[1].attr.is_dir = 1;
-    new_dir_entries[1].attr.read = 1;
-    new_dir_entries[1].attr.write = 1;
-    new_dir_entries[1].first_block = current_dir_block; // 指向父目录
-    new_dir_entries[1].file_size = 0;
-    new_dir_entries[1].create_time = time(NULL);
-
-    // 在当前目录中创建新条目
-    strcpy(current_dir_entries[empty_entry].filename, dirname);
-    current_dir_entries[empty_entry].attr.is_dir = 1;
-    current_dir_entries[empty_entry].attr.read = 1;
-    current_dir_entries[empty_entry].attr.write = 1;
-    current_dir_entries[empty_entry].first_block = new_block;
-    current_dir_entries[empty_entry].file_size = 0;
-    current_dir_entries[empty_entry].create_time = time(NULL);
-
-    printf("目录 %s 创建成功！\n", dirname);
-    return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
 }
 
-// 删除目录
-int my_rmdir(const char* dirname) {
-    // 不允许删除"."和".."
-    if (strcmp(dirname, ".") == 0 || strcmp(dirname, "..") == 0) {
-        printf("不能删除 %s 目录！\n", dirname);
-        return -1;
+// 机器可读模式下打印成功状态，value为负时不带值
+void reply_ok(Shell* sh, long long value) {
+    if (sh->output != OUTPUT_MACHINE) {
+        return;
     }
-
-    // 查找目录
-    DirEntry entry;
-    int entry_index = find_file_or_dir(dirname, &entry);
-    if (entry_index == -1) {
-        printf("目录 %s 不存在！\n", dirname);
-        return -1;
+    if (value < 0) {
+        fputs("ok\n", stdout);
+    } else {
+        printf("ok %lld\n", value);
     }
+}
 
-    // 确保是目录
-    if (!entry.attr.is_dir) {
-        printf("%s 不是目录！\n", dirname);
-        return -1;
+// 打印失败原因（各种输出模式下都会输出）
+void reply_error(Shell* sh, const char* what, int err) {
+    if (sh->output == OUTPUT_MACHINE) {
+        printf("err %d %s\n", err, fs_strerror(err));
+    } else {
+        printf("%s失败：%s！\n", what, fs_strerror(err));
     }
+}
 
-    // 检查目录是否为空
-    DirEntry* dir_entries = (DirEntry*)(virtual_disk + entry.first_block * BLOCK_SIZE);
-    for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-        if (dir_entries[i].filename[0] != '\0') {
-            printf("目录 %s 不为空！\n", dirname);
-            return -1;
-        }
+// 打印命令用法（参数不足时）
+void reply_usage(Shell* sh, const char* usage) {
+    if (sh->output == OUTPUT_MACHINE) {
+        printf("err %d 用法: %s\n", FS_ERR_INVAL, usage);
+    } else {
+        printf("用法: %s\n", usage);
     }
-
-    // 释放目录占用的块
-    free_block(entry.first_block);
-
-    // 从当前目录中删除条目
-    DirEntry* current_dir_entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-    memset(&current_dir_entries[entry_index], 0, sizeof(DirEntry));
-
-    printf("目录 %s 删除成功！\n", dirname);
-    return 0;
 }
 
-// 显示当前目录内容
-void my_ls() {
-    DirEntry* entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-
-    printf("当前目录: %s\n", current_dir);
-    printf("名称\t\t\t类型\t大小\t创建时间\t权限\n");
-
-    for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-        if (entries[i].filename[0] != '\0') {
-            char type = entries[i].attr.is_dir ? 'd' : 'f';
-            char perm[4] = "---";
-            if (entries[i].attr.read) perm[0] = 'r';
-            if (entries[i].attr.write) perm[1] = 'w';
-
-            char time_str[30];
-            struct tm* timeinfo = localtime(&entries[i].create_time);
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", timeinfo);
-
-            printf("%-20s\t%c\t%5d\t%s\t%s\n",
-                   entries[i].filename,
-                   type,
-                   entries[i].file_size,
-                   time_str,
-                   perm);
+// 打印读出的数据
+void print_data(Shell* sh, const char* data, int length) {
+    if (sh->output == OUTPUT_NORMAL) {
+        if (length > 0) {
+            printf("读取内容（%d 字节）：\n%.*s\n", length, length, data);
+        } else {
+            printf("已到达文件末尾\n");
         }
+    } else if (sh->output == OUTPUT_QUIET) {
+        fwrite(data, 1, length, stdout);
+    } else {
+        // 状态行给出字节数，随后是原样的数据和一个换行
+        printf("ok %d\n", length);
+        fwrite(data, 1, length, stdout);
+        putchar('\n');
     }
 }
 
-// 切换目录
-int my_cd(const char* dirname) {
-    // 处理空目录名
-    if (dirname == NULL || dirname[0] == '\0') {
-        printf("用法: cd <目录名>\n");
-        return -1;
-    }
-    
-    // 创建临时变量来存储结果，只有在成功时才更新当前目录
-    char temp_dir[MAX_PATH_LENGTH];
-    unsigned short temp_dir_block;
-    
-    // 处理绝对路径，从根目录开始
-    if (dirname[0] == '/') {
-        strcpy(temp_dir, "/");
-        temp_dir_block = ROOT_BLOCK;
-        
-        // 如果只是根目录"/"，直接返回成功
-        if (dirname[1] == '\0') {
-            strcpy(current_dir, temp_dir);
-            current_dir_block = temp_dir_block;
-            return 0;
+// 把一行命令原地切分为参数，返回参数个数，引号不匹配或参数过多时返回-1
+// 空白分隔参数；双引号内可用 \" \\ \n \t 转义，单引号内按原样；不在引号中的 # 开始注释
+int tokenize(char* line, char** argv, int max_args) {
+    int argc = 0;
+    char* src = line;
+    char* dst = line;
+
+    while (1) {
+        while (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n') {
+            src++;
         }
-        
-        // 处理剩余路径部分
-        dirname++;  // 跳过开头的'/'
-    } else {
-        // 相对路径，复制当前目录作为起点
-        strcpy(temp_dir, current_dir);
-        temp_dir_block = current_dir_block;
-    }
-    
-    // 分割路径并逐级处理
-    char path_copy[MAX_PATH_LENGTH];
-    strcpy(path_copy, dirname);
-    
-    char* token;
-    char* rest = path_copy;
-    char delim[] = "/";
-    
-    while ((token = strtok_r(rest, delim, &rest))) {
-        // 处理"."（当前目录）
-        if (strcmp(token, ".") == 0) {
-            continue;  // 不做任何操作
+        if (*src == '\0' || *src == '#') {
+            break;
         }
-        
-        // 处理".."（父目录）
-        else if (strcmp(token, "..") == 0) {
-            // 如果已经在根目录，就保持不变
-            if (strcmp(temp_dir, "/") == 0) {
-                continue;
-            }
-            
-            // 找到当前目录中的 ".." 目录项
-            DirEntry* entries = (DirEntry*)(virtual_disk + temp_dir_block * BLOCK_SIZE);
-            int found = 0;
-            
-            for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-                if (entries[i].filename[0] != '\0' && 
-                    entries[i].attr.is_dir && 
-                    strcmp(entries[i].filename, "..") == 0) {
-                    // 直接使用 ".." 条目中存储的父目录块号
-                    temp_dir_block = entries[i].first_block;
-                    found = 1;
-                    break;
+        if (argc == max_args) {
+            return -1;
+        }
+
+        // 参数内容写回到原缓冲区，引号和转义符去掉后只会变短
+        argv[argc++] = dst;
+        while (*src != '\0' && *src != ' ' && *src != '\t' && *src != '\r' && *src != '\n') {
+            if (*src == '"') {
+                src++;
+                while (*src != '"') {
+                    if (*src == '\0') {
+                        return -1;
+                    }
+                    if (*src == '\\' && src[1] != '\0') {
+                        src++;
+                        switch (*src) {
+                            case 'n': *dst++ = '\n'; break;
+                            case 't': *dst++ = '\t'; break;
+                            default: *dst++ = *src; break;
+                        }
+                        src++;
+                    } else {
+                        *dst++ = *src++;
+                    }
                 }
-            }
-            
-            // 如果没有找到 ".." 条目（可能是根目录或文件系统损坏）
-            if (!found) {
-                if (temp_dir_block != ROOT_BLOCK) {
-                    printf("警告：目录结构损坏，无法找到父目录\n");
-                    return -1;
+                src++;
+            } else if (*src == '\'') {
+                src++;
+                while (*src != '\'') {
+                    if (*src == '\0') {
+                        return -1;
+                    }
+                    *dst++ = *src++;
                 }
-                continue;  // 在根目录，保持不变
-            }
-            
-            // 更新路径字符串 - 截断到最后一个 '/'
-            char* last_slash = strrchr(temp_dir, '/');
-            if (last_slash == temp_dir) {
-                // 返回根目录
-                temp_dir[1] = '\0';
+                src++;
             } else {
-                *last_slash = '\0';
-                // 如果截断后为空，则设为根目录
-                if (temp_dir[0] == '\0') {
-                    strcpy(temp_dir, "/");
-                }
+                *dst++ = *src++;
             }
         }
-        
-        // 处理常规目录
-        else {
-            DirEntry entry;
-            int found = 0;
-            DirEntry* entries = (DirEntry*)(virtual_disk + temp_dir_block * BLOCK_SIZE);
-            
-            for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-                if (entries[i].filename[0] != '\0' && 
-                    entries[i].attr.is_dir && 
-                    strcmp(entries[i].filename, token) == 0) {
-                    entry = entries[i];
-                    found = 1;
-                    break;
-                }
-            }
-            
-            if (!found) {
-                printf("目录 %s 不存在！\n", token);
-                return -1;
-            }
-            
-            // 更新临时目录块
-            temp_dir_block = entry.first_block;
-            
-            // 更新临时目录路径
-            if (strcmp(temp_dir, "/") != 0) {
-                strcat(temp_dir, "/");
-            }
-            strcat(temp_dir, token);
+
+        // 参数结束：跳过分隔符后再写结束符，避免覆盖尚未读取的内容
+        if (*src != '\0') {
+            src++;
         }
+        *dst++ = '\0';
     }
-    
-    // 所有路径处理成功，更新实际的当前目录
-    strcpy(current_dir, temp_dir);
-    current_dir_block = temp_dir_block;
-    
-    return 0;
+
+    return argc;
 }
 
-// 创建文件
-int my_create(const char* filename) {
-    if (strlen(filename) >= MAX_FILENAME_LENGTH) {
-        printf("文件名过长！\n");
-        return -1;
+// 打印一个目录项（fs_listdir回调）
+int print_dirent(const FsDirent* entry, void* arg) {
+    Shell* sh = (Shell*)arg;
+    char type = entry->is_dir ? 'd' : 'f';
+    char perm[4] = "---";
+    if (entry->read) perm[0] = 'r';
+    if (entry->write) perm[1] = 'w';
+
+    if (sh->output == OUTPUT_MACHINE) {
+        // 名字、类型、大小、创建时间（秒）、权限，以制表符分隔
+        printf("%s\t%c\t%u\t%lld\t%s\n", entry->name, type, entry->size,
+               (long long)entry->create_time, perm);
+        return 0;
     }
 
-    // 检查文件是否已存在
-    DirEntry temp;
-    if (find_file_or_dir(filename, &temp) != -1) {
-        printf("文件 %s 已存在！\n", filename);
-        return -1;
+    char time_str[30];
+    struct tm* timeinfo = localtime(&entry->create_time);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", timeinfo);
+
+    printf("%-20s\t%c\t%5u\t%s\t%s\n",
+           entry->name,
+           type,
+           entry->size,
+           time_str,
+           perm);
+    return 0;
+}
+
+// 打印最近一次保存写回的块数
+void print_saved(Shell* sh) {
+    FsStat st;
+    fs_statfs(sh->fs, &st);
+    say(sh, "文件系统已保存到 %s（写回 %u 块，共 %u 段）\n", IMAGE_FILE, st.saved_blocks, st.saved_ranges);
+    reply_ok(sh, st.saved_blocks);
+}
+
+// format [fat|extent] [块大小] [块数] [16|32]，省略的参数使用默认值
+void cmd_format(Shell* sh, int argc, char** argv) {
+    const char* layout = argc > 1 ? argv[1] : "";
+    say(sh, "格式化文件系统...\n");
+    int ret = fs_format(sh->fs, strcmp(layout, "extent") == 0 ? LAYOUT_EXTENT : LAYOUT_FAT,
+                        argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 0,
+                        argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : 0,
+                        argc > 4 ? (unsigned int)strtoul(argv[4], NULL, 10) : 0);
+    if (ret == FS_OK) {
+        FsStat st;
+        fs_statfs(sh->fs, &st);
+        say(sh, "文件系统格式化完成！（块大小 %u 字节，共 %u 块，%u位FAT）\n",
+            st.block_size, st.block_count, st.fat_width);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "格式化", ret);
     }
+}
 
-    // 查找当前目录中的空条目
-    DirEntry* current_dir_entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-    int empty_entry = -1;
-    for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-        if (current_dir_entries[i].filename[0] == '\0') {
-            empty_entry = i;
-            break;
-        }
+void cmd_mkdir(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int ret = fs_mkdir(sh->fs, argv[1]);
+    if (ret == FS_OK) {
+        say(sh, "目录 %s 创建成功！\n", argv[1]);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "创建目录", ret);
     }
+}
 
-    if (empty_entry == -1) {
-        printf("当前目录已满！\n");
-        return -1;
+void cmd_rmdir(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int ret = fs_rmdir(sh->fs, argv[1]);
+    if (ret == FS_OK) {
+        say(sh, "目录 %s 删除成功！\n", argv[1]);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "删除目录", ret);
     }
+}
 
-    // 分配新块用于文件
-    unsigned short new_block = alloc_block();
-    if (new_block == 0) {
-        printf("磁盘空间不足！\n");
-        return -1;
+// 显示目录内容，省略路径时显示当前目录
+void cmd_ls(Shell* sh, int argc, char** argv) {
+    char dir_path[MAX_PATH_LENGTH];
+    int ret = argc > 1 ? fs_realpath(sh->fs, argv[1], dir_path, sizeof(dir_path))
+                       : fs_getcwd(sh->fs, dir_path, sizeof(dir_path));
+    if (ret != FS_OK) {
+        reply_error(sh, "列出目录", ret);
+        return;
     }
 
-    // 在当前目录中创建新条目
-    strcpy(current_dir_entries[empty_entry].filename, filename);
-    current_dir_entries[empty_entry].attr.is_dir = 0; // 文件而非目录
-    current_dir_entries[empty_entry].attr.read = 1;
-    current_dir_entries[empty_entry].attr.write = 1;
-    current_dir_entries[empty_entry].first_block = new_block;
-    current_dir_entries[empty_entry].file_size = 0;
-    current_dir_entries[empty_entry].create_time = time(NULL);
+    if (sh->output == OUTPUT_MACHINE) {
+        // 状态行之后每个目录项一行，以空行结束
+        reply_ok(sh, -1);
+        fs_listdir(sh->fs, dir_path, print_dirent, sh);
+        putchar('\n');
+        return;
+    }
 
-    printf("文件 %s 创建成功！\n", filename);
-    return 0;
+    say(sh, "当前目录: %s\n", dir_path);
+    say(sh, "名称\t\t\t类型\t大小\t创建时间\t权限\n");
+    fs_listdir(sh->fs, dir_path, print_dirent, sh);
 }
 
-// 打开文件
-int my_open(const char* filename, char mode) {
-    // 查找文件
-    DirEntry entry;
-    int entry_index = find_file_or_dir(filename, &entry);
-    if (entry_index == -1) {
-        printf("文件 %s 不存在！\n", filename);
-        return -1;
+void cmd_cd(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int ret = fs_chdir(sh->fs, argv[1]);
+    if (ret == FS_OK) {
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "切换目录", ret);
     }
+}
 
-    // 确保是文件而非目录
-    if (entry.attr.is_dir) {
-        printf("%s 是目录而非文件！\n", filename);
-        return -1;
+void cmd_create(Shell* sh, int argc, char** argv) {
+    int layout = LAYOUT_DEFAULT;
+    if (argc > 2 && strcmp(argv[2], "extent") == 0) {
+        layout = LAYOUT_EXTENT;
+    } else if (argc > 2 && strcmp(argv[2], "fat") == 0) {
+        layout = LAYOUT_FAT;
     }
 
-    // 检查权限
-    if (mode == 'r' && !entry.attr.read) {
-        printf("没有读取权限！\n");
-        return -1;
+    int ret = fs_create(sh->fs, argv[1], layout);
+    if (ret == FS_OK) {
+        say(sh, "文件 %s 创建成功！\n", argv[1]);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "创建文件", ret);
     }
+}
 
-    if (mode == 'w' && !entry.attr.write) {
-        printf("没有写入权限！\n");
-        return -1;
+// open <路径> <模式> [预计大小]
+void cmd_open(Shell* sh, int argc, char** argv) {
+    unsigned int hint = argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : 0;
+    int ret = fs_open_hint(sh->fs, argv[1], argv[2][0], hint);
+    if (ret >= 0) {
+        say(sh, "已打开文件，文件描述符为: %d\n", ret);
+        reply_ok(sh, ret);
+    } else {
+        reply_error(sh, "打开文件", ret);
     }
+}
 
-    // 在打开文件表中查找空闲项
-    int fd = find_empty_entry();
-    if (fd == -1) {
-        printf("打开文件数已达上限！\n");
-        return -1;
+void cmd_close(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int fd = atoi(argv[1]);
+    int ret = fs_close(sh->fs, fd);
+    if (ret == FS_OK) {
+        say(sh, "文件描述符 %d 关闭成功！\n", fd);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "关闭文件", ret);
     }
+}
 
-    // 填充打开文件表项
-    strcpy(open_file_table[fd].filename, filename);
-    open_file_table[fd].first_block = entry.first_block;
-    open_file_table[fd].file_size = entry.file_size;
-    open_file_table[fd].current_pos = 0;
-    open_file_table[fd].is_used = true;
-    open_file_table[fd].can_read = (mode == 'r' || mode == 'a');
-    open_file_table[fd].can_write = (mode == 'w' || mode == 'a');
-
-    // 如果是写模式，清空文件内容
-    if (mode == 'w') {
-        // 释放可能存在的链接块
-        unsigned short block = entry.first_block;
-        unsigned short next_block;
+// write <文件描述符> [内容]，不提供内容时从输入中读取多行，直到单独一行的END
+void cmd_write(Shell* sh, int argc, char** argv) {
+    int fd = atoi(argv[1]);
+    int ret;
 
-        while (block != EOF_BLOCK) {
-            next_block = fat[block];
-            if (block != entry.first_block) {
-                fat[block] = 0; // 标记为空闲
+    if (argc < 3) {
+        // 多行输入模式（内容行与命令来自同一输入）
+        say(sh, "请输入内容，以单独一行的END结束：\n");
+        if (sh->output == OUTPUT_NORMAL && !sh->batch) {
+            fflush(stdout);
+        }
+        // 行攒到块缓冲区中，满了就写入一次，内容长度不受限制
+        char* chunk = (char*)malloc(WRITE_CHUNK_SIZE);
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len;
+        int used = 0;
+        ret = chunk != NULL ? 0 : FS_ERR_NOMEM;
+
+        while ((line_len = getline(&line, &line_cap, sh->in)) >= 0) {
+            if (strcmp(line, "END\n") == 0 || strcmp(line, "end\n") == 0) {
+                break;
+            }
+            // 出错后继续读到END为止，不把剩余内容当作命令执行
+            for (ssize_t done = 0; ret >= 0 && done < line_len; ) {
+                int n = line_len - done < WRITE_CHUNK_SIZE - used ? (int)(line_len - done) : WRITE_CHUNK_SIZE - used;
+                memcpy(chunk + used, line + done, n);
+                used += n;
+                done += n;
+                if (used == WRITE_CHUNK_SIZE) {
+                    int w = fs_write(sh->fs, fd, chunk, used);
+                    ret = w < 0 ? w : (w < used ? FS_ERR_NOSPC : ret + w);
+                    used = 0;
+                }
             }
-            block = next_block;
         }
-
-        // 更新目录项
-        DirEntry* current_dir_entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-        current_dir_entries[entry_index].file_size = 0;
-
-        // 清空文件首块
-        memset(virtual_disk + entry.first_block * BLOCK_SIZE, 0, BLOCK_SIZE);
-        fat[entry.first_block] = EOF_BLOCK;
+        if (ret >= 0 && used > 0) {
+            int w = fs_write(sh->fs, fd, chunk, used);
+            ret = w < 0 ? w : ret + w;
+        }
+        free(line);
+        free(chunk);
+    } else {
+        // 使用命令行提供的内容
+        ret = fs_write(sh->fs, fd, argv[2], strlen(argv[2]));
     }
 
-    // 如果是追加模式，将位置设在文件末尾
-    if (mode == 'a') {
-        open_file_table[fd].current_pos = entry.file_size;
+    if (ret >= 0) {
+        say(sh, "已写入 %d 字节\n", ret);
+        reply_ok(sh, ret);
+    } else {
+        reply_error(sh, "写入文件", ret);
     }
-
-    printf("文件 %s 打开成功，文件描述符为 %d\n", filename, fd);
-    return fd;
 }
 
-// 关闭文件
-int my_close(int fd) {
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !open_file_table[fd].is_used) {
-        printf("无效的文件描述符！\n");
-        return -1;
+// read <文件描述符> [读取字节数]，默认读取1024字节
+void cmd_read(Shell* sh, int argc, char** argv) {
+    int size = argc > 2 ? atoi(argv[2]) : 1024;
+    if (size < 0) {
+        size = 0;
     }
 
-    // 清除打开文件表项
-    open_file_table[fd].is_used = false;
+    char* read_buffer = (char*)malloc(size + 1);
+    if (read_buffer == NULL) {
+        reply_error(sh, "读取文件", FS_ERR_NOMEM);
+        return;
+    }
 
-    printf("文件描述符 %d 关闭成功！\n", fd);
-    return 0;
+    int ret = fs_read(sh->fs, atoi(argv[1]), read_buffer, size);
+    if (ret >= 0) {
+        print_data(sh, read_buffer, ret);
+    } else {
+        reply_error(sh, "读取文件", ret);
+    }
+
+    free(read_buffer);
 }
 
-// 写文件
-int my_write(int fd, const char* buffer, int length) {
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !open_file_table[fd].is_used) {
-        printf("无效的文件描述符！\n");
-        return -1;
+// import <主机文件> <路径> [fat|extent]：文件不存在时创建，已存在时清空后写入
+void cmd_import(Shell* sh, int argc, char** argv) {
+    int host_fd = open(argv[1], O_RDONLY);
+    if (host_fd < 0) {
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("err %d 无法打开主机文件 %s\n", FS_ERR_IO, argv[1]);
+        } else {
+            printf("无法打开主机文件 %s！\n", argv[1]);
+        }
+        return;
     }
 
-    if (!open_file_table[fd].can_write) {
-        printf("文件没有写入权限！\n");
-        return -1;
+    int layout = LAYOUT_DEFAULT;
+    if (argc > 3 && strcmp(argv[3], "extent") == 0) {
+        layout = LAYOUT_EXTENT;
+    } else if (argc > 3 && strcmp(argv[3], "fat") == 0) {
+        layout = LAYOUT_FAT;
     }
 
-    int bytes_written = 0;
-    int current_pos = open_file_table[fd].current_pos;
-    unsigned short current_block = open_file_table[fd].first_block;
-
-    // 找到对应的数据块
-    int block_offset = current_pos / BLOCK_SIZE;
-    for (int i = 0; i < block_offset; i++) {
-        current_block = fat[current_block];
-        if (current_block == EOF_BLOCK) {
-            // 需要分配新块
-            unsigned short new_block = alloc_block();
-            if (new_block == 0) {
-                printf("磁盘空间不足！\n");
-                break;
-            }
-
-            // 更新FAT
-            fat[current_block] = new_block;
-            fat[new_block] = EOF_BLOCK;
-            current_block = new_block;
-        }
+    // 按主机文件的大小预留连续的块
+    struct stat host_st;
+    unsigned int hint = 0;
+    if (fstat(host_fd, &host_st) == 0 && S_ISREG(host_st.st_mode) && host_st.st_size <= 0xFFFFFFFFLL) {
+        hint = (unsigned int)host_st.st_size;
     }
 
-    // 写入数据
-    while (bytes_written < length) {
-        // 计算当前块内偏移
-        int offset_in_block = current_pos % BLOCK_SIZE;
+    int ret = fs_create(sh->fs, argv[2], layout);
+    int fd = FS_ERR_NOMEM;
+    char* chunk = NULL;
+    if (ret == FS_OK || ret == FS_ERR_EXIST) {
+        fd = fs_open_hint(sh->fs, argv[2], 'w', hint);
+    }
+    if (fd >= 0) {
+        chunk = (char*)malloc(COPY_CHUNK_SIZE);
+    }
 
-        // 计算当前块可写入的字节数
-        int bytes_to_write = BLOCK_SIZE - offset_in_block;
-        if (bytes_to_write > length - bytes_written) {
-            bytes_to_write = length - bytes_written;
+    // 主机文件按大块读入，每块直接写入文件的数据块
+    long long total = 0;
+    ret = fd < 0 ? fd : (chunk == NULL ? FS_ERR_NOMEM : FS_OK);
+    while (ret == FS_OK) {
+        ssize_t n = read(host_fd, chunk, COPY_CHUNK_SIZE);
+        if (n <= 0) {
+            ret = n < 0 ? FS_ERR_IO : FS_OK;
+            break;
+        }
+        int w = fs_write(sh->fs, fd, chunk, (int)n);
+        if (w < 0) {
+            ret = w;
+        } else if (w < n) {
+            total += w;
+            ret = FS_ERR_NOSPC;
+        } else {
+            total += w;
         }
+    }
 
-        // 写入数据
-        memcpy(virtual_disk + current_block * BLOCK_SIZE + offset_in_block,
-               buffer + bytes_written,
-               bytes_to_write);
-
-        bytes_written += bytes_to_write;
-        current_pos += bytes_to_write;
-
-        // 检查是否需要分配新块
-        if (bytes_written < length && offset_in_block + bytes_to_write >= BLOCK_SIZE) {
-            if (fat[current_block] == EOF_BLOCK) {
-                // 需要分配新块
-                unsigned short new_block = alloc_block();
-                if (new_block == 0) {
-                    printf("磁盘空间不足！\n");
-                    break;
-                }
+    free(chunk);
+    if (fd >= 0) {
+        fs_close(sh->fs, fd);
+    }
+    close(host_fd);
 
-                // 更新FAT
-                fat[current_block] = new_block;
-                fat[new_block] = EOF_BLOCK;
-            }
+    if (ret == FS_OK) {
+        say(sh, "已从 %s 导入 %lld 字节到 %s\n", argv[1], total, argv[2]);
+        reply_ok(sh, total);
+    } else {
+        reply_error(sh, "导入文件", ret);
+    }
+}
 
-            current_block = fat[current_block];
+// export <路径> <主机文件>：主机文件已存在时覆盖
+void cmd_export(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int fd = fs_open(sh->fs, argv[1], 'r');
+    if (fd < 0) {
+        reply_error(sh, "导出文件", fd);
+        return;
+    }
+    int host_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (host_fd < 0) {
+        fs_close(sh->fs, fd);
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("err %d 无法创建主机文件 %s\n", FS_ERR_IO, argv[2]);
+        } else {
+            printf("无法创建主机文件 %s！\n", argv[2]);
         }
+        return;
     }
 
-    // 更新文件大小
-    if (current_pos > open_file_table[fd].file_size) {
-        open_file_table[fd].file_size = current_pos;
-
-        // 更新目录项中的文件大小
-        DirEntry* entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-        for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-            if (entries[i].filename[0] != '\0' &&
-                strcmp(entries[i].filename, open_file_table[fd].filename) == 0) {
-                entries[i].file_size = current_pos;
+    // 按大块从文件的数据块读出，直接写入主机文件
+    char* chunk = (char*)malloc(COPY_CHUNK_SIZE);
+    long long total = 0;
+    int ret = chunk != NULL ? FS_OK : FS_ERR_NOMEM;
+    while (ret == FS_OK) {
+        int n = fs_read(sh->fs, fd, chunk, COPY_CHUNK_SIZE);
+        if (n <= 0) {
+            ret = n;
+            break;
+        }
+        for (int done = 0; done < n; ) {
+            ssize_t w = write(host_fd, chunk + done, n - done);
+            if (w < 0) {
+                ret = FS_ERR_IO;
                 break;
             }
+            done += w;
         }
+        total += n;
     }
 
-    // 更新当前位置
-    open_file_table[fd].current_pos = current_pos;
+    free(chunk);
+    fs_close(sh->fs, fd);
+    if (close(host_fd) != 0 && ret == FS_OK) {
+        ret = FS_ERR_IO;
+    }
 
-    return bytes_written;
+    if (ret == FS_OK) {
+        say(sh, "已从 %s 导出 %lld 字节到 %s\n", argv[1], total, argv[2]);
+        reply_ok(sh, total);
+    } else {
+        reply_error(sh, "导出文件", ret);
+    }
 }
 
-// 读文件
-int my_read(int fd, char* buffer, int length) {
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !open_file_table[fd].is_used) {
-        printf("无效的文件描述符！\n");
-        return -1;
+// fallocate <文件描述符> <字节数>
+void cmd_fallocate(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int ret = fs_fallocate(sh->fs, atoi(argv[1]), (unsigned int)strtoul(argv[2], NULL, 10));
+    if (ret == FS_OK) {
+        say(sh, "已为文件描述符 %s 预留 %s 字节\n", argv[1], argv[2]);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "预留空间", ret);
     }
+}
 
-    if (!open_file_table[fd].can_read) {
-        printf("文件没有读取权限！\n");
-        return -1;
+void cmd_lseek(Shell* sh, int argc, char** argv) {
+    int whence = MY_SEEK_SET;
+    if (argc > 3 && strcmp(argv[3], "cur") == 0) {
+        whence = MY_SEEK_CUR;
+    } else if (argc > 3 && strcmp(argv[3], "end") == 0) {
+        whence = MY_SEEK_END;
     }
 
-    int bytes_read = 0;
-    int current_pos = open_file_table[fd].current_pos;
-    unsigned short current_block = open_file_table[fd].first_block;
+    int ret = fs_lseek(sh->fs, atoi(argv[1]), atoi(argv[2]), whence);
+    if (ret >= 0) {
+        say(sh, "当前位置: %d\n", ret);
+        reply_ok(sh, ret);
+    } else {
+        reply_error(sh, "移动读写位置", ret);
+    }
+}
 
-    // 如果已经到文件末尾，直接返回0
-    if (current_pos >= open_file_table[fd].file_size) {
-        return 0;
+void cmd_pwrite(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int ret = fs_pwrite(sh->fs, atoi(argv[1]), argv[3], strlen(argv[3]), (unsigned int)atoi(argv[2]));
+    if (ret >= 0) {
+        say(sh, "已写入 %d 字节\n", ret);
+        reply_ok(sh, ret);
+    } else {
+        reply_error(sh, "写入文件", ret);
     }
+}
 
-    // 限制读取长度不超过文件大小
-    if (current_pos + length > open_file_table[fd].file_size) {
-        length = open_file_table[fd].file_size - current_pos;
+void cmd_pread(Shell* sh, int argc, char** argv) {
+    int size = argc > 3 ? atoi(argv[3]) : 1024;
+    if (size < 0) {
+        size = 0;
     }
 
-    // 找到对应的数据块
-    int block_offset = current_pos / BLOCK_SIZE;
-    for (int i = 0; i < block_offset; i++) {
-        current_block = fat[current_block];
-        if (current_block == EOF_BLOCK) {
-            // 文件结构损坏
-            printf("文件结构损坏！\n");
-            return -1;
-        }
+    char* read_buffer = (char*)malloc(size + 1);
+    if (read_buffer == NULL) {
+        reply_error(sh, "读取文件", FS_ERR_NOMEM);
+        return;
     }
 
-    // 读取数据
-    while (bytes_read < length) {
-        // 计算当前块内偏移
-        int offset_in_block = current_pos % BLOCK_SIZE;
+    int ret = fs_pread(sh->fs, atoi(argv[1]), read_buffer, size, (unsigned int)atoi(argv[2]));
+    if (ret >= 0) {
+        print_data(sh, read_buffer, ret);
+    } else {
+        reply_error(sh, "读取文件", ret);
+    }
 
-        // 计算当前块可读取的字节数
-        int bytes_to_read = BLOCK_SIZE - offset_in_block;
-        if (bytes_to_read > length - bytes_read) {
-            bytes_to_read = length - bytes_read;
-        }
+    free(read_buffer);
+}
 
-        // 读取数据
-        memcpy(buffer + bytes_read,
-               virtual_disk + current_block * BLOCK_SIZE + offset_in_block,
-               bytes_to_read);
+void cmd_rm(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    int ret = fs_unlink(sh->fs, argv[1]);
+    if (ret == FS_OK) {
+        say(sh, "文件 %s 删除成功！\n", argv[1]);
+        reply_ok(sh, -1);
+    } else {
+        reply_error(sh, "删除文件", ret);
+    }
+}
 
-        bytes_read += bytes_to_read;
-        current_pos += bytes_to_read;
+void cmd_sync(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    int ret = fs_sync(sh->fs);
+    if (ret == FS_OK) {
+        print_saved(sh);
+    } else {
+        reply_error(sh, "保存文件系统", ret);
+    }
+}
 
-        // 检查是否需要继续读下一块
-        if (bytes_read < length && offset_in_block + bytes_to_read >= BLOCK_SIZE) {
-            current_block = fat[current_block];
-            if (current_block == EOF_BLOCK) {
-                // 已到文件末尾
-                break;
+// writeback [off|<间隔毫秒> [脏块阈值]]：开启、调整或关闭后台回写，不带参数时显示当前设置
+// 机器可读模式：状态行的值为回写间隔（0表示未开启），查询时再加脏块阈值、未写回的块数和最近一次回写的错误码
+void cmd_writeback(Shell* sh, int argc, char** argv) {
+    if (argc > 1) {
+        unsigned int interval = 0, threshold = 0;
+        if (strcmp(argv[1], "off") != 0) {
+            interval = (unsigned int)strtoul(argv[1], NULL, 10);
+            threshold = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 0;
+            if (interval == 0) {
+                reply_usage(sh, "writeback [off|<间隔毫秒> [脏块阈值]]");
+                return;
             }
         }
+        int ret = fs_set_writeback(sh->fs, interval, threshold);
+        if (ret != FS_OK) {
+            reply_error(sh, "设置后台回写", ret);
+            if (ret == FS_ERR_INVAL) {
+                say(sh, "后台回写需要使用日志，映射模式或没有日志时只在sync和退出时写回映像\n");
+            }
+            return;
+        }
     }
 
-    // 更新当前位置
-    open_file_table[fd].current_pos = current_pos;
-
-    return bytes_read;
+    FsStat st;
+    fs_statfs(sh->fs, &st);
+    if (sh->output == OUTPUT_MACHINE) {
+        if (argc > 1) {
+            printf("ok %u\n", st.writeback_ms);
+        } else {
+            printf("ok %u %u %u %d\n", st.writeback_ms, st.writeback_blocks, st.dirty_blocks, st.writeback_error);
+        }
+        return;
+    }
+    if (st.writeback_ms == 0) {
+        say(sh, "后台回写未开启，未写回的块: %u\n", st.dirty_blocks);
+        return;
+    }
+    say(sh, "后台回写：每 %u 毫秒或脏块达到 %u 块时写回，未写回的块: %u\n",
+        st.writeback_ms, st.writeback_blocks, st.dirty_blocks);
+    if (st.writeback_error != FS_OK) {
+        say(sh, "最近一次回写失败：%s！\n", fs_strerror(st.writeback_error));
+    }
 }
 
-// 删除文件
-int my_rm(const char* filename) {
-    // 查找文件
-    DirEntry entry;
-    int entry_index = find_file_or_dir(filename, &entry);
-    if (entry_index == -1) {
-        printf("文件 %s 不存在！\n", filename);
-        return -1;
+// 显示磁盘使用情况
+void cmd_df(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    FsStat st;
+    fs_statfs(sh->fs, &st);
+    unsigned int used = st.data_blocks - st.free_blocks;
+
+    if (sh->output == OUTPUT_MACHINE) {
+        // 数据块总数、已用、空闲、块大小，设置了驻留预算时再加预算和驻留量（字节）
+        printf("ok %u %u %u %u", st.data_blocks, used, st.free_blocks, st.block_size);
+        if (st.cache_budget > 0) {
+            printf(" %llu %llu", st.cache_budget, st.cache_resident);
+        }
+        putchar('\n');
+        return;
     }
 
-    // 确保是文件而非目录
-    if (entry.attr.is_dir) {
-        printf("%s 是目录而非文件！\n", filename);
-        return -1;
+    printf("数据块总数: %u  已用: %u  空闲: %u  (块大小 %u 字节)\n",
+           st.data_blocks, used, st.free_blocks, st.block_size);
+    printf("空闲空间: %llu KB / %llu KB\n",
+           (unsigned long long)st.free_blocks * st.block_size / 1024,
+           (unsigned long long)st.data_blocks * st.block_size / 1024);
+    if (st.cache_budget > 0) {
+        printf("驻留: %llu KB / 预算 %llu KB\n", st.cache_resident / 1024, st.cache_budget / 1024);
     }
+    if (st.shared_blocks > 0) {
+        printf("去重后共享的块: %u\n", st.shared_blocks);
+    }
+}
 
-    // 检查文件是否已打开
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_file_table[i].is_used &&
-            strcmp(open_file_table[i].filename, filename) == 0) {
-            printf("文件 %s 已打开，不能删除！\n", filename);
-            return -1;
+// 由延迟分布估计百分位：返回累计数达到count*p的桶的上界（纳秒）
+unsigned long long latency_percentile(const unsigned long long* hist, unsigned long long count, double p) {
+    unsigned long long target = (unsigned long long)(count * p);
+    unsigned long long seen = 0;
+    for (int i = 0; i < FS_LATENCY_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target || seen == count) {
+            return 2ULL << i;
         }
     }
+    return 2ULL << (FS_LATENCY_BUCKETS - 1);
+}
 
-    // 释放文件占用的所有块
-    unsigned short block = entry.first_block;
-    unsigned short next_block;
-
-    while (block != EOF_BLOCK) {
-        next_block = fat[block];
-        fat[block] = 0; // 标记为空闲
-        block = next_block;
+// stats [reset]：显示引擎的运行计数和各接口的调用次数、平均延迟及p50/p99（按2的幂分桶估计的上界）
+void cmd_stats(Shell* sh, int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        fs_reset_stats(sh->fs);
+        say(sh, "运行计数已清零\n");
+        reply_ok(sh, -1);
+        return;
     }
 
-    // 从目录中删除条目
-    DirEntry* current_dir_entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
-    memset(&current_dir_entries[entry_index], 0, sizeof(DirEntry));
+    FsCounters c;
+    fs_get_stats(sh->fs, &c);
+    static const struct {
+        const char* key;                 // 机器可读模式下的名字
+        const char* label;               // 说明
+        size_t offset;
+    } counters[] = {
+        {"fat_hops", "FAT链前进次数", offsetof(FsCounters, fat_hops)},
+        {"blocks_allocated", "分配块数", offsetof(FsCounters, blocks_allocated)},
+        {"blocks_freed", "释放块数", offsetof(FsCounters, blocks_freed)},
+        {"dir_slots_scanned", "检查的目录项/索引桶", offsetof(FsCounters, dir_slots_scanned)},
+        {"dcache_hits", "目录项缓存命中", offsetof(FsCounters, dcache_hits)},
+        {"dcache_misses", "目录项缓存未命中", offsetof(FsCounters, dcache_misses)},
+        {"bytes_read", "读出字节数", offsetof(FsCounters, bytes_read)},
+        {"bytes_written", "写入字节数", offsetof(FsCounters, bytes_written)},
+        {"fd_opens", "打开文件次数", offsetof(FsCounters, fd_opens)},
+        {"fd_closes", "关闭文件次数", offsetof(FsCounters, fd_closes)},
+        {"journal_commits", "日志事务提交次数", offsetof(FsCounters, journal_commits)},
+        {"cache_evictions", "超出驻留预算淘汰的段数", offsetof(FsCounters, cache_evictions)},
+        {"readahead_blocks", "顺序读预读的块数", offsetof(FsCounters, readahead_blocks)},
+        {"zero_blocks_skipped", "写入空洞时省去的零块数", offsetof(FsCounters, zero_blocks_skipped)},
+        {"inline_promotions", "内联文件改用数据块的次数", offsetof(FsCounters, inline_promotions)},
+        {"snapshot_copies", "快照写时复制的块数", offsetof(FsCounters, snapshot_copies)},
+        {"shared_copies", "写入共享块前复制的块数", offsetof(FsCounters, shared_copies)},
+        {"writebacks", "后台回写次数", offsetof(FsCounters, writebacks)},
+        {"writeback_blocks", "后台回写时只持读锁预写的块数", offsetof(FsCounters, writeback_blocks)},
+    };
+
+    // 机器可读模式：状态行后每项一行（名字 值），接口一行（op 名字 次数 总纳秒 p50 p99）
+    // 加一行分布（hist 名字 各桶计数），以空行结束
+    reply_ok(sh, -1);
+    if (sh->output != OUTPUT_MACHINE) {
+        printf("引擎计数：\n");
+    }
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        unsigned long long v = *(const unsigned long long*)((const char*)&c + counters[i].offset);
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("%s %llu\n", counters[i].key, v);
+        } else {
+            printf("  %s：%llu\n", counters[i].label, v);
+        }
+    }
 
-    printf("文件 %s 删除成功！\n", filename);
-    return 0;
+    if (sh->output != OUTPUT_MACHINE) {
+        printf("接口\t\t次数\t平均(微秒)\tp50≤(微秒)\tp99≤(微秒)\n");
+    }
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        unsigned long long n = c.op_count[op];
+        if (n == 0) {
+            continue;
+        }
+        unsigned long long timed = 0;
+        for (int b = 0; b < FS_LATENCY_BUCKETS; b++) {
+            timed += c.latency[op][b];
+        }
+        unsigned long long p50 = timed ? latency_percentile(c.latency[op], timed, 0.5) : 0;
+        unsigned long long p99 = timed ? latency_percentile(c.latency[op], timed, 0.99) : 0;
+
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("op %s %llu %llu %llu %llu\n", fs_op_name(op), n, c.op_total_ns[op], p50, p99);
+            printf("hist %s", fs_op_name(op));
+            for (int b = 0; b < FS_LATENCY_BUCKETS; b++) {
+                printf(" %llu", c.latency[op][b]);
+            }
+            putchar('\n');
+        } else if (timed > 0) {
+            printf("  %-8s\t%llu\t%.2f\t\t%.2f\t\t%.2f\n", fs_op_name(op), n,
+                   c.op_total_ns[op] / 1e3 / timed, p50 / 1e3, p99 / 1e3);
+        } else {
+            printf("  %-8s\t%llu\t-\t\t-\t\t-\n", fs_op_name(op), n);
+        }
+    }
+    if (sh->output == OUTPUT_MACHINE) {
+        putchar('\n');
+    }
 }
 
-// 退出文件系统
-void my_exitsys() {
-    // 保存文件系统状态
-    save_to_file("filesystem.img");
-
-    // 释放虚拟磁盘
-    if (virtual_disk != NULL) {
-        free(virtual_disk);
-        virtual_disk = NULL;
+// 打印碎片情况（机器可读模式下为一行：标签 文件数 分散文件数 文件块数 文件段数 目录数 目录块数 目录段数 内联文件数）
+void print_fragstat(Shell* sh, const char* tag, const char* label, const FsFragStat* st) {
+    if (sh->output == OUTPUT_MACHINE) {
+        printf("%s %u %u %llu %llu %u %llu %llu %u\n", tag, st->files, st->fragmented_files,
+               st->file_blocks, st->file_runs, st->dirs, st->dir_blocks, st->dir_runs, st->inline_files);
+        return;
     }
-
-    printf("文件系统已安全退出！\n");
+    // 每个文件的段数只按使用数据块的文件计算
+    unsigned int block_files = st->files - st->inline_files;
+    printf("%s：文件 %u 个（分散的 %u 个，内联的 %u 个），%llu 块共 %llu 段，平均段长 %.1f 块，每个文件 %.2f 段；"
+           "目录 %u 个，%llu 块共 %llu 段\n", label, st->files, st->fragmented_files, st->inline_files,
+           st->file_blocks, st->file_runs,
+           st->file_runs ? (double)st->file_blocks / st->file_runs : 0.0,
+           block_files ? (double)st->file_runs / block_files : 0.0,
+           st->dirs, st->dir_blocks, st->dir_runs);
 }
 
-/* 辅助函数实现 */
-
-// 分配一个空闲块
-unsigned short alloc_block() {
-    for (int i = DATA_BLOCK; i < BLOCK_NUM; i++) {
-        if (fat[i] == 0) { // 空闲块
-            fat[i] = EOF_BLOCK; // 标记为已分配
-            return i;
+// defrag [check]：碎片整理，前后各统计一次
+void cmd_defrag(Shell* sh, int argc, char** argv) {
+    FsFragStat before;
+    fs_fragstat(sh->fs, &before);
+    if (argc > 1 && strcmp(argv[1], "check") == 0) {
+        reply_ok(sh, -1);
+        print_fragstat(sh, "frag", "碎片情况", &before);
+        if (sh->output == OUTPUT_MACHINE) {
+            putchar('\n');
         }
+        return;
     }
-    return 0; // 没有空闲块
-}
 
-// 释放一个块
-void free_block(unsigned short block) {
-    fat[block] = 0; // 标记为空闲
-}
+    unsigned int moved = 0;
+    int ret = fs_defrag(sh->fs, &moved);
+    if (ret != FS_OK) {
+        reply_error(sh, "碎片整理", ret);
+        return;
+    }
+    FsFragStat after;
+    fs_fragstat(sh->fs, &after);
 
-// 在当前目录中查找文件或目录
-int find_file_or_dir(const char* name, DirEntry* entry) {
-    DirEntry* entries = (DirEntry*)(virtual_disk + current_dir_block * BLOCK_SIZE);
+    // 机器可读模式：状态行的值为搬动的文件和目录数，随后两行为整理前后的碎片情况，以空行结束
+    reply_ok(sh, moved);
+    if (sh->output == OUTPUT_QUIET) {
+        return;
+    }
+    print_fragstat(sh, "before", "整理前", &before);
+    print_fragstat(sh, "after", "整理后", &after);
+    if (sh->output == OUTPUT_MACHINE) {
+        putchar('\n');
+    } else {
+        printf("搬动了 %u 个文件和目录\n", moved);
+    }
+}
 
-    for (int i = 0; i < BLOCK_SIZE / sizeof(DirEntry); i++) {
-        if (entries[i].filename[0] != '\0' &&
-            strcmp(entries[i].filename, name) == 0) {
-            *entry = entries[i];
-            return i;
+// 去重命令
+void cmd_dedup(Shell* sh, int argc, char** argv) {
+    FsDedupStat st;
+    int ret = fs_dedup(sh->fs, &st);
+    if (ret != FS_OK) {
+        reply_error(sh, "去重", ret);
+        // 提交失败时内存中的卷已经改过，sync或退出时会再次写入
+        if (st.blocks_shared > 0) {
+            say(sh, "内存中已有 %llu 块改为共享（回收 %llu 块），尚未写入日志\n", st.blocks_shared, st.blocks_reclaimed);
         }
+        return;
     }
 
-    return -1; // 未找到
+    // 机器可读模式：状态行的值为回收的块数，随后一行为参与和不参与的文件数、扫描和改为共享的块数
+    reply_ok(sh, (long long)st.blocks_reclaimed);
+    if (sh->output == OUTPUT_MACHINE) {
+        printf("%u\t%u\t%llu\t%llu\n", st.files, st.skipped_files, st.blocks_scanned, st.blocks_shared);
+        return;
+    }
+    FsStat info;
+    fs_statfs(sh->fs, &info);
+    say(sh, "扫描了 %u 个区段布局文件的 %llu 块（FAT链布局的 %u 个文件不参与）\n",
+        st.files, st.blocks_scanned, st.skipped_files);
+    say(sh, "%llu 块改为共享，回收 %llu 块（%.1f KB）\n", st.blocks_shared, st.blocks_reclaimed,
+        (double)st.blocks_reclaimed * info.block_size / 1024);
 }
 
-// 在打开文件表中查找空闲项
-int find_empty_entry() {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!open_file_table[i].is_used) {
-            return i;
+// 打印一致性检查的结果（机器可读模式下第一行为目录数、文件数、被引用的块数、线程数、问题数和已修复数，
+// 随后每类问题一行：类别名和个数，以制表符分隔，以空行结束）
+void print_fsck(Shell* sh, const FsFsckStat* st, double ms) {
+    struct {
+        const char* tag;
+        const char* label;
+        unsigned int count;
+    } problems[] = {
+        {"meta", "元数据区的错误", st->meta_errors},
+        {"entry", "无效的目录项", st->bad_entries},
+        {"link", "错误的\".\"或\"..\"", st->dir_links},
+        {"index", "无效的目录索引", st->dir_indexes},
+        {"chain", "断开、成环或交叉的FAT链", st->chain_errors},
+        {"extent", "区段表错误", st->extent_errors},
+        {"small", "小文件块错误", st->small_errors},
+        {"size", "文件大小错误", st->size_errors},
+        {"cross", "交叉引用的块或槽", st->cross_links},
+        {"lost", "丢失的块", st->lost_blocks},
+        {"free", "被引用的空闲块", st->free_referenced},
+        {"refs", "共享计数错误", st->ref_errors},
+    };
+    if (sh->output == OUTPUT_MACHINE) {
+        printf("%u\t%u\t%llu\t%u\t%u\t%u\n", st->dirs, st->files, st->blocks, st->threads, st->problems, st->repaired);
+    } else {
+        say(sh, "检查了 %u 个目录、%u 个文件、%llu 个数据块（%u 个线程，%.1f ms）\n",
+            st->dirs, st->files, st->blocks, st->threads, ms);
+    }
+    for (size_t i = 0; i < sizeof(problems) / sizeof(problems[0]); i++) {
+        if (problems[i].count == 0) {
+            continue;
+        }
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("%s\t%u\n", problems[i].tag, problems[i].count);
+        } else {
+            say(sh, "  %s: %u\n", problems[i].label, problems[i].count);
         }
     }
-    return -1; // 未找到空闲项
+    if (sh->output == OUTPUT_MACHINE) {
+        putchar('\n');
+    }
 }
 
-// 将文件系统保存到磁盘文件
-void save_to_file(const char* filename) {
-    FILE* fp = fopen(filename, "wb");
-    if (fp == NULL) {
-        printf("无法打开文件 %s 进行写入！\n", filename);
+// fsck [repair]：一致性检查，repair时同时修复
+void cmd_fsck(Shell* sh, int argc, char** argv) {
+    bool repair = argc > 1 && strcmp(argv[1], "repair") == 0;
+    if (argc > 1 && !repair) {
+        reply_usage(sh, "fsck [repair]");
+        return;
+    }
+    FsFsckStat st;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = fs_fsck(sh->fs, repair, &st);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (ret != FS_OK) {
+        reply_error(sh, "一致性检查", ret);
         return;
     }
 
-    // 写入整个虚拟磁盘
-    fwrite(virtual_disk, 1, DISK_SIZE, fp);
+    // 机器可读模式：状态行的值为还没有修复的问题数
+    reply_ok(sh, st.problems - st.repaired);
+    if (sh->output == OUTPUT_QUIET) {
+        return;
+    }
+    print_fsck(sh, &st, (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    if (st.problems == 0) {
+        say(sh, "没有发现问题\n");
+    } else if (repair) {
+        say(sh, "发现 %u 个问题，已修复 %u 个\n", st.problems, st.repaired);
+    } else {
+        say(sh, "发现 %u 个问题，可用 fsck repair 修复\n", st.problems);
+    }
+}
 
-    fclose(fp);
-    printf("文件系统已保存到 %s\n", filename);
+// 打印一个快照（机器可读模式下为一行：名字、创建时间（秒）、已复制保存的块数，以制表符分隔）
+int print_snapshot(const FsSnapshot* snap, void* arg) {
+    Shell* sh = (Shell*)arg;
+    if (sh->output == OUTPUT_MACHINE) {
+        printf("%s\t%lld\t%u\n", snap->name, (long long)snap->create_time, snap->saved_blocks);
+        return 0;
+    }
+    char time_str[30];
+    struct tm* timeinfo = localtime(&snap->create_time);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", timeinfo);
+    printf("%-20s\t%s\t%u\n", snap->name, time_str, snap->saved_blocks);
+    return 0;
 }
 
-// 从磁盘文件加载文件系统
-void load_from_file(const char* filename) {
-    FILE* fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        printf("文件 %s 不存在，将创建新的文件系统！\n", filename);
-        my_format();
+// snapshot create|rollback|delete <名字>，snapshot list
+void cmd_snapshot(Shell* sh, int argc, char** argv) {
+    const char* usage = "snapshot create|rollback|delete <名字> / list";
+    if (strcmp(argv[1], "list") == 0) {
+        reply_ok(sh, -1);
+        say(sh, "名称\t\t\t创建时间\t\t已复制块数\n");
+        fs_snapshot_list(sh->fs, print_snapshot, sh);
+        if (sh->output == OUTPUT_MACHINE) {
+            putchar('\n');
+        }
         return;
     }
-
-    // 释放之前的虚拟磁盘（如果存在）
-    if (virtual_disk != NULL) {
-        free(virtual_disk);
+    if (argc < 3) {
+        reply_usage(sh, usage);
+        return;
     }
 
-    // 分配虚拟磁盘空间
-    virtual_disk = (unsigned char*)malloc(DISK_SIZE);
-    if (virtual_disk == NULL) {
-        printf("内存分配失败！\n");
-        fclose(fp);
-        exit(1);
+    int ret;
+    const char* what;
+    const char* done;
+    if (strcmp(argv[1], "create") == 0) {
+        ret = fs_snapshot_create(sh->fs, argv[2]);
+        what = "创建快照";
+        done = "已创建快照";
+    } else if (strcmp(argv[1], "rollback") == 0) {
+        ret = fs_snapshot_rollback(sh->fs, argv[2]);
+        what = "回滚到快照";
+        done = "已回滚到快照";
+    } else if (strcmp(argv[1], "delete") == 0) {
+        ret = fs_snapshot_delete(sh->fs, argv[2]);
+        what = "删除快照";
+        done = "已删除快照";
+    } else {
+        reply_usage(sh, usage);
+        return;
     }
-
-    // 读取整个虚拟磁盘
-    size_t read_size = fread(virtual_disk, 1, DISK_SIZE, fp);
-    fclose(fp);
-
-    if (read_size != DISK_SIZE) {
-        printf("文件读取错误，将创建新的文件系统！\n");
-        my_format();
+    if (ret != FS_OK) {
+        reply_error(sh, what, ret);
         return;
     }
+    say(sh, "%s %s\n", done, argv[2]);
+    reply_ok(sh, -1);
+}
 
-    // 重新设置全局变量
-    fat = (FAT_ENTRY*)(virtual_disk + FAT_BLOCK * BLOCK_SIZE);
-    current_dir_block = ROOT_BLOCK;
-    strcpy(current_dir, "/");
-
-    // 初始化打开文件表
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        open_file_table[i].is_used = false;
+// 保存文件系统状态并结束命令循环（实例由main释放）
+void cmd_exit(Shell* sh, int argc, char** argv) {
+    cmd_sync(sh, argc, argv);
+    if (sh->dump_stats) {
+        cmd_stats(sh, 0, NULL);
     }
-
-    printf("文件系统已从 %s 加载！\n", filename);
+    sh->running = false;
 }
 
-// 主函数
-int main() {
-    char cmd[256];
-    char arg1[256];
-    char arg2[256];
-    int fd, ret;
-    char buffer[1024];
-
-    // 尝试加载已有的文件系统，如果不存在则格式化一个新的
-    load_from_file("filesystem.img");
-
-    printf("简易文件系统启动成功！输入help查看可用命令。\n");
-
-    while (1) {
-        printf("%s> ", current_dir);
-        fflush(stdout);
-
-        cmd[0] = '\0';
-        arg1[0] = '\0';
-        arg2[0] = '\0';
-
-        fgets(buffer, sizeof(buffer), stdin);
-        sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
+void cmd_help(Shell* sh, int argc, char** argv) {
+    (void)argc;
+    (void)argv;
+    reply_ok(sh, -1);
+    printf("可用命令：\n");
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        if (commands[i].help != NULL) {
+            printf("  %-40s - %s\n", commands[i].usage, commands[i].help);
+        }
+    }
+    printf("参数中含空白时用引号括起，如 write 0 \"hello world\"；双引号内可用 \\n \\t \\\" \\\\ 转义\n");
+}
 
-        if (strcmp(cmd, "format") == 0 || strcmp(cmd, "my_format") == 0) {
-            my_format();
+// 按命令名或旧命令名查找命令
+const Command* find_command(const char* name) {
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        if (strcmp(name, commands[i].name) == 0 ||
+            (commands[i].alias != NULL && strcmp(name, commands[i].alias) == 0)) {
+            return &commands[i];
         }
-        else if (strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "my_mkdir") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: mkdir <目录名>\n");
-            } else {
-                my_mkdir(arg1);
-            }
+    }
+    return NULL;
+}
+
+// 解析并执行一行命令
+void run_line(Shell* sh, char* line) {
+    char* argv[MAX_ARGS];
+    int argc = tokenize(line, argv, MAX_ARGS);
+    if (argc < 0) {
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("err %d 引号不匹配或参数过多\n", FS_ERR_INVAL);
+        } else {
+            printf("命令格式错误：引号不匹配或参数过多！\n");
         }
-        else if (strcmp(cmd, "rmdir") == 0 || strcmp(cmd, "my_rmdir") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: rmdir <目录名>\n");
-            } else {
-                my_rmdir(arg1);
-            }
+        return;
+    }
+    if (argc == 0) {
+        return;
+    }
+
+    const Command* cmd = find_command(argv[0]);
+    if (cmd == NULL) {
+        if (sh->output == OUTPUT_MACHINE) {
+            printf("err %d 未知命令: %s\n", FS_ERR_INVAL, argv[0]);
+        } else {
+            printf("未知命令: %s\n", argv[0]);
+            printf("输入 help 查看可用命令\n");
         }
-        else if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "my_ls") == 0) {
-            my_ls();
+        return;
+    }
+    if (argc - 1 < cmd->min_args) {
+        reply_usage(sh, cmd->usage);
+        return;
+    }
+    cmd->run(sh, argc, argv);
+}
+
+// 打印挂载结果
+void print_mount_info(Shell* sh) {
+    FsStat st;
+    fs_statfs(sh->fs, &st);
+    if (st.mount_state == FS_MOUNT_CREATED) {
+        say(sh, "文件 %s 不存在，已创建新的文件系统！\n", IMAGE_FILE);
+    } else if (st.mount_state == FS_MOUNT_REFORMATTED) {
+        say(sh, "映像文件格式无效，已创建新的文件系统！\n");
+    } else {
+        if (st.replayed > 0) {
+            say(sh, "已从日志 %s 恢复 %u 个事务\n", JOURNAL_FILE, st.replayed);
         }
-        else if (strcmp(cmd, "cd") == 0 || strcmp(cmd, "my_cd") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: cd <目录名>\n");
-            } else {
-                my_cd(arg1);
+        say(sh, "文件系统已从 %s %s！\n", IMAGE_FILE, st.mapped ? "映射加载" : "加载");
+    }
+    if (!st.mapped && !st.journaled) {
+        say(sh, "无法打开日志文件 %s，将不使用日志！\n", JOURNAL_FILE);
+    }
+}
+
+// 主函数
+// 用法: douzza_FileSystem [-m] [-c MiB] [-z] [-k] [-w 毫秒] [-b [脚本文件]] [-o normal|quiet|machine] [-s]
+//   -m 以映射模式打开映像文件
+//   -c 限制映射模式下虚拟磁盘的驻留内存（MiB），用于挂载比内存大的卷，隐含-m
+//   -z 写入区段布局文件的空洞时不为全零的块分配空间（稀疏文件）
+//   -k 加载后先做一次一致性检查（不修复），发现问题时给出提示
+//   -w 开启后台回写，每隔指定的毫秒数（或脏块较多时）把修改写回映像（同writeback命令，需要使用日志）
+//   -b 批量执行脚本文件中的命令（省略文件名时读标准输入），不显示提示符
+//   -o 输出模式：quiet只输出错误和读出的数据，machine每条命令输出一行状态
+//   -s 退出时输出运行计数（同stats命令）
+int main(int argc, char* argv[]) {
+    Shell sh;
+    memset(&sh, 0, sizeof(sh));
+    sh.in = stdin;
+    sh.output = OUTPUT_NORMAL;
+    int flags = FS_MOUNT_TIMING; // 命令行每条命令的开销远大于取时间，总是统计延迟
+    const char* script = NULL;
+    unsigned long long cache_mb = 0;
+    bool check = false;
+    unsigned int writeback_ms = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cache_mb = strtoull(argv[++i], NULL, 10);
+            if (cache_mb == 0) {
+                printf("驻留预算必须是正整数（MiB）\n");
+                return 1;
             }
-        }
-        else if (strcmp(cmd, "create") == 0 || strcmp(cmd, "my_create") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: create <文件名>\n");
-            } else {
-                my_create(arg1);
+            flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            flags |= FS_MOUNT_SPARSE;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            check = true;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            writeback_ms = (unsigned int)strtoul(argv[++i], NULL, 10);
+            if (writeback_ms == 0) {
+                printf("回写间隔必须是正整数（毫秒）\n");
+                return 1;
             }
-        }
-        else if (strcmp(cmd, "open") == 0 || strcmp(cmd, "my_open") == 0) {
-            if (arg1[0] == '\0' || arg2[0] == '\0') {
-                printf("用法: open <文件名> <模式(r/w/a)>\n");
-            } else {
-                ret = my_open(arg1, arg2[0]);
-                if (ret >= 0) {
-                    printf("已打开文件，文件描述符为: %d\n", ret);
-                }
+        } else if (strcmp(argv[i], "-b") == 0) {
+            sh.batch = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                script = argv[++i];
             }
-        }
-        else if (strcmp(cmd, "close") == 0 || strcmp(cmd, "my_close") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: close <文件描述符>\n");
+        } else if (strcmp(argv[i], "-s") == 0) {
+            sh.dump_stats = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "normal") == 0) {
+                sh.output = OUTPUT_NORMAL;
+            } else if (strcmp(mode, "quiet") == 0) {
+                sh.output = OUTPUT_QUIET;
+            } else if (strcmp(mode, "machine") == 0) {
+                sh.output = OUTPUT_MACHINE;
             } else {
-                fd = atoi(arg1);
-                my_close(fd);
+                printf("未知输出模式: %s\n", mode);
+                return 1;
             }
+        } else {
+            printf("未知选项: %s\n", argv[i]);
+            printf("用法: %s [-m] [-c MiB] [-z] [-k] [-w 毫秒] [-b [脚本文件]] [-o normal|quiet|machine] [-s]\n", argv[0]);
+            return 1;
         }
-        else if (strcmp(cmd, "write") == 0 || strcmp(cmd, "my_write") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: write <文件描述符> [内容]\n");
-                printf("      如果不提供内容，将进入多行输入模式，以单独一行的END结束\n");
-            } else {
-                fd = atoi(arg1);
-
-                if (arg2[0] == '\0') {
-                    // 多行输入模式
-                    printf("请输入内容，以单独一行的END结束：\n");
-                    char content[4096] = "";
-                    char line[256];
-
-                    while (1) {
-                        fgets(line, sizeof(line), stdin);
-                        if (strcmp(line, "END\n") == 0 || strcmp(line, "end\n") == 0) {
-                            break;
-                        }
-                        strcat(content, line);
-                    }
+    }
 
-                    ret = my_write(fd, content, strlen(content));
-                    if (ret >= 0) {
-                        printf("已写入 %d 字节\n", ret);
-                    }
-                } else {
-                    // 使用命令行提供的内容
-                    ret = my_write(fd, arg2, strlen(arg2));
-                    if (ret >= 0) {
-                        printf("已写入 %d 字节\n", ret);
-                    }
-                }
-            }
+    if (script != NULL) {
+        sh.in = fopen(script, "r");
+        if (sh.in == NULL) {
+            printf("无法打开脚本文件 %s！\n", script);
+            return 1;
         }
-        else if (strcmp(cmd, "read") == 0 || strcmp(cmd, "my_read") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: read <文件描述符> [读取字节数]\n");
-            } else {
-                fd = atoi(arg1);
-                int size = 1024; // 默认读取1024字节
-
-                if (arg2[0] != '\0') {
-                    size = atoi(arg2);
-                }
-
-                char* read_buffer = (char*)malloc(size + 1);
-                if (read_buffer == NULL) {
-                    printf("内存分配失败！\n");
-                    continue;
-                }
+    }
+    sh.interactive = !sh.batch && isatty(STDIN_FILENO);
 
-                ret = my_read(fd, read_buffer, size);
-                if (ret > 0) {
-                    read_buffer[ret] = '\0';
-                    printf("读取内容（%d 字节）：\n%s\n", ret, read_buffer);
-                } else if (ret == 0) {
-                    printf("已到达文件末尾\n");
-                }
+    // 批量模式下输出整块缓冲，避免每行一次write系统调用
+    if (sh.batch) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
 
-                free(read_buffer);
-            }
+    // 尝试加载已有的文件系统，如果不存在则格式化一个新的
+    int ret = fs_mount(&sh.fs, IMAGE_FILE, JOURNAL_FILE, flags);
+    if (ret != FS_OK) {
+        reply_error(&sh, "加载文件系统", ret);
+        return 1;
+    }
+    if (cache_mb > 0) {
+        ret = fs_set_cache_budget(sh.fs, cache_mb * 1024 * 1024);
+        if (ret != FS_OK) {
+            reply_error(&sh, "设置驻留预算", ret);
+            fs_unmount(sh.fs);
+            return 1;
         }
-        else if (strcmp(cmd, "rm") == 0 || strcmp(cmd, "my_rm") == 0) {
-            if (arg1[0] == '\0') {
-                printf("用法: rm <文件名>\n");
-            } else {
-                my_rm(arg1);
+    }
+    print_mount_info(&sh);
+    if (writeback_ms > 0) {
+        ret = fs_set_writeback(sh.fs, writeback_ms, 0);
+        if (ret != FS_OK) {
+            reply_error(&sh, "开启后台回写", ret);
+            if (ret == FS_ERR_INVAL) {
+                say(&sh, "后台回写需要使用日志，映射模式或没有日志时只在sync和退出时写回映像\n");
             }
         }
-        else if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0 ||
-                 strcmp(cmd, "my_exitsys") == 0) {
-            my_exitsys();
-            break;
+    }
+    if (check) {
+        // 机器可读模式下不输出，以免打乱命令与状态行的对应
+        FsFsckStat st;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ret = fs_fsck(sh.fs, false, &st);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (ret != FS_OK) {
+            reply_error(&sh, "一致性检查", ret);
+        } else if (st.problems > 0 && sh.output != OUTPUT_MACHINE) {
+            print_fsck(&sh, &st, (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+            printf("一致性检查发现 %u 个问题，可用 fsck repair 修复！\n", st.problems);
+        } else {
+            say(&sh, "一致性检查没有发现问题\n");
+        }
+    }
+    if (sh.batch) {
+        // 脚本可以重新执行，放宽组提交以减少落盘次数
+        fs_set_group_commit(sh.fs, BATCH_GROUP_OPS, BATCH_GROUP_MS);
+    } else {
+        say(&sh, "简易文件系统启动成功！输入help查看可用命令。\n");
+    }
+
+    sh.running = true;
+    while (sh.running) {
+        if (!sh.batch) {
+            char cwd[MAX_PATH_LENGTH];
+            fs_getcwd(sh.fs, cwd, sizeof(cwd));
+            printf("%s> ", cwd);
+            fflush(stdout);
         }
-        else if (strcmp(cmd, "help") == 0) {
-            printf("可用命令：\n");
-            printf("  format             - 格式化文件系统\n");
-            printf("  mkdir <目录名>     - 创建目录\n");
-            printf("  rmdir <目录名>     - 删除目录\n");
-            printf("  ls                 - 显示当前目录内容\n");
-            printf("  cd <目录名>        - 切换目录\n");
-            printf("  create <文件名>    - 创建文件\n");
-            printf("  open <文件名> <模式> - 打开文件（模式: r-读, w-写, a-追加）\n");
-            printf("  close <文件描述符> - 关闭文件\n");
-            printf("  write <文件描述符> [内容] - 写入文件\n");
-            printf("  read <文件描述符> [字节数] - 读取文件\n");
-            printf("  rm <文件名>        - 删除文件\n");
-            printf("  exit/quit          - 退出文件系统\n");
+
+        // 交互输入时每条命令之间都可能长时间等待，等待前先提交；批量输入时按组提交
+        if (sh.interactive) {
+            fs_commit(sh.fs);
         }
-        else if (cmd[0] != '\0') {
-            printf("未知命令: %s\n", cmd);
-            printf("输入 help 查看可用命令\n");
+
+        // 输入结束时与exit相同，保存后退出
+        if (getline(&sh.line, &sh.line_cap, sh.in) < 0) {
+            if (!sh.batch) {
+                putchar('\n');
+            }
+            cmd_exit(&sh, 0, NULL);
+            break;
         }
+        run_line(&sh, sh.line);
     }
 
+    fs_unmount(sh.fs);
+    say(&sh, "文件系统已安全退出！\n");
+
+    free(sh.line);
+    if (sh.in != stdin) {
+        fclose(sh.in);
+    }
     return 0;
-}
\ No newline at end of file
+}
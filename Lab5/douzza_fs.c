@@ -0,0 +1,6552 @@
+/*
+ * 简单文件系统实现
+ *
+ * 本实现在内存中创建一个虚拟磁盘，并实现一个具有多级目录结构的简单文件系统。
+ * 接口见 douzza_fs.h，所有状态都保存在 fs_instance 中。
+ */
+
+#include "douzza_fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* 常量定义 */
+#define DEFAULT_BLOCK_SIZE 1024    // 默认块大小（字节）
+#define DEFAULT_BLOCK_COUNT 1024   // 默认块数（默认卷大小1MB）
+#define MIN_BLOCK_SIZE 512         // 块大小下限
+#define MAX_BLOCK_SIZE 65536       // 块大小上限
+#define MIN_BLOCK_COUNT 16         // 块数下限
+#define MAX_FAT16_BLOCKS 0xFFF0    // 16位FAT能描述的最大块数
+#define SKIP_SLOTS 64         // 每个打开文件的跳跃索引槽数
+#define SUPER_BLOCK 0         // 超级块位于块0，因此块号0可以表示"无块"
+#define FAT_BLOCK 1           // FAT表从块1开始，占用若干连续块
+#define EOF_BLOCK 0xFFFFFFFF  // FAT中的文件结束标记（16位FAT在盘上记为0xFFFF）
+#define FS_MAGIC "DOUZZAFS"   // 超级块魔数
+#define FS_VERSION 4          // 盘上格式版本（2：内联文件、小文件块和区段布局的空洞；3：快照；4：共享的数据块；仍可挂载旧版本的卷）
+#define JOURNAL_MAGIC 0x4C4E524A      // 日志事务魔数
+#define JOURNAL_GROUP_OPS 32          // 组提交：累计的操作数达到此值时提交
+#define JOURNAL_GROUP_MS 100          // 组提交：最早未提交的操作等待超过此毫秒数时提交
+#define JOURNAL_CHECKPOINT_BYTES (4 * 1024 * 1024)  // 日志超过此大小时做检查点并截断
+#define WRITEBACK_POLL_MS 100         // 后台回写线程检查脏块数和未提交事务的间隔（毫秒）
+#define WRITEBACK_DIRTY_BLOCKS 4096   // 后台回写的默认脏块阈值
+#define WRITEBACK_STAGE_BYTES (4 * 1024 * 1024)  // 后台回写每轮在实例写锁内复制出的最大字节数
+#define DIR_LOCK_STRIPES 64           // 目录读写锁数（按目录首块散列）
+#define FILE_LOCK_STRIPES 64          // 文件读写锁数（按目录项位置散列）
+#define DCACHE_LOCKS 16               // 目录项缓存锁数（按缓存槽散列）
+#define STAT_STRIPES 16               // 运行计数的分组数（各线程累加到不同的组）
+#define CACHE_CHUNK_SIZE (64 * 1024)  // 驻留预算的管理粒度（页大小的整数倍）
+#define CACHE_HEAT_MASK 0x03          // 段状态：热度（CLOCK指针经过时减1，为0时淘汰）
+#define CACHE_RESIDENT 0x40           // 段状态：已计入驻留
+#define CACHE_PINNED 0x80             // 段状态：常驻（超级块、FAT区、根目录），不计入预算
+#define CACHE_MIN_CHUNKS 16           // 预算至少为这么多段
+#define CACHE_DATA_HEAT 1             // 访问数据块后的热度
+#define CACHE_DIR_HEAT 3              // 访问目录块后的热度，热目录比数据多经过几轮才被淘汰
+#define DEFRAG_PASSES 3               // 碎片整理最多遍历目录树的次数（前一遍腾出的空间可能让后一遍搬得动）
+#define READAHEAD_MIN (128 * 1024)    // 检测到顺序读后第一次预读的字节数
+#define READAHEAD_MAX (8 * 1024 * 1024) // 预读窗口的上限（字节），持续顺序读时窗口逐次加倍到此为止
+#define SMALL_SLOT_SIZE 64            // 小文件块的槽大小（字节）
+#define SMALL_MAX_SLOTS 4             // 内联文件最多占用的连续槽数
+#define INLINE_MAX (SMALL_SLOT_SIZE * SMALL_MAX_SLOTS)  // 内联文件的大小上限（字节），超过时改用数据块
+#define MAX_SNAPSHOTS 16              // 每个卷最多的快照数
+#define MAX_BLOCK_REFS 16             // 区段布局的数据块最多被几处共享（共享计数记在FAT表项中）
+#define DEDUP_MIN_SLOTS 1024          // 去重哈希索引的最少槽数
+#define FSCK_PARALLEL_BLOCKS 65536    // 块数达到此值的卷用多个线程做一致性检查
+#define FSCK_MAX_THREADS 8            // 一致性检查最多使用的线程数
+
+/* 结构体定义 */
+
+// FAT表条目（内存中统一按32位处理，盘上宽度由超级块决定）
+typedef unsigned int FAT_ENTRY;
+
+// 超级块：记录格式化时选定的卷几何参数
+typedef struct {
+    char magic[8];                       // 魔数 FS_MAGIC
+    unsigned int version;                // 格式版本
+    unsigned int block_size;             // 块大小（字节）
+    unsigned int block_count;            // 块总数
+    unsigned int fat_width;              // FAT表项位宽（16或32）
+    unsigned int fat_start;              // FAT区起始块
+    unsigned int fat_blocks;             // FAT区块数
+    unsigned int root_block;             // 根目录首块
+    unsigned int data_start;             // 数据区起始块
+    unsigned int default_layout;         // 新建文件的默认布局
+    unsigned int small_head;             // 小文件块链的首块（0表示无，版本2起）
+    unsigned int snap_head;              // 最新快照的描述块（0表示无快照，版本3起）
+} SuperBlock;
+
+// 文件/目录属性
+typedef struct {
+    unsigned char is_dir : 1;     // 是否是目录
+    unsigned char read : 1;       // 读权限
+    unsigned char write : 1;      // 写权限
+    unsigned char extents : 1;    // 区段布局
+    unsigned char inline_data : 1;  // 内联文件：内容在小文件块的槽中（还没写入内容时不占用任何块）
+    unsigned char reserved : 3;   // 保留位
+} Attributes;
+
+// 目录项结构
+typedef struct {
+    char filename[MAX_FILENAME_LENGTH];  // 文件名
+    Attributes attr;                     // 文件属性
+    unsigned int first_block;            // 第一个数据块号
+    unsigned int file_size;              // 文件大小
+    unsigned int index_block;            // 目录名哈希索引首块（仅"."项使用，0表示无索引）；内联文件为槽号和槽数
+    time_t create_time;                  // 创建时间
+} DirEntry;
+
+#define DIR_ENTRIES_PER_BLOCK ((int)(fs->block_size / sizeof(DirEntry)))  // 每个目录块的目录项数
+
+// 目录哈希索引头，位于索引首块开头；索引占用一段连续块，桶数组紧随其后
+typedef struct {
+    unsigned int bucket_count;           // 桶数（2的幂）
+    unsigned int used;                   // 有效项数（不含"."和".."）
+    unsigned int tombstones;             // 删除标记数
+    unsigned int tail_block;             // 目录链的最后一块
+    unsigned int free_block;             // 最近出现空槽的目录块
+} DirIndexHeader;
+
+// 索引桶：loc为目录项位置编码（块号*每块项数+槽位+1），0表示空桶
+typedef struct {
+    unsigned int hash;                   // 名字哈希
+    unsigned int loc;                    // 目录项位置
+} IndexBucket;
+
+#define INDEX_HEADER_SIZE 32          // 索引头占用的字节数（桶数组起始偏移）
+#define INDEX_TOMBSTONE 0xFFFFFFFF    // 已删除桶标记
+#define INDEX_MIN_BUCKETS 64          // 索引最小桶数
+
+// 目录项缓存槽：缓存（父目录首块，名字）的查找结果，loc为0表示名字不存在（负缓存）
+typedef struct {
+    unsigned int parent;                 // 父目录首块（0表示空槽）
+    unsigned int hash;                   // 名字哈希
+    unsigned int loc;                    // 目录项位置编码（同目录索引）
+    char name[MAX_FILENAME_LENGTH];
+} Dentry;
+
+#define DCACHE_SLOTS 4096             // 目录项缓存槽数（2的幂，直接映射）
+
+// 区段布局的文件：first_block指向区段表块，数据块在FAT中只标记为已占用（EOF_BLOCK），不成链；
+// 去重后被n处共享的数据块记为EOF_BLOCK-(n-1)（见block_refs），写入前先复制（见extent_unshare）
+// 区段表块头，区段数组紧随其后；区段过多时通过next串接溢出块
+typedef struct {
+    unsigned int count;                  // 本块中的区段数
+    unsigned int next;                   // 下一个溢出块（0表示无）
+    unsigned int tail;                   // 最后一个区段表块（仅首块有效）
+    unsigned int reserved;
+} ExtentHeader;
+
+// 区段：一段逻辑上和物理上都连续的块
+typedef struct {
+    unsigned int logical;                // 起始逻辑块号
+    unsigned int start;                  // 起始物理块号
+    unsigned int length;                 // 块数
+} Extent;
+
+#define EXTENTS_PER_BLOCK ((int)((fs->block_size - sizeof(ExtentHeader)) / sizeof(Extent)))  // 每块区段数
+#define MAX_EXTENT_LENGTH 0xFFFFFF    // 单个区段的最大块数
+
+// 内联文件（不超过INLINE_MAX字节）不独占数据块：内容放在小文件块的若干连续槽中，目录项的first_block为
+// 所在的小文件块，index_block的低16位为起始槽号、高16位为槽数；新建的文件是没有槽的内联文件（first_block为0），
+// 写入内容后超过INLINE_MAX字节时才按文件的布局申请首块
+// 目录项（56字节：名字、属性、首块、大小、索引块和创建时间）没有空余的位置存放内容，加长目录项会改变
+// DIR_ENTRIES_PER_BLOCK和磁盘上的目录与索引布局，因此内容放在共享的小文件块中
+// 小文件块头，其后是槽占用位图（块头和位图本身占用开头的几个槽）；所有小文件块串成双向链，链头在超级块中
+typedef struct {
+    unsigned int used;                   // 内联文件占用的槽数
+    unsigned int next;                   // 链中的下一块（0表示无）
+    unsigned int prev;                   // 链中的上一块（0表示链头）
+    unsigned int reserved;
+} SmallHeader;
+
+#define SMALL_SLOTS ((unsigned int)(fs->block_size / SMALL_SLOT_SIZE))  // 每个小文件块的槽数
+#define SMALL_META_BYTES (sizeof(SmallHeader) + (SMALL_SLOTS + 63) / 64 * 8)  // 块头和位图的字节数
+
+// 快照：创建时记下当时占用的块（块号小于数据区起点，或FAT中非0），这些块此后第一次要在映像中被覆盖前，
+// 先把映像中的旧内容复制到一个空闲块，（原块号，副本块号）记入快照的映射表；没被修改过的块仍由快照原地保存
+// 快照专用的块（描述块、占用块位图、映射表和副本）在FAT中是空闲的，由内存中的引用计数占住，不经过日志直接写入映像；
+// 创建时占用的块在快照删除前一直被引用，即使卷中已释放也不再分配，回滚时才能把内容写回原处而不覆盖别的副本
+// 快照描述块，各快照从新到旧串成单链，链头在超级块中
+typedef struct {
+    char name[MAX_FILENAME_LENGTH];      // 快照名
+    unsigned int next;                   // 更早一个快照的描述块（0表示无）
+    long long create_time;               // 创建时间
+    unsigned int bitmap_start;           // 创建时的占用块位图（一段连续块）
+    unsigned int bitmap_blocks;
+    unsigned int map_head;               // 映射表首块
+    unsigned int map_tail;               // 映射表的最后一块
+    unsigned int map_count;              // 映射项总数（已复制保存的块数）
+    unsigned int reserved;
+} SnapInfo;
+
+// 映射表块头，映射项数组紧随其后
+typedef struct {
+    unsigned int count;                  // 本块中的映射项数
+    unsigned int next;                   // 下一块（0表示无）
+} SnapMapHeader;
+
+// 映射项：快照中原块号为block的块的内容保存在copy中
+typedef struct {
+    unsigned int block;
+    unsigned int copy;
+} SnapMap;
+
+#define SNAP_MAPS_PER_BLOCK ((unsigned int)((fs->block_size - sizeof(SnapMapHeader)) / sizeof(SnapMap)))  // 每块映射项数
+
+// 去重哈希索引的槽（开放寻址）：每种内容记一个可供共享的块，只在去重期间存在
+typedef struct {
+    unsigned long long hash;             // 块内容的哈希
+    unsigned int block;                  // 块号（0表示空槽）
+} DedupSlot;
+
+// 一致性检查中待检查的目录
+typedef struct {
+    unsigned int block;                  // 目录首块
+    unsigned int parent;                 // 父目录首块（".."应指向它）
+} FsckDir;
+
+// 一致性检查的状态：各线程从目录栈中取出目录检查，子目录压回栈中；遇到的块记入占用位图和引用数，
+// 最后逐块与FAT对照。FAT链、目录索引、区段表和小文件块只能有一个主人，区段布局的数据块可以被共享
+typedef struct {
+    fs_instance* fs;
+    bool repair;                         // 同时修复（只用一个线程，修复时不会与其他线程冲突）
+    unsigned long long* owned;           // 已有主人的块（独占），置1表示已被占用
+    unsigned char* refs;                 // 区段布局的数据块被引用的次数（到255为止）
+    unsigned int* small_blocks;          // 小文件块链中的块（升序，二分查找）
+    unsigned int small_count;
+    unsigned long long* small_used;      // 各小文件块中块头和内联文件实际占用的槽，与small_blocks一一对应
+    unsigned int small_words;            // 每个小文件块的槽位图字数
+    FsckDir* stack;                      // 待检查的目录
+    unsigned int stack_count;
+    unsigned int stack_cap;
+    unsigned int active;                 // 正在检查目录的线程数
+    bool failed;                         // 内存不足，检查不完整
+    unsigned int* reindex;               // 修复时改动过、需要重建索引的目录
+    unsigned int reindex_count;
+    unsigned int reindex_cap;
+    pthread_mutex_t lock;                // 保护目录栈
+    pthread_cond_t cond;                 // 目录栈中有新目录，或全部检查完毕
+    FsFsckStat st;                       // 检查结果，各项用原子操作累加
+} FsckState;
+
+// 一致性检查最后一遍中一个线程对照的块号范围
+typedef struct {
+    FsckState* ck;
+    unsigned int start;
+    unsigned int end;
+} FsckRange;
+
+// 后台回写的暂存区：一轮中复制出的各段脏块
+typedef struct {
+    unsigned char* data;                 // 各段内容依次存放，malloc的max_blocks块暂存区
+    unsigned int* runs;                  // 各段的首块号和块数，两两一组
+    unsigned int run_count;
+    unsigned int max_blocks;             // 一轮最多复制的块数
+    unsigned int block_size;             // 开始回写时的卷几何，期间重新格式化则不再预写
+    unsigned int block_num;
+} WritebackStage;
+
+
+// 日志事务头，其后依次是range_count个JournalRange和data_bytes字节的新内容
+// checksum覆盖事务头之后的全部内容，写到一半的事务校验不通过，恢复时丢弃
+typedef struct {
+    unsigned int magic;                  // JOURNAL_MAGIC
+    unsigned int range_count;            // 修改的字节段数
+    unsigned int data_bytes;             // 新内容总字节数
+    unsigned int checksum;               // 校验和（FNV-1a）
+    unsigned long long seq;              // 事务序号
+} JournalHeader;
+
+// 日志中的一段元数据修改：虚拟磁盘上的字节偏移和长度
+typedef struct {
+    unsigned long long offset;
+    unsigned int length;
+    unsigned int reserved;
+} JournalRange;
+
+// 按块号散列的读写锁，每个锁独占一个缓存行，不同线程使用相邻的锁时不会互相干扰
+typedef struct {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) LockStripe;
+
+// 一组运行计数，独占若干缓存行；线程固定使用其中一组，读取时把各组相加
+typedef struct {
+    FsCounters c;
+} __attribute__((aligned(64))) StatStripe;
+
+// 打开文件表项
+typedef struct {
+    pthread_mutex_t lock;                // 表项锁：同一描述符上的操作依次执行
+    char filename[MAX_FILENAME_LENGTH];  // 文件名
+    unsigned int dir_block;              // 所在目录的首块号
+    unsigned int entry_loc;              // 目录项位置编码（文件打开期间目录项不会移动）
+    unsigned int first_block;            // 第一个数据块号
+    unsigned int file_size;              // 文件大小
+    unsigned int current_pos;            // 当前位置
+    unsigned int trunc_gen;              // 已处理到的截断代数，落后于实例的代数时需重新读取文件大小
+    bool is_used;                        // 是否使用
+    bool can_read;                       // 是否可读
+    bool can_write;                      // 是否可写
+    bool extents;                        // 是否为区段布局
+    bool inline_data;                    // 是否为内联文件
+
+    // 区段布局：最近命中的区段，顺序访问时直接使用
+    Extent cursor_extent;                // length为0表示无效
+
+    // FAT链游标：最近访问的逻辑块及其物理块号，顺序访问时无需从头遍历
+    unsigned int cursor_lblock;          // 游标逻辑块号
+    unsigned int cursor_pblock;          // 游标物理块号（0表示无效）
+
+    // 稀疏跳跃索引：skip[i]为逻辑块 i*skip_stride 的物理块号，随机定位时从最近的槽位出发
+    unsigned int skip[SKIP_SLOTS];
+    unsigned int skip_stride;            // 槽位间隔（逻辑块数，2的幂）
+    unsigned int skip_count;             // 已填写的槽位数
+
+    // 顺序预读（映射模式）：读的起点等于上次读的终点时视为顺序读
+    unsigned int ra_next;                // 上次读的终点（字节）
+    unsigned int ra_window;              // 当前预读窗口（块数，0表示未在顺序读）
+    unsigned int ra_mark;                // 已预读到的逻辑块号（不含）
+} OpenFileEntry;
+
+
+/* 文件系统实例：一个卷的虚拟磁盘及全部运行状态，各实例之间互不影响
+ *
+ * 并发控制（加锁顺序自上而下）：
+ *   fs_lock      普通操作持读锁；格式化、删除目录、切换目录、提交和检查点持写锁
+ *   dir_locks    目录读写锁：查找持读锁，创建、删除目录项持写锁
+ *   fd_lock      打开文件表的分配和释放
+ *   表项锁       同一描述符上的操作依次执行，保护读写位置和链游标
+ *   file_locks   文件内容读写锁（按目录项位置散列，首块可能变化）：读持读锁，写和截断持写锁
+ *   small_lock   小文件块的槽位图和链
+ *   alloc_lock   空闲位图、空闲块计数和分配提示
+ *   journal_lock 当前事务的字节段表、延迟释放表和组提交计数
+ *   dcache_locks 目录项缓存槽
+ *   wb_lock      后台回写的设置（不与其他锁嵌套）
+ * 读文件只取表项锁和文件读锁，不访问任何全局锁，读不同文件的线程可以在多个核上并行
+ * 脏块位图用原子操作置位，只在持有fs_lock写锁时清除
+ * 后台回写线程在写锁内复制脏块，只持读锁写入映像，写映像期间普通操作照常进行
+ */
+struct fs_instance {
+    pthread_rwlock_t fs_lock;                  // 实例锁
+    LockStripe dir_locks[DIR_LOCK_STRIPES];    // 目录锁
+    LockStripe file_locks[FILE_LOCK_STRIPES];  // 文件锁
+    pthread_mutex_t fd_lock;                   // 打开文件表锁
+    pthread_mutex_t alloc_lock;                // 分配器锁
+    pthread_mutex_t journal_lock;              // 日志事务锁
+    pthread_mutex_t small_lock;                // 小文件块锁
+    pthread_mutex_t dcache_locks[DCACHE_LOCKS];  // 目录项缓存锁
+
+    unsigned char* virtual_disk;               // 虚拟磁盘
+    SuperBlock* super;                         // 指向超级块的指针
+    void* fat;                                 // 指向FAT区的指针（按fat_width解释）
+    OpenFileEntry open_file_table[MAX_OPEN_FILES];  // 打开文件表
+    char current_dir[MAX_PATH_LENGTH];         // 当前目录
+    unsigned int current_dir_block;            // 当前目录块
+    char image_path[MAX_PATH_LENGTH];          // 映像文件路径
+    char journal_path[MAX_PATH_LENGTH];        // 日志文件路径
+
+    /* 卷几何参数（挂载时从超级块读出） */
+    unsigned int block_size;                   // 块大小
+    unsigned int block_num;                    // 块总数
+    unsigned long long disk_size;              // 卷大小（字节）
+    unsigned int fat_width;                    // FAT表项位宽
+    unsigned int root_block;                   // 根目录首块
+    unsigned int data_block;                   // 数据区起始块
+
+    /* 映射模式：virtual_disk直接映射磁盘映像文件（MAP_SHARED），按需缺页加载 */
+    bool use_mmap;                             // 是否使用映射模式
+    int disk_fd;                               // 映射模式下映像文件的描述符
+
+    /* 空闲块管理（由FAT重建，不写入磁盘） */
+    unsigned long long* free_bitmap;           // 空闲位图，置1表示块空闲
+    unsigned int bitmap_words;                 // 空闲位图的字数（每字64块）
+    unsigned int free_block_count;             // 空闲块数
+    unsigned int alloc_hint;                   // 下次分配的起始搜索位置
+    unsigned int shared_blocks;                // 被多处共享的数据块数，为0时（没做过去重）写入不必检查共享
+    unsigned int index_fail_free;              // 上次因空间不足建不成目录索引时的空闲块数（受alloc_lock保护），空闲块增加前新建目录项不再重建
+
+    /* 小文件块（不写入磁盘）：最近释放过槽或新申请的小文件块，申请槽时先在这块中找 */
+    unsigned int small_hint;                   // 0表示未知
+    bool small_scanned;                        // 挂载后是否已沿链找过有空位的块
+
+    /* 快照（不写入磁盘，挂载时由快照链重建）：snapshots按创建先后排列 */
+    unsigned int snapshots[MAX_SNAPSHOTS];     // 各快照的描述块
+    unsigned long long* snap_held[MAX_SNAPSHOTS];  // 各快照仍原地保存的块（置1表示映像中的内容属于该快照）
+    unsigned int snapshot_count;
+    unsigned long long* snap_cow;              // 所有快照原地保存的块的并集，写回映像前需要先复制
+    unsigned char* snap_refs;                  // 每块被快照引用的次数，不为0的块即使FAT中空闲也不能分配（无快照时为NULL）
+
+    /* 截断代数：每次截断文件加1，打开项取得文件锁后发现代数变化就丢弃缓存的文件大小和链游标 */
+    unsigned int trunc_gen;
+
+    /* 目录项缓存：路径解析逐级查找时先查缓存，命中则不必访问目录块 */
+    Dentry dcache[DCACHE_SLOTS];
+
+    /* 脏块管理：记录自上次保存以来修改过的块，保存时只写回这些块 */
+    unsigned long long* dirty_bitmap;          // 脏块位图，置1表示块已修改
+    unsigned long long* logged_bitmap;         // 自上次检查点以来在日志中出现过的块（提交和重放时置位，检查点清零）
+
+    /* 元数据日志：FAT和目录项等元数据的修改先写入日志，数据块在提交前原地写回映像 */
+    int journal_fd;                            // 日志文件描述符（-1表示不使用日志）
+    bool journal_broken;                       // 记录字节段时内存不足，下次提交改做检查点
+    JournalRange* journal_ranges;              // 当前事务修改过的元数据字节段
+    unsigned int journal_range_count;
+    unsigned int journal_range_cap;
+    unsigned int* pending_frees;               // 当前事务释放的块，提交后才能重新分配
+    unsigned int pending_free_count;
+    unsigned int pending_free_cap;
+    unsigned int journal_ops;                  // 当前事务累计的操作数
+    unsigned int group_ops;                    // 组提交的操作数阈值
+    unsigned int group_ms;                     // 组提交的等待时间阈值（毫秒）
+    long long journal_first_ms;                // 当前事务第一个操作的时间
+    unsigned long long journal_seq;            // 下一个事务的序号
+    unsigned long long journal_bytes;          // 日志文件当前大小
+
+    /* 驻留预算（映射模式）：按段记录对虚拟磁盘的访问，驻留的段数超过预算时用CLOCK算法
+     * 选出冷段，以MADV_DONTNEED从进程中丢弃。映射是MAP_SHARED的，丢弃的页（包括未写回的修改）
+     * 仍在内核页缓存中，由保存或内核回写写入映像，再次访问时重新缺页载入，因此淘汰不会丢数据，
+     * 也不需要与正在使用该段的线程互斥；并发时计数可能短暂偏离实际驻留量 */
+    unsigned long long cache_limit;            // 预算（字节，0表示不限制）
+    unsigned char* cache_state;                // 每段的状态（CACHE_*）
+    unsigned int cache_chunk_count;            // 段数
+    unsigned int cache_budget;                 // 预算段数（0表示不限制）
+    unsigned int cache_resident;               // 计入预算的驻留段数
+    unsigned int cache_hand;                   // CLOCK指针
+    pthread_mutex_t cache_lock;                // 淘汰时持有，同一时间只有一个线程淘汰
+
+    /* 后台回写（fs_set_writeback）：定期或脏块较多时把修改写回映像 */
+    pthread_t wb_thread;
+    bool wb_running;                           // 回写线程是否在运行
+    bool wb_stop;                              // 通知回写线程退出
+    unsigned int wb_interval_ms;               // 回写间隔（毫秒，0表示不回写）
+    unsigned int wb_dirty_blocks;              // 脏块达到此数时不等间隔提前回写
+    long long wb_last_ms;                      // 上次回写的时间
+    int wb_error;                              // 最近一次回写的结果
+    pthread_mutex_t wb_lock;                   // 保护以上设置
+    pthread_cond_t wb_cond;                    // 唤醒回写线程（修改设置或要求退出时）
+    unsigned int save_gen;                     // 写回代数：提交或保存原地写映像、重新格式化时加1（持有实例写锁）
+
+    /* 稀疏文件：区段布局中未映射的逻辑块是空洞，读出零，写到时才分配 */
+    bool zero_detect;                          // 写入空洞时检测全零块，不为其分配（FS_MOUNT_SPARSE）
+
+    /* 运行计数（供fs_get_stats查询） */
+    bool timing;                               // 是否统计各接口的延迟分布
+    StatStripe stats[STAT_STRIPES];
+
+    /* 挂载和保存信息（供fs_statfs查询） */
+    int mount_state;                           // FS_MOUNT_LOADED等
+    unsigned int replayed;                     // 挂载时从日志恢复的事务数
+    unsigned int saved_blocks;                 // 最近一次保存写回的块数
+    unsigned int saved_ranges;                 // 最近一次保存写回的段数
+};
+
+static void journal_note(fs_instance* fs, const void* addr, size_t len);
+
+// 当前线程使用的计数组（首次使用时轮流分配）
+static __thread int stat_stripe = -1;
+static int stat_stripe_next;
+
+static inline FsCounters* thread_stats(fs_instance* fs) {
+    if (stat_stripe < 0) {
+        stat_stripe = __atomic_fetch_add(&stat_stripe_next, 1, __ATOMIC_RELAXED) % STAT_STRIPES;
+    }
+    return &fs->stats[stat_stripe].c;
+}
+
+// 累加一项运行计数
+#define STAT_ADD(fs, field, n) __atomic_fetch_add(&thread_stats(fs)->field, (n), __ATOMIC_RELAXED)
+
+// 当前时间（纳秒，单调时钟）
+static inline long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 接口开始：统计延迟时返回开始时间，否则返回0
+static inline long long op_begin(fs_instance* fs) {
+    return fs->timing ? now_ns() : 0;
+}
+
+// 接口结束：计数并记录耗时，原样返回ret
+static int op_end(fs_instance* fs, int op, long long start, int ret) {
+    FsCounters* c = thread_stats(fs);
+    __atomic_fetch_add(&c->op_count[op], 1, __ATOMIC_RELAXED);
+    if (start != 0) {
+        long long ns = now_ns() - start;
+        int bucket = ns > 1 ? 63 - __builtin_clzll((unsigned long long)ns) : 0;
+        if (bucket >= FS_LATENCY_BUCKETS) {
+            bucket = FS_LATENCY_BUCKETS - 1;
+        }
+        __atomic_fetch_add(&c->op_total_ns[op], (unsigned long long)ns, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&c->latency[op][bucket], 1, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+// 驻留段数超过预算时，转动CLOCK指针淘汰冷段，直到降到预算的7/8（其他线程正在淘汰时直接返回）
+static void cache_evict(fs_instance* fs) {
+    if (pthread_mutex_trylock(&fs->cache_lock) != 0) {
+        return;
+    }
+    unsigned int target = fs->cache_budget - fs->cache_budget / 8;
+    unsigned long long limit = (unsigned long long)fs->cache_chunk_count * (CACHE_HEAT_MASK + 1);
+
+    for (unsigned long long n = 0; n < limit && __atomic_load_n(&fs->cache_resident, __ATOMIC_RELAXED) > target; n++) {
+        unsigned int c = fs->cache_hand;
+        fs->cache_hand = c + 1 < fs->cache_chunk_count ? c + 1 : 0;
+
+        unsigned char state = __atomic_load_n(&fs->cache_state[c], __ATOMIC_RELAXED);
+        if (!(state & CACHE_RESIDENT) || (state & CACHE_PINNED)) {
+            continue;
+        }
+        if (state & CACHE_HEAT_MASK) {
+            // 最近访问过：降低热度，给它下一轮机会（失败说明刚被访问，同样跳过）
+            __atomic_compare_exchange_n(&fs->cache_state[c], &state, state - 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&fs->cache_state[c], &state, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            size_t offset = (size_t)c * CACHE_CHUNK_SIZE;
+            size_t len = fs->disk_size - offset < CACHE_CHUNK_SIZE ? fs->disk_size - offset : CACHE_CHUNK_SIZE;
+            madvise(fs->virtual_disk + offset, len, MADV_DONTNEED);
+            __atomic_fetch_sub(&fs->cache_resident, 1, __ATOMIC_RELAXED);
+            STAT_ADD(fs, cache_evictions, 1);
+        }
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// 记录对虚拟磁盘[offset, offset+len)的访问：提升所在段的热度，新驻留的段计入预算
+static inline void cache_touch(fs_instance* fs, size_t offset, size_t len, unsigned char heat) {
+    if (__atomic_load_n(&fs->cache_budget, __ATOMIC_ACQUIRE) == 0 || len == 0) {
+        return;
+    }
+    size_t last = (offset + len - 1) / CACHE_CHUNK_SIZE;
+    for (size_t c = offset / CACHE_CHUNK_SIZE; c <= last; c++) {
+        unsigned char state = __atomic_load_n(&fs->cache_state[c], __ATOMIC_RELAXED);
+        if ((state & CACHE_PINNED) || ((state & CACHE_RESIDENT) && (state & CACHE_HEAT_MASK) >= heat)) {
+            continue;
+        }
+        unsigned char old = __atomic_fetch_or(&fs->cache_state[c], CACHE_RESIDENT | heat, __ATOMIC_RELAXED);
+        if (!(old & CACHE_RESIDENT) &&
+            __atomic_add_fetch(&fs->cache_resident, 1, __ATOMIC_RELAXED) > fs->cache_budget) {
+            cache_evict(fs);
+        }
+    }
+}
+
+// 块号对应的虚拟磁盘地址
+static inline unsigned char* block_ptr(fs_instance* fs, unsigned int block) {
+    cache_touch(fs, (size_t)block * fs->block_size, fs->block_size, CACHE_DATA_HEAT);
+    return fs->virtual_disk + (size_t)block * fs->block_size;
+}
+
+// 从block开始的count个连续块的地址（整段计入驻留）
+static inline unsigned char* run_ptr(fs_instance* fs, unsigned int block, unsigned int count) {
+    cache_touch(fs, (size_t)block * fs->block_size, (size_t)count * fs->block_size, CACHE_DATA_HEAT);
+    return fs->virtual_disk + (size_t)block * fs->block_size;
+}
+
+// 置[start, start+count)的脏块标记（多个线程可能同时标记同一字中的不同块，用原子或）
+static inline void set_dirty(fs_instance* fs, unsigned int start, unsigned int count) {
+    for (unsigned int b = start; b < start + count; b++) {
+        __atomic_fetch_or(&fs->dirty_bitmap[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+    }
+}
+
+// 块自上次检查点以来是否在日志中出现过（置位和清零都在持有实例写锁时进行）
+static inline bool block_logged(fs_instance* fs, unsigned int block) {
+    return fs->journal_fd >= 0 && (fs->logged_bitmap[block / 64] & (1ULL << (block % 64)));
+}
+
+// 把虚拟磁盘上[addr, addr+len)记入当前日志事务
+static inline void journal_add(fs_instance* fs, const void* addr, size_t len) {
+    pthread_mutex_lock(&fs->journal_lock);
+    journal_note(fs, addr, len);
+    pthread_mutex_unlock(&fs->journal_lock);
+}
+
+// 将[start, start+count)标记为脏块
+// 日志中出现过的块（如释放后重新分配的区段表块或小文件块）整块记入日志：
+// 原地写回的数据会在崩溃后重放时被旧事务中的字节段覆盖，记入日志后重放的最后结果就是新内容
+static inline void mark_dirty_blocks(fs_instance* fs, unsigned int start, unsigned int count) {
+    set_dirty(fs, start, count);
+    for (unsigned int b = start; b < start + count; b++) {
+        if (block_logged(fs, b)) {
+            journal_add(fs, fs->virtual_disk + (size_t)b * fs->block_size, fs->block_size);
+        }
+    }
+}
+
+// 将虚拟磁盘上[addr, addr+len)所在的块标记为脏块，落在日志中出现过的块内的部分记入日志
+// （只记这些块内的部分：其他块有本事务的字节段时提交时不会原地写回）
+static inline void mark_dirty(fs_instance* fs, const void* addr, size_t len) {
+    size_t offset = (const unsigned char*)addr - fs->virtual_disk;
+    unsigned int first = offset / fs->block_size;
+    unsigned int last = (offset + len - 1) / fs->block_size;
+    set_dirty(fs, first, last - first + 1);
+    for (unsigned int b = first; b <= last; b++) {
+        if (block_logged(fs, b)) {
+            size_t start = (size_t)b * fs->block_size;
+            size_t end = start + fs->block_size;
+            start = start > offset ? start : offset;
+            end = end < offset + len ? end : offset + len;
+            journal_add(fs, fs->virtual_disk + start, end - start);
+        }
+    }
+}
+
+// 标记元数据修改：除了标记脏块，还把修改的字节段记入当前日志事务
+static inline void mark_meta(fs_instance* fs, const void* addr, size_t len) {
+    size_t offset = (const unsigned char*)addr - fs->virtual_disk;
+    unsigned int first = offset / fs->block_size;
+    unsigned int last = (offset + len - 1) / fs->block_size;
+    set_dirty(fs, first, last - first + 1);
+    if (fs->journal_fd >= 0) {
+        journal_add(fs, addr, len);
+    }
+}
+
+// 把[offset, offset+len)所在的块标记为在日志中出现过
+static inline void mark_logged(fs_instance* fs, unsigned long long offset, size_t len) {
+    for (unsigned int b = offset / fs->block_size; b <= (offset + len - 1) / fs->block_size; b++) {
+        fs->logged_bitmap[b / 64] |= 1ULL << (b % 64);
+    }
+}
+
+// 目录首块对应的目录锁
+static inline pthread_rwlock_t* dir_lock(fs_instance* fs, unsigned int block) {
+    return &fs->dir_locks[block % DIR_LOCK_STRIPES].lock;
+}
+
+// 文件首块对应的文件锁
+static inline pthread_rwlock_t* file_lock(fs_instance* fs, unsigned int loc) {
+    return &fs->file_locks[loc % FILE_LOCK_STRIPES].lock;
+}
+
+// 读FAT表项，16位FAT的结束标记和共享计数统一转换为32位的值（16位FAT的块号小于0xFFF0）
+static inline FAT_ENTRY fat_get(fs_instance* fs, unsigned int block) {
+    if (fs->fat_width == 16) {
+        unsigned short value = ((unsigned short*)fs->fat)[block];
+        return value >= 0xFFF0 ? value | 0xFFFF0000 : value;
+    }
+    return ((unsigned int*)fs->fat)[block];
+}
+
+// 写FAT表项
+static inline void fat_set(fs_instance* fs, unsigned int block, FAT_ENTRY value) {
+    if (fs->fat_width == 16) {
+        ((unsigned short*)fs->fat)[block] = (unsigned short)value;
+        mark_meta(fs, (unsigned short*)fs->fat + block, sizeof(unsigned short));
+    } else {
+        ((unsigned int*)fs->fat)[block] = value;
+        mark_meta(fs, (unsigned int*)fs->fat + block, sizeof(unsigned int));
+    }
+}
+
+// 区段布局的数据块被几处引用：FAT表项为EOF_BLOCK时1处，共享时为EOF_BLOCK-(n-1)，这些值大于任何块号
+static inline unsigned int block_refs(fs_instance* fs, unsigned int block) {
+    FAT_ENTRY value = fat_get(fs, block);
+    return value >= EOF_BLOCK - (MAX_BLOCK_REFS - 1) ? EOF_BLOCK - value + 1 : 1;
+}
+
+/* 函数声明 */
+static unsigned int alloc_block(fs_instance* fs);
+static unsigned int alloc_run(fs_instance* fs, unsigned int want, unsigned int* got);
+static void free_block(fs_instance* fs, unsigned int block);
+static void put_free(fs_instance* fs, unsigned int block);
+static void free_chain(fs_instance* fs, unsigned int block);
+static unsigned int extend_chain(fs_instance* fs, unsigned int last, int want);
+static unsigned int alloc_extent(fs_instance* fs, unsigned int near, unsigned int want, unsigned int* got);
+static void rebuild_free_map(fs_instance* fs);
+static unsigned int extent_map(fs_instance* fs, OpenFileEntry* file, unsigned int lblock, unsigned int* run);
+static int extent_append(fs_instance* fs, unsigned int meta_block, unsigned int logical, unsigned int start, unsigned int length);
+static ExtentHeader* extent_grow(fs_instance* fs, ExtentHeader* head, ExtentHeader* tail);
+static int extent_insert(fs_instance* fs, unsigned int meta_block, unsigned int logical, unsigned int start, unsigned int length);
+static void extent_free_all(fs_instance* fs, unsigned int meta_block);
+static Extent* extent_find(fs_instance* fs, unsigned int meta_block, unsigned int lblock, unsigned int* hole);
+static int extent_remap(fs_instance* fs, unsigned int meta_block, unsigned int logical, unsigned int count, unsigned int start);
+static unsigned int extent_unshare(fs_instance* fs, OpenFileEntry* file, unsigned int lblock, unsigned int block, unsigned int* run);
+static bool extent_shared(fs_instance* fs, unsigned int meta_block);
+static unsigned char* inline_ptr(fs_instance* fs, unsigned int block, unsigned int slot);
+static unsigned int small_alloc(fs_instance* fs, unsigned int n, unsigned int* slot);
+static void small_free(fs_instance* fs, unsigned int block, unsigned int slot, unsigned int n);
+static void file_extend(fs_instance* fs, OpenFileEntry* file, unsigned int size);
+static DirEntry* dir_entries(fs_instance* fs, unsigned int block);
+static unsigned int entry_loc(fs_instance* fs, const DirEntry* entry);
+static DirEntry* loc_entry(fs_instance* fs, unsigned int loc);
+static DirEntry* dir_lookup(fs_instance* fs, unsigned int dir_block, const char* name);
+static DirEntry* dir_alloc_entry(fs_instance* fs, unsigned int dir_block, const char* name);
+static void dir_remove_entry(fs_instance* fs, unsigned int dir_block, DirEntry* entry);
+static bool dir_is_empty(fs_instance* fs, unsigned int dir_block);
+static void dir_free(fs_instance* fs, unsigned int dir_block);
+static int dir_build_index(fs_instance* fs, unsigned int dir_block);
+static void dcache_clear(fs_instance* fs);
+static int find_empty_entry(fs_instance* fs);
+static void reset_file_cursor(OpenFileEntry* file);
+static void file_readahead(fs_instance* fs, OpenFileEntry* file, unsigned int offset, unsigned int length);
+static unsigned int file_map(fs_instance* fs, OpenFileEntry* file, unsigned int lblock, unsigned int want, bool alloc, unsigned int* run);
+static int save_to_file(fs_instance* fs);
+static int journal_commit(fs_instance* fs);
+static int journal_checkpoint(fs_instance* fs);
+static int journal_flush(fs_instance* fs);
+static void journal_release(fs_instance* fs);
+static void journal_end_op(fs_instance* fs);
+static void journal_reset(fs_instance* fs);
+static void* writeback_thread(void* arg);
+static unsigned int dirty_count(fs_instance* fs);
+static long long now_ms();
+static void release_disk(fs_instance* fs);
+static int snap_preserve(fs_instance* fs);
+static void snap_reset(fs_instance* fs);
+static void defrag_walk(fs_instance* fs, unsigned int dir_block, int depth, FsFragStat* st, unsigned int* moved);
+static void dedup_walk(fs_instance* fs, unsigned int dir_block, int depth, DedupSlot* slots, unsigned int mask, FsDedupStat* st);
+static int fsck_run(fs_instance* fs, bool repair, FsFsckStat* st);
+static SnapInfo* snap_info(fs_instance* fs, unsigned int block);
+static int snap_find(fs_instance* fs, const char* name);
+static int snap_create(fs_instance* fs, const char* name);
+static int snap_rollback(fs_instance* fs, unsigned int i);
+static int snap_delete(fs_instance* fs, unsigned int i);
+
+/* 文件系统实现 */
+
+// 为指定大小的卷准备虚拟磁盘内存
+// 映射模式下调整映像文件大小并重新映射，只清零元数据区；否则重新分配一块清零的内存
+// 普通模式下分配失败时保留原有虚拟磁盘；映射模式下重新映射失败后实例不可再用
+static int prepare_disk(fs_instance* fs, unsigned long long size, unsigned int metadata_bytes) {
+    if (fs->use_mmap && fs->disk_fd >= 0) {
+        if (fs->virtual_disk == NULL || size != fs->disk_size) {
+            if (fs->virtual_disk != NULL) {
+                munmap(fs->virtual_disk, fs->disk_size);
+                fs->virtual_disk = NULL;
+            }
+            if (ftruncate(fs->disk_fd, size) != 0) {
+                return FS_ERR_IO;
+            }
+            void* disk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fs->disk_fd, 0);
+            if (disk == MAP_FAILED) {
+                return FS_ERR_IO;
+            }
+            fs->virtual_disk = (unsigned char*)disk;
+        }
+        // 只清零超级块、FAT区和根目录，数据块在分配时才初始化，避免触碰整个映像
+        memset(fs->virtual_disk, 0, metadata_bytes);
+        return FS_OK;
+    }
+
+    // 分配虚拟磁盘空间并初始化为0（大块内存由系统按需清零）
+    unsigned char* disk = (unsigned char*)calloc(1, size);
+    if (disk == NULL) {
+        return FS_ERR_NOMEM;
+    }
+
+    // 释放之前的虚拟磁盘（如果存在）
+    free(fs->virtual_disk);
+    fs->virtual_disk = disk;
+    return FS_OK;
+}
+
+// 按当前卷几何和预算重建段状态表（映射模式且设置了预算时才启用）
+// 元数据区（超级块、FAT）和根目录所在的段常驻不计入预算，其余段先全部丢弃，按访问重新计入
+// 调用者独占实例（持有实例写锁和所有打开文件表项的锁，或者在挂载过程中）
+static int cache_setup(fs_instance* fs) {
+    __atomic_store_n(&fs->cache_budget, 0, __ATOMIC_RELEASE);
+    free(fs->cache_state);
+    fs->cache_state = NULL;
+    fs->cache_resident = 0;
+    fs->cache_hand = 0;
+    if (!fs->use_mmap || fs->cache_limit == 0 || fs->virtual_disk == NULL) {
+        return FS_OK;
+    }
+
+    fs->cache_chunk_count = (fs->disk_size + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+    fs->cache_state = (unsigned char*)calloc(fs->cache_chunk_count, 1);
+    if (fs->cache_state == NULL) {
+        return FS_ERR_NOMEM;
+    }
+    size_t meta_end = ((size_t)fs->data_block * fs->block_size + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+    for (size_t c = 0; c < meta_end && c < fs->cache_chunk_count; c++) {
+        fs->cache_state[c] = CACHE_PINNED;
+    }
+    fs->cache_state[(size_t)fs->root_block * fs->block_size / CACHE_CHUNK_SIZE] = CACHE_PINNED;
+
+    for (size_t c = 0; c < fs->cache_chunk_count; c++) {
+        if (!(fs->cache_state[c] & CACHE_PINNED)) {
+            size_t offset = c * CACHE_CHUNK_SIZE;
+            size_t len = fs->disk_size - offset < CACHE_CHUNK_SIZE ? fs->disk_size - offset : CACHE_CHUNK_SIZE;
+            madvise(fs->virtual_disk + offset, len, MADV_DONTNEED);
+        }
+    }
+
+    unsigned long long budget = fs->cache_limit / CACHE_CHUNK_SIZE;
+    if (budget < CACHE_MIN_CHUNKS) {
+        budget = CACHE_MIN_CHUNKS;
+    }
+    if (budget > fs->cache_chunk_count) {
+        budget = fs->cache_chunk_count;
+    }
+    __atomic_store_n(&fs->cache_budget, (unsigned int)budget, __ATOMIC_RELEASE);
+    return FS_OK;
+}
+
+// 根据超级块设置卷几何参数，并为空闲位图分配空间
+static int apply_geometry(fs_instance* fs) {
+    fs->super = (SuperBlock*)fs->virtual_disk;
+    fs->block_size = fs->super->block_size;
+    fs->block_num = fs->super->block_count;
+    fs->disk_size = (unsigned long long)fs->block_size * fs->block_num;
+    fs->fat_width = fs->super->fat_width;
+    fs->root_block = fs->super->root_block;
+    fs->data_block = fs->super->data_start;
+    fs->fat = fs->virtual_disk + (size_t)fs->super->fat_start * fs->block_size;
+
+    fs->small_hint = 0;
+    fs->small_scanned = false;
+    fs->save_gen++;
+    snap_reset(fs);
+
+    fs->bitmap_words = (fs->block_num + 63) / 64;
+    free(fs->free_bitmap);
+    free(fs->dirty_bitmap);
+    free(fs->logged_bitmap);
+    fs->free_bitmap = (unsigned long long*)calloc(fs->bitmap_words, sizeof(unsigned long long));
+    fs->dirty_bitmap = (unsigned long long*)calloc(fs->bitmap_words, sizeof(unsigned long long));
+    fs->logged_bitmap = (unsigned long long*)calloc(fs->bitmap_words, sizeof(unsigned long long));
+    if (fs->free_bitmap == NULL || fs->dirty_bitmap == NULL || fs->logged_bitmap == NULL) {
+        return FS_ERR_NOMEM;
+    }
+    return cache_setup(fs);
+}
+
+// 格式化虚拟磁盘
+// layout为新建文件的默认布局（LAYOUT_FAT或LAYOUT_EXTENT），其余参数为0时使用默认值：
+// 块大小DEFAULT_BLOCK_SIZE、块数DEFAULT_BLOCK_COUNT，FAT位宽按块数自动选择16或32
+static int do_format(fs_instance* fs, int layout, unsigned int new_block_size, unsigned int new_block_count, unsigned int new_fat_width) {
+    if (layout != LAYOUT_FAT && layout != LAYOUT_EXTENT) {
+        return FS_ERR_INVAL;
+    }
+    if (new_block_size == 0) {
+        new_block_size = DEFAULT_BLOCK_SIZE;
+    }
+    if (new_block_count == 0) {
+        new_block_count = DEFAULT_BLOCK_COUNT;
+    }
+    if (new_fat_width == 0) {
+        new_fat_width = new_block_count > MAX_FAT16_BLOCKS ? 32 : 16;
+    }
+
+    // 检查参数，不合法时保留原有文件系统
+    if (new_block_size < MIN_BLOCK_SIZE || new_block_size > MAX_BLOCK_SIZE ||
+        (new_block_size & (new_block_size - 1)) != 0) {
+        return FS_ERR_INVAL;
+    }
+    if (new_fat_width != 16 && new_fat_width != 32) {
+        return FS_ERR_INVAL;
+    }
+    if (new_block_count < MIN_BLOCK_COUNT ||
+        (new_fat_width == 16 && new_block_count > MAX_FAT16_BLOCKS) ||
+        new_block_count >= EOF_BLOCK - 16) {
+        return FS_ERR_INVAL;
+    }
+
+    unsigned long long fat_bytes = (unsigned long long)new_block_count * (new_fat_width / 8);
+    unsigned int fat_blocks = (unsigned int)((fat_bytes + new_block_size - 1) / new_block_size);
+    unsigned int new_root = FAT_BLOCK + fat_blocks;
+    if (new_root + 1 >= new_block_count) {
+        return FS_ERR_INVAL;
+    }
+
+    unsigned long long size = (unsigned long long)new_block_size * new_block_count;
+    int ret = prepare_disk(fs, size, (new_root + 1) * new_block_size);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    // 写入超级块
+    SuperBlock* sb = (SuperBlock*)fs->virtual_disk;
+    memcpy(sb->magic, FS_MAGIC, sizeof(sb->magic));
+    sb->version = FS_VERSION;
+    sb->block_size = new_block_size;
+    sb->block_count = new_block_count;
+    sb->fat_width = new_fat_width;
+    sb->fat_start = FAT_BLOCK;
+    sb->fat_blocks = fat_blocks;
+    sb->root_block = new_root;
+    sb->data_start = new_root + 1;
+    sb->default_layout = layout;
+    sb->small_head = 0;
+    sb->snap_head = 0;
+    ret = apply_geometry(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    // 设置已使用的块（超级块、FAT表和根目录），其余块为0即空闲
+    for (unsigned int i = SUPER_BLOCK; i < fs->data_block; i++) {
+        fat_set(fs, i, EOF_BLOCK);
+    }
+    rebuild_free_map(fs);
+
+    // 初始化根目录
+    DirEntry* root_dir = (DirEntry*)(block_ptr(fs, fs->root_block));
+    memset(root_dir, 0, fs->block_size);
+    
+    // 添加 "." 条目 (根目录指向自身)
+    strcpy(root_dir[0].filename, ".");
+    root_dir[0].attr.is_dir = 1;
+    root_dir[0].attr.read = 1;
+    root_dir[0].attr.write = 1;
+    root_dir[0].first_block = fs->root_block;
+    root_dir[0].file_size = 0;
+    root_dir[0].create_time = time(NULL);
+    
+    // 添加 ".." 条目 (根目录的父目录是自身)
+    strcpy(root_dir[1].filename, "..");
+    root_dir[1].attr.is_dir = 1;
+    root_dir[1].attr.read = 1;
+    root_dir[1].attr.write = 1;
+    root_dir[1].first_block = fs->root_block; // 根目录的父目录仍是自己
+    root_dir[1].file_size = 0;
+    root_dir[1].create_time = time(NULL);
+
+    // 超级块、FAT区和根目录都需要写回；数据块不必写，未分配的块内容不会被读到
+    mark_dirty_blocks(fs, SUPER_BLOCK, fs->data_block);
+
+    // 日志中旧卷的事务已无意义：直接把新卷的元数据写回映像并清空日志
+    if (fs->journal_fd >= 0) {
+        journal_reset(fs);
+        ret = journal_checkpoint(fs);
+    }
+
+    // 设置当前目录为根目录
+    strcpy(fs->current_dir, "/");
+    fs->current_dir_block = fs->root_block;
+    dcache_clear(fs);
+
+    // 初始化打开文件表
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        fs->open_file_table[i].is_used = false;
+    }
+
+    return ret;
+}
+
+// 格式化会替换整个虚拟磁盘：持有实例写锁，并锁住所有打开文件表项，等待正在读文件的线程结束
+int fs_format(fs_instance* fs, int layout, unsigned int new_block_size, unsigned int new_block_count, unsigned int new_fat_width) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_lock(&fs->open_file_table[i].lock);
+    }
+    int ret = do_format(fs, layout, new_block_size, new_block_count, new_fat_width);
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->open_file_table[i].lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_FORMAT, t0, ret);
+}
+
+// 解析路径：绝对路径从根目录出发，相对路径从当前目录出发，逐级经目录项缓存查找
+// parent为true时只解析到最后一级的父目录，最后一级名字通过leaf返回（路径为"/"时为空）
+// 成功返回FS_OK并通过dir_block返回目录首块，canon不为NULL时返回该目录的规范路径
+// 调用者需持有实例读锁；每一级查找时持有该级目录的读锁，返回时不持有任何目录锁
+static int resolve_path(fs_instance* fs, const char* path, bool parent, unsigned int* dir_block, char* leaf, char* canon) {
+    char buf[MAX_PATH_LENGTH];
+    char cur_path[MAX_PATH_LENGTH];
+    unsigned int block;
+
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return FS_ERR_NAMETOOLONG;
+    }
+    strcpy(buf, path);
+
+    if (buf[0] == '/') {
+        block = fs->root_block;
+        strcpy(cur_path, "/");
+    } else {
+        block = fs->current_dir_block;
+        strcpy(cur_path, fs->current_dir);
+    }
+
+    // 需要父目录时先切出最后一级名字（忽略末尾的'/'）
+    if (parent) {
+        size_t len = strlen(buf);
+        while (len > 1 && buf[len - 1] == '/') {
+            buf[--len] = '\0';
+        }
+        char* slash = strrchr(buf, '/');
+        const char* name = slash != NULL ? slash + 1 : buf;
+        if (strlen(name) >= MAX_FILENAME_LENGTH) {
+            return FS_ERR_NAMETOOLONG;
+        }
+        strcpy(leaf, name);
+        if (slash != NULL) {
+            slash[1] = '\0';
+        } else {
+            buf[0] = '\0';
+        }
+    }
+
+    char* rest = buf;
+    char* token;
+    while ((token = strtok_r(rest, "/", &rest))) {
+        if (strcmp(token, ".") == 0) {
+            continue;
+        }
+
+        pthread_rwlock_t* lock = dir_lock(fs, block);
+        pthread_rwlock_rdlock(lock);
+
+        if (strcmp(token, "..") == 0) {
+            // ".." 固定位于目录首块的第二项，根目录的".."指向自身
+            block = dir_lookup(fs, block, "..")->first_block;
+            pthread_rwlock_unlock(lock);
+            char* last_slash = strrchr(cur_path, '/');
+            if (last_slash == cur_path) {
+                cur_path[1] = '\0';
+            } else {
+                *last_slash = '\0';
+            }
+            continue;
+        }
+
+        DirEntry* entry = dir_lookup(fs, block, token);
+        int ret = FS_OK;
+        if (entry == NULL) {
+            ret = FS_ERR_NOENT;
+        } else if (!entry->attr.is_dir) {
+            ret = FS_ERR_NOTDIR;
+        } else {
+            block = entry->first_block;
+        }
+        pthread_rwlock_unlock(lock);
+        if (ret != FS_OK) {
+            return ret;
+        }
+
+        if (strlen(cur_path) + strlen(token) + 2 > MAX_PATH_LENGTH) {
+            return FS_ERR_NAMETOOLONG;
+        }
+        if (strcmp(cur_path, "/") != 0) {
+            strcat(cur_path, "/");
+        }
+        strcat(cur_path, token);
+    }
+
+    *dir_block = block;
+    if (canon != NULL) {
+        strcpy(canon, cur_path);
+    }
+    return FS_OK;
+}
+
+// 解析路径的父目录和最后一级名字，名字为空、"."或".."时返回FS_ERR_INVAL
+static int resolve_parent(fs_instance* fs, const char* path, unsigned int* dir_block, char* leaf) {
+    int ret = resolve_path(fs, path, true, dir_block, leaf, NULL);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    if (leaf[0] == '\0' || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) {
+        return FS_ERR_INVAL;
+    }
+    return FS_OK;
+}
+
+// 在父目录中创建目录（调用者持有父目录写锁）
+static int do_mkdir(fs_instance* fs, unsigned int parent, const char* dirname) {
+    // 检查目录是否已存在
+    if (dir_lookup(fs, parent, dirname) != NULL) {
+        return FS_ERR_EXIST;
+    }
+
+    // 分配新块用于目录
+    unsigned int new_block = alloc_block(fs);
+    if (new_block == 0) {
+        return FS_ERR_NOSPC;
+    }
+
+    // 在父目录中创建新条目（目录块不够时会沿FAT链扩展）
+    DirEntry* entry = dir_alloc_entry(fs, parent, dirname);
+    if (entry == NULL) {
+        free_block(fs, new_block);
+        return FS_ERR_NOSPC;
+    }
+
+    // 初始化新目录块
+    DirEntry* new_dir_entries = dir_entries(fs, new_block);
+    memset(new_dir_entries, 0, fs->block_size);
+    mark_meta(fs, new_dir_entries, fs->block_size);
+    
+    // 添加 "." 条目 (指向自身)
+    strcpy(new_dir_entries[0].filename, ".");
+    new_dir_entries[0].attr.is_dir = 1;
+    new_dir_entries[0].attr.read = 1;
+    new_dir_entries[0].attr.write = 1; 
+    new_dir_entries[0].first_block = new_block;
+    new_dir_entries[0].file_size = 0;
+    new_dir_entries[0].create_time = time(NULL);
+    
+    // 添加 ".." 条目 (指向父目录)
+    strcpy(new_dir_entries[1].filename, "..");
+    new_dir_entries[1].attr.is_dir = 1;
+    new_dir_entries[1].attr.read = 1;
+    new_dir_entries[1].attr.write = 1;
+    new_dir_entries[1].first_block = parent; // 指向父目录
+    new_dir_entries[1].file_size = 0;
+    new_dir_entries[1].create_time = time(NULL);
+
+    // 填写新条目
+    entry->attr.is_dir = 1;
+    entry->attr.read = 1;
+    entry->attr.write = 1;
+    entry->first_block = new_block;
+    entry->file_size = 0;
+    entry->create_time = time(NULL);
+
+    return FS_OK;
+}
+
+// 删除目录（调用者持有实例写锁，无需目录锁）
+static int do_rmdir(fs_instance* fs, const char* path) {
+    // 不允许删除"."和".."（resolve_parent会拒绝）
+    unsigned int parent;
+    char dirname[MAX_FILENAME_LENGTH];
+    int ret = resolve_parent(fs, path, &parent, dirname);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    // 查找目录
+    DirEntry* entry = dir_lookup(fs, parent, dirname);
+    if (entry == NULL) {
+        return FS_ERR_NOENT;
+    }
+
+    // 确保是目录
+    if (!entry->attr.is_dir) {
+        return FS_ERR_NOTDIR;
+    }
+
+    // 当前目录的祖先都不为空，只需防止删除当前目录本身
+    if (entry->first_block == fs->current_dir_block) {
+        return FS_ERR_BUSY;
+    }
+
+    // 检查目录是否为空（"."和".."除外）
+    if (!dir_is_empty(fs, entry->first_block)) {
+        return FS_ERR_NOTEMPTY;
+    }
+
+    // 释放目录占用的块及其索引
+    dir_free(fs, entry->first_block);
+
+    // 从父目录中删除条目
+    dir_remove_entry(fs, parent, entry);
+    return FS_OK;
+}
+
+// 遍历目录内容，path为NULL或空时遍历当前目录；回调返回非0时停止
+// 回调执行时持有该目录的读锁，回调中不能修改同一实例
+int fs_listdir(fs_instance* fs, const char* path, fs_listdir_cb cb, void* arg) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    unsigned int dir_block = fs->current_dir_block;
+    if (path != NULL && path[0] != '\0') {
+        int ret = resolve_path(fs, path, false, &dir_block, NULL, NULL);
+        if (ret != FS_OK) {
+            pthread_rwlock_unlock(&fs->fs_lock);
+            return op_end(fs, FS_OP_LISTDIR, t0, ret);
+        }
+    }
+
+    pthread_rwlock_t* lock = dir_lock(fs, dir_block);
+    pthread_rwlock_rdlock(lock);
+
+    // 沿FAT链遍历目录的所有块
+    bool stop = false;
+    unsigned int scanned = 0, hops = 0;
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK && !stop; blk = fat_get(fs, blk), hops++) {
+        DirEntry* entries = dir_entries(fs, blk);
+
+        for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            scanned++;
+            if (entries[i].filename[0] == '\0') {
+                continue;
+            }
+
+            FsDirent info;
+            strcpy(info.name, entries[i].filename);
+            info.is_dir = entries[i].attr.is_dir;
+            info.extents = entries[i].attr.extents;
+            info.read = entries[i].attr.read;
+            info.write = entries[i].attr.write;
+            info.size = __atomic_load_n(&entries[i].file_size, __ATOMIC_RELAXED); // 写文件时不持有目录锁
+            info.create_time = entries[i].create_time;
+            if (cb(&info, arg) != 0) {
+                stop = true;
+                break;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    STAT_ADD(fs, dir_slots_scanned, scanned);
+    STAT_ADD(fs, fat_hops, hops);
+    return op_end(fs, FS_OP_LISTDIR, t0, FS_OK);
+}
+
+// 切换目录，解析成功后才更新当前目录（当前目录由实例内所有线程共享，修改时持有实例写锁）
+int fs_chdir(fs_instance* fs, const char* path) {
+    long long t0 = op_begin(fs);
+    if (path == NULL || path[0] == '\0') {
+        return op_end(fs, FS_OP_CHDIR, t0, FS_ERR_INVAL);
+    }
+
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    char temp_dir[MAX_PATH_LENGTH];
+    unsigned int temp_dir_block;
+    int ret = resolve_path(fs, path, false, &temp_dir_block, NULL, temp_dir);
+    if (ret == FS_OK) {
+        strcpy(fs->current_dir, temp_dir);
+        fs->current_dir_block = temp_dir_block;
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_CHDIR, t0, ret);
+}
+
+// 取得当前目录的路径
+int fs_getcwd(fs_instance* fs, char* buf, size_t size) {
+    int ret = FS_OK;
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    if (strlen(fs->current_dir) >= size) {
+        ret = FS_ERR_NAMETOOLONG;
+    } else {
+        strcpy(buf, fs->current_dir);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return ret;
+}
+
+// 取得目录路径的规范形式（绝对路径，不含"."和".."）
+int fs_realpath(fs_instance* fs, const char* path, char* buf, size_t size) {
+    char canon[MAX_PATH_LENGTH];
+    unsigned int dir_block;
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    int ret = resolve_path(fs, path, false, &dir_block, NULL, canon);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    if (strlen(canon) >= size) {
+        return FS_ERR_NAMETOOLONG;
+    }
+    strcpy(buf, canon);
+    return FS_OK;
+}
+
+// 在父目录中创建文件，layout为LAYOUT_DEFAULT时使用卷的默认布局（调用者持有父目录写锁）
+static int do_create(fs_instance* fs, unsigned int parent, const char* filename, int layout) {
+    // 检查文件是否已存在
+    if (dir_lookup(fs, parent, filename) != NULL) {
+        return FS_ERR_EXIST;
+    }
+
+    if (layout == LAYOUT_DEFAULT) {
+        layout = fs->super->default_layout;
+    } else if (layout != LAYOUT_FAT && layout != LAYOUT_EXTENT) {
+        return FS_ERR_INVAL;
+    }
+
+    // 在父目录中创建新条目（目录块不够时会沿FAT链扩展）
+    // 新文件是空的内联文件，不占用任何块，写入内容时才申请槽或首块
+    DirEntry* entry = dir_alloc_entry(fs, parent, filename);
+    if (entry == NULL) {
+        return FS_ERR_NOSPC;
+    }
+
+    entry->attr.is_dir = 0; // 文件而非目录
+    entry->attr.extents = (layout == LAYOUT_EXTENT);
+    entry->attr.inline_data = 1;
+    entry->attr.read = 1;
+    entry->attr.write = 1;
+    entry->first_block = 0;
+    entry->index_block = 0;
+    entry->file_size = 0;
+    entry->create_time = time(NULL);
+
+    return FS_OK;
+}
+
+// 释放文件占用的全部块（内联文件为槽），不修改目录项
+static void release_file_blocks(fs_instance* fs, DirEntry* entry) {
+    if (entry->attr.inline_data) {
+        if (entry->first_block != 0) {
+            small_free(fs, entry->first_block, entry->index_block & 0xFFFF, entry->index_block >> 16);
+        }
+        return;
+    }
+    if (entry->attr.extents) {
+        // 释放所有数据块和溢出块，区段表块随后沿链释放
+        extent_free_all(fs, entry->first_block);
+    }
+    free_chain(fs, entry->first_block);
+}
+
+// 截断文件为空，文件变回不占用任何块的内联文件
+// 调用者持有父目录写锁，这里再持有文件写锁以等待正在读写该文件的线程
+static void truncate_file(fs_instance* fs, DirEntry* entry) {
+    pthread_rwlock_t* lock = file_lock(fs, entry_loc(fs, entry));
+    pthread_rwlock_wrlock(lock);
+
+    release_file_blocks(fs, entry);
+
+    // 更新目录项
+    entry->attr.inline_data = 1;
+    entry->first_block = 0;
+    entry->index_block = 0;
+    entry->file_size = 0;
+    mark_meta(fs, entry, sizeof(DirEntry));
+
+    // 同一文件的其他打开项缓存的文件大小和链位置已失效，由它们下次取得文件锁时自行更新
+    // （打开文件表项由各自的表项锁保护，这里持有文件锁时不能再去取表项锁）
+    __atomic_add_fetch(&fs->trunc_gen, 1, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(lock);
+}
+
+// 打开父目录中的文件，成功返回文件描述符（调用者持有父目录锁，mode为'w'时须为写锁）
+static int do_open(fs_instance* fs, unsigned int parent, const char* filename, char mode) {
+    // 查找文件
+    DirEntry* entry = dir_lookup(fs, parent, filename);
+    if (entry == NULL) {
+        return FS_ERR_NOENT;
+    }
+
+    // 确保是文件而非目录
+    if (entry->attr.is_dir) {
+        return FS_ERR_ISDIR;
+    }
+
+    // 检查权限
+    if (mode == 'r' && !entry->attr.read) {
+        return FS_ERR_PERM;
+    }
+
+    if (mode == 'w' && !entry->attr.write) {
+        return FS_ERR_PERM;
+    }
+
+    // 如果是写模式，清空文件内容
+    if (mode == 'w') {
+        truncate_file(fs, entry);
+    }
+
+    // 在打开文件表中查找空闲项
+    pthread_mutex_lock(&fs->fd_lock);
+    int fd = find_empty_entry(fs);
+    if (fd == -1) {
+        pthread_mutex_unlock(&fs->fd_lock);
+        return FS_ERR_MFILE;
+    }
+
+    // 填充打开文件表项
+    OpenFileEntry* file = &fs->open_file_table[fd];
+    pthread_mutex_lock(&file->lock);
+    strcpy(file->filename, filename);
+    file->dir_block = parent;
+    file->entry_loc = entry_loc(fs, entry);
+    file->first_block = entry->first_block;
+    file->trunc_gen = __atomic_load_n(&fs->trunc_gen, __ATOMIC_RELAXED);
+    file->file_size = __atomic_load_n(&entry->file_size, __ATOMIC_RELAXED);
+    file->current_pos = 0;
+    file->can_read = (mode == 'r' || mode == 'a');
+    file->can_write = (mode == 'w' || mode == 'a');
+    file->extents = entry->attr.extents;
+    file->inline_data = entry->attr.inline_data;
+    reset_file_cursor(file);
+
+    // 如果是追加模式，将位置设在文件末尾
+    if (mode == 'a') {
+        file->current_pos = file->file_size;
+    }
+    file->is_used = true;
+    pthread_mutex_unlock(&file->lock);
+    STAT_ADD(fs, fd_opens, 1);
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    return fd;
+}
+
+// 其他描述符截断过文件时，重新读取文件大小并丢弃链游标；内联文件改用数据块（或截断后变回内联文件）
+// 时首块随之变化，同样丢弃链游标（调用者持有表项锁和文件锁，目录项的首块只在持有文件写锁时修改）
+static void sync_open_file(fs_instance* fs, OpenFileEntry* file) {
+    DirEntry* entry = loc_entry(fs, file->entry_loc);
+    unsigned int gen = __atomic_load_n(&fs->trunc_gen, __ATOMIC_RELAXED);
+    if (file->trunc_gen != gen) {
+        file->trunc_gen = gen;
+        file->file_size = __atomic_load_n(&entry->file_size, __ATOMIC_RELAXED);
+        reset_file_cursor(file);
+    }
+    if (file->first_block != entry->first_block || file->inline_data != entry->attr.inline_data) {
+        file->first_block = entry->first_block;
+        file->inline_data = entry->attr.inline_data;
+        reset_file_cursor(file);
+    }
+}
+
+// 取得并锁定打开文件表项，文件描述符无效时返回NULL；用完后调用put_open_file
+static OpenFileEntry* get_open_file(fs_instance* fs, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return NULL;
+    }
+    OpenFileEntry* file = &fs->open_file_table[fd];
+    pthread_mutex_lock(&file->lock);
+    if (!file->is_used) {
+        pthread_mutex_unlock(&file->lock);
+        return NULL;
+    }
+    return file;
+}
+
+static void put_open_file(OpenFileEntry* file) {
+    pthread_mutex_unlock(&file->lock);
+}
+
+// 关闭文件
+int fs_close(fs_instance* fs, int fd) {
+    long long t0 = op_begin(fs);
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return op_end(fs, FS_OP_CLOSE, t0, FS_ERR_BADF);
+    }
+
+    pthread_mutex_lock(&fs->fd_lock);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        pthread_mutex_unlock(&fs->fd_lock);
+        return op_end(fs, FS_OP_CLOSE, t0, FS_ERR_BADF);
+    }
+
+    // 清除打开文件表项
+    file->is_used = false;
+    STAT_ADD(fs, fd_closes, 1);
+    put_open_file(file);
+    pthread_mutex_unlock(&fs->fd_lock);
+    return op_end(fs, FS_OP_CLOSE, t0, FS_OK);
+}
+
+// 判断一段数据是否全为零
+static bool is_zero(const char* data, size_t len) {
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+// 从offset起（写入内容为data，NULL表示写入零，end为写入终点）统计最多max个块中，
+// 开头连续多少块要写入的内容全为零（zero为true）或不全为零（zero为false）
+// 不检测零块（未以FS_MOUNT_SPARSE挂载）时，只有写入零的块算作全零
+static unsigned int count_zero_blocks(fs_instance* fs, const char* data, unsigned int offset, unsigned int end, unsigned int max, bool zero) {
+    unsigned int n = 0;
+    unsigned long long pos = offset;
+    while (n < max && pos < end) {
+        unsigned long long chunk_end = (pos / fs->block_size + 1) * fs->block_size;
+        if (chunk_end > end) {
+            chunk_end = end;
+        }
+        bool chunk_zero = data == NULL || (fs->zero_detect && is_zero(data + (pos - offset), chunk_end - pos));
+        if (chunk_zero != zero) {
+            break;
+        }
+        n++;
+        pos = chunk_end;
+    }
+    return n;
+}
+
+// 在offset处写入数据（buffer为NULL时写入零），必要时扩展FAT链，不改变读写位置
+// 区段布局的空洞中内容为零的块不分配，其余块分配后把本次没有写到的部分清零
+// 返回写入的字节数，空间不足时可能只写入一部分（调用者持有文件写锁）
+static int file_pwrite(fs_instance* fs, OpenFileEntry* file, const char* buffer, int length, unsigned int offset) {
+    if (length <= 0) {
+        return 0;
+    }
+
+    unsigned int last_lblock = (offset + length - 1) / fs->block_size;
+    unsigned int end = offset + length;
+    int bytes_written = 0;
+    unsigned int copied = 0;
+    unsigned int skipped = 0;
+
+    while (bytes_written < length) {
+        // 找到对应的数据块及其后物理连续的块数，不够时一次申请到本次写入末尾所需的块
+        unsigned int lblock = offset / fs->block_size;
+        unsigned int want = last_lblock - lblock + 1;
+        const char* data = buffer != NULL ? buffer + bytes_written : NULL;
+        unsigned int run;
+        unsigned int block = 0;
+        bool fresh = false;
+        if (file->extents) {
+            block = file_map(fs, file, lblock, want, false, &run);
+            if (block != 0) {
+                block = extent_unshare(fs, file, lblock, block, &run);
+            } else {
+                // 空洞：开头内容为零的块直接跳过，其余块一直分配到下一个零块或空洞结束
+                unsigned int hole = run < want ? run : want;
+                unsigned int zeros = count_zero_blocks(fs, data, offset, end, hole, true);
+                if (zeros > 0) {
+                    unsigned long long next = (unsigned long long)(lblock + zeros) * fs->block_size;
+                    unsigned int advance = (next < end ? (unsigned int)next : end) - offset;
+                    bytes_written += advance;
+                    offset += advance;
+                    skipped += zeros;
+                    continue;
+                }
+                block = file_map(fs, file, lblock, count_zero_blocks(fs, data, offset, end, hole, false), true, &run);
+                fresh = true;
+            }
+        } else {
+            block = file_map(fs, file, lblock, want, true, &run);
+        }
+        if (block == 0) {
+            break;
+        }
+
+        // 计算块内偏移和这段连续块可写入的字节数
+        int offset_in_block = offset % fs->block_size;
+        int bytes_to_write = run * fs->block_size - offset_in_block;
+        if (bytes_to_write > length - bytes_written) {
+            bytes_to_write = length - bytes_written;
+        }
+
+        // 写入数据
+        unsigned char* base = run_ptr(fs, block, run);
+        unsigned char* dest = base + offset_in_block;
+        if (data != NULL) {
+            memcpy(dest, data, bytes_to_write);
+        } else {
+            memset(dest, 0, bytes_to_write);
+        }
+        mark_dirty(fs, dest, bytes_to_write);
+        copied += bytes_to_write;
+
+        // 新分配的块原先是空洞，读出来应为零，首尾没写到的部分清零
+        if (fresh) {
+            unsigned int tail = (fs->block_size - (offset_in_block + bytes_to_write) % fs->block_size) % fs->block_size;
+            memset(base, 0, offset_in_block);
+            memset(dest + bytes_to_write, 0, tail);
+            mark_dirty(fs, base, offset_in_block + bytes_to_write + tail);
+        }
+
+        bytes_written += bytes_to_write;
+        offset += bytes_to_write;
+    }
+    STAT_ADD(fs, bytes_written, copied);
+    if (skipped > 0) {
+        STAT_ADD(fs, zero_blocks_skipped, skipped);
+    }
+
+    file_extend(fs, file, offset);
+    return bytes_written;
+}
+
+// 写入到size处后更新文件大小（调用者持有文件写锁）
+static void file_extend(fs_instance* fs, OpenFileEntry* file, unsigned int size) {
+    if (size > file->file_size) {
+        file->file_size = size;
+
+        // 更新目录项中的文件大小：打开时记下了目录项的位置，文件打开期间目录项不会移动，
+        // 因此无需查找目录，也无需持有目录锁（同一块中其他目录项可能正被并发修改，只原子地写这一个字段）
+        DirEntry* entry = loc_entry(fs, file->entry_loc);
+        __atomic_store_n(&entry->file_size, size, __ATOMIC_RELAXED);
+        mark_meta(fs, &entry->file_size, sizeof(entry->file_size));
+    }
+}
+
+// 写内联文件，写入后不超过INLINE_MAX字节（调用者持有文件写锁）
+// 槽不够时换一段更长的槽并搬入原内容；内联内容与目录项一样作为元数据记入日志
+static int inline_pwrite(fs_instance* fs, OpenFileEntry* file, const char* buffer, int length, unsigned int offset) {
+    DirEntry* entry = loc_entry(fs, file->entry_loc);
+    unsigned int held = entry->index_block >> 16;
+    unsigned int end = offset + length;
+    unsigned int need = (end + SMALL_SLOT_SIZE - 1) / SMALL_SLOT_SIZE;
+    if (need == 0) {
+        return 0;
+    }
+    if (need > held) {
+        unsigned int slot;
+        unsigned int block = small_alloc(fs, need, &slot);
+        if (block == 0) {
+            return FS_ERR_NOSPC;
+        }
+        unsigned char* dest = inline_ptr(fs, block, slot);
+        memset(dest, 0, need * SMALL_SLOT_SIZE);
+        if (held > 0) {
+            memcpy(dest, inline_ptr(fs, entry->first_block, entry->index_block & 0xFFFF), held * SMALL_SLOT_SIZE);
+            small_free(fs, entry->first_block, entry->index_block & 0xFFFF, held);
+        }
+        mark_meta(fs, dest, need * SMALL_SLOT_SIZE);
+        entry->first_block = block;
+        entry->index_block = slot | (need << 16);
+        mark_meta(fs, entry, sizeof(DirEntry));
+        file->first_block = block;
+    }
+
+    // 写入位置超过文件末尾时，中间补零
+    unsigned char* data = inline_ptr(fs, entry->first_block, entry->index_block & 0xFFFF);
+    unsigned int from = offset;
+    if (offset > file->file_size) {
+        from = file->file_size;
+        memset(data + from, 0, offset - from);
+    }
+    if (buffer != NULL) {
+        memcpy(data + offset, buffer, length);
+    } else {
+        memset(data + offset, 0, length);
+    }
+    if (end > from) {
+        mark_meta(fs, data + from, end - from);
+    }
+    STAT_ADD(fs, bytes_written, length);
+    file_extend(fs, file, end);
+    return length;
+}
+
+// 内联文件写入后将超过INLINE_MAX字节时改用数据块：按文件的布局申请首块（区段布局还要申请一个数据块），
+// 把内联内容搬入后释放槽，目录项改为普通文件（调用者持有文件写锁）
+static int inline_promote(fs_instance* fs, OpenFileEntry* file) {
+    DirEntry* entry = loc_entry(fs, file->entry_loc);
+    unsigned int size = entry->file_size;
+    unsigned int new_block = alloc_block(fs);
+    if (new_block == 0) {
+        return FS_ERR_NOSPC;
+    }
+    unsigned int data_block = new_block;
+    if (entry->attr.extents) {
+        memset(block_ptr(fs, new_block), 0, fs->block_size);
+        mark_meta(fs, block_ptr(fs, new_block), fs->block_size);
+        if (size > 0) {
+            unsigned int got;
+            data_block = alloc_extent(fs, new_block + 1, 1, &got);
+            if (data_block == 0) {
+                free_block(fs, new_block);
+                return FS_ERR_NOSPC;
+            }
+            extent_append(fs, new_block, 0, data_block, 1);
+        }
+    }
+    if (size > 0) {
+        unsigned char* dest = block_ptr(fs, data_block);
+        memcpy(dest, inline_ptr(fs, entry->first_block, entry->index_block & 0xFFFF), size);
+        mark_dirty(fs, dest, size);
+    }
+
+    release_file_blocks(fs, entry);
+    entry->attr.inline_data = 0;
+    entry->first_block = new_block;
+    entry->index_block = 0;
+    mark_meta(fs, entry, sizeof(DirEntry));
+
+    file->first_block = new_block;
+    file->inline_data = false;
+    reset_file_cursor(file);
+    STAT_ADD(fs, inline_promotions, 1);
+    return FS_OK;
+}
+
+// 在指定位置写文件，不改变读写位置；返回写入的字节数，一个字节都没写入时返回错误码
+// 调用者持有打开文件表项的锁
+static int do_pwrite(fs_instance* fs, OpenFileEntry* file, const char* buffer, int length, unsigned int offset) {
+    if (!file->can_write) {
+        return FS_ERR_PERM;
+    }
+    // 写0字节不改变文件（即使位置超过文件末尾也不补零）
+    if (length <= 0) {
+        return 0;
+    }
+    // 写入后超过文件大小上限时拒绝，以下的位置和长度计算都不会溢出
+    if ((unsigned long long)offset + length > FS_MAX_FILE_SIZE) {
+        return FS_ERR_INVAL;
+    }
+
+    pthread_rwlock_t* lock = file_lock(fs, file->entry_loc);
+    pthread_rwlock_wrlock(lock);
+    sync_open_file(fs, file);
+
+    int bytes_written = 0;
+
+    // 内联文件写入后仍不超过INLINE_MAX字节时写在槽中，否则先改用数据块
+    if (file->inline_data) {
+        if ((unsigned long long)offset + length <= INLINE_MAX) {
+            bytes_written = inline_pwrite(fs, file, buffer, length, offset);
+            pthread_rwlock_unlock(lock);
+            return bytes_written;
+        }
+        bytes_written = inline_promote(fs, file);
+        if (bytes_written != FS_OK) {
+            pthread_rwlock_unlock(lock);
+            return bytes_written;
+        }
+    }
+
+    // 写入位置超过文件末尾时，中间的空洞补零（区段布局中未分配的块保持为空洞）
+    // 补零后一个字节也没写进去时恢复原来的大小，已链入的块像预留的块一样留在文件中
+    unsigned int old_size = file->file_size;
+    if (offset > old_size) {
+        unsigned long long gap = (unsigned long long)offset - old_size;
+        if (file_pwrite(fs, file, NULL, (int)gap, old_size) != (int)gap) {
+            bytes_written = FS_ERR_NOSPC;
+        }
+    }
+
+    if (bytes_written == 0) {
+        bytes_written = file_pwrite(fs, file, buffer, length, offset);
+        if (bytes_written == 0) {
+            bytes_written = FS_ERR_NOSPC;
+        }
+    }
+    if (bytes_written < 0 && file->file_size != old_size) {
+        file->file_size = old_size;
+        DirEntry* entry = loc_entry(fs, file->entry_loc);
+        __atomic_store_n(&entry->file_size, old_size, __ATOMIC_RELAXED);
+        mark_meta(fs, &entry->file_size, sizeof(entry->file_size));
+    }
+
+    pthread_rwlock_unlock(lock);
+    return bytes_written;
+}
+
+// 为文件预留前length字节所需的数据块，不改变文件大小（调用者持有打开文件表项的锁）
+// 已有的块沿链跳过，缺少的块从链尾（区段布局在空洞处）起按尽量长的连续段一次申请并链入，
+// 之后的写入直接使用这些块；超出文件大小的部分明显多于空闲块时直接返回空间不足，
+// 否则（已预留过或有并发申请时）空间不足的情况下已申请到的块仍留在文件中
+static int do_fallocate(fs_instance* fs, OpenFileEntry* file, unsigned int length) {
+    if (!file->can_write) {
+        return FS_ERR_PERM;
+    }
+    if (length > FS_MAX_FILE_SIZE) {
+        return FS_ERR_INVAL;
+    }
+
+    pthread_rwlock_t* lock = file_lock(fs, file->entry_loc);
+    pthread_rwlock_wrlock(lock);
+    sync_open_file(fs, file);
+
+    int ret = FS_OK;
+    unsigned int need = (unsigned int)(((unsigned long long)length + fs->block_size - 1) / fs->block_size);
+    unsigned int have = (file->file_size + fs->block_size - 1) / fs->block_size;
+    pthread_mutex_lock(&fs->alloc_lock);
+    unsigned int free_blocks = fs->free_block_count;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (need > have && need - have > free_blocks) {
+        pthread_rwlock_unlock(lock);
+        return FS_ERR_NOSPC;
+    }
+
+    // 内联文件能容纳时不需要预留，否则先改用数据块
+    if (file->inline_data) {
+        ret = length <= INLINE_MAX ? FS_OK : inline_promote(fs, file);
+        if (ret != FS_OK || file->inline_data) {
+            pthread_rwlock_unlock(lock);
+            return ret;
+        }
+    }
+
+    unsigned int lblock = 0;
+    while (lblock < need) {
+        unsigned int run;
+        unsigned int block = file->extents ? file_map(fs, file, lblock, need - lblock, false, &run) : 0;
+        if (block == 0) {
+            block = file_map(fs, file, lblock, need - lblock, true, &run);
+            if (block == 0) {
+                ret = FS_ERR_NOSPC;
+                break;
+            }
+            // 填补文件范围内的空洞时新块要清零（文件末尾之后的块在写到时才补零）
+            if (file->extents && (unsigned long long)lblock * fs->block_size < file->file_size) {
+                memset(run_ptr(fs, block, run), 0, (size_t)run * fs->block_size);
+                mark_dirty_blocks(fs, block, run);
+            }
+        }
+        lblock += run;
+    }
+
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+// 在指定位置读文件，不改变读写位置（调用者持有打开文件表项的锁）
+// 只持有文件读锁，读不同文件（以及用不同描述符读同一文件）的线程之间不会互相等待
+static int do_pread(fs_instance* fs, OpenFileEntry* file, char* buffer, int length, unsigned int offset) {
+    if (!file->can_read) {
+        return FS_ERR_PERM;
+    }
+
+    pthread_rwlock_t* lock = file_lock(fs, file->entry_loc);
+    pthread_rwlock_rdlock(lock);
+    sync_open_file(fs, file);
+
+    // 如果已经到文件末尾，直接返回0
+    if (length <= 0 || offset >= file->file_size) {
+        pthread_rwlock_unlock(lock);
+        return 0;
+    }
+
+    // 限制读取长度不超过文件大小（用剩余长度比较，大文件末尾附近不会溢出）
+    if ((unsigned int)length > file->file_size - offset) {
+        length = file->file_size - offset;
+    }
+
+    // 内联文件直接从槽中拷贝
+    if (file->inline_data) {
+        DirEntry* entry = loc_entry(fs, file->entry_loc);
+        memcpy(buffer, inline_ptr(fs, entry->first_block, entry->index_block & 0xFFFF) + offset, length);
+        STAT_ADD(fs, bytes_read, length);
+        pthread_rwlock_unlock(lock);
+        return length;
+    }
+
+    file_readahead(fs, file, offset, length);
+
+    int bytes_read = 0;
+    unsigned int last_lblock = (offset + length - 1) / fs->block_size;
+
+    while (bytes_read < length) {
+        // 找到对应的数据块及其后物理连续的块数，整段一次拷贝
+        unsigned int lblock = offset / fs->block_size;
+        unsigned int run;
+        unsigned int block = file_map(fs, file, lblock, last_lblock - lblock + 1, false, &run);
+        if (block == 0 && run == 0) {
+            // 文件结构损坏
+            bytes_read = FS_ERR_CORRUPT;
+            break;
+        }
+
+        // 计算块内偏移和这段连续块（或空洞）可读取的字节数
+        int offset_in_block = offset % fs->block_size;
+        unsigned long long span = (unsigned long long)run * fs->block_size - offset_in_block;
+        int bytes_to_read = span < (unsigned long long)(length - bytes_read) ? (int)span : length - bytes_read;
+
+        // 读取数据，空洞读出零
+        if (block == 0) {
+            memset(buffer + bytes_read, 0, bytes_to_read);
+        } else {
+            memcpy(buffer + bytes_read,
+                   run_ptr(fs, block, run) + offset_in_block,
+                   bytes_to_read);
+        }
+
+        bytes_read += bytes_to_read;
+        offset += bytes_to_read;
+    }
+    if (bytes_read > 0) {
+        STAT_ADD(fs, bytes_read, bytes_read);
+    }
+
+    pthread_rwlock_unlock(lock);
+    return bytes_read;
+}
+
+// 在指定位置读文件，不改变读写位置
+int fs_pread(fs_instance* fs, int fd, char* buffer, int length, unsigned int offset) {
+    long long t0 = op_begin(fs);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        return op_end(fs, FS_OP_PREAD, t0, FS_ERR_BADF);
+    }
+    int bytes_read = do_pread(fs, file, buffer, length, offset);
+    put_open_file(file);
+    return op_end(fs, FS_OP_PREAD, t0, bytes_read);
+}
+
+// 读文件
+int fs_read(fs_instance* fs, int fd, char* buffer, int length) {
+    long long t0 = op_begin(fs);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        return op_end(fs, FS_OP_READ, t0, FS_ERR_BADF);
+    }
+
+    int bytes_read = do_pread(fs, file, buffer, length, file->current_pos);
+
+    // 更新当前位置
+    if (bytes_read > 0) {
+        file->current_pos += bytes_read;
+    }
+
+    put_open_file(file);
+    return op_end(fs, FS_OP_READ, t0, bytes_read);
+}
+
+// 移动读写位置，返回新位置；允许定位到文件末尾之后，之后的写入会补零
+int fs_lseek(fs_instance* fs, int fd, int offset, int whence) {
+    long long t0 = op_begin(fs);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        return op_end(fs, FS_OP_LSEEK, t0, FS_ERR_BADF);
+    }
+
+    // 文件大小可能被其他描述符的截断修改，读取时持有文件读锁
+    pthread_rwlock_t* lock = file_lock(fs, file->entry_loc);
+    pthread_rwlock_rdlock(lock);
+    sync_open_file(fs, file);
+
+    long long base = -1;
+    switch (whence) {
+        case MY_SEEK_SET: base = 0; break;
+        case MY_SEEK_CUR: base = file->current_pos; break;
+        case MY_SEEK_END: base = file->file_size; break;
+    }
+    pthread_rwlock_unlock(lock);
+
+    long long pos = base + offset;
+    int ret;
+    if (base < 0 || pos < 0 || pos > FS_MAX_FILE_SIZE) {
+        ret = FS_ERR_INVAL;
+    } else {
+        file->current_pos = (unsigned int)pos;
+        ret = (int)pos;
+    }
+
+    put_open_file(file);
+    return op_end(fs, FS_OP_LSEEK, t0, ret);
+}
+
+// 删除父目录中的文件（调用者持有父目录写锁）
+static int do_unlink(fs_instance* fs, unsigned int parent, const char* filename) {
+    // 查找文件
+    DirEntry* entry = dir_lookup(fs, parent, filename);
+    if (entry == NULL) {
+        return FS_ERR_NOENT;
+    }
+
+    // 确保是文件而非目录
+    if (entry->attr.is_dir) {
+        return FS_ERR_ISDIR;
+    }
+
+    // 检查文件是否已打开（不同目录下可能有同名文件，内联文件可能没有首块或共用小文件块，按目录项位置判断）
+    // 打开同一文件须先取得同一目录的锁，因此检查之后不会有新的打开项
+    unsigned int loc = entry_loc(fs, entry);
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (fs->open_file_table[i].is_used && fs->open_file_table[i].entry_loc == loc) {
+            pthread_mutex_unlock(&fs->fd_lock);
+            return FS_ERR_BUSY;
+        }
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    // 释放文件占用的所有块
+    release_file_blocks(fs, entry);
+
+    // 从目录中删除条目
+    dir_remove_entry(fs, parent, entry);
+    return FS_OK;
+}
+
+/* 修改文件系统的接口：持有实例读锁解析路径并取得目录或文件锁后执行，
+ * 每次调用是一个操作，结束时交给组提交决定是否提交日志事务 */
+
+// 解析路径的父目录并以写锁锁定，成功时返回时持有实例读锁和父目录写锁
+static int lock_parent(fs_instance* fs, const char* path, unsigned int* parent, char* leaf, bool write) {
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    int ret = resolve_parent(fs, path, parent, leaf);
+    if (ret != FS_OK) {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return ret;
+    }
+    if (write) {
+        pthread_rwlock_wrlock(dir_lock(fs, *parent));
+    } else {
+        pthread_rwlock_rdlock(dir_lock(fs, *parent));
+    }
+    return FS_OK;
+}
+
+static void unlock_parent(fs_instance* fs, unsigned int parent) {
+    pthread_rwlock_unlock(dir_lock(fs, parent));
+    pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+int fs_mkdir(fs_instance* fs, const char* path) {
+    long long t0 = op_begin(fs);
+    unsigned int parent;
+    char dirname[MAX_FILENAME_LENGTH];
+    int ret = lock_parent(fs, path, &parent, dirname, true);
+    if (ret != FS_OK) {
+        return op_end(fs, FS_OP_MKDIR, t0, ret);
+    }
+    ret = do_mkdir(fs, parent, dirname);
+    unlock_parent(fs, parent);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_MKDIR, t0, ret);
+}
+
+// 删除目录会使其首块和缓存失效，与其他所有操作互斥
+int fs_rmdir(fs_instance* fs, const char* path) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = do_rmdir(fs, path);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_RMDIR, t0, ret);
+}
+
+int fs_create(fs_instance* fs, const char* path, int layout) {
+    long long t0 = op_begin(fs);
+    unsigned int parent;
+    char filename[MAX_FILENAME_LENGTH];
+    int ret = lock_parent(fs, path, &parent, filename, true);
+    if (ret != FS_OK) {
+        return op_end(fs, FS_OP_CREATE, t0, ret);
+    }
+    ret = do_create(fs, parent, filename, layout);
+    unlock_parent(fs, parent);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_CREATE, t0, ret);
+}
+
+// 以读或追加模式打开只需目录读锁，写模式会截断文件，需要目录写锁
+int fs_open(fs_instance* fs, const char* path, char mode) {
+    long long t0 = op_begin(fs);
+    if (mode != 'r' && mode != 'w' && mode != 'a') {
+        return op_end(fs, FS_OP_OPEN, t0, FS_ERR_INVAL);
+    }
+
+    unsigned int parent;
+    char filename[MAX_FILENAME_LENGTH];
+    int ret = lock_parent(fs, path, &parent, filename, mode == 'w');
+    if (ret != FS_OK) {
+        return op_end(fs, FS_OP_OPEN, t0, ret);
+    }
+    ret = do_open(fs, parent, filename, mode);
+    unlock_parent(fs, parent);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_OPEN, t0, ret);
+}
+
+// 打开文件并按预计大小size_hint预留连续的块（写模式和追加模式有效），预留失败不影响打开
+// 预先知道最终大小时（如导入），与其他文件交错写入也不会把文件的链切成碎片
+// 检测零块时区段布局的文件不预留，否则内容为零的块也会占用空间
+int fs_open_hint(fs_instance* fs, const char* path, char mode, unsigned int size_hint) {
+    int fd = fs_open(fs, path, mode);
+    if (fd >= 0 && size_hint > 0 && mode != 'r') {
+        bool reserve = true;
+        if (fs->zero_detect) {
+            OpenFileEntry* file = get_open_file(fs, fd);
+            reserve = file != NULL && !file->extents;
+            if (file != NULL) {
+                put_open_file(file);
+            }
+        }
+        if (reserve) {
+            fs_fallocate(fs, fd, size_hint);
+        }
+    }
+    return fd;
+}
+
+// 预留文件前length字节所需的块，不改变文件大小和读写位置
+int fs_fallocate(fs_instance* fs, int fd, unsigned int length) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return op_end(fs, FS_OP_FALLOCATE, t0, FS_ERR_BADF);
+    }
+    int ret = do_fallocate(fs, file, length);
+    put_open_file(file);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_FALLOCATE, t0, ret);
+}
+
+int fs_write(fs_instance* fs, int fd, const char* buffer, int length) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return op_end(fs, FS_OP_WRITE, t0, FS_ERR_BADF);
+    }
+
+    int bytes_written = do_pwrite(fs, file, buffer, length, file->current_pos);
+
+    // 更新当前位置
+    if (bytes_written > 0) {
+        file->current_pos += bytes_written;
+    }
+
+    put_open_file(file);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_WRITE, t0, bytes_written);
+}
+
+int fs_pwrite(fs_instance* fs, int fd, const char* buffer, int length, unsigned int offset) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    OpenFileEntry* file = get_open_file(fs, fd);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return op_end(fs, FS_OP_PWRITE, t0, FS_ERR_BADF);
+    }
+    int bytes_written = do_pwrite(fs, file, buffer, length, offset);
+    put_open_file(file);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_PWRITE, t0, bytes_written);
+}
+
+int fs_unlink(fs_instance* fs, const char* path) {
+    long long t0 = op_begin(fs);
+    unsigned int parent;
+    char filename[MAX_FILENAME_LENGTH];
+    int ret = lock_parent(fs, path, &parent, filename, true);
+    if (ret != FS_OK) {
+        return op_end(fs, FS_OP_UNLINK, t0, ret);
+    }
+    ret = do_unlink(fs, parent, filename);
+    unlock_parent(fs, parent);
+    journal_end_op(fs);
+    return op_end(fs, FS_OP_UNLINK, t0, ret);
+}
+
+// 卷信息和空间使用情况（空闲块数由分配器维护，无需扫描FAT）
+int fs_statfs(fs_instance* fs, FsStat* st) {
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    st->block_size = fs->block_size;
+    st->block_count = fs->block_num;
+    st->fat_width = fs->fat_width;
+    st->data_blocks = fs->block_num - fs->data_block;
+    pthread_mutex_lock(&fs->alloc_lock);
+    st->free_blocks = fs->free_block_count;
+    st->shared_blocks = fs->shared_blocks;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    st->default_layout = fs->super->default_layout;
+    st->mapped = fs->use_mmap;
+    st->journaled = fs->journal_fd >= 0;
+    st->mount_state = fs->mount_state;
+    st->replayed = fs->replayed;
+    st->saved_blocks = fs->saved_blocks;
+    st->saved_ranges = fs->saved_ranges;
+    st->cache_budget = (unsigned long long)__atomic_load_n(&fs->cache_budget, __ATOMIC_RELAXED) * CACHE_CHUNK_SIZE;
+    st->cache_resident = (unsigned long long)__atomic_load_n(&fs->cache_resident, __ATOMIC_RELAXED) * CACHE_CHUNK_SIZE;
+    st->dirty_blocks = dirty_count(fs);
+    pthread_mutex_lock(&fs->wb_lock);
+    st->writeback_ms = fs->wb_interval_ms;
+    st->writeback_blocks = fs->wb_interval_ms ? fs->wb_dirty_blocks : 0;
+    st->writeback_error = fs->wb_error;
+    pthread_mutex_unlock(&fs->wb_lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return FS_OK;
+}
+
+// 把修改过的块写回映像文件（使用日志时同时清空日志）
+int fs_sync(fs_instance* fs) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = journal_checkpoint(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_SYNC, t0, ret);
+}
+
+// 立即提交当前日志事务（不等组提交条件满足），不使用日志时什么也不做
+int fs_commit(fs_instance* fs) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = journal_commit(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_COMMIT, t0, ret);
+}
+
+// 取得运行计数：把各线程所在计数组的值相加（其他线程可能正在累加，各项之间不保证是同一时刻的值）
+int fs_get_stats(fs_instance* fs, FsCounters* out) {
+    unsigned long long* dst = (unsigned long long*)out;
+    size_t n = sizeof(FsCounters) / sizeof(unsigned long long);
+    memset(out, 0, sizeof(FsCounters));
+    for (int g = 0; g < STAT_STRIPES; g++) {
+        unsigned long long* src = (unsigned long long*)&fs->stats[g].c;
+        for (size_t i = 0; i < n; i++) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+    }
+    return FS_OK;
+}
+
+// 运行计数清零
+int fs_reset_stats(fs_instance* fs) {
+    for (int g = 0; g < STAT_STRIPES; g++) {
+        unsigned long long* c = (unsigned long long*)&fs->stats[g].c;
+        for (size_t i = 0; i < sizeof(FsCounters) / sizeof(unsigned long long); i++) {
+            __atomic_store_n(&c[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    return FS_OK;
+}
+
+// 接口编号对应的名字
+const char* fs_op_name(int op) {
+    static const char* names[FS_OP_COUNT] = {
+        "format", "sync", "commit", "mkdir", "rmdir", "chdir", "listdir", "create",
+        "open", "close", "read", "write", "pread", "pwrite", "lseek", "unlink", "fallocate",
+        "defrag", "snapshot", "dedup", "fsck"
+    };
+    return op >= 0 && op < FS_OP_COUNT ? names[op] : "unknown";
+}
+
+// 设置组提交的阈值：累计ops个操作或最早的操作等待超过ms毫秒时提交，参数为0时保持原值
+// 批量回放脚本时调大阈值可以减少落盘次数；崩溃时最多丢失最近一个未提交的事务，卷仍然一致，
+// 但事务中释放的块要到提交后才能重新分配，反复删除和创建大文件时可能提前报告空间不足
+int fs_set_group_commit(fs_instance* fs, unsigned int ops, unsigned int ms) {
+    pthread_mutex_lock(&fs->journal_lock);
+    if (ops > 0) {
+        fs->group_ops = ops;
+    }
+    if (ms > 0) {
+        fs->group_ms = ms;
+    }
+    pthread_mutex_unlock(&fs->journal_lock);
+    return FS_OK;
+}
+
+// 设置后台回写：回写线程每隔interval_ms毫秒（脏块达到dirty_blocks块时不等间隔）把修改写回映像并截断日志，
+// 同时提交等待超过组提交时间的事务；写映像时大部分时间只持读锁，普通操作照常进行
+// interval_ms为0时停止回写线程，dirty_blocks为0时使用默认阈值；不要与fs_unmount同时调用
+// 回写是原地写映像，崩溃时靠日志重放恢复一致，因此只有使用日志时可以开启（映射模式和没有日志时返回FS_ERR_INVAL，
+// 这两种情况下映像只在fs_sync和卸载时写回，中途崩溃仍可能留下写了一半的映像）
+int fs_set_writeback(fs_instance* fs, unsigned int interval_ms, unsigned int dirty_blocks) {
+    if (interval_ms > 0 && fs->journal_fd < 0) {
+        return FS_ERR_INVAL;
+    }
+    pthread_mutex_lock(&fs->wb_lock);
+    if (interval_ms == 0) {
+        bool running = fs->wb_running;
+        fs->wb_interval_ms = 0;
+        fs->wb_stop = true;
+        fs->wb_running = false;
+        pthread_cond_signal(&fs->wb_cond);
+        pthread_mutex_unlock(&fs->wb_lock);
+        if (running) {
+            pthread_join(fs->wb_thread, NULL);
+        }
+        pthread_mutex_lock(&fs->wb_lock);
+        fs->wb_stop = false;
+        pthread_mutex_unlock(&fs->wb_lock);
+        return FS_OK;
+    }
+
+    fs->wb_interval_ms = interval_ms;
+    fs->wb_dirty_blocks = dirty_blocks > 0 ? dirty_blocks : WRITEBACK_DIRTY_BLOCKS;
+    int ret = FS_OK;
+    if (!fs->wb_running) {
+        fs->wb_last_ms = now_ms();
+        fs->wb_error = FS_OK;
+        if (pthread_create(&fs->wb_thread, NULL, writeback_thread, fs) == 0) {
+            fs->wb_running = true;
+        } else {
+            fs->wb_interval_ms = 0;
+            ret = FS_ERR_NOMEM;
+        }
+    } else {
+        pthread_cond_signal(&fs->wb_cond);
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+    return ret;
+}
+
+// 设置映射模式下虚拟磁盘的驻留预算（字节）：进程中驻留的数据和目录块超过预算时淘汰最久未访问的段，
+// 使远大于内存的卷也能以固定的内存挂载；元数据区和根目录常驻，不计入预算；bytes为0时不限制
+// 预算在重新格式化后仍然有效；只有映射模式可以设置（普通模式整个卷都在内存中）
+int fs_set_cache_budget(fs_instance* fs, unsigned long long bytes) {
+    if (!fs->use_mmap) {
+        return FS_ERR_INVAL;
+    }
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_lock(&fs->open_file_table[i].lock);
+    }
+    fs->cache_limit = bytes;
+    int ret = cache_setup(fs);
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->open_file_table[i].lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return ret;
+}
+
+// 统计整个目录树的碎片情况：文件和目录的块数与物理连续段数
+int fs_fragstat(fs_instance* fs, FsFragStat* st) {
+    long long t0 = op_begin(fs);
+    memset(st, 0, sizeof(FsFragStat));
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    defrag_walk(fs, fs->root_block, 0, st, NULL);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_DEFRAG, t0, FS_OK);
+}
+
+// 在线碎片整理：把每个分散的文件搬到一段连续块中（FAT链文件的首块随之改变），紧凑排列目录项并使目录链连续
+// 整理期间独占实例；打开着的描述符和当前目录仍然有效。moved不为NULL时返回搬动的文件和目录数
+// 需要一段与文件一样长的空闲段才能搬动该文件，空间紧张时部分文件保持原样
+int fs_defrag(fs_instance* fs, unsigned int* moved) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_lock(&fs->open_file_table[i].lock);
+    }
+
+    unsigned int total = 0;
+    for (int pass = 0; pass < DEFRAG_PASSES; pass++) {
+        unsigned int count = 0;
+        defrag_walk(fs, fs->root_block, 0, NULL, &count);
+        total += count;
+        if (count == 0) {
+            break;
+        }
+    }
+    fs->alloc_hint = fs->data_block;
+
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->open_file_table[i].lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    journal_end_op(fs);
+    if (moved != NULL) {
+        *moved = total;
+    }
+    return op_end(fs, FS_OP_DEFRAG, t0, FS_OK);
+}
+
+// 在线去重：区段布局文件中内容相同的数据块改为共享同一块（共享计数记在FAT表项中），之后写入共享的块时先复制
+// FAT链布局的文件的FAT表项就是链指针，块不能共享，不参与去重；去重期间独占实例，打开着的描述符仍然有效
+// st不为NULL时返回扫描、共享和回收的块数；提交日志失败时仍填写st：卷在内存中已经去重，
+// 本次修改留在当前事务中，之后的提交或fs_sync会再次写入（回收的块要到提交成功后才能分配）
+int fs_dedup(fs_instance* fs, FsDedupStat* st) {
+    long long t0 = op_begin(fs);
+    FsDedupStat result;
+    memset(&result, 0, sizeof(result));
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    // 读文件不取实例锁，锁住所有打开文件表项以等待正在进行的读
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_lock(&fs->open_file_table[i].lock);
+    }
+
+    // 索引的槽数取已用块数的两倍以上，开放寻址时探测链很短
+    unsigned int used = fs->block_num - fs->data_block - fs->free_block_count;
+    unsigned int slot_count = DEDUP_MIN_SLOTS;
+    while (slot_count < used * 2ULL && slot_count < 0x80000000U) {
+        slot_count *= 2;
+    }
+    DedupSlot* slots = (DedupSlot*)calloc(slot_count, sizeof(DedupSlot));
+    int ret = slots != NULL ? FS_OK : FS_ERR_NOMEM;
+    if (slots != NULL) {
+        dedup_walk(fs, fs->root_block, 0, slots, slot_count - 1, &result);
+        free(slots);
+    }
+
+    // 改写过区段表时，各描述符缓存的区段已失效，和截断一样由它们下次取得文件锁时丢弃
+    if (result.blocks_shared > 0) {
+        fs->trunc_gen++;
+        // 使用日志时释放的块提交后才能分配，立即提交一次
+        ret = journal_commit(fs);
+    }
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->open_file_table[i].lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (st != NULL) {
+        *st = result;
+    }
+    return op_end(fs, FS_OP_DEDUP, t0, ret);
+}
+
+// 一致性检查：FAT链是否断开、成环或交叉，目录项、"."和".."、目录索引、区段表和小文件块是否有效，
+// 文件大小是否超出所占的块，FAT中的占用情况和共享计数是否与实际引用一致；st返回各类问题的个数
+// 检查期间独占实例，大卷用多个线程并行检查目录树。repair为true时同时修复（要求没有打开的文件，
+// 否则返回FS_ERR_BUSY）：去掉无效的目录项和区段，截断损坏的链，收回丢失的块，之后重建空闲位图和索引并提交
+int fs_fsck(fs_instance* fs, bool repair, FsFsckStat* st) {
+    long long t0 = op_begin(fs);
+    FsFsckStat result;
+    memset(&result, 0, sizeof(result));
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_lock(&fs->open_file_table[i].lock);
+    }
+    int ret = FS_OK;
+    for (int i = 0; i < MAX_OPEN_FILES && repair; i++) {
+        if (fs->open_file_table[i].is_used) {
+            ret = FS_ERR_BUSY;
+        }
+    }
+    if (ret == FS_OK) {
+        ret = fsck_run(fs, repair, &result);
+    }
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->open_file_table[i].lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (ret == FS_OK && st != NULL) {
+        *st = result;
+    }
+    return op_end(fs, FS_OP_FSCK, t0, ret);
+}
+
+// 创建快照：快照保存卷在此刻的全部内容，之后块第一次被覆盖前才复制旧内容（写时复制）
+// 创建时先做检查点，只写快照自己的几个块，不复制数据；映射模式不支持快照
+int fs_snapshot_create(fs_instance* fs, const char* name) {
+    long long t0 = op_begin(fs);
+    if (fs->use_mmap) {
+        return op_end(fs, FS_OP_SNAPSHOT, t0, FS_ERR_INVAL);
+    }
+    if (name[0] == '\0') {
+        return op_end(fs, FS_OP_SNAPSHOT, t0, FS_ERR_INVAL);
+    }
+    if (strlen(name) >= MAX_FILENAME_LENGTH) {
+        return op_end(fs, FS_OP_SNAPSHOT, t0, FS_ERR_NAMETOOLONG);
+    }
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = snap_create(fs, name);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_SNAPSHOT, t0, ret);
+}
+
+// 按创建先后列出快照，回调返回非0时停止
+int fs_snapshot_list(fs_instance* fs, fs_snapshot_cb cb, void* arg) {
+    long long t0 = op_begin(fs);
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    for (unsigned int i = 0; i < fs->snapshot_count; i++) {
+        SnapInfo* info = snap_info(fs, fs->snapshots[i]);
+        FsSnapshot snap;
+        memset(&snap, 0, sizeof(snap));
+        strcpy(snap.name, info->name);
+        snap.create_time = (time_t)info->create_time;
+        snap.saved_blocks = info->map_count;
+        if (cb(&snap, arg) != 0) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_SNAPSHOT, t0, FS_OK);
+}
+
+// 把整个卷回滚到快照创建时的内容（快照本身和其他快照都保留）
+// 回滚期间独占实例，有打开的文件时返回FS_ERR_BUSY；完成后当前目录回到根目录
+int fs_snapshot_rollback(fs_instance* fs, const char* name) {
+    long long t0 = op_begin(fs);
+    if (fs->use_mmap) {
+        return op_end(fs, FS_OP_SNAPSHOT, t0, FS_ERR_INVAL);
+    }
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_lock(&fs->open_file_table[i].lock);
+    }
+    int index = snap_find(fs, name);
+    int ret = index >= 0 ? FS_OK : FS_ERR_NOENT;
+    for (int i = 0; i < MAX_OPEN_FILES && ret == FS_OK; i++) {
+        if (fs->open_file_table[i].is_used) {
+            ret = FS_ERR_BUSY;
+        }
+    }
+    if (ret == FS_OK) {
+        ret = snap_rollback(fs, index);
+    }
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&fs->open_file_table[i].lock);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_SNAPSHOT, t0, ret);
+}
+
+// 删除快照，放回只被它引用的块
+int fs_snapshot_delete(fs_instance* fs, const char* name) {
+    long long t0 = op_begin(fs);
+    if (fs->use_mmap) {
+        return op_end(fs, FS_OP_SNAPSHOT, t0, FS_ERR_INVAL);
+    }
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int index = snap_find(fs, name);
+    int ret = index >= 0 ? snap_delete(fs, index) : FS_ERR_NOENT;
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return op_end(fs, FS_OP_SNAPSHOT, t0, ret);
+}
+
+/* 辅助函数实现 */
+
+// 从start开始查找第一个空闲块，找不到返回block_num
+static unsigned int find_free_from(fs_instance* fs, unsigned int start) {
+    if (start >= fs->block_num) {
+        return fs->block_num;
+    }
+    unsigned int w = start / 64;
+    unsigned long long bits = fs->free_bitmap[w] & (~0ULL << (start % 64));
+    while (bits == 0) {
+        if (++w >= fs->bitmap_words) {
+            return fs->block_num;
+        }
+        bits = fs->free_bitmap[w];
+    }
+    unsigned int block = w * 64 + __builtin_ctzll(bits);
+    return block < fs->block_num ? block : fs->block_num;
+}
+
+// 从start开始查找第一个已占用块，找不到返回block_num
+static unsigned int find_used_from(fs_instance* fs, unsigned int start) {
+    if (start >= fs->block_num) {
+        return fs->block_num;
+    }
+    unsigned int w = start / 64;
+    unsigned long long bits = ~fs->free_bitmap[w] & (~0ULL << (start % 64));
+    while (bits == 0) {
+        if (++w >= fs->bitmap_words) {
+            return fs->block_num;
+        }
+        bits = ~fs->free_bitmap[w];
+    }
+    unsigned int block = w * 64 + __builtin_ctzll(bits);
+    return block < fs->block_num ? block : fs->block_num;
+}
+
+// 根据FAT重建空闲位图和空闲块计数（快照引用的块不算空闲）
+static void rebuild_free_map(fs_instance* fs) {
+    memset(fs->free_bitmap, 0, fs->bitmap_words * sizeof(unsigned long long));
+    fs->free_block_count = 0;
+    fs->shared_blocks = 0;
+    fs->index_fail_free = 0;
+    for (int i = fs->data_block; i < fs->block_num; i++) {
+        if (fat_get(fs, i) == 0 && (fs->snap_refs == NULL || fs->snap_refs[i] == 0)) {
+            fs->free_bitmap[i / 64] |= 1ULL << (i % 64);
+            fs->free_block_count++;
+        } else if (block_refs(fs, i) > 1) {
+            fs->shared_blocks++;
+        }
+    }
+    fs->alloc_hint = fs->data_block;
+}
+
+// 分配一个空闲块
+static unsigned int alloc_block(fs_instance* fs) {
+    unsigned int got;
+    return alloc_run(fs, 1, &got);
+}
+
+// 从alloc_hint往后查找长度不小于want的空闲段，找不到则返回遇到的最长空闲段
+// 通过len返回段长（可能大于want），没有空闲块时返回0
+static unsigned int find_free_run(fs_instance* fs, unsigned int want, unsigned int* len) {
+    unsigned int best_start = 0, best_len = 0;
+    unsigned int pos = fs->alloc_hint;
+    bool wrapped = false;
+
+    while (1) {
+        unsigned int start = find_free_from(fs, pos);
+        if (start >= fs->block_num) {
+            if (wrapped) {
+                break;
+            }
+            // 绕回数据区开头继续查找
+            wrapped = true;
+            pos = fs->data_block;
+            continue;
+        }
+        if (wrapped && start >= fs->alloc_hint) {
+            break;
+        }
+
+        unsigned int end = find_used_from(fs, start);
+        if (end - start > best_len) {
+            best_start = start;
+            best_len = end - start;
+            if (best_len >= want) {
+                break;
+            }
+        }
+        pos = end;
+    }
+
+    *len = best_len;
+    return best_len > 0 ? best_start : 0;
+}
+
+// 将[start, start+len)标记为已分配；link为true时在FAT中串成链，否则每块都标记为EOF
+static void claim_range(fs_instance* fs, unsigned int start, unsigned int len, bool link) {
+    for (unsigned int i = 0; i < len; i++) {
+        unsigned int b = start + i;
+        fs->free_bitmap[b / 64] &= ~(1ULL << (b % 64));
+        fat_set(fs, b, (link && i + 1 < len) ? (unsigned int)(b + 1) : EOF_BLOCK);
+    }
+    fs->free_block_count -= len;
+    STAT_ADD(fs, blocks_allocated, len);
+    fs->alloc_hint = start + len;
+    if (fs->alloc_hint >= fs->block_num) {
+        fs->alloc_hint = fs->data_block;
+    }
+}
+
+// 分配一段连续空闲块（最多want块），块之间已在FAT中链接好，末块标记为EOF
+// 优先从alloc_hint往后找长度足够的空闲段，找不到则退而返回遇到的最长空闲段
+// 返回首块号并通过got返回实际块数，没有空闲块时返回0
+static unsigned int alloc_run(fs_instance* fs, unsigned int want, unsigned int* got) {
+    *got = 0;
+    if (want == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    unsigned int len = 0;
+    unsigned int start = fs->free_block_count > 0 ? find_free_run(fs, want, &len) : 0;
+    if (start != 0) {
+        if (len > want) {
+            len = want;
+        }
+        claim_range(fs, start, len, true);
+        *got = (unsigned int)len;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return (unsigned int)start;
+}
+
+// 为区段布局分配一段连续块（最多want块），各块在FAT中只标记为已占用
+// near处空闲时优先从near开始分配，使新区段能与前一个区段合并
+static unsigned int alloc_extent(fs_instance* fs, unsigned int near, unsigned int want, unsigned int* got) {
+    *got = 0;
+    if (want == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    unsigned int start = 0, len = 0;
+    if (fs->free_block_count == 0) {
+        start = 0;
+    } else if (near >= fs->data_block && near < fs->block_num && (fs->free_bitmap[near / 64] & (1ULL << (near % 64)))) {
+        start = near;
+        len = find_used_from(fs, near) - near;
+    } else {
+        start = find_free_run(fs, want, &len);
+    }
+    if (start != 0) {
+        if (len > want) {
+            len = want;
+        }
+        claim_range(fs, start, len, false);
+        *got = (unsigned int)len;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return (unsigned int)start;
+}
+
+// 在链尾last之后追加一段连续块（最多want块），返回新段首块号，失败返回0
+static unsigned int extend_chain(fs_instance* fs, unsigned int last, int want) {
+    unsigned int got;
+    if (want < 1) {
+        want = 1;
+    }
+    unsigned int first = alloc_run(fs, want, &got);
+    if (first != 0) {
+        fat_set(fs, last, first);
+    }
+    return first;
+}
+
+// 释放一个块（调用者持有分配器锁），被共享的数据块只减少共享计数
+static void release_block(fs_instance* fs, unsigned int block) {
+    if (block < fs->data_block || block >= fs->block_num || fat_get(fs, block) == 0) {
+        return;
+    }
+    unsigned int refs = block_refs(fs, block);
+    if (refs > 1) {
+        fat_set(fs, block, fat_get(fs, block) + 1);
+        if (refs == 2) {
+            __atomic_sub_fetch(&fs->shared_blocks, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    fat_set(fs, block, 0); // 标记为空闲
+    STAT_ADD(fs, blocks_freed, 1);
+    put_free(fs, block);
+}
+
+// 把FAT中已空闲的块放回空闲位图（调用者持有分配器锁，或独占实例）
+// 快照仍引用的块不放回，删除快照时再放回
+static void put_free(fs_instance* fs, unsigned int block) {
+    if (fs->snap_refs != NULL && fs->snap_refs[block] != 0) {
+        return;
+    }
+
+    // 使用日志时，事务提交前旧内容可能仍被映像中的元数据引用，提交后才允许重新分配
+    if (fs->journal_fd >= 0) {
+        pthread_mutex_lock(&fs->journal_lock);
+        if (fs->pending_free_count == fs->pending_free_cap) {
+            unsigned int cap = fs->pending_free_cap ? fs->pending_free_cap * 2 : 256;
+            unsigned int* frees = (unsigned int*)realloc(fs->pending_frees, cap * sizeof(unsigned int));
+            if (frees == NULL) {
+                // 内存不足时不放回空闲位图，该块在FAT中已空闲，下次挂载重建位图时收回
+                pthread_mutex_unlock(&fs->journal_lock);
+                return;
+            }
+            fs->pending_frees = frees;
+            fs->pending_free_cap = cap;
+        }
+        fs->pending_frees[fs->pending_free_count++] = block;
+        pthread_mutex_unlock(&fs->journal_lock);
+        return;
+    }
+
+    fs->free_bitmap[block / 64] |= 1ULL << (block % 64);
+    fs->free_block_count++;
+}
+
+// 释放一个块
+static void free_block(fs_instance* fs, unsigned int block) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    release_block(fs, block);
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// 释放从block开始的整条FAT链
+static void free_chain(fs_instance* fs, unsigned int block) {
+    unsigned int hops = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (block != EOF_BLOCK && block != 0) {
+        unsigned int next_block = fat_get(fs, block);
+        release_block(fs, block);
+        block = next_block;
+        hops++;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    STAT_ADD(fs, fat_hops, hops);
+}
+
+/* 目录管理：目录是一条FAT链，超过一块后为其建立持久化的名字哈希索引 */
+
+// 获取目录块中的目录项数组
+static DirEntry* dir_entries(fs_instance* fs, unsigned int block) {
+    cache_touch(fs, (size_t)block * fs->block_size, fs->block_size, CACHE_DIR_HEAT);
+    return (DirEntry*)(fs->virtual_disk + (size_t)block * fs->block_size);
+}
+
+// 名字哈希（FNV-1a）
+static unsigned int name_hash(const char* name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 目录项指针与位置编码之间的转换
+static unsigned int entry_loc(fs_instance* fs, const DirEntry* entry) {
+    size_t offset = (const unsigned char*)entry - fs->virtual_disk;
+    unsigned int block = offset / fs->block_size;
+    unsigned int slot = (offset % fs->block_size) / sizeof(DirEntry);
+    return block * DIR_ENTRIES_PER_BLOCK + slot + 1;
+}
+
+static DirEntry* loc_entry(fs_instance* fs, unsigned int loc) {
+    loc--;
+    return dir_entries(fs, loc / DIR_ENTRIES_PER_BLOCK) + loc % DIR_ENTRIES_PER_BLOCK;
+}
+
+// 获取目录的索引头，无索引时返回NULL
+static DirIndexHeader* dir_index(fs_instance* fs, unsigned int dir_block) {
+    unsigned int index_block = dir_entries(fs, dir_block)[0].index_block;
+    if (index_block == 0) {
+        return NULL;
+    }
+    return (DirIndexHeader*)(block_ptr(fs, index_block));
+}
+
+static IndexBucket* index_buckets(DirIndexHeader* header) {
+    return (IndexBucket*)((unsigned char*)header + INDEX_HEADER_SIZE);
+}
+
+// 将目录项加入索引（调用者保证索引中有空桶）
+static void index_insert(fs_instance* fs, DirIndexHeader* header, const DirEntry* entry) {
+    IndexBucket* buckets = index_buckets(header);
+    unsigned int mask = header->bucket_count - 1;
+    unsigned int hash = name_hash(entry->filename);
+    unsigned int i = hash & mask;
+
+    while (buckets[i].loc != 0 && buckets[i].loc != INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (buckets[i].loc == INDEX_TOMBSTONE) {
+        header->tombstones--;
+    }
+    buckets[i].hash = hash;
+    buckets[i].loc = entry_loc(fs, entry);
+    header->used++;
+    mark_meta(fs, header, sizeof(DirIndexHeader));
+    mark_meta(fs, &buckets[i], sizeof(IndexBucket));
+}
+
+// 在块中查找空槽，没有则返回NULL
+static DirEntry* block_free_slot(fs_instance* fs, unsigned int block) {
+    DirEntry* entries = dir_entries(fs, block);
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        if (entries[i].filename[0] == '\0') {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+// 在目录链尾追加一个清零的目录块，失败返回0
+static unsigned int dir_grow(fs_instance* fs, unsigned int tail_block) {
+    unsigned int new_block = extend_chain(fs, tail_block, 1);
+    if (new_block != 0) {
+        memset(dir_entries(fs, new_block), 0, fs->block_size);
+        mark_meta(fs, dir_entries(fs, new_block), fs->block_size);
+    }
+    return new_block;
+}
+
+// 为目录（重新）建立哈希索引：扫描整条目录链，分配一段连续块存放桶数组
+// 空间不足时目录退化为无索引的线性查找，返回-1
+static int dir_build_index(fs_instance* fs, unsigned int dir_block) {
+    DirEntry* self = &dir_entries(fs, dir_block)[0];
+    unsigned int used = 0;
+    unsigned int tail = dir_block;
+
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < DIR_ENTRIES_PER_BLOCK; i++) {
+            if (entries[i].filename[0] != '\0') {
+                used++;
+            }
+        }
+        tail = blk;
+    }
+
+    // 装载因子不超过1/2
+    unsigned int bucket_count = INDEX_MIN_BUCKETS;
+    while (bucket_count < (used + 1) * 2) {
+        bucket_count *= 2;
+    }
+    unsigned int bytes = INDEX_HEADER_SIZE + bucket_count * sizeof(IndexBucket);
+    unsigned int want = (bytes + fs->block_size - 1) / fs->block_size;
+
+    // 释放旧索引
+    if (self->index_block != 0) {
+        free_chain(fs, self->index_block);
+        self->index_block = 0;
+        mark_meta(fs, self, sizeof(DirEntry));
+    }
+
+    unsigned int got;
+    unsigned int index_block = alloc_run(fs, want, &got);
+    if (index_block == 0 || got < want) {
+        if (index_block != 0) {
+            free_chain(fs, index_block);
+        }
+        pthread_mutex_lock(&fs->alloc_lock);
+        fs->index_fail_free = fs->free_block_count;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+
+    DirIndexHeader* header = (DirIndexHeader*)(block_ptr(fs, index_block));
+    memset(header, 0, want * fs->block_size);
+    mark_meta(fs, header, (size_t)want * fs->block_size);
+    header->bucket_count = bucket_count;
+    header->tail_block = tail;
+    header->free_block = tail;
+
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < DIR_ENTRIES_PER_BLOCK; i++) {
+            if (entries[i].filename[0] != '\0') {
+                index_insert(fs, header, &entries[i]);
+            }
+        }
+    }
+
+    self->index_block = index_block;
+    mark_meta(fs, self, sizeof(DirEntry));
+    return 0;
+}
+
+// 目录项缓存：（父目录，名字）映射到固定槽位，冲突时直接覆盖
+// 不同父目录的名字可能落在同一槽位，槽位按编号分组加锁，锁由调用者通过dcache_slot_lock取得
+static Dentry* dcache_slot(fs_instance* fs, unsigned int parent, unsigned int hash) {
+    return &fs->dcache[(hash ^ (parent * 2654435761u)) & (DCACHE_SLOTS - 1)];
+}
+
+static pthread_mutex_t* dcache_slot_lock(fs_instance* fs, const Dentry* d) {
+    return &fs->dcache_locks[(d - fs->dcache) % DCACHE_LOCKS];
+}
+
+// 清空目录项缓存（格式化或重新加载后）
+static void dcache_clear(fs_instance* fs) {
+    memset(fs->dcache, 0, sizeof(fs->dcache));
+}
+
+// 使（父目录，名字）的缓存失效，在目录中创建或删除该名字时调用
+static void dcache_invalidate(fs_instance* fs, unsigned int parent, const char* name) {
+    unsigned int hash = name_hash(name);
+    Dentry* d = dcache_slot(fs, parent, hash);
+    pthread_mutex_lock(dcache_slot_lock(fs, d));
+    if (d->parent == parent && d->hash == hash && strcmp(d->name, name) == 0) {
+        d->parent = 0;
+    }
+    pthread_mutex_unlock(dcache_slot_lock(fs, d));
+}
+
+// 删除目录时清除以它为父目录的所有缓存（包括负缓存），其首块可能被新目录重用（调用者持有实例写锁）
+static void dcache_purge_dir(fs_instance* fs, unsigned int parent) {
+    for (int i = 0; i < DCACHE_SLOTS; i++) {
+        if (fs->dcache[i].parent == parent) {
+            fs->dcache[i].parent = 0;
+        }
+    }
+}
+
+// 在目录块中查找名字（有索引时查哈希索引，否则沿目录链线性查找）
+static DirEntry* dir_search(fs_instance* fs, unsigned int dir_block, const char* name, unsigned int hash) {
+    DirIndexHeader* header = dir_index(fs, dir_block);
+    DirEntry* found = NULL;
+    unsigned int scanned = 0, hops = 0;
+
+    if (header != NULL) {
+        IndexBucket* buckets = index_buckets(header);
+        unsigned int mask = header->bucket_count - 1;
+
+        for (unsigned int i = hash & mask; buckets[i].loc != 0 && found == NULL; i = (i + 1) & mask) {
+            scanned++;
+            if (buckets[i].loc != INDEX_TOMBSTONE && buckets[i].hash == hash) {
+                DirEntry* entry = loc_entry(fs, buckets[i].loc);
+                if (strcmp(entry->filename, name) == 0) {
+                    found = entry;
+                }
+            }
+        }
+    } else {
+        // 无索引：沿目录链线性查找
+        for (unsigned int blk = dir_block; blk != EOF_BLOCK && found == NULL; blk = fat_get(fs, blk), hops++) {
+            DirEntry* entries = dir_entries(fs, blk);
+            for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+                scanned++;
+                if (entries[i].filename[0] != '\0' &&
+                    strcmp(entries[i].filename, name) == 0) {
+                    found = &entries[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    STAT_ADD(fs, dir_slots_scanned, scanned);
+    STAT_ADD(fs, fat_hops, hops);
+    return found;
+}
+
+// 在目录中查找名字，返回目录项指针，未找到返回NULL；结果（包括未找到）记入目录项缓存
+// 调用者持有该目录的锁（读锁即可）
+static DirEntry* dir_lookup(fs_instance* fs, unsigned int dir_block, const char* name) {
+    DirEntry* first = dir_entries(fs, dir_block);
+
+    // "."和".."固定位于首块的前两项
+    if (strcmp(name, ".") == 0) {
+        return &first[0];
+    }
+    if (strcmp(name, "..") == 0) {
+        return &first[1];
+    }
+
+    unsigned int hash = name_hash(name);
+    Dentry* d = dcache_slot(fs, dir_block, hash);
+    pthread_mutex_t* lock = dcache_slot_lock(fs, d);
+    pthread_mutex_lock(lock);
+    if (d->parent == dir_block && d->hash == hash && strcmp(d->name, name) == 0) {
+        unsigned int loc = d->loc;
+        pthread_mutex_unlock(lock);
+        STAT_ADD(fs, dcache_hits, 1);
+        return loc != 0 ? loc_entry(fs, loc) : NULL;
+    }
+    pthread_mutex_unlock(lock);
+    STAT_ADD(fs, dcache_misses, 1);
+
+    // 调用者持有该目录的锁，查找期间目录内容不会变化
+    DirEntry* entry = dir_search(fs, dir_block, name, hash);
+    if (strlen(name) < MAX_FILENAME_LENGTH) {
+        pthread_mutex_lock(lock);
+        d->parent = dir_block;
+        d->hash = hash;
+        d->loc = entry != NULL ? entry_loc(fs, entry) : 0;
+        strcpy(d->name, name);
+        pthread_mutex_unlock(lock);
+    }
+    return entry;
+}
+
+// 在目录中分配一个目录项并写入名字，必要时扩展目录链并维护索引
+// 其余字段由调用者填写；空间不足时返回NULL（调用者持有该目录的写锁）
+static DirEntry* dir_alloc_entry(fs_instance* fs, unsigned int dir_block, const char* name) {
+    DirIndexHeader* header = dir_index(fs, dir_block);
+    DirEntry* entry = NULL;
+
+    if (header != NULL) {
+        // 先试最近出现空槽的块，再试链尾，都满则扩展
+        entry = block_free_slot(fs, header->free_block);
+        if (entry == NULL) {
+            header->free_block = header->tail_block;
+            entry = block_free_slot(fs, header->tail_block);
+        }
+        if (entry == NULL) {
+            unsigned int new_block = dir_grow(fs, header->tail_block);
+            if (new_block == 0) {
+                return NULL;
+            }
+            header->tail_block = new_block;
+            header->free_block = new_block;
+            entry = dir_entries(fs, new_block);
+        }
+        mark_meta(fs, header, sizeof(DirIndexHeader));
+    } else {
+        unsigned int tail = dir_block;
+        for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+            entry = block_free_slot(fs, blk);
+            if (entry != NULL) {
+                break;
+            }
+            tail = blk;
+        }
+        if (entry == NULL) {
+            unsigned int new_block = dir_grow(fs, tail);
+            if (new_block == 0) {
+                return NULL;
+            }
+            entry = dir_entries(fs, new_block);
+        }
+    }
+
+    // 名字此前可能以"不存在"记入缓存
+    dcache_invalidate(fs, dir_block, name);
+
+    // 调用者随后填写的其余字段与名字在同一块中，此处标记一次即可
+    memset(entry, 0, sizeof(DirEntry));
+    strcpy(entry->filename, name);
+    mark_meta(fs, entry, sizeof(DirEntry));
+
+    if (header == NULL) {
+        // 目录超过一块时建立索引（失败则继续线性查找）
+        // 上次因空间不足失败后，空闲块没有增加时重建注定失败，不必每次都扫描整个目录
+        if (fat_get(fs, dir_block) != EOF_BLOCK) {
+            pthread_mutex_lock(&fs->alloc_lock);
+            bool retry = fs->free_block_count > fs->index_fail_free;
+            pthread_mutex_unlock(&fs->alloc_lock);
+            if (retry) {
+                dir_build_index(fs, dir_block);
+            }
+        }
+    } else if ((header->used + header->tombstones + 1) * 2 > header->bucket_count) {
+        // 装载因子过高，按当前项数重建更大的索引（失败时旧索引已释放，退回线性查找）
+        dir_build_index(fs, dir_block);
+    } else {
+        index_insert(fs, header, entry);
+    }
+
+    return entry;
+}
+
+// 从目录中删除目录项（调用者持有该目录的写锁）
+static void dir_remove_entry(fs_instance* fs, unsigned int dir_block, DirEntry* entry) {
+    DirIndexHeader* header = dir_index(fs, dir_block);
+    dcache_invalidate(fs, dir_block, entry->filename);
+
+    if (header != NULL) {
+        IndexBucket* buckets = index_buckets(header);
+        unsigned int mask = header->bucket_count - 1;
+        unsigned int loc = entry_loc(fs, entry);
+
+        for (unsigned int i = name_hash(entry->filename) & mask; buckets[i].loc != 0; i = (i + 1) & mask) {
+            if (buckets[i].loc == loc) {
+                buckets[i].loc = INDEX_TOMBSTONE;
+                mark_meta(fs, &buckets[i], sizeof(IndexBucket));
+                header->used--;
+                header->tombstones++;
+                break;
+            }
+        }
+        header->free_block = (loc - 1) / DIR_ENTRIES_PER_BLOCK;
+        mark_meta(fs, header, sizeof(DirIndexHeader));
+    }
+
+    memset(entry, 0, sizeof(DirEntry));
+    mark_meta(fs, entry, sizeof(DirEntry));
+}
+
+// 目录是否为空（不计"."和".."）
+static bool dir_is_empty(fs_instance* fs, unsigned int dir_block) {
+    DirIndexHeader* header = dir_index(fs, dir_block);
+    if (header != NULL) {
+        return header->used == 0;
+    }
+
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < DIR_ENTRIES_PER_BLOCK; i++) {
+            if (entries[i].filename[0] != '\0') {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 释放目录的所有块及其索引
+static void dir_free(fs_instance* fs, unsigned int dir_block) {
+    dcache_purge_dir(fs, dir_block);
+    unsigned int index_block = dir_entries(fs, dir_block)[0].index_block;
+    if (index_block != 0) {
+        free_chain(fs, index_block);
+    }
+    free_chain(fs, dir_block);
+}
+
+// 重置打开文件的链游标和跳跃索引（文件首块变化或被截断后调用）
+static void reset_file_cursor(OpenFileEntry* file) {
+    file->cursor_extent.length = 0;
+    file->cursor_lblock = 0;
+    file->cursor_pblock = file->first_block;
+    file->skip[0] = file->first_block;
+    file->skip_stride = 1;
+    file->skip_count = 1;
+    file->ra_next = 0;
+    file->ra_window = 0;
+    file->ra_mark = 0;
+}
+
+// 沿链前进时记录跳跃索引槽位，槽位用完后间隔加倍并压缩
+static void skip_record(OpenFileEntry* file, unsigned int lblock, unsigned int pblock) {
+    if (lblock % file->skip_stride != 0 || lblock / file->skip_stride != file->skip_count) {
+        return;
+    }
+    if (file->skip_count == SKIP_SLOTS) {
+        for (int i = 0; i < SKIP_SLOTS / 2; i++) {
+            file->skip[i] = file->skip[i * 2];
+        }
+        file->skip_count = SKIP_SLOTS / 2;
+        file->skip_stride *= 2;
+        if (lblock % file->skip_stride != 0 || lblock / file->skip_stride != file->skip_count) {
+            return;
+        }
+    }
+    file->skip[file->skip_count++] = pblock;
+}
+
+// 区段表块的块头和区段数组
+static ExtentHeader* extent_header(fs_instance* fs, unsigned int block) {
+    return (ExtentHeader*)(block_ptr(fs, block));
+}
+
+static Extent* extent_array(ExtentHeader* header) {
+    return (Extent*)(header + 1);
+}
+
+// 返回文件第lblock个逻辑块的物理块号，并通过run返回从该块起物理连续的块数（不超过want）
+// FAT链从游标或最近的跳跃索引槽位出发沿链前进，区段布局直接查区段表
+// 文件不够长（或区段布局的块是空洞）时，alloc为true则分配，按本次要用到的want块一起申请连续块；失败返回0
+// alloc为false时遇到区段布局的空洞返回0并通过run返回空洞的块数，FAT链走到链尾返回0且run为0
+static unsigned int file_map(fs_instance* fs, OpenFileEntry* file, unsigned int lblock, unsigned int want, bool alloc, unsigned int* run) {
+    if (want == 0) {
+        want = 1;
+    }
+    *run = 0;
+
+    if (file->extents) {
+        unsigned int block = extent_map(fs, file, lblock, run);
+        if (block == 0 && alloc) {
+            // 填补空洞时新区段不能越过下一个区段
+            unsigned int hole = *run;
+            if (want > hole) {
+                want = hole;
+            }
+            unsigned int near = 0;
+            unsigned int prev_run;
+            if (hole == 0xFFFFFFFF - lblock) {
+                // 追加新区段，优先紧接在最后一个区段之后分配以便合并
+                unsigned int tail_block = extent_header(fs, file->first_block)->tail;
+                ExtentHeader* tail = extent_header(fs, tail_block != 0 ? tail_block : file->first_block);
+                if (tail->count > 0) {
+                    Extent* last = extent_array(tail) + tail->count - 1;
+                    near = last->start + last->length;
+                }
+            } else if (lblock > 0 && (near = extent_map(fs, file, lblock - 1, &prev_run)) != 0) {
+                // 文件中间的空洞，优先紧接在前一个逻辑块之后分配
+                near++;
+            }
+            unsigned int got;
+            unsigned int start = alloc_extent(fs, near, want > MAX_EXTENT_LENGTH ? MAX_EXTENT_LENGTH : want, &got);
+            if (start == 0) {
+                return 0;
+            }
+            if (extent_insert(fs, file->first_block, lblock, start, got) != 0) {
+                for (unsigned int i = 0; i < got; i++) {
+                    free_block(fs, start + i);
+                }
+                return 0;
+            }
+            block = extent_map(fs, file, lblock, run);
+        }
+        if (block != 0 && *run > want) {
+            *run = want;
+        }
+        return block;
+    }
+
+    unsigned int lb;
+    unsigned int pb;
+
+    if (file->cursor_pblock != 0 && file->cursor_lblock <= lblock) {
+        lb = file->cursor_lblock;
+        pb = file->cursor_pblock;
+    } else {
+        unsigned int slot = lblock / file->skip_stride;
+        if (slot >= file->skip_count) {
+            slot = file->skip_count - 1;
+        }
+        lb = slot * file->skip_stride;
+        pb = file->skip[slot];
+    }
+
+    unsigned int walk_from = lb;
+    while (lb < lblock) {
+        if (fat_get(fs, pb) == EOF_BLOCK) {
+            if (!alloc || extend_chain(fs, pb, lblock - lb + want - 1) == 0) {
+                return 0;
+            }
+        }
+        pb = fat_get(fs, pb);
+        lb++;
+        skip_record(file, lb, pb);
+    }
+
+    // 沿链统计物理上连续的块
+    unsigned int block = pb;
+    *run = 1;
+    while (*run < want) {
+        if (fat_get(fs, pb) == EOF_BLOCK && alloc) {
+            if (extend_chain(fs, pb, want - *run) == 0) {
+                break;
+            }
+        }
+        if (fat_get(fs, pb) != pb + 1) {
+            break;
+        }
+        pb++;
+        lb++;
+        (*run)++;
+        skip_record(file, lb, pb);
+    }
+
+    file->cursor_lblock = lb;
+    file->cursor_pblock = pb;
+    STAT_ADD(fs, fat_hops, lb - walk_from);
+    return block;
+}
+
+// 顺序预读：映射模式下数据块在首次访问时才从映像缺页载入，一次一页地同步等待；文件的块沿FAT链
+// 或区段分散在映像中，内核按映像位置做的预读也跟不上文件的逻辑顺序。检测到顺序读后，在拷贝之前
+// 沿文件自身的块映射找出本次要读的块和其后一个窗口的块，以MADV_WILLNEED让内核异步载入（不映射进
+// 进程，不计入驻留预算），拷贝时缺页只需等待已发出的读请求；读到窗口的后一半时再预读下一个窗口，
+// 窗口逐次加倍到READAHEAD_MAX，随机读时清零（调用者持有表项锁和文件读锁）
+static void file_readahead(fs_instance* fs, OpenFileEntry* file, unsigned int offset, unsigned int length) {
+    if (!fs->use_mmap) {
+        return;
+    }
+    unsigned int end = offset + length;
+    if (offset != file->ra_next) {
+        file->ra_next = end;
+        file->ra_window = 0;
+        return;
+    }
+    file->ra_next = end;
+
+    unsigned int first = offset / fs->block_size;
+    unsigned int next = (end + fs->block_size - 1) / fs->block_size;
+    unsigned int window = file->ra_window;
+    if (window == 0) {
+        window = READAHEAD_MIN / fs->block_size;
+        file->ra_mark = first;
+    } else if (next + window / 2 < file->ra_mark) {
+        return;
+    } else if (window < READAHEAD_MAX / fs->block_size) {
+        window *= 2;
+    }
+    // 窗口至少与本次读的长度相同
+    if (window < next - first) {
+        window = next - first;
+    }
+    file->ra_window = window > 0 ? window : 1;
+
+    unsigned int file_blocks = (file->file_size + fs->block_size - 1) / fs->block_size;
+    unsigned int lblock = file->ra_mark > first ? file->ra_mark : first;
+    unsigned int stop = next + file->ra_window < file_blocks ? next + file->ra_window : file_blocks;
+    if (lblock >= stop) {
+        return;
+    }
+
+    // 预读不应移动读路径的游标，结束后恢复
+    Extent saved_extent = file->cursor_extent;
+    unsigned int saved_lblock = file->cursor_lblock;
+    unsigned int saved_pblock = file->cursor_pblock;
+
+    // 只请求文件自己的块（夹在中间的其他文件的块正是内核预读白白读入的部分），物理上相邻的段合并后一次提交
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pending_start = 0;
+    size_t pending_end = 0;
+    unsigned int fetched = 0;
+    while (lblock < stop) {
+        unsigned int run;
+        unsigned int block = file_map(fs, file, lblock, stop - lblock, false, &run);
+        if (block == 0) {
+            if (run == 0) {
+                break;
+            }
+            // 空洞没有块可读
+            lblock = run < stop - lblock ? lblock + run : stop;
+            continue;
+        }
+        size_t start = (size_t)block * fs->block_size;
+        size_t run_end = start + (size_t)run * fs->block_size;
+        if (start != pending_end) {
+            if (pending_end > pending_start) {
+                madvise(fs->virtual_disk + pending_start, pending_end - pending_start, MADV_WILLNEED);
+            }
+            pending_start = start / page * page;
+        }
+        pending_end = run_end;
+        lblock += run;
+        fetched += run;
+    }
+    if (pending_end > pending_start) {
+        madvise(fs->virtual_disk + pending_start, pending_end - pending_start, MADV_WILLNEED);
+    }
+    file->ra_mark = lblock;
+
+    file->cursor_extent = saved_extent;
+    file->cursor_lblock = saved_lblock;
+    file->cursor_pblock = saved_pblock;
+    STAT_ADD(fs, readahead_blocks, fetched);
+}
+
+/* 区段表管理 */
+
+// 查找逻辑块lblock所在的区段，返回物理块号并通过run返回区段内剩余块数
+// 未映射（空洞）时返回0，并通过run返回到下一个区段之前的空洞块数（之后没有区段时为到块号上限的块数）
+static unsigned int extent_map(fs_instance* fs, OpenFileEntry* file, unsigned int lblock, unsigned int* run) {
+    Extent* cached = &file->cursor_extent;
+
+    if (cached->length == 0 || lblock < cached->logical || lblock >= cached->logical + cached->length) {
+        cached->length = 0;
+        Extent* found = extent_find(fs, file->first_block, lblock, run);
+        if (found == NULL) {
+            return 0;
+        }
+        *cached = *found;
+    }
+
+    *run = cached->logical + cached->length - lblock;
+    return cached->start + (lblock - cached->logical);
+}
+
+// 在区段表中查找逻辑块lblock所在的区段，返回区段表中的该项
+// 未映射（空洞）时返回NULL，并通过hole返回到下一个区段之前的空洞块数（之后没有区段时为到块号上限的块数）
+static Extent* extent_find(fs_instance* fs, unsigned int meta_block, unsigned int lblock, unsigned int* hole) {
+    *hole = 0xFFFFFFFF - lblock;
+    for (unsigned int blk = meta_block; blk != 0; blk = extent_header(fs, blk)->next) {
+        ExtentHeader* header = extent_header(fs, blk);
+        Extent* extents = extent_array(header);
+        if (header->count == 0) {
+            break;
+        }
+
+        Extent* last = &extents[header->count - 1];
+        if (lblock >= last->logical + last->length) {
+            continue;
+        }
+
+        // 区段按逻辑块号有序，二分查找
+        int lo = 0, hi = header->count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (extents[mid].logical <= lblock) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        if (extents[lo].logical <= lblock && lblock < extents[lo].logical + extents[lo].length) {
+            return &extents[lo];
+        }
+        // lblock落在两个区段之间（或第一个区段之前），空洞到下一个区段为止
+        Extent* next = extents[lo].logical > lblock ? &extents[lo] : &extents[lo + 1];
+        *hole = next->logical - lblock;
+        break;
+    }
+    return NULL;
+}
+
+// 在区段表末尾追加区段，与最后一个区段首尾相接时直接合并；需要溢出块但空间不足时返回-1
+static int extent_append(fs_instance* fs, unsigned int meta_block, unsigned int logical, unsigned int start, unsigned int length) {
+    ExtentHeader* head = extent_header(fs, meta_block);
+    if (head->tail == 0) {
+        head->tail = meta_block;
+        mark_meta(fs, head, sizeof(ExtentHeader));
+    }
+
+    ExtentHeader* tail = extent_header(fs, head->tail);
+    Extent* extents = extent_array(tail);
+
+    if (tail->count > 0) {
+        Extent* last = &extents[tail->count - 1];
+        if (last->logical + last->length == logical &&
+            last->start + last->length == start &&
+            last->length + length <= MAX_EXTENT_LENGTH) {
+            last->length += length;
+            mark_meta(fs, last, sizeof(Extent));
+            return 0;
+        }
+    }
+
+    if (tail->count == EXTENTS_PER_BLOCK) {
+        tail = extent_grow(fs, head, tail);
+        if (tail == NULL) {
+            return -1;
+        }
+        extents = extent_array(tail);
+    }
+
+    extents[tail->count].logical = logical;
+    extents[tail->count].start = start;
+    extents[tail->count].length = length;
+    mark_meta(fs, &extents[tail->count], sizeof(Extent));
+    tail->count++;
+    mark_meta(fs, tail, sizeof(ExtentHeader));
+    return 0;
+}
+
+// 在区段表末块tail之后接上一个空的溢出块，返回其块头，空间不足时返回NULL
+static ExtentHeader* extent_grow(fs_instance* fs, ExtentHeader* head, ExtentHeader* tail) {
+    unsigned int overflow = alloc_block(fs);
+    if (overflow == 0) {
+        return NULL;
+    }
+    memset(block_ptr(fs, overflow), 0, fs->block_size);
+    mark_meta(fs, block_ptr(fs, overflow), fs->block_size);
+    tail->next = overflow;
+    head->tail = overflow;
+    mark_meta(fs, tail, sizeof(ExtentHeader));
+    mark_meta(fs, head, sizeof(ExtentHeader));
+    return extent_header(fs, overflow);
+}
+
+// 按逻辑块号把区段插入区段表（填补空洞），位于所有区段之后时同extent_append
+// 能与前后区段首尾相接时直接合并，否则其后的区段依次后移一格，各块都满时先申请溢出块；空间不足时返回-1
+static int extent_insert(fs_instance* fs, unsigned int meta_block, unsigned int logical, unsigned int start, unsigned int length) {
+    ExtentHeader* head = extent_header(fs, meta_block);
+    ExtentHeader* tail = extent_header(fs, head->tail != 0 ? head->tail : meta_block);
+    Extent* last = tail->count > 0 ? extent_array(tail) + tail->count - 1 : NULL;
+    if (last == NULL && tail != head) {
+        // 末块是extent_remap预先接上的空溢出块，最后一个区段在前面的块中
+        for (unsigned int blk = meta_block; blk != 0; blk = extent_header(fs, blk)->next) {
+            ExtentHeader* header = extent_header(fs, blk);
+            if (header->count > 0) {
+                last = extent_array(header) + header->count - 1;
+            }
+        }
+    }
+    if (last == NULL || logical >= last->logical + last->length) {
+        return extent_append(fs, meta_block, logical, start, length);
+    }
+
+    // 找到第一个逻辑块号大于logical的区段（插入位置）及其前一个区段
+    unsigned int blk = meta_block;
+    ExtentHeader* header = head;
+    Extent* prev = NULL;
+    unsigned int pos = 0;
+    for (; blk != 0; blk = header->next) {
+        header = extent_header(fs, blk);
+        Extent* extents = extent_array(header);
+        if (header->count > 0 && extents[header->count - 1].logical > logical) {
+            while (extents[pos].logical < logical) {
+                pos++;
+            }
+            if (pos > 0) {
+                prev = &extents[pos - 1];
+            }
+            break;
+        }
+        if (header->count > 0) {
+            prev = &extents[header->count - 1];
+        }
+    }
+    if (blk == 0) {
+        return -1;
+    }
+
+    Extent* next = extent_array(header) + pos;
+    if (prev != NULL && prev->logical + prev->length == logical &&
+        prev->start + prev->length == start && prev->length + length <= MAX_EXTENT_LENGTH) {
+        prev->length += length;
+        mark_meta(fs, prev, sizeof(Extent));
+        return 0;
+    }
+    if (logical + length == next->logical && start + length == next->start &&
+        next->length + length <= MAX_EXTENT_LENGTH) {
+        next->logical = logical;
+        next->start = start;
+        next->length += length;
+        mark_meta(fs, next, sizeof(Extent));
+        return 0;
+    }
+
+    // 从插入位置起的各块都满时，最后一个区段要挪到新的溢出块中，先申请好再移动
+    unsigned int b = blk;
+    while (b != 0 && extent_header(fs, b)->count == (unsigned int)EXTENTS_PER_BLOCK) {
+        b = extent_header(fs, b)->next;
+    }
+    if (b == 0 && extent_grow(fs, head, tail) == NULL) {
+        return -1;
+    }
+
+    Extent carry = {logical, start, length};
+    while (1) {
+        Extent* extents = extent_array(header);
+        if (header->count < (unsigned int)EXTENTS_PER_BLOCK) {
+            memmove(&extents[pos + 1], &extents[pos], (header->count - pos) * sizeof(Extent));
+            extents[pos] = carry;
+            header->count++;
+            mark_meta(fs, &extents[pos], (header->count - pos) * sizeof(Extent));
+            mark_meta(fs, header, sizeof(ExtentHeader));
+            return 0;
+        }
+        // 本块已满，末尾的区段挪到下一块开头
+        Extent out = extents[header->count - 1];
+        memmove(&extents[pos + 1], &extents[pos], (header->count - 1 - pos) * sizeof(Extent));
+        extents[pos] = carry;
+        mark_meta(fs, &extents[pos], (header->count - pos) * sizeof(Extent));
+        carry = out;
+        header = extent_header(fs, header->next);
+        pos = 0;
+    }
+}
+
+// 把逻辑块[logical, logical+count)（位于同一个区段内）改为映射到从start开始的块，原来的块由调用者释放
+// 原区段被截成前后两段，最多多出两个区段：先确保末块有两个空位，之后的插入不会失败；空间不足时返回-1且不做修改
+static int extent_remap(fs_instance* fs, unsigned int meta_block, unsigned int logical, unsigned int count, unsigned int start) {
+    ExtentHeader* head = extent_header(fs, meta_block);
+    ExtentHeader* tail = extent_header(fs, head->tail != 0 ? head->tail : meta_block);
+    if (tail->count + 2 > (unsigned int)EXTENTS_PER_BLOCK && extent_grow(fs, head, tail) == NULL) {
+        return -1;
+    }
+
+    unsigned int hole;
+    Extent* found = extent_find(fs, meta_block, logical, &hole);
+    if (found == NULL || logical + count > found->logical + found->length) {
+        return -1;
+    }
+    Extent cur = *found;
+    if (cur.logical == logical && cur.length == count) {
+        found->start = start;
+        mark_meta(fs, found, sizeof(Extent));
+        return 0;
+    }
+
+    if (cur.logical == logical) {
+        // 替换开头的块：原区段去掉开头
+        found->logical += count;
+        found->start += count;
+        found->length -= count;
+        mark_meta(fs, found, sizeof(Extent));
+    } else {
+        // 替换中间或末尾的块：原区段只保留前一段，后一段重新插入
+        found->length = logical - cur.logical;
+        mark_meta(fs, found, sizeof(Extent));
+        unsigned int after = logical + count;
+        if (after < cur.logical + cur.length) {
+            extent_insert(fs, meta_block, after, cur.start + (after - cur.logical), cur.logical + cur.length - after);
+        }
+    }
+    return extent_insert(fs, meta_block, logical, start, count);
+}
+
+// 写入区段布局文件从lblock起的run个物理连续块（首块为block）之前解除共享（调用者持有文件写锁）
+// 开头的块没有共享时直接使用，到第一个共享的块之前为止；否则把开头连续的共享块复制到新分配的块，
+// 改写区段表后释放一次原来的块（只减少共享计数），返回新的首块号并通过run返回块数；空间不足时返回0
+// 共享计数可能正被共享同一块的其他文件的写入减少，在分配器锁内读；读到的计数只会偏大，最多多复制一次
+static unsigned int extent_unshare(fs_instance* fs, OpenFileEntry* file, unsigned int lblock, unsigned int block, unsigned int* run) {
+    if (__atomic_load_n(&fs->shared_blocks, __ATOMIC_RELAXED) == 0) {
+        return block;
+    }
+    unsigned int n = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (n < *run && block_refs(fs, block + n) == 1) {
+        n++;
+    }
+    bool shared = n == 0;
+    while (shared && n < *run && block_refs(fs, block + n) > 1) {
+        n++;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (!shared) {
+        *run = n;
+        return block;
+    }
+
+    unsigned int got;
+    unsigned int start = alloc_extent(fs, 0, n, &got);
+    if (start == 0) {
+        return 0;
+    }
+    memcpy(run_ptr(fs, start, got), run_ptr(fs, block, got), (size_t)got * fs->block_size);
+    mark_dirty_blocks(fs, start, got);
+    if (extent_remap(fs, file->first_block, lblock, got, start) != 0) {
+        for (unsigned int i = 0; i < got; i++) {
+            free_block(fs, start + i);
+        }
+        return 0;
+    }
+    for (unsigned int i = 0; i < got; i++) {
+        free_block(fs, block + i);
+    }
+
+    // 同一文件的其他描述符缓存的区段已失效，和截断一样由它们取得文件锁时丢弃
+    reset_file_cursor(file);
+    __atomic_add_fetch(&fs->trunc_gen, 1, __ATOMIC_RELAXED);
+    STAT_ADD(fs, shared_copies, got);
+    *run = got;
+    return start;
+}
+
+// 区段布局文件是否有被共享的数据块
+static bool extent_shared(fs_instance* fs, unsigned int meta_block) {
+    for (unsigned int blk = meta_block; blk != 0; blk = extent_header(fs, blk)->next) {
+        ExtentHeader* header = extent_header(fs, blk);
+        Extent* extents = extent_array(header);
+        for (unsigned int i = 0; i < header->count; i++) {
+            for (unsigned int j = 0; j < extents[i].length; j++) {
+                if (block_refs(fs, extents[i].start + j) > 1) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// 释放区段表描述的所有数据块和溢出块，区段表首块保留并清空
+static void extent_free_all(fs_instance* fs, unsigned int meta_block) {
+    unsigned int blk = meta_block;
+    while (blk != 0) {
+        ExtentHeader* header = extent_header(fs, blk);
+        Extent* extents = extent_array(header);
+        unsigned int next = header->next;
+
+        for (int i = 0; i < header->count; i++) {
+            for (unsigned int j = 0; j < extents[i].length; j++) {
+                free_block(fs, extents[i].start + j);
+            }
+        }
+        if (blk != meta_block) {
+            free_block(fs, blk);
+        }
+        blk = next;
+    }
+
+    memset(extent_header(fs, meta_block), 0, fs->block_size);
+    mark_meta(fs, extent_header(fs, meta_block), fs->block_size);
+}
+
+// 在打开文件表中查找空闲项（调用者持有打开文件表锁）
+static int find_empty_entry(fs_instance* fs) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (!fs->open_file_table[i].is_used) {
+            return i;
+        }
+    }
+    return -1; // 未找到空闲项
+}
+
+// 查找从start开始的下一段连续脏块，返回首块号并通过len返回段长，没有脏块时返回block_num
+static unsigned int next_dirty_run(fs_instance* fs, unsigned int start, unsigned int* len) {
+    unsigned int first = start;
+    while (first < fs->block_num && !(fs->dirty_bitmap[first / 64] & (1ULL << (first % 64)))) {
+        // 整字为0时一次跳过64块
+        if (first % 64 == 0 && fs->dirty_bitmap[first / 64] == 0) {
+            first += 64;
+        } else {
+            first++;
+        }
+    }
+    if (first >= fs->block_num) {
+        return fs->block_num;
+    }
+
+    unsigned int last = first;
+    while (last < fs->block_num && (fs->dirty_bitmap[last / 64] & (1ULL << (last % 64)))) {
+        if (last % 64 == 0 && fs->dirty_bitmap[last / 64] == ~0ULL) {
+            last += 64;
+        } else {
+            last++;
+        }
+    }
+    if (last > fs->block_num) {
+        last = fs->block_num;
+    }
+    *len = last - first;
+    return first;
+}
+
+// 把buf中的bytes字节写到文件的offset处
+static bool pwrite_all(int fd, const unsigned char* buf, size_t bytes, size_t offset) {
+    while (bytes > 0) {
+        ssize_t n = pwrite(fd, buf, bytes, offset);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        offset += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// 把一段脏块写回映像：映射模式下msync对应页，否则pwrite到映像文件的相同位置
+static bool write_back_range(fs_instance* fs, int fd, unsigned int start, unsigned int count) {
+    size_t offset = (size_t)start * fs->block_size;
+    size_t bytes = (size_t)count * fs->block_size;
+
+    if (fs->use_mmap) {
+        // msync要求地址按页对齐
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t aligned = offset & ~(page - 1);
+        return msync(fs->virtual_disk + aligned, offset + bytes - aligned, MS_SYNC) == 0;
+    }
+
+    return pwrite_all(fd, fs->virtual_disk + offset, bytes, offset);
+}
+
+// 把映像所在目录落盘，使改名持久化
+static bool sync_parent_dir(const char* path) {
+    char dir[MAX_PATH_LENGTH];
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// 整个写出映像：先写到同目录下的临时文件并落盘，再改名替换原映像，中途失败或崩溃时原映像保持不变
+// 用于映像还不存在或大小与卷不一致（按其他大小重新格式化）时，这时原地写回会留下新旧卷混杂的映像
+static int save_whole_image(fs_instance* fs) {
+    char tmp[MAX_PATH_LENGTH + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fs->image_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return FS_ERR_IO;
+    }
+    bool ok = write_back_range(fs, fd, 0, fs->block_num) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp, fs->image_path) != 0) {
+        unlink(tmp);
+        return FS_ERR_IO;
+    }
+    if (!sync_parent_dir(fs->image_path)) {
+        return FS_ERR_IO;
+    }
+
+    memset(fs->dirty_bitmap, 0, fs->bitmap_words * sizeof(unsigned long long));
+    fs->save_gen++;
+    fs->saved_blocks = fs->block_num;
+    fs->saved_ranges = 1;
+    return FS_OK;
+}
+
+// 将文件系统保存到磁盘文件：只写回上次保存以来修改过的块，相邻脏块合并为一次写入
+static int save_to_file(fs_instance* fs) {
+    // 快照还要用的旧内容先复制出来，之后才能覆盖
+    int ret = snap_preserve(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    int fd = fs->disk_fd;
+    if (!fs->use_mmap) {
+        // 映像还不存在或大小与卷不一致时整个写出，否则原地写回脏块
+        struct stat st;
+        if (stat(fs->image_path, &st) != 0 || (unsigned long long)st.st_size != fs->disk_size) {
+            return save_whole_image(fs);
+        }
+        fd = open(fs->image_path, O_WRONLY);
+        if (fd < 0) {
+            return FS_ERR_IO;
+        }
+    } else if (fs->disk_fd < 0) {
+        fd = open(fs->image_path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            return FS_ERR_IO;
+        }
+
+        // 映像大小与卷不一致（新建或按其他大小重新格式化）时先调整大小，扩展部分由系统补零
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (unsigned long long)st.st_size != fs->disk_size) {
+            if (ftruncate(fd, fs->disk_size) != 0) {
+                close(fd);
+                return FS_ERR_IO;
+            }
+        }
+    }
+
+    unsigned int blocks = 0, ranges = 0;
+    bool ok = true;
+    unsigned int len = 0;
+    for (unsigned int start = next_dirty_run(fs, 0, &len); start < fs->block_num;
+         start = next_dirty_run(fs, start + len, &len)) {
+        if (!write_back_range(fs, fd, start, len)) {
+            ok = false;
+            break;
+        }
+        blocks += len;
+        ranges++;
+    }
+    if (ok && !fs->use_mmap && fsync(fd) != 0) {
+        ok = false;
+    }
+    if (fd != fs->disk_fd) {
+        close(fd);
+    }
+
+    if (!ok) {
+        // 脏块标记保留，下次保存时重试
+        return FS_ERR_IO;
+    }
+
+    memset(fs->dirty_bitmap, 0, fs->bitmap_words * sizeof(unsigned long long));
+    fs->save_gen++;
+    fs->saved_blocks = blocks;
+    fs->saved_ranges = ranges;
+    return FS_OK;
+}
+
+/* 小文件块：内联文件的内容按槽存放，多个小文件共用一块 */
+
+// 小文件块头及其后的槽占用位图
+static SmallHeader* small_header(fs_instance* fs, unsigned int block) {
+    return (SmallHeader*)block_ptr(fs, block);
+}
+
+static unsigned long long* small_bitmap(SmallHeader* header) {
+    return (unsigned long long*)(header + 1);
+}
+
+// 内联文件内容的地址（block为小文件块，slot为起始槽号）
+static unsigned char* inline_ptr(fs_instance* fs, unsigned int block, unsigned int slot) {
+    return block_ptr(fs, block) + (size_t)slot * SMALL_SLOT_SIZE;
+}
+
+// 在小文件块中查找n个连续的空闲槽，返回起始槽号，找不到返回0（开头的槽是块头）
+static unsigned int small_find(fs_instance* fs, unsigned int block, unsigned int n) {
+    unsigned long long* bits = small_bitmap(small_header(fs, block));
+    unsigned int run = 0;
+    for (unsigned int i = 0; i < SMALL_SLOTS; i++) {
+        if (bits[i / 64] & (1ULL << (i % 64))) {
+            run = 0;
+        } else if (++run == n) {
+            return i + 1 - n;
+        }
+    }
+    return 0;
+}
+
+// 标记或清除[slot, slot+n)的占用位并更新占用槽数
+static void small_mark(fs_instance* fs, unsigned int block, unsigned int slot, unsigned int n, bool used) {
+    SmallHeader* header = small_header(fs, block);
+    unsigned long long* bits = small_bitmap(header);
+    for (unsigned int i = slot; i < slot + n; i++) {
+        if (used) {
+            bits[i / 64] |= 1ULL << (i % 64);
+        } else {
+            bits[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+    header->used = used ? header->used + n : header->used - n;
+    mark_meta(fs, header, SMALL_META_BYTES);
+}
+
+// 申请一个新的小文件块并接到链头，块头和位图所在的槽标记为占用（调用者持有小文件块锁）
+static unsigned int small_grow(fs_instance* fs) {
+    unsigned int block = alloc_block(fs);
+    if (block == 0) {
+        return 0;
+    }
+    SmallHeader* header = small_header(fs, block);
+    memset(header, 0, SMALL_META_BYTES);
+    unsigned int meta_slots = (SMALL_META_BYTES + SMALL_SLOT_SIZE - 1) / SMALL_SLOT_SIZE;
+    for (unsigned int i = 0; i < meta_slots; i++) {
+        small_bitmap(header)[i / 64] |= 1ULL << (i % 64);
+    }
+    header->next = fs->super->small_head;
+    mark_meta(fs, header, SMALL_META_BYTES);
+    if (header->next != 0) {
+        SmallHeader* next = small_header(fs, header->next);
+        next->prev = block;
+        mark_meta(fs, next, sizeof(SmallHeader));
+    }
+    fs->super->small_head = block;
+    mark_meta(fs, &fs->super->small_head, sizeof(fs->super->small_head));
+    return block;
+}
+
+// 为内联文件申请n个连续槽，返回所在的小文件块并通过slot返回起始槽号，空间不足时返回0
+// 先在最近释放过槽或新申请的块中找，挂载后第一次找不到时沿链找一个有空位的块，再找不到就申请新块
+static unsigned int small_alloc(fs_instance* fs, unsigned int n, unsigned int* slot) {
+    pthread_mutex_lock(&fs->small_lock);
+    unsigned int block = fs->small_hint;
+    unsigned int found = block != 0 ? small_find(fs, block, n) : 0;
+    if (found == 0 && !fs->small_scanned) {
+        fs->small_scanned = true;
+        for (block = fs->super->small_head; block != 0; block = small_header(fs, block)->next) {
+            found = small_find(fs, block, n);
+            if (found != 0) {
+                break;
+            }
+        }
+    }
+    if (found == 0) {
+        block = small_grow(fs);
+        found = block != 0 ? small_find(fs, block, n) : 0;
+    }
+    if (found != 0) {
+        small_mark(fs, block, found, n, true);
+        fs->small_hint = block;
+    }
+    pthread_mutex_unlock(&fs->small_lock);
+
+    *slot = found;
+    return found != 0 ? block : 0;
+}
+
+// 释放内联文件占用的n个槽；小文件块空了且不是链头时从链中摘下并释放（链头留作下次申请）
+static void small_free(fs_instance* fs, unsigned int block, unsigned int slot, unsigned int n) {
+    pthread_mutex_lock(&fs->small_lock);
+    small_mark(fs, block, slot, n, false);
+    SmallHeader* header = small_header(fs, block);
+    if (header->used == 0 && header->prev != 0) {
+        SmallHeader* prev = small_header(fs, header->prev);
+        prev->next = header->next;
+        mark_meta(fs, prev, sizeof(SmallHeader));
+        if (header->next != 0) {
+            SmallHeader* next = small_header(fs, header->next);
+            next->prev = header->prev;
+            mark_meta(fs, next, sizeof(SmallHeader));
+        }
+        fs->small_hint = header->prev;
+        free_block(fs, block);
+    } else {
+        fs->small_hint = block;
+    }
+    pthread_mutex_unlock(&fs->small_lock);
+}
+
+/* 快照：写回映像前把快照还要用的旧内容复制出来，卷的布局不变，回滚时把副本拷回原处 */
+
+// 快照描述块
+static SnapInfo* snap_info(fs_instance* fs, unsigned int block) {
+    return (SnapInfo*)(fs->virtual_disk + (size_t)block * fs->block_size);
+}
+
+// 映射表块头
+static SnapMapHeader* snap_map(fs_instance* fs, unsigned int block) {
+    return (SnapMapHeader*)(fs->virtual_disk + (size_t)block * fs->block_size);
+}
+
+// 按名字查找快照，返回在snapshots中的下标，找不到返回-1
+static int snap_find(fs_instance* fs, const char* name) {
+    for (unsigned int i = 0; i < fs->snapshot_count; i++) {
+        if (strcmp(snap_info(fs, fs->snapshots[i])->name, name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// 丢弃内存中的全部快照状态（格式化、重新挂载和卸载时）
+static void snap_reset(fs_instance* fs) {
+    for (unsigned int i = 0; i < fs->snapshot_count; i++) {
+        free(fs->snap_held[i]);
+        fs->snap_held[i] = NULL;
+    }
+    fs->snapshot_count = 0;
+    free(fs->snap_cow);
+    free(fs->snap_refs);
+    fs->snap_cow = NULL;
+    fs->snap_refs = NULL;
+}
+
+// 第一个快照出现时分配引用计数和并集位图
+static int snap_setup(fs_instance* fs) {
+    if (fs->snap_refs != NULL) {
+        return FS_OK;
+    }
+    fs->snap_refs = (unsigned char*)calloc(fs->block_num, 1);
+    fs->snap_cow = (unsigned long long*)calloc(fs->bitmap_words, sizeof(unsigned long long));
+    if (fs->snap_refs == NULL || fs->snap_cow == NULL) {
+        free(fs->snap_refs);
+        free(fs->snap_cow);
+        fs->snap_refs = NULL;
+        fs->snap_cow = NULL;
+        return FS_ERR_NOMEM;
+    }
+    return FS_OK;
+}
+
+// 为快照占用一段连续的n个空闲块（不写FAT，引用计数由调用者设置），没有足够长的空闲段时返回0
+static unsigned int snap_claim(fs_instance* fs, unsigned int n) {
+    unsigned int len = 0;
+    unsigned int start = fs->free_block_count >= n ? find_free_run(fs, n, &len) : 0;
+    if (start == 0 || len < n) {
+        return 0;
+    }
+    for (unsigned int b = start; b < start + n; b++) {
+        fs->free_bitmap[b / 64] &= ~(1ULL << (b % 64));
+    }
+    fs->free_block_count -= n;
+    return start;
+}
+
+// 快照不再引用某块：引用计数减到0且FAT中也空闲时放回空闲位图
+static void snap_unref(fs_instance* fs, unsigned int block) {
+    if (--fs->snap_refs[block] == 0 && block >= fs->data_block && fat_get(fs, block) == 0) {
+        put_free(fs, block);
+    }
+}
+
+// 从映像读入[start, start+count)并清除这些块的脏块标记：快照专用的块不经过日志，
+// 重放可能用旧事务中的字节段覆盖了其中释放后又被快照重用的块，以映像中的内容为准
+static bool snap_read(fs_instance* fs, int fd, unsigned int start, unsigned int count) {
+    size_t bytes = (size_t)count * fs->block_size;
+    if (pread(fd, fs->virtual_disk + (size_t)start * fs->block_size, bytes, (off_t)start * fs->block_size) != (ssize_t)bytes) {
+        return false;
+    }
+    for (unsigned int b = start; b < start + count; b++) {
+        fs->dirty_bitmap[b / 64] &= ~(1ULL << (b % 64));
+    }
+    return true;
+}
+
+// 在快照i的映射表末尾追加一项，末块已满时接上新块（修改只在内存中，由调用者写入映像）
+static int snap_map_add(fs_instance* fs, unsigned int i, unsigned int block, unsigned int copy) {
+    SnapInfo* info = snap_info(fs, fs->snapshots[i]);
+    SnapMapHeader* tail = snap_map(fs, info->map_tail);
+    if (tail->count == SNAP_MAPS_PER_BLOCK) {
+        unsigned int next = snap_claim(fs, 1);
+        if (next == 0) {
+            return FS_ERR_NOSPC;
+        }
+        fs->snap_refs[next] = 1;
+        memset(snap_map(fs, next), 0, fs->block_size);
+        tail->next = next;
+        info->map_tail = next;
+        tail = snap_map(fs, next);
+    }
+    SnapMap* maps = (SnapMap*)(tail + 1);
+    maps[tail->count].block = block;
+    maps[tail->count].copy = copy;
+    tail->count++;
+    info->map_count++;
+    return FS_OK;
+}
+
+// 写时复制：脏块中仍由快照原地保存的块在写回映像前，先把映像中的旧内容复制到一个空闲块，
+// 副本落盘后再把（原块号，副本块号）记入各快照的映射表并落盘，之后调用者才能覆盖映像中的原块
+// 每块只在快照后第一次写回时复制一次；调用者独占实例（持有实例写锁，或在挂载、卸载过程中）
+static int snap_preserve(fs_instance* fs) {
+    if (fs->snapshot_count == 0) {
+        return FS_OK;
+    }
+
+    int fd = -1;
+    int ret = FS_OK;
+    unsigned int* copies = NULL;         // 依次为原块号和副本块号
+    unsigned int count = 0, cap = 0;
+    unsigned int len = 0;
+    for (unsigned int start = next_dirty_run(fs, 0, &len); start < fs->block_num && ret == FS_OK;
+         start = next_dirty_run(fs, start + len, &len)) {
+        for (unsigned int b = start; b < start + len; b++) {
+            if (!(fs->snap_cow[b / 64] & (1ULL << (b % 64)))) {
+                continue;
+            }
+            if (fd < 0 && (fd = open(fs->image_path, O_RDWR)) < 0) {
+                ret = FS_ERR_IO;
+                break;
+            }
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                unsigned int* grown = (unsigned int*)realloc(copies, cap * 2 * sizeof(unsigned int));
+                if (grown == NULL) {
+                    ret = FS_ERR_NOMEM;
+                    break;
+                }
+                copies = grown;
+            }
+            unsigned int copy = snap_claim(fs, 1);
+            if (copy == 0) {
+                ret = FS_ERR_NOSPC;
+                break;
+            }
+            // 副本同时放在虚拟磁盘中，回滚时直接从内存拷回
+            unsigned char* p = fs->virtual_disk + (size_t)copy * fs->block_size;
+            copies[count * 2] = b;
+            copies[count * 2 + 1] = copy;
+            count++;
+            if (pread(fd, p, fs->block_size, (off_t)b * fs->block_size) != (ssize_t)fs->block_size ||
+                !write_back_range(fs, fd, copy, 1)) {
+                ret = FS_ERR_IO;
+                break;
+            }
+        }
+    }
+    if (count > 0 && fdatasync(fd) != 0) {
+        ret = FS_ERR_IO;
+    }
+
+    // 记入映射表：先记下各快照原来的末块和项数，追加后从原来的末块写到新的末块
+    unsigned int from[MAX_SNAPSHOTS], mapped[MAX_SNAPSHOTS];
+    for (unsigned int i = 0; i < fs->snapshot_count; i++) {
+        from[i] = snap_info(fs, fs->snapshots[i])->map_tail;
+        mapped[i] = snap_info(fs, fs->snapshots[i])->map_count;
+    }
+    int map_ret = FS_OK;
+    for (unsigned int k = 0; k < count; k++) {
+        unsigned int b = copies[k * 2], copy = copies[k * 2 + 1];
+        bool still_held = false;
+        for (unsigned int i = 0; i < fs->snapshot_count && ret == FS_OK; i++) {
+            if (!(fs->snap_held[i][b / 64] & (1ULL << (b % 64)))) {
+                continue;
+            }
+            if (map_ret == FS_OK) {
+                map_ret = snap_map_add(fs, i, b, copy);
+            }
+            if (map_ret != FS_OK) {
+                still_held = true;
+                continue;
+            }
+            fs->snap_held[i][b / 64] &= ~(1ULL << (b % 64));
+            fs->snap_refs[copy]++;
+        }
+        if (ret == FS_OK && !still_held) {
+            fs->snap_cow[b / 64] &= ~(1ULL << (b % 64));
+        }
+        if (fs->snap_refs[copy] == 0) {
+            // 没有记入任何映射表的副本（复制或落盘失败）直接放回
+            put_free(fs, copy);
+        } else {
+            STAT_ADD(fs, snapshot_copies, 1);
+        }
+    }
+    if (ret == FS_OK && count > 0) {
+        for (unsigned int i = 0; i < fs->snapshot_count && ret == FS_OK; i++) {
+            SnapInfo* info = snap_info(fs, fs->snapshots[i]);
+            if (info->map_count == mapped[i]) {
+                continue;
+            }
+            for (unsigned int m = from[i]; m != 0 && ret == FS_OK; m = snap_map(fs, m)->next) {
+                if (!write_back_range(fs, fd, m, 1)) {
+                    ret = FS_ERR_IO;
+                }
+            }
+            if (ret == FS_OK && !write_back_range(fs, fd, fs->snapshots[i], 1)) {
+                ret = FS_ERR_IO;
+            }
+        }
+        if (ret == FS_OK && fdatasync(fd) != 0) {
+            ret = FS_ERR_IO;
+        }
+        if (ret == FS_OK) {
+            ret = map_ret;
+        }
+    }
+
+    free(copies);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+// 由各快照原地保存的块重新计算并集
+static void snap_rebuild_cow(fs_instance* fs) {
+    memset(fs->snap_cow, 0, fs->bitmap_words * sizeof(unsigned long long));
+    for (unsigned int i = 0; i < fs->snapshot_count; i++) {
+        for (unsigned int w = 0; w < fs->bitmap_words; w++) {
+            fs->snap_cow[w] |= fs->snap_held[i][w];
+        }
+    }
+}
+
+// 挂载时沿快照链读入各快照（重放日志之后、重建空闲位图之前调用）：
+// 描述块、占用块位图和映射表从映像读出，由它们重建引用计数、各快照原地保存的块和并集
+static int snap_load(fs_instance* fs) {
+    unsigned int chain[MAX_SNAPSHOTS];
+    unsigned int n = 0;
+    if (fs->super->snap_head == 0) {
+        return FS_OK;
+    }
+    int ret = snap_setup(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    int fd = open(fs->image_path, O_RDONLY);
+    if (fd < 0) {
+        return FS_ERR_IO;
+    }
+
+    // 链从新到旧，snapshots按创建先后排列
+    for (unsigned int block = fs->super->snap_head; block != 0 && ret == FS_OK; block = snap_info(fs, block)->next) {
+        if (n == MAX_SNAPSHOTS || block < fs->data_block || block >= fs->block_num) {
+            ret = FS_ERR_CORRUPT;
+        } else if (!snap_read(fs, fd, block, 1)) {
+            ret = FS_ERR_IO;
+        } else {
+            chain[n++] = block;
+        }
+    }
+
+    size_t bitmap_bytes = fs->bitmap_words * sizeof(unsigned long long);
+    for (unsigned int k = n; k > 0 && ret == FS_OK; k--) {
+        unsigned int desc = chain[k - 1];
+        SnapInfo* info = snap_info(fs, desc);
+        if (info->bitmap_start < fs->data_block || info->bitmap_blocks == 0 ||
+            info->bitmap_blocks > fs->block_num - info->bitmap_start ||
+            (size_t)info->bitmap_blocks * fs->block_size < bitmap_bytes) {
+            ret = FS_ERR_CORRUPT;
+            break;
+        }
+        unsigned long long* held = (unsigned long long*)malloc(bitmap_bytes);
+        if (held == NULL) {
+            ret = FS_ERR_NOMEM;
+            break;
+        }
+        fs->snapshots[fs->snapshot_count] = desc;
+        fs->snap_held[fs->snapshot_count] = held;
+        fs->snapshot_count++;
+        if (!snap_read(fs, fd, info->bitmap_start, info->bitmap_blocks)) {
+            ret = FS_ERR_IO;
+            break;
+        }
+        memcpy(held, fs->virtual_disk + (size_t)info->bitmap_start * fs->block_size, bitmap_bytes);
+        fs->snap_refs[desc]++;
+        for (unsigned int b = info->bitmap_start; b < info->bitmap_start + info->bitmap_blocks; b++) {
+            fs->snap_refs[b]++;
+        }
+        for (unsigned int b = 0; b < fs->block_num; b++) {
+            if (held[b / 64] & (1ULL << (b % 64))) {
+                fs->snap_refs[b]++;
+            }
+        }
+
+        // 已复制保存的块不再原地保存；副本被重放覆盖过时从映像重新读入
+        unsigned int total = 0;
+        for (unsigned int m = info->map_head; m != 0 && ret == FS_OK; m = snap_map(fs, m)->next) {
+            if (m < fs->data_block || m >= fs->block_num || !snap_read(fs, fd, m, 1)) {
+                ret = m < fs->data_block || m >= fs->block_num ? FS_ERR_CORRUPT : FS_ERR_IO;
+                break;
+            }
+            SnapMapHeader* header = snap_map(fs, m);
+            SnapMap* maps = (SnapMap*)(header + 1);
+            if (header->count > SNAP_MAPS_PER_BLOCK || ++total > fs->block_num) {
+                ret = FS_ERR_CORRUPT;
+                break;
+            }
+            fs->snap_refs[m]++;
+            for (unsigned int j = 0; j < header->count; j++) {
+                unsigned int b = maps[j].block, copy = maps[j].copy;
+                if (b >= fs->block_num || copy < fs->data_block || copy >= fs->block_num) {
+                    ret = FS_ERR_CORRUPT;
+                    break;
+                }
+                held[b / 64] &= ~(1ULL << (b % 64));
+                if (fs->snap_refs[copy]++ == 0 && (fs->dirty_bitmap[copy / 64] & (1ULL << (copy % 64))) &&
+                    !snap_read(fs, fd, copy, 1)) {
+                    ret = FS_ERR_IO;
+                    break;
+                }
+            }
+        }
+    }
+    close(fd);
+    if (ret == FS_OK) {
+        snap_rebuild_cow(fs);
+    }
+    return ret;
+}
+
+// 去掉快照i：放回只被它引用的块（调用者已把它从快照链中摘下并落盘）
+static void snap_drop(fs_instance* fs, unsigned int i) {
+    SnapInfo* info = snap_info(fs, fs->snapshots[i]);
+    const unsigned long long* used = (const unsigned long long*)(fs->virtual_disk + (size_t)info->bitmap_start * fs->block_size);
+    for (unsigned int m = info->map_head; m != 0;) {
+        SnapMapHeader* header = snap_map(fs, m);
+        SnapMap* maps = (SnapMap*)(header + 1);
+        for (unsigned int j = 0; j < header->count; j++) {
+            snap_unref(fs, maps[j].copy);
+        }
+        unsigned int next = header->next;
+        snap_unref(fs, m);
+        m = next;
+    }
+    for (unsigned int b = 0; b < fs->block_num; b++) {
+        if (used[b / 64] & (1ULL << (b % 64))) {
+            snap_unref(fs, b);
+        }
+    }
+    for (unsigned int b = info->bitmap_start; b < info->bitmap_start + info->bitmap_blocks; b++) {
+        snap_unref(fs, b);
+    }
+    snap_unref(fs, fs->snapshots[i]);
+
+    free(fs->snap_held[i]);
+    for (unsigned int k = i + 1; k < fs->snapshot_count; k++) {
+        fs->snapshots[k - 1] = fs->snapshots[k];
+        fs->snap_held[k - 1] = fs->snap_held[k];
+    }
+    fs->snapshot_count--;
+    fs->snap_held[fs->snapshot_count] = NULL;
+    if (fs->snapshot_count == 0) {
+        snap_reset(fs);
+    } else {
+        snap_rebuild_cow(fs);
+    }
+}
+
+// 创建快照：先做检查点使映像与内存一致，再记下此刻占用的块，写入描述块、占用块位图和空的映射表，
+// 最后把快照接到链头；不复制任何数据块，代价只与卷的块数（FAT和位图的大小）有关
+static int snap_create(fs_instance* fs, const char* name) {
+    if (snap_find(fs, name) >= 0) {
+        return FS_ERR_EXIST;
+    }
+    if (fs->snapshot_count == MAX_SNAPSHOTS) {
+        return FS_ERR_NOSPC;
+    }
+    int ret = journal_checkpoint(fs);
+    if (ret == FS_OK) {
+        ret = snap_setup(fs);
+    }
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    size_t bitmap_bytes = fs->bitmap_words * sizeof(unsigned long long);
+    unsigned int bitmap_blocks = (bitmap_bytes + fs->block_size - 1) / fs->block_size;
+    unsigned long long* held = (unsigned long long*)calloc(fs->bitmap_words, sizeof(unsigned long long));
+    unsigned int bitmap = 0, desc = 0, map = 0;
+    if (held == NULL) {
+        ret = FS_ERR_NOMEM;
+    } else if ((bitmap = snap_claim(fs, bitmap_blocks)) == 0 || (desc = snap_claim(fs, 1)) == 0 ||
+               (map = snap_claim(fs, 1)) == 0) {
+        ret = FS_ERR_NOSPC;
+    }
+
+    if (ret == FS_OK) {
+        // 超级块、FAT区、根目录和FAT中已占用的块
+        for (unsigned int b = 0; b < fs->block_num; b++) {
+            if (b < fs->data_block || fat_get(fs, b) != 0) {
+                held[b / 64] |= 1ULL << (b % 64);
+            }
+        }
+        unsigned char* p = fs->virtual_disk + (size_t)bitmap * fs->block_size;
+        memset(p, 0, (size_t)bitmap_blocks * fs->block_size);
+        memcpy(p, held, bitmap_bytes);
+
+        SnapInfo* info = snap_info(fs, desc);
+        memset(info, 0, fs->block_size);
+        strcpy(info->name, name);
+        info->next = fs->super->snap_head;
+        info->create_time = time(NULL);
+        info->bitmap_start = bitmap;
+        info->bitmap_blocks = bitmap_blocks;
+        info->map_head = map;
+        info->map_tail = map;
+        memset(snap_map(fs, map), 0, fs->block_size);
+
+        int fd = open(fs->image_path, O_WRONLY);
+        if (fd < 0 || !write_back_range(fs, fd, bitmap, bitmap_blocks) || !write_back_range(fs, fd, desc, 1) ||
+            !write_back_range(fs, fd, map, 1) || fdatasync(fd) != 0) {
+            ret = FS_ERR_IO;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    if (ret != FS_OK) {
+        // 占用的块在FAT中仍是空闲的，直接放回
+        for (unsigned int b = bitmap; bitmap != 0 && b < bitmap + bitmap_blocks; b++) {
+            put_free(fs, b);
+        }
+        if (desc != 0) {
+            put_free(fs, desc);
+        }
+        if (map != 0) {
+            put_free(fs, map);
+        }
+        free(held);
+        if (fs->snapshot_count == 0) {
+            snap_reset(fs);
+        }
+        return ret;
+    }
+
+    for (unsigned int b = bitmap; b < bitmap + bitmap_blocks; b++) {
+        fs->snap_refs[b] = 1;
+    }
+    fs->snap_refs[desc] = 1;
+    fs->snap_refs[map] = 1;
+    for (unsigned int w = 0; w < fs->bitmap_words; w++) {
+        fs->snap_cow[w] |= held[w];
+        for (unsigned long long bits = held[w]; bits != 0; bits &= bits - 1) {
+            fs->snap_refs[w * 64 + __builtin_ctzll(bits)]++;
+        }
+    }
+    fs->snapshots[fs->snapshot_count] = desc;
+    fs->snap_held[fs->snapshot_count] = held;
+    fs->snapshot_count++;
+
+    // 快照链头随超级块记入日志；超级块本身也由新快照原地保存，这次检查点就会复制它
+    fs->super->snap_head = desc;
+    mark_meta(fs, fs->super, sizeof(SuperBlock));
+    return journal_checkpoint(fs);
+}
+
+// 回滚到快照i：先做检查点，再把快照映射表中的副本拷回原块（整块记入日志，一个事务完成），
+// 由恢复后的FAT重建空闲位图；快照之后新建的快照都保留，快照i本身也保留，可以再次回滚
+// 调用者独占实例且没有打开的文件；当前目录回到根目录
+static int snap_rollback(fs_instance* fs, unsigned int i) {
+    int ret = journal_checkpoint(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    SnapInfo* info = snap_info(fs, fs->snapshots[i]);
+    for (unsigned int m = info->map_head; m != 0; m = snap_map(fs, m)->next) {
+        SnapMapHeader* header = snap_map(fs, m);
+        SnapMap* maps = (SnapMap*)(header + 1);
+        for (unsigned int j = 0; j < header->count; j++) {
+            unsigned char* dst = fs->virtual_disk + (size_t)maps[j].block * fs->block_size;
+            memcpy(dst, fs->virtual_disk + (size_t)maps[j].copy * fs->block_size, fs->block_size);
+            mark_meta(fs, dst, fs->block_size);
+        }
+    }
+    // 恢复的超级块是创建快照前的，快照链头仍用当前的
+    fs->super->snap_head = fs->snapshots[fs->snapshot_count - 1];
+    mark_meta(fs, fs->super, sizeof(SuperBlock));
+
+    rebuild_free_map(fs);
+    fs->small_hint = 0;
+    fs->small_scanned = false;
+    fs->trunc_gen++;
+    dcache_clear(fs);
+    strcpy(fs->current_dir, "/");
+    fs->current_dir_block = fs->root_block;
+    return journal_checkpoint(fs);
+}
+
+// 删除快照i：先把它从快照链中摘下并落盘，再放回只被它引用的块
+static int snap_delete(fs_instance* fs, unsigned int i) {
+    unsigned int desc = fs->snapshots[i];
+    unsigned int older = snap_info(fs, desc)->next;
+    int ret;
+    if (i == fs->snapshot_count - 1) {
+        fs->super->snap_head = older;
+        mark_meta(fs, fs->super, sizeof(SuperBlock));
+        ret = journal_checkpoint(fs);
+        if (ret != FS_OK) {
+            fs->super->snap_head = desc;
+            return ret;
+        }
+    } else {
+        unsigned int newer = fs->snapshots[i + 1];
+        snap_info(fs, newer)->next = older;
+        int fd = open(fs->image_path, O_WRONLY);
+        ret = fd >= 0 && write_back_range(fs, fd, newer, 1) && fdatasync(fd) == 0 ? FS_OK : FS_ERR_IO;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (ret != FS_OK) {
+            snap_info(fs, newer)->next = desc;
+            return ret;
+        }
+    }
+
+    snap_drop(fs, i);
+    // 使用日志时放回的块提交后才能分配，立即提交一次
+    return journal_commit(fs);
+}
+
+/* 碎片整理：把文件的块搬到一段连续块中，把目录的有效项紧凑排列并使目录链连续 */
+
+// 从数据区开头起查找并占用一段连续的n个空闲块，找不到足够长的空闲段时返回0
+// 从开头找使整理后的文件向数据区前部聚拢，空闲块留在后部连成大段
+static unsigned int claim_contiguous(fs_instance* fs, unsigned int n, bool link) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    unsigned int start = 0, len = 0;
+    if (fs->free_block_count >= n) {
+        fs->alloc_hint = fs->data_block;
+        start = find_free_run(fs, n, &len);
+        if (start != 0 && len >= n) {
+            claim_range(fs, start, n, link);
+        } else {
+            start = 0;
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    // 使用日志时刚释放的块要等提交后才能重用，提交后再试一次
+    if (start == 0 && fs->pending_free_count > 0 && journal_commit(fs) == FS_OK) {
+        return claim_contiguous(fs, n, link);
+    }
+    return start;
+}
+
+// 统计FAT链的块数和物理连续段数
+static void chain_runs(fs_instance* fs, unsigned int block, unsigned long long* blocks, unsigned long long* runs) {
+    unsigned int prev = 0;
+    for (; block != EOF_BLOCK && block != 0; block = fat_get(fs, block)) {
+        if (block != prev + 1) {
+            (*runs)++;
+        }
+        (*blocks)++;
+        prev = block;
+    }
+}
+
+// 统计区段布局文件的数据块数和物理连续段数（首尾相接的区段算作一段）
+static void extent_runs(fs_instance* fs, unsigned int meta_block, unsigned long long* blocks, unsigned long long* runs) {
+    unsigned int prev_end = 0;
+    for (unsigned int blk = meta_block; blk != 0; blk = extent_header(fs, blk)->next) {
+        ExtentHeader* header = extent_header(fs, blk);
+        Extent* extents = extent_array(header);
+        for (unsigned int i = 0; i < header->count; i++) {
+            if (extents[i].start != prev_end) {
+                (*runs)++;
+            }
+            *blocks += extents[i].length;
+            prev_end = extents[i].start + extents[i].length;
+        }
+    }
+}
+
+// 把分散的FAT链文件整体搬到一段连续块中，首块号随之改变，返回是否搬动
+static bool defrag_fat_file(fs_instance* fs, DirEntry* entry) {
+    unsigned long long blocks = 0, runs = 0;
+    chain_runs(fs, entry->first_block, &blocks, &runs);
+    if (runs <= 1) {
+        return false;
+    }
+    unsigned int start = claim_contiguous(fs, blocks, true);
+    if (start == 0) {
+        return false;
+    }
+
+    unsigned int old_first = entry->first_block;
+    unsigned int dst = start;
+    for (unsigned int src = old_first; src != EOF_BLOCK; src = fat_get(fs, src), dst++) {
+        memcpy(block_ptr(fs, dst), block_ptr(fs, src), fs->block_size);
+    }
+    mark_dirty_blocks(fs, start, blocks);
+    entry->first_block = start;
+    mark_meta(fs, &entry->first_block, sizeof(entry->first_block));
+    free_chain(fs, old_first);
+
+    // 打开着的描述符改用新的首块（调用者独占实例）
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        OpenFileEntry* file = &fs->open_file_table[i];
+        if (file->is_used && file->first_block == old_first) {
+            file->first_block = start;
+            reset_file_cursor(file);
+        }
+    }
+    return true;
+}
+
+// 把区段布局文件的数据块依次搬到一段连续块中，区段表块（首块）不动，返回是否搬动
+// 区段表就地改写：逻辑上相接的区段搬动后物理上也相接，合并为一个（写位置不会超过读位置），
+// 空洞保持不分配，合并后多出来的溢出块释放
+static bool defrag_extent_file(fs_instance* fs, DirEntry* entry) {
+    unsigned long long blocks = 0, runs = 0;
+    extent_runs(fs, entry->first_block, &blocks, &runs);
+    // 搬动会给共享的块各复制一份，去重省下的空间又被占回去，因此不搬动有共享块的文件
+    if (runs <= 1 || extent_shared(fs, entry->first_block)) {
+        return false;
+    }
+    unsigned int start = claim_contiguous(fs, blocks, false);
+    if (start == 0) {
+        return false;
+    }
+
+    ExtentHeader* head = extent_header(fs, entry->first_block);
+    unsigned int out_block = entry->first_block;
+    ExtentHeader* out = head;
+    unsigned int out_count = 0;
+    Extent* prev = NULL;
+    unsigned int dst = start;
+    for (unsigned int blk = entry->first_block; blk != 0; ) {
+        ExtentHeader* header = extent_header(fs, blk);
+        Extent* extents = extent_array(header);
+        unsigned int count = header->count;
+        unsigned int next = header->next;
+        for (unsigned int i = 0; i < count; i++) {
+            Extent cur = extents[i];
+            memcpy(block_ptr(fs, dst), block_ptr(fs, cur.start), (size_t)cur.length * fs->block_size);
+            for (unsigned int j = 0; j < cur.length; j++) {
+                free_block(fs, cur.start + j);
+            }
+            cur.start = dst;
+            dst += cur.length;
+
+            if (prev != NULL && prev->logical + prev->length == cur.logical &&
+                prev->length + cur.length <= MAX_EXTENT_LENGTH) {
+                prev->length += cur.length;
+                continue;
+            }
+            if (out_count == (unsigned int)EXTENTS_PER_BLOCK) {
+                out->count = out_count;
+                out_block = out->next;
+                out = extent_header(fs, out_block);
+                out_count = 0;
+            }
+            prev = &extent_array(out)[out_count++];
+            *prev = cur;
+        }
+        blk = next;
+    }
+    mark_dirty_blocks(fs, start, blocks);
+
+    // 截断区段表，释放多出来的溢出块
+    out->count = out_count;
+    unsigned int spare = out->next;
+    out->next = 0;
+    head->tail = out_block;
+    while (spare != 0) {
+        unsigned int next = extent_header(fs, spare)->next;
+        free_block(fs, spare);
+        spare = next;
+    }
+    for (unsigned int blk = entry->first_block; blk != 0; blk = extent_header(fs, blk)->next) {
+        mark_meta(fs, extent_header(fs, blk), fs->block_size);
+    }
+
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        OpenFileEntry* file = &fs->open_file_table[i];
+        if (file->is_used && file->first_block == entry->first_block) {
+            reset_file_cursor(file);
+        }
+    }
+    return true;
+}
+
+// 紧凑排列目录的有效项：首块不动（"."、".."、父目录中的目录项和当前目录都指向它），
+// 其余项依次填入首块和新申请的一段连续块，释放原来的后续块并重建索引；返回是否改动
+// 打开着的文件的目录项位置随之更新
+static bool defrag_dir(fs_instance* fs, unsigned int dir_block) {
+    int per_block = DIR_ENTRIES_PER_BLOCK;
+    unsigned long long blocks = 0, runs = 0;
+    chain_runs(fs, dir_block, &blocks, &runs);
+    if (blocks <= 1) {
+        return false;
+    }
+
+    // 收集有效项及其原位置
+    unsigned int used = 0;
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < per_block; i++) {
+            if (entries[i].filename[0] != '\0') {
+                used++;
+            }
+        }
+    }
+    unsigned int need = (used + 2 + per_block - 1) / per_block;
+    unsigned int second = fat_get(fs, dir_block);
+    unsigned long long rest_blocks = 0, rest_runs = 0;
+    chain_runs(fs, second, &rest_blocks, &rest_runs);
+    if (need == blocks && rest_runs <= 1) {
+        return false;
+    }
+
+    DirEntry* saved = (DirEntry*)malloc((size_t)(used > 0 ? used : 1) * sizeof(DirEntry));
+    unsigned int* old_locs = (unsigned int*)malloc((size_t)(used > 0 ? used : 1) * sizeof(unsigned int));
+    unsigned int rest = need > 1 ? claim_contiguous(fs, need - 1, true) : 0;
+    if (saved == NULL || old_locs == NULL || (need > 1 && rest == 0)) {
+        free(saved);
+        free(old_locs);
+        if (rest != 0) {
+            free_chain(fs, rest);
+        }
+        return false;
+    }
+
+    unsigned int n = 0;
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < per_block; i++) {
+            if (entries[i].filename[0] != '\0') {
+                saved[n] = entries[i];
+                old_locs[n] = entry_loc(fs, &entries[i]);
+                n++;
+            }
+        }
+    }
+
+    // 重新排列：首块从第3项开始，之后是新申请的连续块
+    DirEntry* first = dir_entries(fs, dir_block);
+    memset(&first[2], 0, (size_t)(per_block - 2) * sizeof(DirEntry));
+    mark_meta(fs, first, fs->block_size);
+    for (unsigned int b = 0; b + 1 < need; b++) {
+        memset(dir_entries(fs, rest + b), 0, fs->block_size);
+        mark_meta(fs, dir_entries(fs, rest + b), fs->block_size);
+    }
+    for (unsigned int k = 0; k < n; k++) {
+        unsigned int slot = k + 2;
+        DirEntry* dest = slot < (unsigned int)per_block ? &first[slot]
+                                                      : &dir_entries(fs, rest + slot / per_block - 1)[slot % per_block];
+        *dest = saved[k];
+        unsigned int loc = entry_loc(fs, dest);
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            OpenFileEntry* file = &fs->open_file_table[i];
+            if (file->is_used && file->dir_block == dir_block && file->entry_loc == old_locs[k]) {
+                file->entry_loc = loc;
+            }
+        }
+    }
+    free(saved);
+    free(old_locs);
+
+    // 换上新的后续块，释放原来的
+    fat_set(fs, dir_block, need > 1 ? rest : EOF_BLOCK);
+    if (second != EOF_BLOCK) {
+        free_chain(fs, second);
+    }
+
+    // 项的位置都变了：重建索引（只剩一块时去掉索引），丢弃以该目录为父目录的缓存
+    dcache_purge_dir(fs, dir_block);
+    if (need > 1) {
+        dir_build_index(fs, dir_block);
+    } else if (first[0].index_block != 0) {
+        free_chain(fs, first[0].index_block);
+        first[0].index_block = 0;
+        mark_meta(fs, &first[0], sizeof(DirEntry));
+    }
+    return true;
+}
+
+// 遍历目录树：moved为NULL时只统计碎片情况，否则先整理目录本身，再整理其中的文件并递归进入子目录
+// 调用者独占实例（持有实例写锁和所有打开文件表项的锁）
+static void defrag_walk(fs_instance* fs, unsigned int dir_block, int depth, FsFragStat* st, unsigned int* moved) {
+    if (depth > MAX_PATH_LENGTH / 2) {
+        return;
+    }
+    if (moved != NULL && defrag_dir(fs, dir_block)) {
+        (*moved)++;
+    }
+    if (st != NULL) {
+        st->dirs++;
+        chain_runs(fs, dir_block, &st->dir_blocks, &st->dir_runs);
+    }
+
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < DIR_ENTRIES_PER_BLOCK; i++) {
+            DirEntry* entry = &entries[i];
+            if (entry->filename[0] == '\0') {
+                continue;
+            }
+            if (entry->attr.is_dir) {
+                defrag_walk(fs, entry->first_block, depth + 1, st, moved);
+                continue;
+            }
+            // 内联文件的内容在小文件块中，没有可整理的块
+            if (entry->attr.inline_data) {
+                if (st != NULL) {
+                    st->files++;
+                    st->inline_files++;
+                }
+                continue;
+            }
+            if (moved != NULL && (entry->attr.extents ? defrag_extent_file(fs, entry) : defrag_fat_file(fs, entry))) {
+                (*moved)++;
+            }
+            if (st != NULL) {
+                unsigned long long blocks = 0, runs = 0;
+                if (entry->attr.extents) {
+                    extent_runs(fs, entry->first_block, &blocks, &runs);
+                } else {
+                    chain_runs(fs, entry->first_block, &blocks, &runs);
+                }
+                st->files++;
+                if (runs > 1) {
+                    st->fragmented_files++;
+                }
+                st->file_blocks += blocks;
+                st->file_runs += runs;
+            }
+        }
+    }
+}
+
+/* 去重：按内容哈希找出相同的数据块，改为共享同一块 */
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// 块内容的64位哈希：每32字节分成4个8字节的字，分别累加到4路（乘法和循环移位），各路之间没有依赖，
+// 编译器展开后可以交错执行或向量化，比逐字节计算的FNV-1a快得多；块大小总是32的倍数
+static unsigned long long block_hash(const unsigned char* data, size_t len) {
+    const unsigned long long p1 = 0x9E3779B185EBCA87ULL;
+    const unsigned long long p2 = 0xC2B2AE3D27D4EB4FULL;
+    unsigned long long lane[4] = {p1 + p2, p2, 0, 0 - p1};
+    for (size_t i = 0; i < len; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            unsigned long long word;
+            memcpy(&word, data + i + k * 8, sizeof(word));
+            lane[k] = rotl64(lane[k] + word * p2, 31) * p1;
+        }
+    }
+    unsigned long long h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18) + len;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p1;
+    return h ^ (h >> 32);
+}
+
+// 对区段布局文件的第lblock块（物理块为block）去重，返回是否改写了区段表
+// 内容第一次出现时记入索引；与索引中的块逐字节相同时改为共享那一块，原来的块释放一次（共享的块只减少计数）
+static bool dedup_block(fs_instance* fs, unsigned int meta_block, unsigned int lblock, unsigned int block,
+                        DedupSlot* slots, unsigned int mask, FsDedupStat* st) {
+    const unsigned char* data = block_ptr(fs, block);
+    unsigned long long hash = block_hash(data, fs->block_size);
+    unsigned int i = (unsigned int)hash & mask;
+    while (slots[i].block != 0 && slots[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    DedupSlot* slot = &slots[i];
+    if (slot->block == 0) {
+        slot->hash = hash;
+        slot->block = block;
+        return false;
+    }
+
+    // 已经共享同一块，或哈希相同而内容不同
+    unsigned int same = slot->block;
+    if (same == block || memcmp(block_ptr(fs, same), data, fs->block_size) != 0) {
+        return false;
+    }
+    // 共享计数已满，之后相同的内容改为共享这一块
+    if (block_refs(fs, same) == MAX_BLOCK_REFS) {
+        if (block_refs(fs, block) < MAX_BLOCK_REFS) {
+            slot->block = block;
+        }
+        return false;
+    }
+    if (extent_remap(fs, meta_block, lblock, 1, same) != 0) {
+        return false;
+    }
+    if (block_refs(fs, same) == 1) {
+        __atomic_add_fetch(&fs->shared_blocks, 1, __ATOMIC_RELAXED);
+    }
+    fat_set(fs, same, fat_get(fs, same) - 1);
+    if (block_refs(fs, block) == 1) {
+        st->blocks_reclaimed++;
+    }
+    free_block(fs, block);
+    st->blocks_shared++;
+    return true;
+}
+
+// 对区段布局文件去重：只看文件大小以内的块（预留的块和空洞不算），改写区段表后从下一块起重新查找区段
+static void dedup_file(fs_instance* fs, DirEntry* entry, DedupSlot* slots, unsigned int mask, FsDedupStat* st) {
+    unsigned int meta_block = entry->first_block;
+    unsigned int blocks = (unsigned int)(((unsigned long long)entry->file_size + fs->block_size - 1) / fs->block_size);
+    unsigned int lblock = 0;
+    while (lblock < blocks) {
+        unsigned int hole;
+        Extent* found = extent_find(fs, meta_block, lblock, &hole);
+        if (found == NULL) {
+            lblock = hole < blocks - lblock ? lblock + hole : blocks;
+            continue;
+        }
+        unsigned int end = found->logical + found->length < blocks ? found->logical + found->length : blocks;
+        bool remapped = false;
+        while (lblock < end && !remapped) {
+            remapped = dedup_block(fs, meta_block, lblock, found->start + (lblock - found->logical), slots, mask, st);
+            st->blocks_scanned++;
+            lblock++;
+        }
+    }
+}
+
+// 递归遍历目录树，对每个区段布局的文件去重（调用者独占实例）
+static void dedup_walk(fs_instance* fs, unsigned int dir_block, int depth, DedupSlot* slots, unsigned int mask, FsDedupStat* st) {
+    if (depth > MAX_PATH_LENGTH / 2) {
+        return;
+    }
+    for (unsigned int blk = dir_block; blk != EOF_BLOCK; blk = fat_get(fs, blk)) {
+        DirEntry* entries = dir_entries(fs, blk);
+        for (int i = (blk == dir_block ? 2 : 0); i < DIR_ENTRIES_PER_BLOCK; i++) {
+            DirEntry* entry = &entries[i];
+            if (entry->filename[0] == '\0' || entry->attr.inline_data) {
+                continue;
+            }
+            if (entry->attr.is_dir) {
+                dedup_walk(fs, entry->first_block, depth + 1, slots, mask, st);
+            } else if (entry->attr.extents) {
+                st->files++;
+                dedup_file(fs, entry, slots, mask, st);
+            } else {
+                st->skipped_files++;
+            }
+        }
+    }
+}
+
+/* 一致性检查：遍历目录树，把每个结构用到的块和槽记下来，最后逐块与FAT对照 */
+
+// 记一个问题，fixed为true时同时记为已修复
+static void fsck_problem(FsckState* ck, unsigned int* field, bool fixed) {
+    __atomic_add_fetch(field, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ck->st.problems, 1, __ATOMIC_RELAXED);
+    if (fixed) {
+        __atomic_add_fetch(&ck->st.repaired, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// 块号是否落在数据区内
+static inline bool fsck_data_block(fs_instance* fs, unsigned int block) {
+    return block >= fs->data_block && block < fs->block_num;
+}
+
+// 独占一个块，已被其他结构占用时返回false
+static bool fsck_own(FsckState* ck, unsigned int block) {
+    unsigned long long bit = 1ULL << (block % 64);
+    return !(__atomic_fetch_or(&ck->owned[block / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// 放回占用的块（修复时去掉一个结构后调用，此时只有一个线程）
+static void fsck_disown(FsckState* ck, unsigned int block) {
+    ck->owned[block / 64] &= ~(1ULL << (block % 64));
+}
+
+// 区段布局的数据块多一处引用（到255为止）
+static void fsck_ref(FsckState* ck, unsigned int block) {
+    unsigned char old = __atomic_load_n(&ck->refs[block], __ATOMIC_RELAXED);
+    while (old < 255 && !__atomic_compare_exchange_n(&ck->refs[block], &old, old + 1, false,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static int block_cmp(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 在升序的块号数组中二分查找，返回下标，找不到返回-1
+static int fsck_find(const unsigned int* sorted, unsigned int count, unsigned int block) {
+    unsigned int lo = 0, hi = count;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (sorted[mid] < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < count && sorted[lo] == block ? (int)lo : -1;
+}
+
+// 沿FAT链占用first（已由调用者占用）之后的各块，返回链的块数并通过last返回最后一块
+// 下一块越界、是无效的值或已被占用（成环或与其他链交叉）时链在此断开，修复时把这一块改为链尾
+// 下一块在FAT中空闲时也在此停止，由最后一遍按"被引用的空闲块"处理
+static unsigned int fsck_chain(FsckState* ck, unsigned int first, unsigned int* last) {
+    fs_instance* fs = ck->fs;
+    unsigned int count = 1;
+    unsigned int block = first;
+    while (1) {
+        FAT_ENTRY next = fat_get(fs, block);
+        if (next == EOF_BLOCK || next == 0) {
+            break;
+        }
+        if (!fsck_data_block(fs, next) || !fsck_own(ck, next)) {
+            fsck_problem(ck, &ck->st.chain_errors, ck->repair);
+            if (ck->repair) {
+                fat_set(fs, block, EOF_BLOCK);
+            }
+            break;
+        }
+        block = next;
+        count++;
+    }
+    *last = block;
+    return count;
+}
+
+// 把目录压入待检查的栈，唤醒一个等待的线程
+static void fsck_push(FsckState* ck, unsigned int block, unsigned int parent) {
+    pthread_mutex_lock(&ck->lock);
+    if (ck->stack_count == ck->stack_cap) {
+        unsigned int cap = ck->stack_cap ? ck->stack_cap * 2 : 256;
+        FsckDir* stack = (FsckDir*)realloc(ck->stack, cap * sizeof(FsckDir));
+        if (stack == NULL) {
+            ck->failed = true;
+            pthread_mutex_unlock(&ck->lock);
+            return;
+        }
+        ck->stack = stack;
+        ck->stack_cap = cap;
+    }
+    ck->stack[ck->stack_count].block = block;
+    ck->stack[ck->stack_count].parent = parent;
+    ck->stack_count++;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// 修复时记下改动过的目录，检查结束后重建其索引（内存不足时不重建，索引中失效的项查找时会被跳过）
+static void fsck_reindex(FsckState* ck, unsigned int dir_block) {
+    if (ck->reindex_count == ck->reindex_cap) {
+        unsigned int cap = ck->reindex_cap ? ck->reindex_cap * 2 : 64;
+        unsigned int* list = (unsigned int*)realloc(ck->reindex, cap * sizeof(unsigned int));
+        if (list == NULL) {
+            return;
+        }
+        ck->reindex = list;
+        ck->reindex_cap = cap;
+    }
+    ck->reindex[ck->reindex_count++] = dir_block;
+}
+
+// 修复时把文件清空为不占用任何块的内联文件（内容已无法找回，名字保留）
+static void fsck_empty_file(FsckState* ck, DirEntry* entry) {
+    if (!ck->repair) {
+        return;
+    }
+    entry->attr.inline_data = 1;
+    entry->first_block = 0;
+    entry->index_block = 0;
+    entry->file_size = 0;
+    mark_meta(ck->fs, entry, sizeof(DirEntry));
+}
+
+// 检查内联文件：槽位须在小文件块链中的某一块内，且不与其他内联文件重叠
+static void fsck_inline(FsckState* ck, DirEntry* entry) {
+    fs_instance* fs = ck->fs;
+    if (entry->first_block == 0) {
+        if (entry->file_size != 0 || entry->index_block != 0) {
+            fsck_problem(ck, &ck->st.size_errors, ck->repair);
+            fsck_empty_file(ck, entry);
+        }
+        return;
+    }
+
+    unsigned int slot = entry->index_block & 0xFFFF;
+    unsigned int n = entry->index_block >> 16;
+    unsigned int meta_slots = (SMALL_META_BYTES + SMALL_SLOT_SIZE - 1) / SMALL_SLOT_SIZE;
+    int i = fsck_find(ck->small_blocks, ck->small_count, entry->first_block);
+    if (i < 0 || n == 0 || n > SMALL_MAX_SLOTS || slot < meta_slots || slot + n > SMALL_SLOTS) {
+        fsck_problem(ck, &ck->st.bad_entries, ck->repair);
+        fsck_empty_file(ck, entry);
+        return;
+    }
+
+    // 占用槽位，与其他内联文件重叠时清空这个文件（修复时先放回刚占用的槽）
+    unsigned long long* used = ck->small_used + (size_t)i * ck->small_words;
+    for (unsigned int k = slot; k < slot + n; k++) {
+        unsigned long long bit = 1ULL << (k % 64);
+        if (__atomic_fetch_or(&used[k / 64], bit, __ATOMIC_RELAXED) & bit) {
+            fsck_problem(ck, &ck->st.cross_links, ck->repair);
+            if (ck->repair) {
+                for (unsigned int j = slot; j < k; j++) {
+                    used[j / 64] &= ~(1ULL << (j % 64));
+                }
+                fsck_empty_file(ck, entry);
+            }
+            return;
+        }
+    }
+    if (entry->file_size > n * SMALL_SLOT_SIZE) {
+        fsck_problem(ck, &ck->st.size_errors, ck->repair);
+        if (ck->repair) {
+            entry->file_size = n * SMALL_SLOT_SIZE;
+            mark_meta(fs, entry, sizeof(DirEntry));
+        }
+    }
+}
+
+// 检查FAT链布局的文件（首块已占用）：链的块数须能容纳文件大小，预留的块可以更多；修复时按链长截短文件
+static void fsck_fat_file(FsckState* ck, DirEntry* entry) {
+    fs_instance* fs = ck->fs;
+    unsigned int last;
+    unsigned int count = fsck_chain(ck, entry->first_block, &last);
+    unsigned long long need = ((unsigned long long)entry->file_size + fs->block_size - 1) / fs->block_size;
+    if (need > count) {
+        fsck_problem(ck, &ck->st.size_errors, ck->repair);
+        if (ck->repair) {
+            entry->file_size = count * fs->block_size;
+            mark_meta(fs, entry, sizeof(DirEntry));
+        }
+    }
+}
+
+// 检查区段布局文件的区段表（首块已占用），记下各数据块的引用
+// 区段须落在数据区内、按逻辑块号升序且不重叠；溢出块须有效且未被占用，空的区段表块只能是最后一块
+// （extent_remap会预先接上一个空的溢出块），首块的tail须指向最后一块；修复时去掉无效的区段并截断溢出链
+static void fsck_extents(FsckState* ck, DirEntry* entry) {
+    fs_instance* fs = ck->fs;
+    unsigned int meta_block = entry->first_block;
+    ExtentHeader* head = extent_header(fs, meta_block);
+    unsigned long long prev_end = 0;
+    unsigned int last = meta_block;
+
+    for (unsigned int blk = meta_block; blk != 0; ) {
+        ExtentHeader* header = extent_header(fs, blk);
+        FAT_ENTRY value = fat_get(fs, blk);
+        if (value != EOF_BLOCK && value != 0) {
+            fsck_problem(ck, &ck->st.extent_errors, ck->repair);
+            if (ck->repair) {
+                fat_set(fs, blk, EOF_BLOCK);
+            }
+        }
+        if (header->count > (unsigned int)EXTENTS_PER_BLOCK) {
+            fsck_problem(ck, &ck->st.extent_errors, ck->repair);
+            if (ck->repair) {
+                header->count = EXTENTS_PER_BLOCK;
+                mark_meta(fs, header, sizeof(ExtentHeader));
+            }
+        }
+
+        Extent* extents = extent_array(header);
+        unsigned int count = header->count < (unsigned int)EXTENTS_PER_BLOCK ? header->count : EXTENTS_PER_BLOCK;
+        unsigned int kept = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            Extent cur = extents[i];
+            if (cur.length == 0 || cur.length > MAX_EXTENT_LENGTH || cur.start < fs->data_block ||
+                (unsigned long long)cur.start + cur.length > fs->block_num || cur.logical < prev_end ||
+                (unsigned long long)cur.logical + cur.length > 0x100000000ULL) {
+                fsck_problem(ck, &ck->st.extent_errors, ck->repair);
+                continue;
+            }
+            for (unsigned int j = 0; j < cur.length; j++) {
+                fsck_ref(ck, cur.start + j);
+            }
+            prev_end = (unsigned long long)cur.logical + cur.length;
+            extents[kept++] = cur;
+        }
+        if (ck->repair && kept != count) {
+            header->count = kept;
+            mark_meta(fs, header, fs->block_size);
+        }
+
+        unsigned int next = header->next;
+        if (next != 0 && (!fsck_data_block(fs, next) || !fsck_own(ck, next))) {
+            fsck_problem(ck, &ck->st.extent_errors, ck->repair);
+            next = 0;
+            if (ck->repair) {
+                header->next = 0;
+                mark_meta(fs, header, sizeof(ExtentHeader));
+            }
+        }
+
+        // 查找区段时遇到空块就停止，其后的区段会找不到：修复时把下一块的内容搬进来，再检查一遍这一块
+        if (next != 0 && header->count == 0) {
+            fsck_problem(ck, &ck->st.extent_errors, ck->repair);
+            if (ck->repair) {
+                ExtentHeader* src = extent_header(fs, next);
+                unsigned int src_count = src->count < (unsigned int)EXTENTS_PER_BLOCK ? src->count : EXTENTS_PER_BLOCK;
+                memcpy(extents, extent_array(src), (size_t)src_count * sizeof(Extent));
+                header->count = src_count;
+                header->next = src->next;
+                mark_meta(fs, header, fs->block_size);
+                fsck_disown(ck, next);
+                continue;
+            }
+        }
+        last = blk;
+        blk = next;
+    }
+
+    if (head->tail != last && !(head->tail == 0 && last == meta_block)) {
+        fsck_problem(ck, &ck->st.extent_errors, ck->repair);
+        if (ck->repair) {
+            head->tail = last;
+            mark_meta(fs, head, sizeof(ExtentHeader));
+        }
+    }
+}
+
+// 检查一个文件的目录项和它占用的块或槽
+static void fsck_file(FsckState* ck, DirEntry* entry) {
+    fs_instance* fs = ck->fs;
+    __atomic_add_fetch(&ck->st.files, 1, __ATOMIC_RELAXED);
+    if (entry->attr.inline_data) {
+        fsck_inline(ck, entry);
+        return;
+    }
+    if (!fsck_data_block(fs, entry->first_block)) {
+        fsck_problem(ck, &ck->st.bad_entries, ck->repair);
+        fsck_empty_file(ck, entry);
+        return;
+    }
+    if (!fsck_own(ck, entry->first_block)) {
+        fsck_problem(ck, &ck->st.cross_links, ck->repair);
+        fsck_empty_file(ck, entry);
+        return;
+    }
+    if (entry->attr.extents) {
+        fsck_extents(ck, entry);
+    } else {
+        fsck_fat_file(ck, entry);
+    }
+}
+
+// 目录项的名字是否有效：在名字长度内结束、不含'/'，也不是"."或".."
+static bool fsck_name_ok(const DirEntry* entry) {
+    const char* end = (const char*)memchr(entry->filename, '\0', MAX_FILENAME_LENGTH);
+    return end != NULL && memchr(entry->filename, '/', end - entry->filename) == NULL &&
+           strcmp(entry->filename, ".") != 0 && strcmp(entry->filename, "..") != 0;
+}
+
+// 检查目录中的一项，返回false表示这一项无效、修复时应当去掉；子目录压入栈中由某个线程稍后检查
+static bool fsck_entry(FsckState* ck, unsigned int dir_block, DirEntry* entry) {
+    fs_instance* fs = ck->fs;
+    if (!fsck_name_ok(entry) || (entry->attr.is_dir && (entry->attr.extents || entry->attr.inline_data))) {
+        fsck_problem(ck, &ck->st.bad_entries, ck->repair);
+        return false;
+    }
+    if (!entry->attr.is_dir) {
+        fsck_file(ck, entry);
+        return true;
+    }
+    if (!fsck_data_block(fs, entry->first_block)) {
+        fsck_problem(ck, &ck->st.bad_entries, ck->repair);
+        return false;
+    }
+    // 首块已被占用：目录成环（指向祖先）或与其他结构交叉
+    if (!fsck_own(ck, entry->first_block)) {
+        fsck_problem(ck, &ck->st.cross_links, ck->repair);
+        return false;
+    }
+    fsck_push(ck, entry->first_block, dir_block);
+    return true;
+}
+
+// 检查目录的名字索引并占用其块（blocks为目录链的各块，升序排列的副本为sorted，used为目录中的项数）
+// 索引须是一段物理连续的链，桶数为2的幂，每个有效桶指向目录中名字哈希相符的项，每一项都能从其哈希探测到，
+// 项数、删除标记数与索引头一致且至少有一个空桶（否则查找不会结束），链尾块和最近空槽块都在目录链中
+// 修复的做法是去掉索引再重建，因此索引无效且要修复时放回已占用的块，由最后一遍收回
+static bool fsck_dir_index(FsckState* ck, unsigned int dir_block, unsigned int index_block,
+                           const unsigned int* blocks, const unsigned int* sorted, unsigned int count, unsigned int used) {
+    fs_instance* fs = ck->fs;
+    int per_block = DIR_ENTRIES_PER_BLOCK;
+    if (!fsck_data_block(fs, index_block) || !fsck_own(ck, index_block)) {
+        return false;
+    }
+    unsigned int last;
+    unsigned int index_count = fsck_chain(ck, index_block, &last);
+    bool ok = last == index_block + index_count - 1;
+    for (unsigned int blk = index_block; ok && blk != last; blk++) {
+        ok = fat_get(fs, blk) == blk + 1;
+    }
+
+    DirIndexHeader* header = (DirIndexHeader*)block_ptr(fs, index_block);
+    unsigned int bucket_count = header->bucket_count;
+    ok = ok && bucket_count >= INDEX_MIN_BUCKETS && (bucket_count & (bucket_count - 1)) == 0 &&
+         INDEX_HEADER_SIZE + (unsigned long long)bucket_count * sizeof(IndexBucket) <= (unsigned long long)index_count * fs->block_size &&
+         header->used == used && header->tail_block == blocks[count - 1] && fsck_find(sorted, count, header->free_block) >= 0;
+
+    IndexBucket* buckets = index_buckets(header);
+    unsigned int live = 0, tombstones = 0, empty = 0;
+    for (unsigned int i = 0; ok && i < bucket_count; i++) {
+        unsigned int loc = buckets[i].loc;
+        if (loc == 0) {
+            empty++;
+            continue;
+        }
+        if (loc == INDEX_TOMBSTONE) {
+            tombstones++;
+            continue;
+        }
+        unsigned int blk = (loc - 1) / per_block;
+        unsigned int slot = (loc - 1) % per_block;
+        ok = fsck_find(sorted, count, blk) >= 0 && !(blk == dir_block && slot < 2);
+        if (ok) {
+            DirEntry* entry = loc_entry(fs, loc);
+            ok = entry->filename[0] != '\0' && memchr(entry->filename, '\0', MAX_FILENAME_LENGTH) != NULL &&
+                 name_hash(entry->filename) == buckets[i].hash;
+        }
+        live++;
+    }
+    ok = ok && live == used && tombstones == header->tombstones && empty > 0;
+
+    // 每一项都要能从其名字哈希探测到
+    for (unsigned int b = 0; ok && b < count; b++) {
+        DirEntry* entries = dir_entries(fs, blocks[b]);
+        for (int i = (b == 0 ? 2 : 0); ok && i < per_block; i++) {
+            if (entries[i].filename[0] == '\0' || memchr(entries[i].filename, '\0', MAX_FILENAME_LENGTH) == NULL) {
+                continue;
+            }
+            unsigned int loc = entry_loc(fs, &entries[i]);
+            unsigned int mask = bucket_count - 1;
+            unsigned int k = name_hash(entries[i].filename) & mask;
+            while (buckets[k].loc != 0 && buckets[k].loc != loc) {
+                k = (k + 1) & mask;
+            }
+            ok = buckets[k].loc == loc;
+        }
+    }
+
+    if (!ok && ck->repair) {
+        for (unsigned int k = 0, blk = index_block; k < index_count; k++, blk = fat_get(fs, blk)) {
+            fsck_disown(ck, blk);
+        }
+    }
+    return ok;
+}
+
+// 检查一个目录（首块已由调用者占用）："."和".."、目录链、其中的各项和名字索引
+// 修复时去掉无效的项，改正"."和".."，去掉无效的索引，改动过的目录在检查结束后重建索引
+static void fsck_dir(FsckState* ck, unsigned int dir_block, unsigned int parent) {
+    fs_instance* fs = ck->fs;
+    int per_block = DIR_ENTRIES_PER_BLOCK;
+    __atomic_add_fetch(&ck->st.dirs, 1, __ATOMIC_RELAXED);
+
+    unsigned int last;
+    unsigned int count = fsck_chain(ck, dir_block, &last);
+    unsigned int* blocks = (unsigned int*)malloc((size_t)count * 2 * sizeof(unsigned int));
+    if (blocks == NULL) {
+        pthread_mutex_lock(&ck->lock);
+        ck->failed = true;
+        pthread_mutex_unlock(&ck->lock);
+        return;
+    }
+    unsigned int* sorted = blocks + count;
+    for (unsigned int i = 0, blk = dir_block; i < count; i++, blk = fat_get(fs, blk)) {
+        blocks[i] = blk;
+        sorted[i] = blk;
+    }
+    qsort(sorted, count, sizeof(unsigned int), block_cmp);
+
+    // "."和".."固定位于首块的前两项
+    DirEntry* first = dir_entries(fs, dir_block);
+    bool changed = false;
+    for (int i = 0; i < 2; i++) {
+        const char* name = i == 0 ? "." : "..";
+        unsigned int target = i == 0 ? dir_block : parent;
+        DirEntry* entry = &first[i];
+        if (strncmp(entry->filename, name, MAX_FILENAME_LENGTH) == 0 && entry->attr.is_dir &&
+            !entry->attr.extents && !entry->attr.inline_data && entry->first_block == target) {
+            continue;
+        }
+        fsck_problem(ck, &ck->st.dir_links, ck->repair);
+        if (ck->repair) {
+            memset(entry->filename, 0, MAX_FILENAME_LENGTH);
+            strcpy(entry->filename, name);
+            memset(&entry->attr, 0, sizeof(Attributes));
+            entry->attr.is_dir = 1;
+            entry->attr.read = 1;
+            entry->attr.write = 1;
+            entry->first_block = target;
+            entry->file_size = 0;
+            if (i == 1) {
+                entry->index_block = 0;
+            }
+            mark_meta(fs, entry, sizeof(DirEntry));
+        }
+    }
+
+    unsigned int used = 0;
+    for (unsigned int b = 0; b < count; b++) {
+        DirEntry* entries = dir_entries(fs, blocks[b]);
+        for (int i = (b == 0 ? 2 : 0); i < per_block; i++) {
+            DirEntry* entry = &entries[i];
+            if (entry->filename[0] == '\0') {
+                continue;
+            }
+            if (!fsck_entry(ck, dir_block, entry) && ck->repair) {
+                memset(entry, 0, sizeof(DirEntry));
+                mark_meta(fs, entry, sizeof(DirEntry));
+                changed = true;
+                continue;
+            }
+            used++;
+        }
+    }
+
+    unsigned int index_block = first[0].index_block;
+    if (index_block != 0 && !fsck_dir_index(ck, dir_block, index_block, blocks, sorted, count, used)) {
+        fsck_problem(ck, &ck->st.dir_indexes, ck->repair);
+        if (ck->repair) {
+            first[0].index_block = 0;
+            mark_meta(fs, &first[0], sizeof(DirEntry));
+            changed = true;
+        }
+    }
+    if (changed) {
+        fsck_reindex(ck, dir_block);
+    }
+    free(blocks);
+}
+
+// 检查线程：从栈中取目录检查，栈空且没有线程还在检查（不会再有新目录）时结束
+static void* fsck_worker(void* arg) {
+    FsckState* ck = (FsckState*)arg;
+    pthread_mutex_lock(&ck->lock);
+    while (1) {
+        while (ck->stack_count == 0 && ck->active > 0) {
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        }
+        if (ck->stack_count == 0) {
+            break;
+        }
+        FsckDir dir = ck->stack[--ck->stack_count];
+        ck->active++;
+        pthread_mutex_unlock(&ck->lock);
+        fsck_dir(ck, dir.block, dir.parent);
+        pthread_mutex_lock(&ck->lock);
+        if (--ck->active == 0 && ck->stack_count == 0) {
+            pthread_cond_broadcast(&ck->cond);
+        }
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+// 检查超级块中的默认布局和元数据区的FAT表项（超级块、FAT区和根目录首块都应标记为已占用，
+// 根目录首块的表项是目录链的下一块，随根目录检查）
+static void fsck_meta(FsckState* ck) {
+    fs_instance* fs = ck->fs;
+    SuperBlock* sb = fs->super;
+    if (sb->default_layout != LAYOUT_FAT && sb->default_layout != LAYOUT_EXTENT) {
+        fsck_problem(ck, &ck->st.meta_errors, ck->repair);
+        if (ck->repair) {
+            sb->default_layout = LAYOUT_FAT;
+            mark_meta(fs, &sb->default_layout, sizeof(sb->default_layout));
+        }
+    }
+    for (unsigned int b = SUPER_BLOCK; b < fs->data_block; b++) {
+        FAT_ENTRY value = fat_get(fs, b);
+        if (value == 0 || (b != fs->root_block && value != EOF_BLOCK)) {
+            fsck_problem(ck, &ck->st.meta_errors, ck->repair);
+            if (ck->repair) {
+                fat_set(fs, b, EOF_BLOCK);
+            }
+        }
+    }
+}
+
+// 沿小文件块链检查并占用各块，记下链中的块供内联文件查找，并预先标记各块中块头和位图所在的槽
+// 链成环、与其他结构交叉或越界时在此断开；空的小文件块（如链头）是允许的
+static int fsck_small_chain(FsckState* ck) {
+    fs_instance* fs = ck->fs;
+    unsigned int cap = 0;
+    unsigned int prev = 0;
+    unsigned int block = fs->super->small_head;
+    if (block != 0 && !fsck_data_block(fs, block)) {
+        fsck_problem(ck, &ck->st.small_errors, ck->repair);
+        block = 0;
+        if (ck->repair) {
+            fs->super->small_head = 0;
+            mark_meta(fs, &fs->super->small_head, sizeof(fs->super->small_head));
+        }
+    }
+    while (block != 0) {
+        if (!fsck_own(ck, block)) {
+            fsck_problem(ck, &ck->st.small_errors, ck->repair);
+            if (ck->repair) {
+                small_header(fs, prev)->next = 0;
+                mark_meta(fs, small_header(fs, prev), sizeof(SmallHeader));
+            }
+            break;
+        }
+        SmallHeader* header = small_header(fs, block);
+        if (header->prev != prev) {
+            fsck_problem(ck, &ck->st.small_errors, ck->repair);
+            if (ck->repair) {
+                header->prev = prev;
+                mark_meta(fs, header, sizeof(SmallHeader));
+            }
+        }
+        FAT_ENTRY value = fat_get(fs, block);
+        if (value != EOF_BLOCK && value != 0) {
+            fsck_problem(ck, &ck->st.small_errors, ck->repair);
+            if (ck->repair) {
+                fat_set(fs, block, EOF_BLOCK);
+            }
+        }
+        if (ck->small_count == cap) {
+            cap = cap ? cap * 2 : 64;
+            unsigned int* list = (unsigned int*)realloc(ck->small_blocks, cap * sizeof(unsigned int));
+            if (list == NULL) {
+                return FS_ERR_NOMEM;
+            }
+            ck->small_blocks = list;
+        }
+        ck->small_blocks[ck->small_count++] = block;
+
+        unsigned int next = header->next;
+        if (next != 0 && !fsck_data_block(fs, next)) {
+            fsck_problem(ck, &ck->st.small_errors, ck->repair);
+            next = 0;
+            if (ck->repair) {
+                header->next = 0;
+                mark_meta(fs, header, sizeof(SmallHeader));
+            }
+        }
+        prev = block;
+        block = next;
+    }
+    if (ck->small_count == 0) {
+        return FS_OK;
+    }
+
+    qsort(ck->small_blocks, ck->small_count, sizeof(unsigned int), block_cmp);
+    ck->small_words = (SMALL_SLOTS + 63) / 64;
+    ck->small_used = (unsigned long long*)calloc((size_t)ck->small_count * ck->small_words, sizeof(unsigned long long));
+    if (ck->small_used == NULL) {
+        return FS_ERR_NOMEM;
+    }
+    unsigned int meta_slots = (SMALL_META_BYTES + SMALL_SLOT_SIZE - 1) / SMALL_SLOT_SIZE;
+    for (unsigned int i = 0; i < ck->small_count; i++) {
+        for (unsigned int k = 0; k < meta_slots; k++) {
+            ck->small_used[(size_t)i * ck->small_words + k / 64] |= 1ULL << (k % 64);
+        }
+    }
+    return FS_OK;
+}
+
+// 对照各小文件块的槽位图和占用槽数与内联文件实际占用的槽，修复时按实际占用改写
+static void fsck_small_maps(FsckState* ck) {
+    fs_instance* fs = ck->fs;
+    unsigned int meta_slots = (SMALL_META_BYTES + SMALL_SLOT_SIZE - 1) / SMALL_SLOT_SIZE;
+    for (unsigned int i = 0; i < ck->small_count; i++) {
+        SmallHeader* header = small_header(fs, ck->small_blocks[i]);
+        unsigned long long* want = ck->small_used + (size_t)i * ck->small_words;
+        unsigned int slots = 0;
+        for (unsigned int w = 0; w < ck->small_words; w++) {
+            slots += __builtin_popcountll(want[w]);
+        }
+        if (memcmp(small_bitmap(header), want, ck->small_words * sizeof(unsigned long long)) != 0 ||
+            header->used != slots - meta_slots) {
+            fsck_problem(ck, &ck->st.small_errors, ck->repair);
+            if (ck->repair) {
+                memcpy(small_bitmap(header), want, ck->small_words * sizeof(unsigned long long));
+                header->used = slots - meta_slots;
+                mark_meta(fs, header, SMALL_META_BYTES);
+            }
+        }
+    }
+    if (ck->repair) {
+        fs->small_hint = 0;
+        fs->small_scanned = false;
+    }
+}
+
+// 最后一遍：逐块对照FAT与实际引用（各线程负责一段块号）
+// 独占的块在FAT中应为已占用的链指针或链尾；区段布局的数据块被n处引用时应为EOF_BLOCK-(n-1)；
+// 没有被引用的块应为空闲（快照保存的块在FAT中本来就是空闲的）。既被独占又被区段引用的块无法判断归属，不修复
+static void* fsck_scan(void* arg) {
+    FsckRange* range = (FsckRange*)arg;
+    FsckState* ck = range->ck;
+    fs_instance* fs = ck->fs;
+    unsigned long long blocks = 0;
+    for (unsigned int b = range->start; b < range->end; b++) {
+        bool own = (ck->owned[b / 64] >> (b % 64)) & 1;
+        unsigned int refs = ck->refs[b];
+        FAT_ENTRY value = fat_get(fs, b);
+        if (own || refs > 0) {
+            blocks++;
+        }
+        if (own && refs > 0) {
+            fsck_problem(ck, &ck->st.cross_links, false);
+        } else if (own) {
+            if (value == 0 || (value != EOF_BLOCK && value >= EOF_BLOCK - (MAX_BLOCK_REFS - 1))) {
+                fsck_problem(ck, value == 0 ? &ck->st.free_referenced : &ck->st.ref_errors, ck->repair);
+                if (ck->repair) {
+                    fat_set(fs, b, EOF_BLOCK);
+                }
+            }
+        } else if (refs > 0) {
+            FAT_ENTRY want = EOF_BLOCK - (refs - 1);
+            if (value != want) {
+                // 共享计数最多记到MAX_BLOCK_REFS，更多处引用同一块时无法修复
+                bool fixable = ck->repair && refs <= MAX_BLOCK_REFS;
+                fsck_problem(ck, value == 0 ? &ck->st.free_referenced : &ck->st.ref_errors, fixable);
+                if (fixable) {
+                    fat_set(fs, b, want);
+                }
+            }
+        } else if (value != 0) {
+            fsck_problem(ck, &ck->st.lost_blocks, ck->repair);
+            if (ck->repair) {
+                fat_set(fs, b, 0);
+            }
+        }
+    }
+    __atomic_add_fetch(&ck->st.blocks, blocks, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// 把数据区分成threads段，各线程对照一段
+static void fsck_blocks(FsckState* ck, unsigned int threads) {
+    fs_instance* fs = ck->fs;
+    FsckRange ranges[FSCK_MAX_THREADS];
+    pthread_t tids[FSCK_MAX_THREADS];
+    bool started[FSCK_MAX_THREADS];
+    unsigned int per = (fs->block_num - fs->data_block + threads - 1) / threads;
+    for (unsigned int i = 0; i < threads; i++) {
+        unsigned int start = fs->data_block + i * per;
+        ranges[i].ck = ck;
+        ranges[i].start = start < fs->block_num ? start : fs->block_num;
+        ranges[i].end = fs->block_num - ranges[i].start > per ? ranges[i].start + per : fs->block_num;
+        started[i] = i > 0 && pthread_create(&tids[i], NULL, fsck_scan, &ranges[i]) == 0;
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        if (!started[i]) {
+            fsck_scan(&ranges[i]);
+        }
+    }
+    for (unsigned int i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+}
+
+// 修复之后：提交修复的内容，按FAT重建空闲位图（收回丢失的块），重建改动过的目录的索引后再提交一次
+static int fsck_finish(FsckState* ck) {
+    fs_instance* fs = ck->fs;
+    int ret = journal_commit(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    rebuild_free_map(fs);
+    for (unsigned int i = 0; i < ck->reindex_count; i++) {
+        unsigned int dir_block = ck->reindex[i];
+        if (fat_get(fs, dir_block) != EOF_BLOCK || dir_entries(fs, dir_block)[0].index_block != 0) {
+            dir_build_index(fs, dir_block);
+        }
+    }
+    dcache_clear(fs);
+    return journal_commit(fs);
+}
+
+// 一致性检查（调用者独占实例）：先检查元数据区和小文件块链，再从根目录起并行检查目录树，
+// 然后对照小文件块的槽位图，最后逐块对照FAT；修复时只用一个线程，检查不完整（内存不足）时不做最后一遍
+static int fsck_run(fs_instance* fs, bool repair, FsFsckStat* st) {
+    FsckState* ck = (FsckState*)calloc(1, sizeof(FsckState));
+    if (ck == NULL) {
+        return FS_ERR_NOMEM;
+    }
+    ck->fs = fs;
+    ck->repair = repair;
+    ck->owned = (unsigned long long*)calloc(fs->bitmap_words, sizeof(unsigned long long));
+    ck->refs = (unsigned char*)calloc(fs->block_num, 1);
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+
+    // 大卷用多个线程，修复时只用一个线程
+    unsigned int threads = 1;
+    if (!repair && fs->block_num >= FSCK_PARALLEL_BLOCKS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : cpus > 1 ? (unsigned int)cpus : 1;
+    }
+
+    int ret = ck->owned != NULL && ck->refs != NULL ? FS_OK : FS_ERR_NOMEM;
+    if (ret == FS_OK) {
+        fsck_meta(ck);
+        ret = fsck_small_chain(ck);
+    }
+    if (ret == FS_OK) {
+        fsck_push(ck, fs->root_block, fs->root_block);
+        pthread_t tids[FSCK_MAX_THREADS];
+        unsigned int started = 0;
+        for (unsigned int i = 1; i < threads; i++) {
+            if (pthread_create(&tids[started], NULL, fsck_worker, ck) == 0) {
+                started++;
+            }
+        }
+        fsck_worker(ck);
+        for (unsigned int i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        ck->st.threads = started + 1;
+        if (ck->failed) {
+            ret = FS_ERR_NOMEM;
+        }
+    }
+    if (ret == FS_OK) {
+        fsck_small_maps(ck);
+        fsck_blocks(ck, threads);
+        if (repair && ck->st.repaired > 0) {
+            ret = fsck_finish(ck);
+        }
+    }
+
+    *st = ck->st;
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    free(ck->owned);
+    free(ck->refs);
+    free(ck->small_blocks);
+    free(ck->small_used);
+    free(ck->stack);
+    free(ck->reindex);
+    free(ck);
+    return ret;
+}
+
+/* 元数据日志：FAT、目录项、索引和区段表的修改以字节段为单位记录，多个操作组成一个事务一起提交 */
+
+// 当前时间（毫秒，单调时钟）
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 日志校验和（FNV-1a）
+static unsigned int journal_checksum(const unsigned char* p, size_t n) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 把虚拟磁盘上[addr, addr+len)记入当前事务，与上一段重叠或相邻时直接合并
+static void journal_note(fs_instance* fs, const void* addr, size_t len) {
+    if (fs->journal_broken) {
+        return;
+    }
+    unsigned long long offset = (const unsigned char*)addr - fs->virtual_disk;
+
+    if (fs->journal_range_count > 0) {
+        JournalRange* last = &fs->journal_ranges[fs->journal_range_count - 1];
+        if (offset >= last->offset && offset <= last->offset + last->length) {
+            if (offset + len > last->offset + last->length) {
+                last->length = offset + len - last->offset;
+            }
+            return;
+        }
+    }
+
+    if (fs->journal_range_count == fs->journal_range_cap) {
+        unsigned int cap = fs->journal_range_cap ? fs->journal_range_cap * 2 : 256;
+        JournalRange* ranges = (JournalRange*)realloc(fs->journal_ranges, cap * sizeof(JournalRange));
+        if (ranges == NULL) {
+            // 事务记录不完整，不能再写入日志，提交时改为直接写回全部脏块
+            fs->journal_broken = true;
+            return;
+        }
+        fs->journal_ranges = ranges;
+        fs->journal_range_cap = cap;
+    }
+    fs->journal_ranges[fs->journal_range_count].offset = offset;
+    fs->journal_ranges[fs->journal_range_count].length = len;
+    fs->journal_ranges[fs->journal_range_count].reserved = 0;
+    fs->journal_range_count++;
+}
+
+static int range_cmp(const void* a, const void* b) {
+    unsigned long long x = ((const JournalRange*)a)->offset;
+    unsigned long long y = ((const JournalRange*)b)->offset;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// 丢弃当前事务（格式化后旧卷上的修改已无意义）
+static void journal_reset(fs_instance* fs) {
+    fs->journal_broken = false;
+    fs->journal_range_count = 0;
+    fs->pending_free_count = 0;
+    fs->journal_ops = 0;
+}
+
+// 把本事务元数据没有涉及的脏块（数据块和已提交过的元数据）原地写回映像并落盘
+// 这样日志中引用这些数据块的元数据提交时，数据已经在映像中
+static int journal_write_data(fs_instance* fs) {
+    int fd = -1;
+    unsigned int k = 0;
+    unsigned int len = 0;
+    int ret = snap_preserve(fs) == FS_OK ? 0 : -1;
+
+    for (unsigned int start = next_dirty_run(fs, 0, &len); start < fs->block_num && ret == 0;
+         start = next_dirty_run(fs, start + len, &len)) {
+        unsigned int b = start;
+        unsigned int end = start + len;
+
+        while (b < end) {
+            // 跳过本事务元数据所在的块，它们只写日志，检查点时才写回映像
+            while (k < fs->journal_range_count &&
+                   (fs->journal_ranges[k].offset + fs->journal_ranges[k].length - 1) / fs->block_size < b) {
+                k++;
+            }
+            unsigned int meta_first = fs->block_num;
+            if (k < fs->journal_range_count) {
+                meta_first = fs->journal_ranges[k].offset / fs->block_size;
+            }
+            if (meta_first <= b) {
+                b = (fs->journal_ranges[k].offset + fs->journal_ranges[k].length - 1) / fs->block_size + 1;
+                continue;
+            }
+
+            unsigned int stop = meta_first < end ? meta_first : end;
+            if (fd < 0) {
+                fd = open(fs->image_path, O_WRONLY);
+                if (fd < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+            if (!write_back_range(fs, fd, b, stop - b)) {
+                ret = -1;
+                break;
+            }
+            for (unsigned int i = b; i < stop; i++) {
+                fs->dirty_bitmap[i / 64] &= ~(1ULL << (i % 64));
+            }
+            fs->save_gen++;
+            b = stop;
+        }
+    }
+
+    if (fd >= 0) {
+        if (ret == 0 && fdatasync(fd) != 0) {
+            ret = -1;
+        }
+        close(fd);
+    }
+    return ret;
+}
+
+// 提交当前事务：先写回数据块，再把合并后的元数据字节段及其当前内容追加到日志并落盘
+// 提交成功后本事务释放的块才能重新分配
+static int journal_commit(fs_instance* fs) {
+    if (fs->journal_fd < 0 || (fs->journal_range_count == 0 && fs->pending_free_count == 0 && !fs->journal_broken)) {
+        fs->journal_ops = 0;
+        return FS_OK;
+    }
+
+    // 事务记录不完整时做检查点代替提交（检查点写回全部脏块后才释放延迟释放的块）
+    if (fs->journal_broken) {
+        int ret = journal_flush(fs);
+        if (ret == FS_OK) {
+            journal_release(fs);
+        }
+        return ret;
+    }
+
+    // 排序并合并重叠或相邻的字节段
+    if (fs->journal_range_count > 1) {
+        qsort(fs->journal_ranges, fs->journal_range_count, sizeof(JournalRange), range_cmp);
+    }
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < fs->journal_range_count; i++) {
+        JournalRange* r = &fs->journal_ranges[i];
+        if (n > 0 && r->offset <= fs->journal_ranges[n - 1].offset + fs->journal_ranges[n - 1].length) {
+            unsigned long long end = r->offset + r->length;
+            if (end > fs->journal_ranges[n - 1].offset + fs->journal_ranges[n - 1].length) {
+                fs->journal_ranges[n - 1].length = end - fs->journal_ranges[n - 1].offset;
+            }
+        } else {
+            fs->journal_ranges[n++] = *r;
+        }
+    }
+    fs->journal_range_count = n;
+    STAT_ADD(fs, journal_commits, 1);
+
+    if (journal_write_data(fs) != 0) {
+        return FS_ERR_IO;
+    }
+
+    if (n > 0) {
+        // 组装事务：事务头 + 字节段表 + 新内容，一次写入
+        size_t data_bytes = 0;
+        for (unsigned int i = 0; i < n; i++) {
+            data_bytes += fs->journal_ranges[i].length;
+        }
+        size_t body = n * sizeof(JournalRange) + data_bytes;
+        size_t total = sizeof(JournalHeader) + body;
+        unsigned char* buf = (unsigned char*)malloc(total);
+        if (buf == NULL) {
+            fs->journal_broken = true;
+            return journal_commit(fs);
+        }
+
+        JournalHeader* header = (JournalHeader*)buf;
+        memcpy(buf + sizeof(JournalHeader), fs->journal_ranges, n * sizeof(JournalRange));
+        unsigned char* data = buf + sizeof(JournalHeader) + n * sizeof(JournalRange);
+        for (unsigned int i = 0; i < n; i++) {
+            memcpy(data, fs->virtual_disk + fs->journal_ranges[i].offset, fs->journal_ranges[i].length);
+            data += fs->journal_ranges[i].length;
+        }
+        header->magic = JOURNAL_MAGIC;
+        header->range_count = n;
+        header->data_bytes = data_bytes;
+        header->seq = fs->journal_seq;
+        header->checksum = journal_checksum(buf + sizeof(JournalHeader), body);
+
+        size_t done = 0;
+        while (done < total) {
+            ssize_t w = write(fs->journal_fd, buf + done, total - done);
+            if (w <= 0) {
+                break;
+            }
+            done += w;
+        }
+        free(buf);
+        if (done < total || fdatasync(fs->journal_fd) != 0) {
+            return FS_ERR_IO;
+        }
+        fs->journal_seq++;
+        fs->journal_bytes += total;
+        for (unsigned int i = 0; i < n; i++) {
+            mark_logged(fs, fs->journal_ranges[i].offset, fs->journal_ranges[i].length);
+        }
+    }
+
+    // 事务已持久化，释放本事务中释放的块
+    journal_release(fs);
+
+    // 日志过大时做检查点
+    if (fs->journal_bytes >= JOURNAL_CHECKPOINT_BYTES) {
+        return journal_checkpoint(fs);
+    }
+    return FS_OK;
+}
+
+// 事务结束：把本事务中释放的块放回空闲位图，清空当前事务
+static void journal_release(fs_instance* fs) {
+    for (unsigned int i = 0; i < fs->pending_free_count; i++) {
+        unsigned int b = fs->pending_frees[i];
+        if (fat_get(fs, b) == 0 && (fs->snap_refs == NULL || fs->snap_refs[b] == 0) &&
+            !(fs->free_bitmap[b / 64] & (1ULL << (b % 64)))) {
+            fs->free_bitmap[b / 64] |= 1ULL << (b % 64);
+            fs->free_block_count++;
+        }
+    }
+    fs->journal_broken = false;
+    fs->journal_range_count = 0;
+    fs->pending_free_count = 0;
+    fs->journal_ops = 0;
+}
+
+// 把所有脏块写回映像并截断日志，映像落盘后日志中的事务都已无用
+static int journal_flush(fs_instance* fs) {
+    int ret = save_to_file(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    if (fs->journal_fd >= 0 && fs->journal_bytes > 0) {
+        if (ftruncate(fs->journal_fd, 0) != 0 || fsync(fs->journal_fd) != 0) {
+            return FS_ERR_IO;
+        }
+        fs->journal_bytes = 0;
+    }
+    memset(fs->logged_bitmap, 0, fs->bitmap_words * sizeof(unsigned long long));
+    return FS_OK;
+}
+
+// 检查点：提交当前事务后把所有脏块写回映像并截断日志
+static int journal_checkpoint(fs_instance* fs) {
+    int ret = journal_commit(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    return journal_flush(fs);
+}
+
+// 一个修改操作结束：组提交，累计的操作足够多或最早的操作已等待足够久时才提交一次
+// 调用时不持有任何锁；提交要取得内存中元数据的一致快照，需要持有实例写锁，等待进行中的操作结束
+static void journal_end_op(fs_instance* fs) {
+    if (fs->journal_fd < 0) {
+        return;
+    }
+
+    // 持有实例读锁计数，与持有写锁的提交互斥
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    pthread_mutex_lock(&fs->journal_lock);
+    bool due = false;
+    if (fs->journal_range_count != 0 || fs->pending_free_count != 0 || fs->journal_broken) {
+        long long now = now_ms();
+        if (fs->journal_ops++ == 0) {
+            fs->journal_first_ms = now;
+        }
+        due = fs->journal_ops >= fs->group_ops || now - fs->journal_first_ms >= fs->group_ms;
+    }
+    pthread_mutex_unlock(&fs->journal_lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    // 多个线程可能同时发现需要提交，后取得写锁的线程会发现事务已为空而直接返回
+    if (due) {
+        pthread_rwlock_wrlock(&fs->fs_lock);
+        journal_commit(fs);
+        pthread_rwlock_unlock(&fs->fs_lock);
+    }
+}
+
+/* 后台回写：定期或脏块较多时把修改写回映像并截断日志，长时间运行的会话不必等到退出才保存 */
+
+// 当前的脏块数（调用者持有实例锁；其他线程可能正在用原子操作置位）
+static unsigned int dirty_count(fs_instance* fs) {
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < fs->bitmap_words; i++) {
+        count += __builtin_popcountll(__atomic_load_n(&fs->dirty_bitmap[i], __ATOMIC_RELAXED));
+    }
+    return count;
+}
+
+// 预写一轮：持有写锁提交当前事务，从*cursor起把至多一个暂存区的脏块复制出来并清除脏标记，
+// 然后只持读锁写入映像。复制时内存中都是已提交的内容，写入的是一致的状态；
+// 复制后被改动的块会重新变脏，由后面的检查点写回。放开写锁到取得读锁之间如果有提交或保存原地写过映像，
+// 暂存的内容可能比映像中的旧，这时放弃本轮写入，把这些块重新标记为脏块
+// 返回写入的块数，*cursor到达块数时这一遍结束；出错时返回负的错误码
+static int writeback_round(fs_instance* fs, WritebackStage* stage, unsigned int* cursor, int fd) {
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = journal_commit(fs);
+    if (ret == FS_OK) {
+        ret = snap_preserve(fs);
+    }
+    unsigned int blocks = 0;
+    stage->run_count = 0;
+    if (ret == FS_OK && fs->block_size == stage->block_size && fs->block_num == stage->block_num) {
+        unsigned int len = 0;
+        unsigned int start = next_dirty_run(fs, *cursor, &len);
+        while (start < fs->block_num && blocks < stage->max_blocks) {
+            if (len > stage->max_blocks - blocks) {
+                len = stage->max_blocks - blocks;
+            }
+            memcpy(stage->data + (size_t)blocks * fs->block_size,
+                   fs->virtual_disk + (size_t)start * fs->block_size, (size_t)len * fs->block_size);
+            for (unsigned int b = start; b < start + len; b++) {
+                fs->dirty_bitmap[b / 64] &= ~(1ULL << (b % 64));
+            }
+            stage->runs[stage->run_count * 2] = start;
+            stage->runs[stage->run_count * 2 + 1] = len;
+            stage->run_count++;
+            blocks += len;
+            *cursor = start + len;
+            start = next_dirty_run(fs, *cursor, &len);
+        }
+        if (start >= fs->block_num) {
+            *cursor = fs->block_num;
+        }
+    } else {
+        *cursor = stage->block_num;
+    }
+    unsigned int gen = fs->save_gen;
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (ret != FS_OK || stage->run_count == 0) {
+        return ret;
+    }
+
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    bool fresh = fs->save_gen == gen;
+    bool ok = true;
+    size_t done = 0;
+    for (unsigned int i = 0; fresh && ok && i < stage->run_count; i++) {
+        unsigned int start = stage->runs[i * 2];
+        unsigned int len = stage->runs[i * 2 + 1];
+        ok = pwrite_all(fd, stage->data + done, (size_t)len * fs->block_size, (size_t)start * fs->block_size);
+        done += (size_t)len * fs->block_size;
+    }
+    if (!fresh || !ok) {
+        for (unsigned int i = 0; i < stage->run_count; i++) {
+            set_dirty(fs, stage->runs[i * 2], stage->runs[i * 2 + 1]);
+        }
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+    if (!ok) {
+        return FS_ERR_IO;
+    }
+    if (!fresh) {
+        return 0;
+    }
+    STAT_ADD(fs, writeback_blocks, blocks);
+    return (int)blocks;
+}
+
+// 后台回写一次：先分轮预写一遍脏块，再做一次检查点（提交、写回剩下的脏块、落盘并截断日志），
+// 检查点只需写回预写期间新变脏的块，持有写锁的时间与这段时间内的修改量成正比，而不是与全部脏块成正比
+// 映像还不存在或大小与卷不一致时不预写，由检查点整个写出（只在使用日志时开启，不会是映射模式）
+static int writeback_run(fs_instance* fs) {
+    WritebackStage stage;
+    memset(&stage, 0, sizeof(stage));
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    stage.block_size = fs->block_size;
+    stage.block_num = fs->block_num;
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    stage.max_blocks = WRITEBACK_STAGE_BYTES / stage.block_size;
+    stage.runs = (unsigned int*)malloc((size_t)stage.max_blocks * 2 * sizeof(unsigned int));
+    stage.data = (unsigned char*)malloc(WRITEBACK_STAGE_BYTES);
+    int fd = open(fs->image_path, O_WRONLY);
+    struct stat st;
+    if (fd >= 0 && (fstat(fd, &st) != 0 ||
+                    (unsigned long long)st.st_size != (unsigned long long)stage.block_size * stage.block_num)) {
+        close(fd);
+        fd = -1;
+    }
+
+    int ret = FS_OK;
+    if (stage.runs != NULL && stage.data != NULL && fd >= 0) {
+        unsigned int cursor = 0;
+        while (cursor < stage.block_num && ret >= 0) {
+            ret = writeback_round(fs, &stage, &cursor, fd);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(stage.data);
+    free(stage.runs);
+
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int checkpoint = journal_checkpoint(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    STAT_ADD(fs, writebacks, 1);
+    return ret < 0 ? ret : checkpoint;
+}
+
+// 回写线程：每WRITEBACK_POLL_MS醒来一次，有修改且脏块达到阈值或距上次回写已超过间隔时回写；
+// 否则只提交等待超过组提交时间的事务（没有后续操作触发组提交时，事务不会一直留在内存中）
+static void* writeback_thread(void* arg) {
+    fs_instance* fs = (fs_instance*)arg;
+    pthread_mutex_lock(&fs->wb_lock);
+    while (!fs->wb_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WRITEBACK_POLL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&fs->wb_cond, &fs->wb_lock, &deadline);
+        if (fs->wb_stop) {
+            break;
+        }
+        unsigned int interval = fs->wb_interval_ms;
+        unsigned int threshold = fs->wb_dirty_blocks;
+        long long last = fs->wb_last_ms;
+        pthread_mutex_unlock(&fs->wb_lock);
+
+        long long now = now_ms();
+        pthread_rwlock_rdlock(&fs->fs_lock);
+        unsigned int dirty = dirty_count(fs);
+        pthread_mutex_lock(&fs->journal_lock);
+        bool pending = fs->journal_range_count != 0 || fs->pending_free_count != 0 || fs->journal_broken;
+        bool expired = pending && now - fs->journal_first_ms >= fs->group_ms;
+        pthread_mutex_unlock(&fs->journal_lock);
+        pthread_rwlock_unlock(&fs->fs_lock);
+
+        bool run = (dirty > 0 || pending) && (dirty >= threshold || now - last >= interval);
+        int ret = FS_OK;
+        if (run) {
+            ret = writeback_run(fs);
+        } else if (expired) {
+            pthread_rwlock_wrlock(&fs->fs_lock);
+            journal_commit(fs);
+            pthread_rwlock_unlock(&fs->fs_lock);
+        }
+
+        pthread_mutex_lock(&fs->wb_lock);
+        if (run) {
+            fs->wb_last_ms = now_ms();
+            fs->wb_error = ret;
+        }
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+    return NULL;
+}
+
+// 重放日志中校验通过的事务（映像载入后、重建空闲位图前调用），返回重放的事务数
+// 遇到不完整或校验失败的事务即停止，它及之后的内容都未提交
+static unsigned int journal_replay(fs_instance* fs) {
+    struct stat st;
+    if (fstat(fs->journal_fd, &st) != 0 || st.st_size == 0) {
+        return 0;
+    }
+    fs->journal_bytes = st.st_size;
+
+    size_t size = st.st_size;
+    unsigned char* buf = (unsigned char*)malloc(size);
+    if (buf == NULL || pread(fs->journal_fd, buf, size, 0) != (ssize_t)size) {
+        free(buf);
+        return 0;
+    }
+
+    unsigned int count = 0;
+    size_t pos = 0;
+    while (pos + sizeof(JournalHeader) <= size) {
+        JournalHeader* header = (JournalHeader*)(buf + pos);
+        size_t body = (size_t)header->range_count * sizeof(JournalRange) + header->data_bytes;
+        if (header->magic != JOURNAL_MAGIC || body > size - pos - sizeof(JournalHeader)) {
+            break;
+        }
+        unsigned char* p = buf + pos + sizeof(JournalHeader);
+        if (journal_checksum(p, body) != header->checksum) {
+            break;
+        }
+
+        // 先检查所有字节段都落在卷内，再统一应用
+        JournalRange* ranges = (JournalRange*)p;
+        unsigned char* data = p + header->range_count * sizeof(JournalRange);
+        size_t total = 0;
+        bool ok = true;
+        for (unsigned int i = 0; i < header->range_count; i++) {
+            if (ranges[i].offset + ranges[i].length > fs->disk_size || ranges[i].length == 0) {
+                ok = false;
+            }
+            total += ranges[i].length;
+        }
+        if (!ok || total != header->data_bytes) {
+            break;
+        }
+        for (unsigned int i = 0; i < header->range_count; i++) {
+            memcpy(fs->virtual_disk + ranges[i].offset, data, ranges[i].length);
+            set_dirty(fs, ranges[i].offset / fs->block_size,
+                      (ranges[i].offset + ranges[i].length - 1) / fs->block_size - ranges[i].offset / fs->block_size + 1);
+            mark_logged(fs, ranges[i].offset, ranges[i].length);
+            data += ranges[i].length;
+        }
+
+        fs->journal_seq = header->seq + 1;
+        count++;
+        pos += sizeof(JournalHeader) + body;
+    }
+
+    free(buf);
+    return count;
+}
+
+// 释放虚拟磁盘（映射模式下解除映射并关闭映像文件）
+static void release_disk(fs_instance* fs) {
+    if (fs->virtual_disk != NULL) {
+        if (fs->use_mmap && fs->disk_fd >= 0) {
+            munmap(fs->virtual_disk, fs->disk_size);
+        } else {
+            free(fs->virtual_disk);
+        }
+        fs->virtual_disk = NULL;
+    }
+    if (fs->disk_fd >= 0) {
+        close(fs->disk_fd);
+        fs->disk_fd = -1;
+    }
+    fs->super = NULL;
+    fs->fat = NULL;
+}
+
+// 检查超级块是否有效，且与映像文件大小一致
+static bool super_valid(const SuperBlock* sb, unsigned long long file_size) {
+    if (memcmp(sb->magic, FS_MAGIC, sizeof(sb->magic)) != 0 || sb->version < 1 || sb->version > FS_VERSION) {
+        return false;
+    }
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE ||
+        (sb->block_size & (sb->block_size - 1)) != 0) {
+        return false;
+    }
+    if ((sb->fat_width != 16 && sb->fat_width != 32) || sb->block_count < MIN_BLOCK_COUNT ||
+        sb->data_start >= sb->block_count || sb->root_block >= sb->data_start) {
+        return false;
+    }
+    // FAT区须位于超级块与根目录之间并能容纳全部表项，否则按FAT访问任何块都可能越界
+    if (sb->fat_start < FAT_BLOCK || (unsigned long long)sb->fat_start + sb->fat_blocks > sb->root_block ||
+        (unsigned long long)sb->fat_blocks * sb->block_size < (unsigned long long)sb->block_count * (sb->fat_width / 8) ||
+        (sb->fat_width == 16 && sb->block_count > MAX_FAT16_BLOCKS)) {
+        return false;
+    }
+    return (unsigned long long)sb->block_size * sb->block_count == file_size;
+}
+
+// 载入虚拟磁盘后设置卷几何参数并初始化运行状态
+static int mount_disk(fs_instance* fs) {
+    int ret = apply_geometry(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+    fs->current_dir_block = fs->root_block;
+    strcpy(fs->current_dir, "/");
+
+    // 重放日志中已提交但还没写回映像的元数据修改
+    if (fs->journal_fd >= 0) {
+        fs->replayed = journal_replay(fs);
+    }
+
+    // 版本1的卷没有内联文件和小文件块，版本2的卷没有快照，版本3的卷没有共享的块，升级版本号后按当前格式使用
+    if (fs->super->version < FS_VERSION) {
+        if (fs->super->version < 2) {
+            fs->super->small_head = 0;
+        }
+        if (fs->super->version < 3) {
+            fs->super->snap_head = 0;
+        }
+        fs->super->version = FS_VERSION;
+        mark_meta(fs, fs->super, sizeof(SuperBlock));
+    }
+
+    // 快照依赖写回映像前先复制旧内容，映射模式下内核随时写回映射页，无法保证，因此不挂载有快照的卷
+    if (fs->use_mmap && fs->super->snap_head != 0) {
+        return FS_ERR_INVAL;
+    }
+    ret = snap_load(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    // 根据FAT重建空闲位图
+    rebuild_free_map(fs);
+    dcache_clear(fs);
+
+    // 初始化打开文件表
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        fs->open_file_table[i].is_used = false;
+    }
+    return FS_OK;
+}
+
+// 映射模式加载：把映像文件映射为虚拟磁盘，不读入数据，页面在首次访问时才载入
+static int load_mapped(fs_instance* fs) {
+    int fd = open(fs->image_path, O_RDWR);
+    if (fd < 0) {
+        fd = open(fs->image_path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return FS_ERR_IO;
+        }
+        fs->disk_fd = fd;
+        fs->mount_state = FS_MOUNT_CREATED;
+        return do_format(fs, LAYOUT_FAT, 0, 0, 0);
+    }
+    fs->disk_fd = fd;
+
+    struct stat st;
+    SuperBlock sb;
+    if (fstat(fd, &st) != 0 || pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb) ||
+        !super_valid(&sb, st.st_size)) {
+        fs->mount_state = FS_MOUNT_REFORMATTED;
+        return do_format(fs, LAYOUT_FAT, 0, 0, 0);
+    }
+
+    void* disk = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (disk == MAP_FAILED) {
+        return FS_ERR_IO;
+    }
+    fs->virtual_disk = (unsigned char*)disk;
+    fs->disk_size = st.st_size;
+
+    return mount_disk(fs);
+}
+
+// 从映像文件读入整个虚拟磁盘
+static int load_from_file(fs_instance* fs) {
+    FILE* fp = fopen(fs->image_path, "rb");
+    if (fp == NULL) {
+        fs->mount_state = FS_MOUNT_CREATED;
+        return do_format(fs, LAYOUT_FAT, 0, 0, 0);
+    }
+
+    // 先读超级块，确定卷大小
+    SuperBlock sb;
+    struct stat st;
+    if (fread(&sb, 1, sizeof(sb), fp) != sizeof(sb) || fstat(fileno(fp), &st) != 0 ||
+        !super_valid(&sb, st.st_size)) {
+        fclose(fp);
+        fs->mount_state = FS_MOUNT_REFORMATTED;
+        return do_format(fs, LAYOUT_FAT, 0, 0, 0);
+    }
+    unsigned long long size = st.st_size;
+
+    // 分配虚拟磁盘空间
+    fs->virtual_disk = (unsigned char*)malloc(size);
+    if (fs->virtual_disk == NULL) {
+        fclose(fp);
+        return FS_ERR_NOMEM;
+    }
+
+    // 读取整个虚拟磁盘
+    rewind(fp);
+    size_t read_size = fread(fs->virtual_disk, 1, size, fp);
+    fclose(fp);
+
+    if (read_size != size) {
+        fs->mount_state = FS_MOUNT_REFORMATTED;
+        return do_format(fs, LAYOUT_FAT, 0, 0, 0);
+    }
+
+    int ret = mount_disk(fs);
+    if (ret != FS_OK) {
+        return ret;
+    }
+
+    // 日志中有内容时立即做检查点，把恢复的修改写回映像并清空日志
+    if (fs->journal_bytes > 0) {
+        return journal_checkpoint(fs);
+    }
+    return FS_OK;
+}
+
+// 初始化实例中的所有锁
+static void init_locks(fs_instance* fs) {
+    pthread_rwlock_init(&fs->fs_lock, NULL);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&fs->dir_locks[i].lock, NULL);
+    }
+    for (int i = 0; i < FILE_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&fs->file_locks[i].lock, NULL);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_init(&fs->open_file_table[i].lock, NULL);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&fs->dcache_locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->journal_lock, NULL);
+    pthread_mutex_init(&fs->small_lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    pthread_mutex_init(&fs->wb_lock, NULL);
+    pthread_cond_init(&fs->wb_cond, NULL);
+}
+
+// 释放实例占用的全部资源（不写回任何内容）
+static void release_instance(fs_instance* fs) {
+    release_disk(fs);
+    if (fs->journal_fd >= 0) {
+        close(fs->journal_fd);
+    }
+    free(fs->free_bitmap);
+    free(fs->dirty_bitmap);
+    free(fs->logged_bitmap);
+    snap_reset(fs);
+    free(fs->journal_ranges);
+    free(fs->pending_frees);
+    free(fs->cache_state);
+
+    pthread_rwlock_destroy(&fs->fs_lock);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&fs->dir_locks[i].lock);
+    }
+    for (int i = 0; i < FILE_LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&fs->file_locks[i].lock);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_destroy(&fs->open_file_table[i].lock);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&fs->dcache_locks[i]);
+    }
+    pthread_mutex_destroy(&fs->fd_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->journal_lock);
+    pthread_mutex_destroy(&fs->small_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    pthread_mutex_destroy(&fs->wb_lock);
+    pthread_cond_destroy(&fs->wb_cond);
+    free(fs);
+}
+
+// 挂载映像文件：映像不存在或无效时新建并格式化一个默认大小的卷
+// journal_path为NULL时不使用日志；映射模式下内核随时可能把映射页写回映像，无法保证先写日志，因此也不使用日志
+int fs_mount(fs_instance** out, const char* image_path, const char* journal_path, int flags) {
+    *out = NULL;
+    if (strlen(image_path) >= MAX_PATH_LENGTH ||
+        (journal_path != NULL && strlen(journal_path) >= MAX_PATH_LENGTH)) {
+        return FS_ERR_NAMETOOLONG;
+    }
+
+    // 锁按缓存行对齐，实例本身也需要按缓存行对齐
+    fs_instance* fs;
+    if (posix_memalign((void**)&fs, 64, sizeof(fs_instance)) != 0) {
+        return FS_ERR_NOMEM;
+    }
+    memset(fs, 0, sizeof(fs_instance));
+    init_locks(fs);
+    strcpy(fs->image_path, image_path);
+    fs->use_mmap = (flags & FS_MOUNT_MMAP) != 0;
+    fs->disk_fd = -1;
+    fs->journal_fd = -1;
+    fs->timing = (flags & FS_MOUNT_TIMING) != 0;
+    fs->zero_detect = (flags & FS_MOUNT_SPARSE) != 0;
+    fs->group_ops = JOURNAL_GROUP_OPS;
+    fs->group_ms = JOURNAL_GROUP_MS;
+    fs->mount_state = FS_MOUNT_LOADED;
+
+    int ret;
+    if (fs->use_mmap) {
+        ret = load_mapped(fs);
+    } else {
+        // 打开元数据日志，打不开时不使用日志
+        if (journal_path != NULL) {
+            strcpy(fs->journal_path, journal_path);
+            fs->journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+        }
+        ret = load_from_file(fs);
+    }
+
+    if (ret != FS_OK) {
+        release_instance(fs);
+        return ret;
+    }
+    *out = fs;
+    return FS_OK;
+}
+
+// 卸载：把所有修改写回映像后释放实例，写回失败时仍然释放并返回错误码
+// 调用者须保证此时没有其他线程在使用该实例（后台回写线程在此停止）
+int fs_unmount(fs_instance* fs) {
+    fs_set_writeback(fs, 0, 0);
+    int ret = journal_checkpoint(fs);
+    release_instance(fs);
+    return ret;
+}
+
+// 错误码对应的说明文字
+const char* fs_strerror(int err) {
+    switch (err) {
+        case FS_OK: return "成功";
+        case FS_ERR_NOENT: return "文件或目录不存在";
+        case FS_ERR_EXIST: return "文件或目录已存在";
+        case FS_ERR_NOTDIR: return "不是目录";
+        case FS_ERR_ISDIR: return "是目录";
+        case FS_ERR_NOTEMPTY: return "目录不为空";
+        case FS_ERR_NOSPC: return "磁盘空间不足";
+        case FS_ERR_NAMETOOLONG: return "名字或路径过长";
+        case FS_ERR_INVAL: return "参数无效";
+        case FS_ERR_BADF: return "无效的文件描述符";
+        case FS_ERR_PERM: return "没有权限";
+        case FS_ERR_MFILE: return "打开文件数已达上限";
+        case FS_ERR_BUSY: return "文件已打开或目录正在使用";
+        case FS_ERR_IO: return "读写映像或日志失败";
+        case FS_ERR_NOMEM: return "内存不足";
+        case FS_ERR_CORRUPT: return "文件系统结构损坏";
+        default: return "未知错误";
+    }
+}
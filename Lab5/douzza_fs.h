@@ -0,0 +1,258 @@
+/*
+ * 简单文件系统库接口
+ *
+ * 文件系统引擎以库的形式提供：每个卷对应一个 fs_instance 实例，实例各自维护虚拟磁盘、
+ * 当前目录和打开文件表，一个进程中可以同时挂载多个互不影响的卷。
+ * 库函数不向标准输出打印任何内容，出错时返回负的错误码（FS_ERR_*），
+ * 可用 fs_strerror() 取得对应的说明文字。
+ */
+
+#ifndef DOUZZA_FS_H
+#define DOUZZA_FS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* 常量定义 */
+#define MAX_FILENAME_LENGTH 28  // 最大文件名长度
+#define MAX_OPEN_FILES 16     // 每个实例同时打开的最大文件数
+#define MAX_PATH_LENGTH 256   // 最大路径长度
+#define FS_MAX_FILE_SIZE 0x7FFFFFFFU  // 文件大小上限（字节），与fs_lseek能返回的位置范围一致
+
+// 文件布局
+#define LAYOUT_DEFAULT (-1)           // 使用卷的默认布局
+#define LAYOUT_FAT 0                  // FAT链
+#define LAYOUT_EXTENT 1               // 区段表
+
+// fs_lseek 的定位基准
+#define MY_SEEK_SET 0
+#define MY_SEEK_CUR 1
+#define MY_SEEK_END 2
+
+// fs_mount 的选项
+#define FS_MOUNT_MMAP 0x1             // 以映射模式打开映像文件（不使用日志）
+#define FS_MOUNT_TIMING 0x2           // 记录各接口的延迟分布（每次调用多两次取时间）
+#define FS_MOUNT_SPARSE 0x4           // 写入区段布局文件的空洞时检测全零块，不为其分配
+
+// 挂载结果（FsStat.mount_state）
+#define FS_MOUNT_LOADED 0             // 从映像加载
+#define FS_MOUNT_CREATED 1            // 映像不存在，已新建并格式化
+#define FS_MOUNT_REFORMATTED 2        // 映像无效，已重新格式化
+
+// 接口编号（FsCounters中按接口统计的下标）
+#define FS_OP_FORMAT 0
+#define FS_OP_SYNC 1
+#define FS_OP_COMMIT 2
+#define FS_OP_MKDIR 3
+#define FS_OP_RMDIR 4
+#define FS_OP_CHDIR 5
+#define FS_OP_LISTDIR 6
+#define FS_OP_CREATE 7
+#define FS_OP_OPEN 8
+#define FS_OP_CLOSE 9
+#define FS_OP_READ 10
+#define FS_OP_WRITE 11
+#define FS_OP_PREAD 12
+#define FS_OP_PWRITE 13
+#define FS_OP_LSEEK 14
+#define FS_OP_UNLINK 15
+#define FS_OP_FALLOCATE 16
+#define FS_OP_DEFRAG 17               // fs_defrag和fs_fragstat
+#define FS_OP_SNAPSHOT 18             // fs_snapshot_create/list/rollback/delete
+#define FS_OP_DEDUP 19
+#define FS_OP_FSCK 20
+#define FS_OP_COUNT 21
+
+// 延迟分布的桶数：第i个桶统计耗时在[2^i, 2^(i+1))纳秒内的调用，最后一个桶包括更长的调用
+#define FS_LATENCY_BUCKETS 32
+
+/* 错误码 */
+#define FS_OK 0
+#define FS_ERR_NOENT (-1)             // 文件或目录不存在
+#define FS_ERR_EXIST (-2)             // 已存在
+#define FS_ERR_NOTDIR (-3)            // 不是目录
+#define FS_ERR_ISDIR (-4)             // 是目录
+#define FS_ERR_NOTEMPTY (-5)          // 目录不为空
+#define FS_ERR_NOSPC (-6)             // 磁盘空间不足
+#define FS_ERR_NAMETOOLONG (-7)       // 名字或路径过长
+#define FS_ERR_INVAL (-8)             // 参数无效
+#define FS_ERR_BADF (-9)              // 无效的文件描述符
+#define FS_ERR_PERM (-10)             // 没有权限
+#define FS_ERR_MFILE (-11)            // 打开文件数已达上限
+#define FS_ERR_BUSY (-12)             // 文件已打开或目录正在使用
+#define FS_ERR_IO (-13)               // 读写映像或日志失败
+#define FS_ERR_NOMEM (-14)            // 内存不足
+#define FS_ERR_CORRUPT (-15)          // 文件系统结构损坏
+
+/* 结构体定义 */
+
+// 文件系统实例（内部结构不对外公开）
+typedef struct fs_instance fs_instance;
+
+// 卷信息
+typedef struct {
+    unsigned int block_size;             // 块大小（字节）
+    unsigned int block_count;            // 块总数
+    unsigned int fat_width;              // FAT表项位宽
+    unsigned int data_blocks;            // 数据块总数
+    unsigned int free_blocks;            // 空闲数据块数
+    unsigned int shared_blocks;          // 被多处共享的数据块数（fs_dedup）
+    int default_layout;                  // 新建文件的默认布局
+    bool mapped;                         // 是否为映射模式
+    bool journaled;                      // 是否使用元数据日志
+    int mount_state;                     // 挂载结果（FS_MOUNT_*）
+    unsigned int replayed;               // 挂载时从日志恢复的事务数
+    unsigned int saved_blocks;           // 最近一次保存写回的块数
+    unsigned int saved_ranges;           // 最近一次保存写回的段数
+    unsigned long long cache_budget;     // 驻留预算（字节，0表示不限制，fs_set_cache_budget）
+    unsigned long long cache_resident;   // 计入预算的驻留量（字节，不含常驻的元数据区）
+    unsigned int dirty_blocks;           // 还没有写回映像的块数
+    unsigned int writeback_ms;           // 后台回写的间隔（毫秒，0表示未开启，fs_set_writeback）
+    unsigned int writeback_blocks;       // 后台回写的脏块阈值
+    int writeback_error;                 // 最近一次后台回写的结果（FS_OK或错误码）
+} FsStat;
+
+// 运行计数（fs_get_stats），自挂载或上次fs_reset_stats以来累计；成员都是unsigned long long
+typedef struct {
+    unsigned long long fat_hops;             // 沿FAT链前进的次数（文件定位、释放链、遍历目录链）
+    unsigned long long blocks_allocated;     // 分配的块数
+    unsigned long long blocks_freed;         // 释放的块数
+    unsigned long long dir_slots_scanned;    // 查找和遍历目录时检查的目录项和索引桶数
+    unsigned long long dcache_hits;          // 目录项缓存命中次数
+    unsigned long long dcache_misses;        // 目录项缓存未命中次数
+    unsigned long long bytes_read;           // 从数据块拷贝出的字节数
+    unsigned long long bytes_written;        // 拷贝到数据块的字节数（含补零）
+    unsigned long long fd_opens;             // 分配的文件描述符数
+    unsigned long long fd_closes;            // 释放的文件描述符数
+    unsigned long long journal_commits;      // 提交的日志事务数
+    unsigned long long cache_evictions;      // 超出驻留预算时淘汰的段数
+    unsigned long long readahead_blocks;     // 顺序读时预读的块数
+    unsigned long long zero_blocks_skipped;  // 写入空洞时因内容为零而未分配的块数
+    unsigned long long inline_promotions;    // 内联文件长大后改用数据块的次数
+    unsigned long long snapshot_copies;      // 快照后块第一次写回映像前复制旧内容的次数
+    unsigned long long shared_copies;        // 写入去重后共享的块之前复制的块数
+    unsigned long long writebacks;           // 后台回写的次数
+    unsigned long long writeback_blocks;     // 后台回写只持读锁预写到映像的块数
+    unsigned long long op_count[FS_OP_COUNT];      // 各接口的调用次数
+    unsigned long long op_total_ns[FS_OP_COUNT];   // 各接口的总耗时（纳秒，FS_MOUNT_TIMING时统计）
+    unsigned long long latency[FS_OP_COUNT][FS_LATENCY_BUCKETS];  // 各接口的延迟分布（FS_MOUNT_TIMING时统计）
+} FsCounters;
+
+// 碎片情况（fs_fragstat）：物理连续段越少、平均段长越大，顺序读越快
+typedef struct {
+    unsigned int files;                  // 文件数
+    unsigned int fragmented_files;       // 多于一段的文件数
+    unsigned int inline_files;           // 内容存放在小文件块中的文件数（不计块和段）
+    unsigned long long file_blocks;      // 文件数据块总数（区段布局不含区段表块，空洞不计）
+    unsigned long long file_runs;        // 文件的物理连续段总数
+    unsigned int dirs;                   // 目录数（含根目录）
+    unsigned long long dir_blocks;       // 目录块总数
+    unsigned long long dir_runs;         // 目录链的物理连续段总数
+} FsFragStat;
+
+// 去重结果（fs_dedup）
+typedef struct {
+    unsigned int files;                  // 参与去重的文件数（区段布局）
+    unsigned int skipped_files;          // 不参与去重的文件数（FAT链布局，内联文件不计）
+    unsigned long long blocks_scanned;   // 计算过哈希的块数
+    unsigned long long blocks_shared;    // 改为共享其他块的块数
+    unsigned long long blocks_reclaimed; // 因此空闲出来的块数
+} FsDedupStat;
+
+// 一致性检查结果（fs_fsck）：各类问题的个数，修复时problems中已修复的个数为repaired
+typedef struct {
+    unsigned int dirs;                   // 检查的目录数（含根目录）
+    unsigned int files;                  // 检查的文件数
+    unsigned long long blocks;           // 被引用的数据块数
+    unsigned int threads;                // 检查目录树使用的线程数
+    unsigned int meta_errors;            // 超级块或元数据区的FAT表项不合法
+    unsigned int bad_entries;            // 无效的目录项（名字、类型、首块或内联文件的槽位不合法）
+    unsigned int dir_links;              // "."或".."没有指向目录自身和父目录
+    unsigned int dir_indexes;            // 与目录内容不一致的名字索引
+    unsigned int chain_errors;           // 越界、成环或与其他链交叉的FAT链（目录、索引、FAT链布局的文件）
+    unsigned int extent_errors;          // 无效的区段或损坏的区段表溢出链
+    unsigned int small_errors;           // 与内联文件不一致的小文件块链或槽位图
+    unsigned int size_errors;            // 文件大小超出所占的块或槽
+    unsigned int cross_links;            // 同时被多处独占使用的块或槽
+    unsigned int lost_blocks;            // FAT中已占用但没有被引用的块
+    unsigned int free_referenced;        // 被引用但FAT中空闲的块
+    unsigned int ref_errors;             // 共享计数与实际引用数不一致的块
+    unsigned int problems;               // 问题总数
+    unsigned int repaired;               // 已修复的问题数
+} FsFsckStat;
+
+// 目录项信息（fs_listdir 回调参数）
+typedef struct {
+    char name[MAX_FILENAME_LENGTH];      // 名字
+    bool is_dir;                         // 是否为目录
+    bool extents;                        // 是否为区段布局
+    bool read;                           // 可读
+    bool write;                          // 可写
+    unsigned int size;                   // 文件大小
+    time_t create_time;                  // 创建时间
+} FsDirent;
+
+// fs_listdir 的回调，返回非0时停止遍历
+typedef int (*fs_listdir_cb)(const FsDirent* entry, void* arg);
+
+// 快照信息（fs_snapshot_list 回调参数）
+typedef struct {
+    char name[MAX_FILENAME_LENGTH];      // 快照名
+    time_t create_time;                  // 创建时间
+    unsigned int saved_blocks;           // 创建后被覆盖、已复制保存旧内容的块数
+} FsSnapshot;
+
+// fs_snapshot_list 的回调，返回非0时停止遍历
+typedef int (*fs_snapshot_cb)(const FsSnapshot* snap, void* arg);
+
+/* 实例管理 */
+int fs_mount(fs_instance** out, const char* image_path, const char* journal_path, int flags);
+int fs_unmount(fs_instance* fs);
+int fs_format(fs_instance* fs, int layout, unsigned int block_size, unsigned int block_count, unsigned int fat_width);
+int fs_sync(fs_instance* fs);
+int fs_commit(fs_instance* fs);
+int fs_set_group_commit(fs_instance* fs, unsigned int ops, unsigned int ms);
+int fs_set_writeback(fs_instance* fs, unsigned int interval_ms, unsigned int dirty_blocks);
+int fs_set_cache_budget(fs_instance* fs, unsigned long long bytes);
+int fs_fragstat(fs_instance* fs, FsFragStat* st);
+int fs_defrag(fs_instance* fs, unsigned int* moved);
+int fs_dedup(fs_instance* fs, FsDedupStat* st);
+int fs_fsck(fs_instance* fs, bool repair, FsFsckStat* st);
+int fs_statfs(fs_instance* fs, FsStat* st);
+int fs_get_stats(fs_instance* fs, FsCounters* out);
+int fs_reset_stats(fs_instance* fs);
+const char* fs_op_name(int op);
+
+/* 快照（写时复制，映射模式不支持） */
+int fs_snapshot_create(fs_instance* fs, const char* name);
+int fs_snapshot_list(fs_instance* fs, fs_snapshot_cb cb, void* arg);
+int fs_snapshot_rollback(fs_instance* fs, const char* name);
+int fs_snapshot_delete(fs_instance* fs, const char* name);
+
+/* 目录操作 */
+int fs_mkdir(fs_instance* fs, const char* path);
+int fs_rmdir(fs_instance* fs, const char* path);
+int fs_chdir(fs_instance* fs, const char* path);
+int fs_getcwd(fs_instance* fs, char* buf, size_t size);
+int fs_realpath(fs_instance* fs, const char* path, char* buf, size_t size);
+int fs_listdir(fs_instance* fs, const char* path, fs_listdir_cb cb, void* arg);
+
+/* 文件操作 */
+// 读写位置和文件大小都不超过FS_MAX_FILE_SIZE：写入或预留超出时返回FS_ERR_INVAL（不做部分写入），
+// 从文件末尾之后读时返回0
+int fs_create(fs_instance* fs, const char* path, int layout);
+int fs_open(fs_instance* fs, const char* path, char mode);
+int fs_open_hint(fs_instance* fs, const char* path, char mode, unsigned int size_hint);
+int fs_fallocate(fs_instance* fs, int fd, unsigned int length);
+int fs_close(fs_instance* fs, int fd);
+int fs_read(fs_instance* fs, int fd, char* buffer, int length);
+int fs_write(fs_instance* fs, int fd, const char* buffer, int length);
+int fs_pread(fs_instance* fs, int fd, char* buffer, int length, unsigned int offset);
+int fs_pwrite(fs_instance* fs, int fd, const char* buffer, int length, unsigned int offset);
+int fs_lseek(fs_instance* fs, int fd, int offset, int whence);
+int fs_unlink(fs_instance* fs, const char* path);
+
+const char* fs_strerror(int err);
+
+#endif
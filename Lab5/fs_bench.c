@@ -0,0 +1,273 @@
+/*
+ * 文件系统多线程扩展性测试
+ *
+ * 在同一个文件系统实例上用1到N个线程并发访问，每个线程使用自己的目录和文件：
+ *   读：随机位置读4KB
+ *   混合：80%随机读4KB，15%随机写4KB，5%创建新文件
+ * 输出各线程数下的吞吐量及相对单线程的加速比。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "douzza_fs.h"
+
+/* 常量定义 */
+#define BENCH_IMAGE "fs_bench.img"     // 默认映像文件名
+#define BENCH_JOURNAL "fs_bench.jnl"   // 日志文件名（-j时使用）
+#define BENCH_BLOCK_SIZE 4096          // 块大小
+#define BENCH_BLOCK_COUNT 65536        // 块数（256MB）
+#define FILE_SIZE (1024 * 1024)        // 每个线程的数据文件大小
+#define IO_SIZE 4096                   // 每次读写的字节数
+#define DEFAULT_OPS 200000             // 每个线程的默认操作数
+
+/* 结构体定义 */
+
+// 测试类型
+typedef enum {
+    BENCH_READ,
+    BENCH_MIXED
+} BenchKind;
+
+// 线程参数
+typedef struct {
+    fs_instance* fs;
+    pthread_barrier_t* barrier;
+    BenchKind kind;
+    int id;                              // 线程编号，对应目录 /t<id>
+    int ops;                             // 操作数
+    int creates;                         // 创建的文件数（混合测试后清理）
+    int errors;                          // 失败的操作数
+} BenchThread;
+
+/* 函数声明 */
+double now_sec();
+int prepare(fs_instance* fs, int threads);
+void* bench_thread(void* arg);
+double run_bench(fs_instance* fs, BenchKind kind, int threads, int ops);
+
+// 当前时间（秒，单调时钟）
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 格式化并为每个线程创建目录和数据文件
+int prepare(fs_instance* fs, int threads) {
+    int ret = fs_format(fs, LAYOUT_EXTENT, BENCH_BLOCK_SIZE, BENCH_BLOCK_COUNT, 0);
+    if (ret != FS_OK) {
+        printf("格式化失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+
+    char* buffer = (char*)malloc(FILE_SIZE);
+    if (buffer == NULL) {
+        printf("内存分配失败！\n");
+        return -1;
+    }
+    for (int i = 0; i < FILE_SIZE; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+
+    for (int t = 0; t < threads; t++) {
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "/t%d", t);
+        if ((ret = fs_mkdir(fs, path)) != FS_OK) {
+            break;
+        }
+        snprintf(path, sizeof(path), "/t%d/data", t);
+        if ((ret = fs_create(fs, path, LAYOUT_DEFAULT)) != FS_OK) {
+            break;
+        }
+        int fd = fs_open(fs, path, 'w');
+        if (fd < 0) {
+            ret = fd;
+            break;
+        }
+        ret = fs_write(fs, fd, buffer, FILE_SIZE);
+        fs_close(fs, fd);
+        if (ret != FILE_SIZE) {
+            ret = ret < 0 ? ret : FS_ERR_NOSPC;
+            break;
+        }
+        ret = FS_OK;
+    }
+    free(buffer);
+
+    if (ret != FS_OK) {
+        printf("准备测试文件失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+    return fs_sync(fs) == FS_OK ? 0 : -1;
+}
+
+// 测试线程：打开自己的数据文件，等所有线程就绪后开始计时的操作
+void* bench_thread(void* arg) {
+    BenchThread* bt = (BenchThread*)arg;
+    char path[MAX_PATH_LENGTH];
+    char buffer[IO_SIZE];
+    unsigned int seed = 12345u + bt->id;
+
+    snprintf(path, sizeof(path), "/t%d/data", bt->id);
+    int fd = fs_open(bt->fs, path, bt->kind == BENCH_READ ? 'r' : 'a');
+    memset(buffer, 'x', sizeof(buffer));
+
+    pthread_barrier_wait(bt->barrier);
+
+    for (int i = 0; i < bt->ops && fd >= 0; i++) {
+        unsigned int offset = (rand_r(&seed) % (FILE_SIZE / IO_SIZE)) * IO_SIZE;
+        int r = bt->kind == BENCH_READ ? 0 : rand_r(&seed) % 100;
+        int ret;
+
+        if (r < 80) {
+            ret = fs_pread(bt->fs, fd, buffer, IO_SIZE, offset);
+        } else if (r < 95) {
+            ret = fs_pwrite(bt->fs, fd, buffer, IO_SIZE, offset);
+        } else {
+            snprintf(path, sizeof(path), "/t%d/n%d", bt->id, bt->creates);
+            ret = fs_create(bt->fs, path, LAYOUT_DEFAULT);
+            if (ret == FS_OK) {
+                bt->creates++;
+            }
+        }
+        if (ret < 0) {
+            bt->errors++;
+        }
+    }
+
+    if (fd >= 0) {
+        fs_close(bt->fs, fd);
+    } else {
+        bt->errors = bt->ops;
+    }
+    return NULL;
+}
+
+// 用threads个线程运行一轮测试，返回总吞吐量（次/秒）
+double run_bench(fs_instance* fs, BenchKind kind, int threads, int ops) {
+    pthread_t tids[MAX_OPEN_FILES];
+    BenchThread args[MAX_OPEN_FILES];
+    pthread_barrier_t barrier;
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        args[t].fs = fs;
+        args[t].barrier = &barrier;
+        args[t].kind = kind;
+        args[t].id = t;
+        args[t].ops = ops;
+        args[t].creates = 0;
+        args[t].errors = 0;
+        pthread_create(&tids[t], NULL, bench_thread, &args[t]);
+    }
+
+    // 所有线程打开文件后同时开始
+    pthread_barrier_wait(&barrier);
+    double start = now_sec();
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double elapsed = now_sec() - start;
+    pthread_barrier_destroy(&barrier);
+
+    // 删除混合测试创建的文件，不计入时间
+    int errors = 0;
+    for (int t = 0; t < threads; t++) {
+        errors += args[t].errors;
+        for (int k = 0; k < args[t].creates; k++) {
+            char path[MAX_PATH_LENGTH];
+            snprintf(path, sizeof(path), "/t%d/n%d", t, k);
+            fs_unlink(fs, path);
+        }
+    }
+    if (errors > 0) {
+        printf("警告：%d 次操作失败\n", errors);
+    }
+
+    return (double)threads * ops / elapsed;
+}
+
+// 主函数
+// 用法: fs_bench [-t 最大线程数] [-n 每线程操作数] [-m] [-j] [映像文件]
+int main(int argc, char* argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 0 ? (int)cpus : 1;
+    int ops = DEFAULT_OPS;
+    int flags = 0;
+    bool journal = false;
+    const char* image = BENCH_IMAGE;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            ops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            journal = true;
+        } else if (argv[i][0] != '-') {
+            image = argv[i];
+        } else {
+            printf("用法: %s [-t 最大线程数] [-n 每线程操作数] [-m] [-j] [映像文件]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // 每个线程占用一个文件描述符
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    if (max_threads > MAX_OPEN_FILES) {
+        max_threads = MAX_OPEN_FILES;
+    }
+    if (ops < 1) {
+        ops = 1;
+    }
+
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal ? BENCH_JOURNAL : NULL, flags);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return 1;
+    }
+    if (prepare(fs, max_threads) != 0) {
+        fs_unmount(fs);
+        return 1;
+    }
+
+    printf("在线CPU数: %ld，每线程 %d 次操作，每次 %d 字节%s%s\n", cpus, ops, IO_SIZE,
+           flags & FS_MOUNT_MMAP ? "，映射模式" : "", journal ? "，使用日志" : "");
+    printf("线程数\t读(次/秒)\t加速比\t混合(次/秒)\t加速比\n");
+
+    double read_base = 0, mixed_base = 0;
+    // 线程数按1、2、4……加倍，最后一轮为最大线程数
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        double read_rate = run_bench(fs, BENCH_READ, threads, ops);
+        double mixed_rate = run_bench(fs, BENCH_MIXED, threads, ops);
+        if (threads == 1) {
+            read_base = read_rate;
+            mixed_base = mixed_rate;
+        }
+        printf("%d\t%.0f\t%.2f\t%.0f\t%.2f\n", threads,
+               read_rate, read_rate / read_base, mixed_rate, mixed_rate / mixed_base);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    fs_unmount(fs);
+    unlink(image);
+    if (journal) {
+        unlink(BENCH_JOURNAL);
+    }
+    return 0;
+}
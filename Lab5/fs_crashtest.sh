@@ -0,0 +1,27 @@
+#!/bin/sh
+# 崩溃恢复测试：反复启动 fs_stress -k 写入（使用日志和后台回写），在随机时刻 kill -9，
+# 再用 fs_stress -v 挂载（重放日志）检查一致性并校验每个文件的内容；每次都在上次崩溃后的卷上继续
+# 用法: sh fs_crashtest.sh [次数]
+
+runs=${1:-20}
+image=fs_crash.img
+journal=fs_crash.jnl
+
+rm -f "$image" "$journal"
+i=1
+while [ "$i" -le "$runs" ]; do
+    ./fs_stress -k "$image" "$journal" > /dev/null &
+    pid=$!
+    # 0.1~0.9秒后杀死写入进程
+    sleep "0.$(( (i * 37 + $$) % 9 + 1 ))"
+    kill -9 "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+    if ! ./fs_stress -v "$image" "$journal"; then
+        echo "第 $i 次崩溃后检查失败，保留 $image 和 $journal"
+        exit 1
+    fi
+    i=$((i + 1))
+done
+
+rm -f "$image" "$journal"
+echo "崩溃恢复测试 $runs 次：通过"
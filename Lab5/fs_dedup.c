@@ -0,0 +1,89 @@
+/*
+ * 离线去重工具
+ *
+ * 挂载映像文件（先重放日志中已提交的事务），把区段布局文件中内容相同的数据块改为共享同一块，
+ * 输出扫描和回收的块数后写回映像并卸载。与命令行的dedup命令相同，但不需要启动命令行，
+ * 适合在导入大量相同内容的文件之后整理映像。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "douzza_fs.h"
+
+/* 常量定义 */
+#define DEFAULT_IMAGE "filesystem.img"     // 默认映像文件名（与命令行相同）
+#define DEFAULT_JOURNAL "filesystem.jnl"   // 默认日志文件名（与命令行相同）
+
+// 主函数
+// 用法: fs_dedup [-m] [映像文件 [日志文件]]
+//   -m 以映射模式打开映像文件（不使用日志）
+int main(int argc, char* argv[]) {
+    int flags = 0;
+    const char* image = DEFAULT_IMAGE;
+    const char* journal = DEFAULT_JOURNAL;
+    int positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            flags |= FS_MOUNT_MMAP;
+        } else if (argv[i][0] != '-' && positional == 0) {
+            image = argv[i];
+            positional++;
+        } else if (argv[i][0] != '-' && positional == 1) {
+            journal = argv[i];
+            positional++;
+        } else {
+            printf("用法: %s [-m] [映像文件 [日志文件]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // 映像不存在时fs_mount会新建一个空卷，离线去重没有意义
+    if (access(image, F_OK) != 0) {
+        printf("映像文件 %s 不存在！\n", image);
+        return 1;
+    }
+
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal, flags);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return 1;
+    }
+    FsStat before;
+    fs_statfs(fs, &before);
+    if (before.mount_state != FS_MOUNT_LOADED) {
+        // 无效的映像已在内存中重新格式化，不卸载以免写回覆盖原映像
+        printf("映像文件 %s 无效！\n", image);
+        return 1;
+    }
+
+    FsDedupStat st;
+    ret = fs_dedup(fs, &st);
+    if (ret != FS_OK) {
+        // 提交失败时内存中的卷已经改过，卸载时仍会尝试写回
+        printf("去重失败：%s！\n", fs_strerror(ret));
+        if (st.blocks_shared > 0) {
+            printf("内存中已有 %llu 块改为共享（回收 %llu 块），卸载时再次写回\n", st.blocks_shared, st.blocks_reclaimed);
+        }
+        fs_unmount(fs);
+        return 1;
+    }
+    FsStat after;
+    fs_statfs(fs, &after);
+    printf("扫描了 %u 个区段布局文件的 %llu 块（FAT链布局的 %u 个文件不参与）\n",
+           st.files, st.blocks_scanned, st.skipped_files);
+    printf("%llu 块改为共享，回收 %llu 块（%.1f KB）\n", st.blocks_shared, st.blocks_reclaimed,
+           (double)st.blocks_reclaimed * before.block_size / 1024);
+    printf("已用数据块：%u -> %u\n", before.data_blocks - before.free_blocks, after.data_blocks - after.free_blocks);
+
+    ret = fs_unmount(fs);
+    if (ret != FS_OK) {
+        printf("写回映像失败：%s！\n", fs_strerror(ret));
+        return 1;
+    }
+    return 0;
+}
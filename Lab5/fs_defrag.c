@@ -0,0 +1,105 @@
+/*
+ * 离线碎片整理工具
+ *
+ * 挂载映像文件（先重放日志中已提交的事务），把每个分散的文件搬到一段连续块中，
+ * 紧凑排列目录项，输出整理前后的碎片情况后写回映像并卸载。
+ * 与命令行的defrag命令相同，但不需要启动命令行，适合对长期使用的映像定期整理。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "douzza_fs.h"
+
+/* 常量定义 */
+#define DEFAULT_IMAGE "filesystem.img"     // 默认映像文件名（与命令行相同）
+#define DEFAULT_JOURNAL "filesystem.jnl"   // 默认日志文件名（与命令行相同）
+
+// 打印碎片情况
+void print_fragstat(const char* label, const FsFragStat* st) {
+    printf("%s：\n", label);
+    // 每个文件的段数只按使用数据块的文件计算
+    unsigned int block_files = st->files - st->inline_files;
+    printf("  文件 %u 个（分散的 %u 个，内联的 %u 个），%llu 块共 %llu 段，平均段长 %.1f 块，每个文件 %.2f 段\n",
+           st->files, st->fragmented_files, st->inline_files, st->file_blocks, st->file_runs,
+           st->file_runs ? (double)st->file_blocks / st->file_runs : 0.0,
+           block_files ? (double)st->file_runs / block_files : 0.0);
+    printf("  目录 %u 个，%llu 块共 %llu 段\n", st->dirs, st->dir_blocks, st->dir_runs);
+}
+
+// 主函数
+// 用法: fs_defrag [-m] [-n] [映像文件 [日志文件]]
+//   -m 以映射模式打开映像文件（不使用日志）
+//   -n 只显示碎片情况，不整理
+int main(int argc, char* argv[]) {
+    int flags = 0;
+    bool check_only = false;
+    const char* image = DEFAULT_IMAGE;
+    const char* journal = DEFAULT_JOURNAL;
+    int positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            check_only = true;
+        } else if (argv[i][0] != '-' && positional == 0) {
+            image = argv[i];
+            positional++;
+        } else if (argv[i][0] != '-' && positional == 1) {
+            journal = argv[i];
+            positional++;
+        } else {
+            printf("用法: %s [-m] [-n] [映像文件 [日志文件]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // 映像不存在时fs_mount会新建一个空卷，离线整理没有意义
+    if (access(image, F_OK) != 0) {
+        printf("映像文件 %s 不存在！\n", image);
+        return 1;
+    }
+
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal, flags);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return 1;
+    }
+    FsStat st;
+    fs_statfs(fs, &st);
+    if (st.mount_state != FS_MOUNT_LOADED) {
+        // 无效的映像已在内存中重新格式化，不卸载以免写回覆盖原映像
+        printf("映像文件 %s 无效！\n", image);
+        return 1;
+    }
+
+    FsFragStat before;
+    fs_fragstat(fs, &before);
+    print_fragstat(check_only ? "碎片情况" : "整理前", &before);
+
+    if (!check_only) {
+        unsigned int moved = 0;
+        ret = fs_defrag(fs, &moved);
+        if (ret != FS_OK) {
+            printf("碎片整理失败：%s！\n", fs_strerror(ret));
+            fs_unmount(fs);
+            return 1;
+        }
+        FsFragStat after;
+        fs_fragstat(fs, &after);
+        print_fragstat("整理后", &after);
+        printf("搬动了 %u 个文件和目录\n", moved);
+    }
+
+    ret = fs_unmount(fs);
+    if (ret != FS_OK) {
+        printf("写回映像失败：%s！\n", fs_strerror(ret));
+        return 1;
+    }
+    return 0;
+}
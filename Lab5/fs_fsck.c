@@ -0,0 +1,129 @@
+/*
+ * 离线一致性检查工具
+ *
+ * 挂载映像文件（先重放日志中已提交的事务），从根目录起检查目录树、各文件占用的块和槽、
+ * 名字索引与小文件块链，最后逐块对照FAT，输出各类问题的个数；加-r时同时修复并写回映像。
+ * 大卷的检查用多个线程并行进行，修复只用一个线程。
+ *
+ * 退出码与常见的fsck相同：0 没有问题，1 问题已全部修复，4 还有未修复的问题，8 无法完成检查
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "douzza_fs.h"
+
+/* 常量定义 */
+#define DEFAULT_IMAGE "filesystem.img"     // 默认映像文件名（与命令行相同）
+#define DEFAULT_JOURNAL "filesystem.jnl"   // 默认日志文件名（与命令行相同）
+
+#define EXIT_CLEAN 0          // 没有问题
+#define EXIT_REPAIRED 1       // 问题已全部修复
+#define EXIT_UNCORRECTED 4    // 还有未修复的问题
+#define EXIT_FAILED 8         // 无法完成检查
+
+// 主函数
+// 用法: fs_fsck [-m] [-r] [映像文件 [日志文件]]
+//   -m 以映射模式打开映像文件（不使用日志）
+//   -r 修复发现的问题并写回映像
+int main(int argc, char* argv[]) {
+    int flags = 0;
+    bool repair = false;
+    const char* image = DEFAULT_IMAGE;
+    const char* journal = DEFAULT_JOURNAL;
+    int positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            repair = true;
+        } else if (argv[i][0] != '-' && positional == 0) {
+            image = argv[i];
+            positional++;
+        } else if (argv[i][0] != '-' && positional == 1) {
+            journal = argv[i];
+            positional++;
+        } else {
+            printf("用法: %s [-m] [-r] [映像文件 [日志文件]]\n", argv[0]);
+            return EXIT_FAILED;
+        }
+    }
+
+    // 映像不存在时fs_mount会新建一个空卷，检查没有意义
+    if (access(image, F_OK) != 0) {
+        printf("映像文件 %s 不存在！\n", image);
+        return EXIT_FAILED;
+    }
+
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal, flags);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return EXIT_FAILED;
+    }
+    FsStat info;
+    fs_statfs(fs, &info);
+    if (info.mount_state != FS_MOUNT_LOADED) {
+        // 无效的映像已在内存中重新格式化，不卸载以免写回覆盖原映像
+        printf("映像文件 %s 无效！\n", image);
+        return EXIT_FAILED;
+    }
+
+    FsFsckStat st;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = fs_fsck(fs, repair, &st);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (ret != FS_OK) {
+        printf("检查失败：%s！\n", fs_strerror(ret));
+        fs_unmount(fs);
+        return EXIT_FAILED;
+    }
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("检查了 %u 个目录、%u 个文件、%llu 个数据块（%u 个线程，%.1f ms）\n",
+           st.dirs, st.files, st.blocks, st.threads, ms);
+    struct {
+        const char* name;
+        unsigned int count;
+    } problems[] = {
+        {"元数据区的错误", st.meta_errors},
+        {"无效的目录项", st.bad_entries},
+        {"错误的\".\"或\"..\"", st.dir_links},
+        {"无效的目录索引", st.dir_indexes},
+        {"断开、成环或交叉的FAT链", st.chain_errors},
+        {"区段表错误", st.extent_errors},
+        {"小文件块错误", st.small_errors},
+        {"文件大小错误", st.size_errors},
+        {"交叉引用的块或槽", st.cross_links},
+        {"丢失的块", st.lost_blocks},
+        {"被引用的空闲块", st.free_referenced},
+        {"共享计数错误", st.ref_errors},
+    };
+    for (size_t i = 0; i < sizeof(problems) / sizeof(problems[0]); i++) {
+        if (problems[i].count > 0) {
+            printf("  %s: %u\n", problems[i].name, problems[i].count);
+        }
+    }
+    if (st.problems == 0) {
+        printf("没有发现问题\n");
+    } else if (repair) {
+        printf("发现 %u 个问题，已修复 %u 个\n", st.problems, st.repaired);
+    } else {
+        printf("发现 %u 个问题，加 -r 修复\n", st.problems);
+    }
+
+    ret = fs_unmount(fs);
+    if (ret != FS_OK) {
+        printf("写回映像失败：%s！\n", fs_strerror(ret));
+        return EXIT_FAILED;
+    }
+    if (st.problems == 0) {
+        return EXIT_CLEAN;
+    }
+    return st.repaired == st.problems ? EXIT_REPAIRED : EXIT_UNCORRECTED;
+}
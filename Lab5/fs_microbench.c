@@ -0,0 +1,506 @@
+/*
+ * 文件系统操作微基准测试
+ *
+ * 直接调用库接口（不经过命令行），在不同的卷填充率和目录大小下测量：
+ *   create / open / rm     在含有若干文件的目录中创建、打开关闭、删除文件
+ *   ls                     遍历目录
+ *   cd                     切换到32层深的目录再回到根目录
+ *   seq_write / seq_read   以64KB为单位顺序读写不同大小的文件
+ *   rand_write / rand_read 在文件中随机位置读写4KB
+ *   save / load            修改少量块后保存，卸载后重新挂载
+ * 每项输出一行制表符分隔的结果：吞吐量（次/秒、MB/秒）和单次操作延迟的p50/p99（微秒），
+ * 便于用脚本比较不同版本的结果。进度信息输出到标准错误。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "douzza_fs.h"
+
+/* 常量定义 */
+#define BENCH_IMAGE "fs_microbench.img"     // 默认映像文件名
+#define BENCH_JOURNAL "fs_microbench.jnl"   // 日志文件名（-j时使用）
+#define BENCH_BLOCK_SIZE 4096               // 块大小
+#define BENCH_BLOCK_COUNT 65536             // 块数（256MB）
+#define SEQ_IO_SIZE (64 * 1024)             // 顺序读写每次的字节数
+#define RAND_IO_SIZE 4096                   // 随机读写每次的字节数
+#define FILL_CHUNK_SIZE (1024 * 1024)       // 填充卷时每次写入的字节数
+#define CD_DEPTH 32                         // cd测试的目录深度
+
+// 各项测试的默认操作数（-n 按比例缩放）
+#define NAME_OPS 500                        // create、rm
+#define OPEN_OPS 2000                       // open
+#define LS_OPS 100                          // ls
+#define CD_OPS 2000                         // cd
+#define IO_OPS 2000                         // 读写
+#define SAVE_OPS 20                         // save
+#define LOAD_OPS 3                          // load
+
+/* 结构体定义 */
+
+// 一项测试的延迟样本
+typedef struct {
+    long long* ns;                       // 每次操作的耗时（纳秒）
+    int count;
+    int cap;
+    long long bytes;                     // 读写的总字节数
+    long long total_ns;                  // 总耗时
+} Samples;
+
+// 当前测试的参数（输出到结果行中）
+typedef struct {
+    fs_instance* fs;
+    const char* image;
+    const char* journal;
+    int flags;
+    int layout;
+    int fill;                            // 卷填充率（百分比）
+    int dir_size;                        // 目录中已有的文件数（与目录无关的测试为0）
+    unsigned int file_size;              // 文件大小（与文件无关的测试为0）
+    double scale;                        // 操作数缩放比例
+    unsigned int seed;
+} Bench;
+
+/* 函数声明 */
+long long now_ns();
+void samples_init(Samples* s);
+void samples_add(Samples* s, long long ns, long long bytes);
+int cmp_ll(const void* a, const void* b);
+void report(Bench* b, const char* name, Samples* s);
+int scaled(Bench* b, int ops);
+int fill_volume(Bench* b, int percent);
+int make_dir(Bench* b, int dir_size);
+int count_dirent(const FsDirent* entry, void* arg);
+void bench_names(Bench* b);
+void bench_ls(Bench* b);
+void bench_cd(Bench* b);
+void bench_io(Bench* b);
+void bench_save_load(Bench* b);
+
+// 当前时间（纳秒，单调时钟）
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void samples_init(Samples* s) {
+    memset(s, 0, sizeof(Samples));
+}
+
+// 记录一次操作的耗时
+void samples_add(Samples* s, long long ns, long long bytes) {
+    if (s->count == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 1024;
+        long long* p = (long long*)realloc(s->ns, cap * sizeof(long long));
+        if (p == NULL) {
+            return;
+        }
+        s->ns = p;
+        s->cap = cap;
+    }
+    s->ns[s->count++] = ns;
+    s->bytes += bytes;
+    s->total_ns += ns;
+}
+
+int cmp_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 输出一行结果并释放样本
+void report(Bench* b, const char* name, Samples* s) {
+    if (s->count > 0) {
+        qsort(s->ns, s->count, sizeof(long long), cmp_ll);
+        double secs = s->total_ns / 1e9;
+        long long p50 = s->ns[(s->count - 1) / 2];
+        long long p99 = s->ns[(int)((s->count - 1) * 0.99)];
+        printf("%s\t%s\t%d\t%d\t%u\t%d\t%.0f\t%.1f\t%.2f\t%.2f\n",
+               name, b->layout == LAYOUT_EXTENT ? "extent" : "fat", b->fill, b->dir_size, b->file_size,
+               s->count, s->count / secs, s->bytes / secs / (1024 * 1024), p50 / 1e3, p99 / 1e3);
+        fflush(stdout);
+    }
+    free(s->ns);
+    samples_init(s);
+}
+
+int scaled(Bench* b, int ops) {
+    int n = (int)(ops * b->scale);
+    return n > 0 ? n : 1;
+}
+
+// 写入填充文件，使已用数据块达到卷的percent%
+int fill_volume(Bench* b, int percent) {
+    FsStat st;
+    fs_statfs(b->fs, &st);
+    unsigned long long target = (unsigned long long)st.data_blocks * percent / 100;
+    if (target == 0) {
+        return 0;
+    }
+
+    int ret = fs_create(b->fs, "/fill", LAYOUT_DEFAULT);
+    int fd = ret == FS_OK ? fs_open(b->fs, "/fill", 'w') : ret;
+    if (fd < 0) {
+        return fd;
+    }
+
+    char* chunk = (char*)calloc(1, FILL_CHUNK_SIZE);
+    ret = chunk != NULL ? FS_OK : FS_ERR_NOMEM;
+    while (ret == FS_OK) {
+        fs_statfs(b->fs, &st);
+        unsigned long long used = st.data_blocks - st.free_blocks;
+        if (used >= target) {
+            break;
+        }
+        unsigned long long left = (target - used) * st.block_size;
+        int n = left < FILL_CHUNK_SIZE ? (int)left : FILL_CHUNK_SIZE;
+        int w = fs_write(b->fs, fd, chunk, n);
+        if (w != n) {
+            ret = w < 0 ? w : FS_ERR_NOSPC;
+        }
+    }
+    free(chunk);
+    fs_close(b->fs, fd);
+    return ret;
+}
+
+// 创建含有dir_size个文件的目录 /dir<dir_size>
+int make_dir(Bench* b, int dir_size) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/dir%d", dir_size);
+    int ret = fs_mkdir(b->fs, path);
+    for (int i = 0; i < dir_size && ret == FS_OK; i++) {
+        snprintf(path, sizeof(path), "/dir%d/f%d", dir_size, i);
+        ret = fs_create(b->fs, path, LAYOUT_DEFAULT);
+    }
+    return ret;
+}
+
+int count_dirent(const FsDirent* entry, void* arg) {
+    (void)entry;
+    (*(int*)arg)++;
+    return 0;
+}
+
+// create、open、rm：在含有dir_size个文件的目录中操作
+void bench_names(Bench* b) {
+    char path[MAX_PATH_LENGTH];
+    Samples s;
+    samples_init(&s);
+
+    int n = scaled(b, NAME_OPS);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/dir%d/c%d", b->dir_size, i);
+        long long t = now_ns();
+        int ret = fs_create(b->fs, path, LAYOUT_DEFAULT);
+        t = now_ns() - t;
+        if (ret == FS_OK) {
+            samples_add(&s, t, 0);
+        }
+    }
+    report(b, "create", &s);
+
+    // 随机打开目录中已有的文件再关闭
+    int m = scaled(b, OPEN_OPS);
+    for (int i = 0; i < m; i++) {
+        int k = rand_r(&b->seed) % (b->dir_size + n);
+        if (k < b->dir_size) {
+            snprintf(path, sizeof(path), "/dir%d/f%d", b->dir_size, k);
+        } else {
+            snprintf(path, sizeof(path), "/dir%d/c%d", b->dir_size, k - b->dir_size);
+        }
+        long long t = now_ns();
+        int fd = fs_open(b->fs, path, 'r');
+        if (fd >= 0) {
+            fs_close(b->fs, fd);
+            samples_add(&s, now_ns() - t, 0);
+        }
+    }
+    report(b, "open", &s);
+
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/dir%d/c%d", b->dir_size, i);
+        long long t = now_ns();
+        int ret = fs_unlink(b->fs, path);
+        t = now_ns() - t;
+        if (ret == FS_OK) {
+            samples_add(&s, t, 0);
+        }
+    }
+    report(b, "rm", &s);
+}
+
+// ls：遍历含有dir_size个文件的目录
+void bench_ls(Bench* b) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/dir%d", b->dir_size);
+    Samples s;
+    samples_init(&s);
+
+    int n = scaled(b, LS_OPS);
+    for (int i = 0; i < n; i++) {
+        int entries = 0;
+        long long t = now_ns();
+        int ret = fs_listdir(b->fs, path, count_dirent, &entries);
+        t = now_ns() - t;
+        if (ret == FS_OK) {
+            samples_add(&s, t, 0);
+        }
+    }
+    report(b, "ls", &s);
+}
+
+// cd：切换到 /deep/d1/.../d32 再回到根目录，每次切换计一次操作
+void bench_cd(Bench* b) {
+    char path[MAX_PATH_LENGTH] = "/deep";
+    int ret = fs_mkdir(b->fs, path);
+    for (int d = 1; d <= CD_DEPTH && ret == FS_OK; d++) {
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/d%d", d);
+        ret = fs_mkdir(b->fs, path);
+    }
+    if (ret != FS_OK) {
+        fprintf(stderr, "创建深层目录失败：%s！\n", fs_strerror(ret));
+        return;
+    }
+
+    Samples s;
+    samples_init(&s);
+    int n = scaled(b, CD_OPS);
+    for (int i = 0; i < n; i++) {
+        long long t = now_ns();
+        ret = fs_chdir(b->fs, i % 2 == 0 ? path : "/");
+        t = now_ns() - t;
+        if (ret == FS_OK) {
+            samples_add(&s, t, 0);
+        }
+    }
+    fs_chdir(b->fs, "/");
+    report(b, "cd", &s);
+}
+
+// 顺序和随机读写file_size大小的文件
+void bench_io(Bench* b) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/io%u", b->file_size);
+    char* buffer = (char*)malloc(SEQ_IO_SIZE);
+    if (buffer == NULL || fs_create(b->fs, path, LAYOUT_DEFAULT) != FS_OK) {
+        free(buffer);
+        return;
+    }
+    memset(buffer, 'x', SEQ_IO_SIZE);
+
+    Samples s;
+    samples_init(&s);
+    int n = scaled(b, IO_OPS);
+    unsigned int chunks = (b->file_size + SEQ_IO_SIZE - 1) / SEQ_IO_SIZE;
+
+    // 顺序写：每轮以'w'模式打开（清空文件）后从头写到file_size
+    while (s.count < n) {
+        int fd = fs_open(b->fs, path, 'w');
+        if (fd < 0) {
+            break;
+        }
+        for (unsigned int c = 0; c < chunks; c++) {
+            unsigned int len = b->file_size - c * SEQ_IO_SIZE < SEQ_IO_SIZE ? b->file_size - c * SEQ_IO_SIZE : SEQ_IO_SIZE;
+            long long t = now_ns();
+            int w = fs_write(b->fs, fd, buffer, len);
+            t = now_ns() - t;
+            if (w != (int)len) {
+                n = 0;
+                break;
+            }
+            samples_add(&s, t, len);
+        }
+        fs_close(b->fs, fd);
+    }
+    report(b, "seq_write", &s);
+
+    int fd = fs_open(b->fs, path, 'a');
+    if (fd < 0) {
+        free(buffer);
+        return;
+    }
+
+    // 顺序读：读到末尾后回到开头
+    n = scaled(b, IO_OPS);
+    fs_lseek(b->fs, fd, 0, MY_SEEK_SET);
+    for (int i = 0; i < n; i++) {
+        long long t = now_ns();
+        int r = fs_read(b->fs, fd, buffer, SEQ_IO_SIZE);
+        t = now_ns() - t;
+        if (r <= 0) {
+            fs_lseek(b->fs, fd, 0, MY_SEEK_SET);
+            i--;
+            continue;
+        }
+        samples_add(&s, t, r);
+    }
+    report(b, "seq_read", &s);
+
+    // 随机读写：4KB对齐的随机位置
+    unsigned int slots = b->file_size / RAND_IO_SIZE;
+    if (slots > 0) {
+        for (int i = 0; i < n; i++) {
+            unsigned int offset = (rand_r(&b->seed) % slots) * RAND_IO_SIZE;
+            long long t = now_ns();
+            int w = fs_pwrite(b->fs, fd, buffer, RAND_IO_SIZE, offset);
+            t = now_ns() - t;
+            if (w == RAND_IO_SIZE) {
+                samples_add(&s, t, w);
+            }
+        }
+        report(b, "rand_write", &s);
+
+        for (int i = 0; i < n; i++) {
+            unsigned int offset = (rand_r(&b->seed) % slots) * RAND_IO_SIZE;
+            long long t = now_ns();
+            int r = fs_pread(b->fs, fd, buffer, RAND_IO_SIZE, offset);
+            t = now_ns() - t;
+            if (r == RAND_IO_SIZE) {
+                samples_add(&s, t, r);
+            }
+        }
+        report(b, "rand_read", &s);
+    }
+
+    fs_close(b->fs, fd);
+    fs_unlink(b->fs, path);
+    free(buffer);
+}
+
+// save：随机改写64个块后保存；load：卸载后重新挂载整个卷
+void bench_save_load(Bench* b) {
+    char buffer[RAND_IO_SIZE];
+    memset(buffer, 'y', sizeof(buffer));
+    Samples s;
+    samples_init(&s);
+
+    int fd = fs_open(b->fs, "/fill", 'a');
+    FsStat st;
+    fs_statfs(b->fs, &st);
+    int n = scaled(b, SAVE_OPS);
+    for (int i = 0; i < n; i++) {
+        if (fd >= 0) {
+            unsigned int slots = (st.data_blocks - st.free_blocks) / 2 + 1;
+            for (int k = 0; k < 64; k++) {
+                fs_pwrite(b->fs, fd, buffer, sizeof(buffer), (rand_r(&b->seed) % slots) * RAND_IO_SIZE);
+            }
+        }
+        long long t = now_ns();
+        int ret = fs_sync(b->fs);
+        t = now_ns() - t;
+        if (ret == FS_OK) {
+            fs_statfs(b->fs, &st);
+            samples_add(&s, t, (long long)st.saved_blocks * st.block_size);
+        }
+    }
+    if (fd >= 0) {
+        fs_close(b->fs, fd);
+    }
+    report(b, "save", &s);
+
+    n = scaled(b, LOAD_OPS);
+    for (int i = 0; i < n; i++) {
+        fs_unmount(b->fs);
+        long long t = now_ns();
+        int ret = fs_mount(&b->fs, b->image, b->journal, b->flags);
+        t = now_ns() - t;
+        if (ret != FS_OK) {
+            fprintf(stderr, "重新加载失败：%s！\n", fs_strerror(ret));
+            exit(1);
+        }
+        samples_add(&s, t, 0);
+    }
+    report(b, "load", &s);
+}
+
+// 主函数
+// 用法: fs_microbench [-l fat|extent] [-s 操作数比例] [-m] [-j] [映像文件]
+int main(int argc, char* argv[]) {
+    static const int fills[] = {0, 50, 90};
+    static const int dir_sizes[] = {16, 1024};
+    static const unsigned int file_sizes[] = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+
+    Bench b;
+    memset(&b, 0, sizeof(b));
+    b.image = BENCH_IMAGE;
+    b.layout = LAYOUT_EXTENT;
+    b.scale = 1.0;
+    b.seed = 12345u;
+    bool journal = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            b.layout = strcmp(argv[++i], "fat") == 0 ? LAYOUT_FAT : LAYOUT_EXTENT;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            b.scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            b.flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            journal = true;
+        } else if (argv[i][0] != '-') {
+            b.image = argv[i];
+        } else {
+            printf("用法: %s [-l fat|extent] [-s 操作数比例] [-m] [-j] [映像文件]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (b.scale <= 0) {
+        b.scale = 1.0;
+    }
+    b.journal = journal ? BENCH_JOURNAL : NULL;
+
+    int ret = fs_mount(&b.fs, b.image, b.journal, b.flags);
+    if (ret != FS_OK) {
+        fprintf(stderr, "加载文件系统失败：%s！\n", fs_strerror(ret));
+        return 1;
+    }
+
+    printf("bench\tlayout\tfill\tdir_size\tfile_size\tops\tops_per_sec\tmb_per_sec\tp50_us\tp99_us\n");
+
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        b.fill = fills[f];
+        fprintf(stderr, "填充率 %d%%：格式化并填充...\n", b.fill);
+        ret = fs_format(b.fs, b.layout, BENCH_BLOCK_SIZE, BENCH_BLOCK_COUNT, 0);
+        if (ret == FS_OK) {
+            ret = fill_volume(&b, b.fill);
+        }
+        if (ret != FS_OK) {
+            fprintf(stderr, "准备测试卷失败：%s！\n", fs_strerror(ret));
+            break;
+        }
+
+        for (size_t d = 0; d < sizeof(dir_sizes) / sizeof(dir_sizes[0]); d++) {
+            b.dir_size = dir_sizes[d];
+            if ((ret = make_dir(&b, b.dir_size)) != FS_OK) {
+                fprintf(stderr, "创建测试目录失败：%s！\n", fs_strerror(ret));
+                continue;
+            }
+            bench_names(&b);
+            bench_ls(&b);
+        }
+        b.dir_size = 0;
+
+        bench_cd(&b);
+        for (size_t k = 0; k < sizeof(file_sizes) / sizeof(file_sizes[0]); k++) {
+            b.file_size = file_sizes[k];
+            bench_io(&b);
+        }
+        b.file_size = 0;
+
+        bench_save_load(&b);
+    }
+
+    fs_unmount(b.fs);
+    unlink(b.image);
+    if (journal) {
+        unlink(BENCH_JOURNAL);
+    }
+    return ret == FS_OK ? 0 : 1;
+}
@@ -0,0 +1,763 @@
+/*
+ * 文件系统压力与正确性测试
+ *
+ * 各模式都以退出码报告结果（0 通过，1 失败），供 make test 调用：
+ *   并发（默认）：多个线程在同一实例上反复创建、写入、读回校验、删除文件和建删目录，
+ *                 主线程同时做sync、碎片整理和去重；结束后检查一致性，重新挂载后校验内容再检查一次
+ *   模型（-r）：单线程随机执行pwrite、fallocate、截断、碎片整理、去重、快照回滚和重新挂载，
+ *              每步后与内存中的模型对照文件内容，最后检查一致性；另外检查文件大小上限处的读写边界
+ *   崩溃（-k/-v）：-k 不停写入可校验的内容直到被杀死；-v 挂载（重放日志）后检查一致性，
+ *                 并校验每个文件的内容都是写入时的样式，由 fs_crashtest.sh 配合 kill -9 循环执行
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "douzza_fs.h"
+
+/* 常量定义 */
+#define STRESS_IMAGE "fs_stress.img"       // 默认映像文件名
+#define STRESS_JOURNAL "fs_stress.jnl"     // 默认日志文件名
+#define DEFAULT_THREADS 8                  // 并发模式的默认线程数
+#define DEFAULT_ROUNDS 300                 // 并发模式每个线程的默认轮数
+#define DEFAULT_STEPS 3000                 // 模型模式的默认步数
+#define STRESS_MAX_WRITE 9000              // 并发模式每个文件的最大长度
+#define STRESS_SLOTS 20                    // 并发模式每个线程轮流使用的文件数
+#define MODEL_FILES 6                      // 模型模式的文件数
+#define MODEL_MAX_SIZE (256 * 1024)        // 模型模式文件的最大长度
+#define MODEL_MAX_WRITE (20 * 1024)        // 模型模式每次写入的最大长度
+#define CRASH_THREADS 4                    // 崩溃模式的写入线程数
+#define CRASH_KEEP 30                      // 崩溃模式每个线程保留的文件数
+#define CRASH_MAX_SIZE (64 * 1024)         // 崩溃模式文件的最大长度
+#define CRASH_SECONDS 60                   // 崩溃模式没被杀死时最多运行的秒数
+
+/* 结构体定义 */
+
+// 并发模式的线程参数
+typedef struct {
+    fs_instance* fs;
+    int id;                              // 线程编号，对应目录 /d<id> 和文件 /shared/f<id>_*
+    int rounds;                          // 轮数
+    int errors;                          // 出错次数
+} StressThread;
+
+// 模型模式中一个文件的预期内容
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    unsigned char* data;
+    unsigned int size;
+} ModelFile;
+
+// 崩溃模式收集目录项
+typedef struct {
+    char names[CRASH_KEEP * 8][MAX_FILENAME_LENGTH];
+    unsigned int sizes[CRASH_KEEP * 8];
+    bool dirs[CRASH_KEEP * 8];
+    int count;
+} NameList;
+
+/* 全局变量 */
+int finished = 0;                        // 并发模式中已经结束的工作线程数
+
+/* 函数声明 */
+unsigned char pattern_byte(unsigned int id, unsigned int offset);
+unsigned int path_id(const char* path);
+void fill_pattern(unsigned char* buffer, unsigned int id, unsigned int offset, unsigned int length);
+int check_fsck(fs_instance* fs, const char* when);
+void* stress_thread(void* arg);
+int run_stress(const char* image, int flags, int threads, int rounds);
+int model_verify(fs_instance* fs, ModelFile* files);
+int model_large(fs_instance* fs, bool create);
+int run_model(const char* image, int steps, unsigned int seed);
+int collect_names(const FsDirent* entry, void* arg);
+int verify_pattern_file(fs_instance* fs, const char* path, unsigned int size);
+void* crash_thread(void* arg);
+int run_crash_writer(const char* image, const char* journal);
+int run_crash_verify(const char* image, const char* journal);
+
+// 文件内容的样式：由文件编号和偏移决定，任何前缀都可以单独校验
+unsigned char pattern_byte(unsigned int id, unsigned int offset) {
+    return (unsigned char)(offset * 131u + id * 17u + (offset >> 9));
+}
+
+// 由路径算出文件编号（FNV-1a）
+unsigned int path_id(const char* path) {
+    unsigned int h = 2166136261u;
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+void fill_pattern(unsigned char* buffer, unsigned int id, unsigned int offset, unsigned int length) {
+    for (unsigned int i = 0; i < length; i++) {
+        buffer[i] = pattern_byte(id, offset + i);
+    }
+}
+
+// 检查一致性（不修复），有问题时输出各项计数并返回-1
+int check_fsck(fs_instance* fs, const char* when) {
+    FsFsckStat st;
+    int ret = fs_fsck(fs, false, &st);
+    if (ret != FS_OK) {
+        printf("%s检查失败：%s！\n", when, fs_strerror(ret));
+        return -1;
+    }
+    if (st.problems != 0) {
+        printf("%s发现 %u 个问题（元数据 %u，目录项 %u，链接 %u，索引 %u，FAT链 %u，区段 %u，小文件 %u，"
+               "大小 %u，交叉 %u，丢失 %u，引用空闲 %u，共享计数 %u）\n", when, st.problems,
+               st.meta_errors, st.bad_entries, st.dir_links, st.dir_indexes, st.chain_errors,
+               st.extent_errors, st.small_errors, st.size_errors, st.cross_links, st.lost_blocks,
+               st.free_referenced, st.ref_errors);
+        return -1;
+    }
+    return 0;
+}
+
+/* 并发模式 */
+
+// 工作线程：在共享目录中轮流重写STRESS_SLOTS个文件并读回校验，在自己的目录下建删子目录
+void* stress_thread(void* arg) {
+    StressThread* st = (StressThread*)arg;
+    unsigned char* buffer = (unsigned char*)malloc(STRESS_MAX_WRITE);
+    unsigned char* check = (unsigned char*)malloc(STRESS_MAX_WRITE + 1);
+    unsigned int seed = 777u + st->id;
+    char path[MAX_PATH_LENGTH];
+
+    if (buffer == NULL || check == NULL) {
+        st->errors++;
+        st->rounds = 0;
+    }
+    snprintf(path, sizeof(path), "/d%d", st->id);
+    fs_mkdir(st->fs, path);
+
+    for (int k = 0; k < st->rounds; k++) {
+        snprintf(path, sizeof(path), "/shared/f%d_%d", st->id, k % STRESS_SLOTS);
+        int ret = fs_create(st->fs, path, (k & 1) ? LAYOUT_EXTENT : LAYOUT_FAT);
+        if (ret != FS_OK && ret != FS_ERR_EXIST) {
+            printf("线程 %d 创建 %s 失败：%s\n", st->id, path, fs_strerror(ret));
+            st->errors++;
+            continue;
+        }
+
+        // 有时先预留，有时先写后半段（前面留出空洞）再补上前半段
+        unsigned int n = 1 + rand_r(&seed) % STRESS_MAX_WRITE;
+        fill_pattern(buffer, path_id(path) + k, 0, n);
+        int fd = fs_open(st->fs, path, 'w');
+        if (fd < 0) {
+            printf("线程 %d 打开 %s 失败：%s\n", st->id, path, fs_strerror(fd));
+            st->errors++;
+            continue;
+        }
+        if (k % 5 == 0) {
+            fs_fallocate(st->fs, fd, n + 4096);
+        }
+        if (k % 3 == 1) {
+            unsigned int half = n / 2;
+            ret = fs_pwrite(st->fs, fd, (const char*)buffer + half, n - half, half);
+            if (ret == (int)(n - half)) {
+                ret = fs_pwrite(st->fs, fd, (const char*)buffer, half, 0) == (int)half ? (int)n : -1;
+            }
+        } else {
+            ret = fs_write(st->fs, fd, (const char*)buffer, n);
+        }
+        fs_close(st->fs, fd);
+        if (ret != (int)n) {
+            printf("线程 %d 写入 %s 失败：%d\n", st->id, path, ret);
+            st->errors++;
+            continue;
+        }
+
+        fd = fs_open(st->fs, path, 'r');
+        int got = fd >= 0 ? fs_read(st->fs, fd, (char*)check, STRESS_MAX_WRITE + 1) : fd;
+        if (fd >= 0) {
+            fs_close(st->fs, fd);
+        }
+        if (got != (int)n || memcmp(check, buffer, n) != 0) {
+            printf("线程 %d 读回 %s 不一致（读出 %d 字节，应为 %u）\n", st->id, path, got, n);
+            st->errors++;
+        }
+        if (k % 3 == 0 && fs_unlink(st->fs, path) != FS_OK) {
+            st->errors++;
+        }
+
+        snprintf(path, sizeof(path), "/d%d/x%d", st->id, k);
+        if (fs_mkdir(st->fs, path) != FS_OK || ((k & 1) && fs_rmdir(st->fs, path) != FS_OK)) {
+            st->errors++;
+        }
+    }
+
+    free(buffer);
+    free(check);
+    __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// 并发模式：结束后检查一致性，重新挂载后校验最后留下的文件并再检查一次
+int run_stress(const char* image, int flags, int threads, int rounds) {
+    bool journal = !(flags & FS_MOUNT_MMAP);
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal ? STRESS_JOURNAL : NULL, flags);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+    if ((ret = fs_format(fs, LAYOUT_FAT, 1024, 32768, 0)) != FS_OK ||
+        (ret = fs_mkdir(fs, "/shared")) != FS_OK) {
+        printf("准备测试卷失败：%s！\n", fs_strerror(ret));
+        fs_unmount(fs);
+        return -1;
+    }
+    if (journal) {
+        fs_set_writeback(fs, 20, 0);
+    }
+
+    pthread_t tids[MAX_OPEN_FILES];
+    StressThread args[MAX_OPEN_FILES];
+    for (int t = 0; t < threads; t++) {
+        args[t].fs = fs;
+        args[t].id = t;
+        args[t].rounds = rounds;
+        args[t].errors = 0;
+        pthread_create(&tids[t], NULL, stress_thread, &args[t]);
+    }
+
+    // 工作线程运行期间不断做需要独占实例的操作
+    int extra = 0;
+    unsigned int dummy;
+    FsDedupStat ds;
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < threads) {
+        int r = extra++ % 3;
+        ret = r == 0 ? fs_sync(fs) : r == 1 ? fs_defrag(fs, &dummy) : fs_dedup(fs, &ds);
+        if (ret != FS_OK && ret != FS_ERR_NOSPC && ret != FS_ERR_INVAL) {
+            printf("并发%s失败：%s\n", r == 0 ? "sync" : r == 1 ? "碎片整理" : "去重", fs_strerror(ret));
+            args[0].errors++;
+        }
+        usleep(5000);
+    }
+
+    int errors = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        errors += args[t].errors;
+    }
+    printf("%d 个线程各 %d 轮，穿插 %d 次sync/碎片整理/去重%s，出错 %d 次\n",
+           threads, rounds, extra, journal ? "（使用日志和后台回写）" : "（映射模式）", errors);
+    if (check_fsck(fs, "并发测试后") != 0) {
+        errors++;
+    }
+    if ((ret = fs_unmount(fs)) != FS_OK) {
+        printf("卸载失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+
+    // 重新挂载，留下的文件是各槽最后一轮写的内容
+    if ((ret = fs_mount(&fs, image, journal ? STRESS_JOURNAL : NULL, flags)) != FS_OK) {
+        printf("重新挂载失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+    unsigned char* check = (unsigned char*)malloc(STRESS_MAX_WRITE + 1);
+    for (int t = 0; t < threads && check != NULL; t++) {
+        unsigned int seed = 777u + t;
+        unsigned int sizes[STRESS_SLOTS] = {0};
+        bool present[STRESS_SLOTS] = {false};
+        int last[STRESS_SLOTS] = {0};
+        for (int k = 0; k < rounds; k++) {
+            sizes[k % STRESS_SLOTS] = 1 + rand_r(&seed) % STRESS_MAX_WRITE;
+            present[k % STRESS_SLOTS] = (k % 3 != 0);
+            last[k % STRESS_SLOTS] = k;
+        }
+        for (int s = 0; s < STRESS_SLOTS && s < rounds; s++) {
+            char path[MAX_PATH_LENGTH];
+            snprintf(path, sizeof(path), "/shared/f%d_%d", t, s);
+            int fd = fs_open(fs, path, 'r');
+            if (!present[s]) {
+                if (fd >= 0) {
+                    printf("重新挂载后 %s 应已删除\n", path);
+                    fs_close(fs, fd);
+                    errors++;
+                }
+                continue;
+            }
+            int got = fd >= 0 ? fs_read(fs, fd, (char*)check, STRESS_MAX_WRITE + 1) : fd;
+            if (fd >= 0) {
+                fs_close(fs, fd);
+            }
+            unsigned int n = sizes[s];
+            unsigned int id = path_id(path) + last[s];
+            bool ok = got == (int)n;
+            for (unsigned int i = 0; ok && i < n; i++) {
+                ok = check[i] == pattern_byte(id, i);
+            }
+            if (!ok) {
+                printf("重新挂载后 %s 内容不一致（读出 %d 字节，应为 %u）\n", path, got, n);
+                errors++;
+            }
+        }
+    }
+    free(check);
+    if (check_fsck(fs, "重新挂载后") != 0) {
+        errors++;
+    }
+    fs_unmount(fs);
+    return errors == 0 ? 0 : -1;
+}
+
+/* 模型模式 */
+
+// 逐个文件与模型对照
+int model_verify(fs_instance* fs, ModelFile* files) {
+    unsigned char* check = (unsigned char*)malloc(MODEL_MAX_SIZE + 1);
+    int bad = 0;
+    for (int i = 0; i < MODEL_FILES && check != NULL; i++) {
+        int fd = fs_open(fs, files[i].path, 'r');
+        int got = fd >= 0 ? fs_read(fs, fd, (char*)check, MODEL_MAX_SIZE + 1) : fd;
+        if (fd >= 0) {
+            fs_close(fs, fd);
+        }
+        if (got != (int)files[i].size || memcmp(check, files[i].data, files[i].size) != 0) {
+            unsigned int at = 0;
+            while (got > 0 && at < files[i].size && at < (unsigned int)got && check[at] == files[i].data[at]) {
+                at++;
+            }
+            printf("%s 与模型不一致：读出 %d 字节，应为 %u，第一个不同的字节在 %u\n",
+                   files[i].path, got, files[i].size, at);
+            bad++;
+        }
+    }
+    free(check);
+    return check == NULL || bad > 0 ? -1 : 0;
+}
+
+// 大偏移的边界：在区段布局的稀疏文件/m/big末尾（文件大小上限处）写16字节，检查越过上限的写入被拒绝、
+// 末尾附近的读取截到文件末尾、lseek能到达末尾；create为false时只检查内容和边界（随机操作之后）
+int model_large(fs_instance* fs, bool create) {
+    const char* path = "/m/big";
+    unsigned int tail = FS_MAX_FILE_SIZE - 16;
+    unsigned char data[16];
+    unsigned char check[256];
+    fill_pattern(data, 9, tail, sizeof(data));
+    if (create && fs_create(fs, path, LAYOUT_EXTENT) != FS_OK) {
+        printf("创建 %s 失败\n", path);
+        return -1;
+    }
+
+    int fd = fs_open(fs, path, 'a');
+    if (fd < 0) {
+        printf("打开 %s 失败：%s\n", path, fs_strerror(fd));
+        return -1;
+    }
+    int bad = 0;
+    if (create && fs_pwrite(fs, fd, (const char*)data, sizeof(data), tail) != (int)sizeof(data)) {
+        printf("在 %u 处写入失败\n", tail);
+        bad++;
+    }
+    // 越过上限（包括32位会回绕的位置）的写入一个字节也不写
+    if (fs_pwrite(fs, fd, (const char*)check, 100, 0xFFFFFFF8U) != FS_ERR_INVAL ||
+        fs_pwrite(fs, fd, (const char*)check, 1, FS_MAX_FILE_SIZE) != FS_ERR_INVAL ||
+        fs_pwrite(fs, fd, (const char*)check, 32, tail + 8) != FS_ERR_INVAL ||
+        fs_fallocate(fs, fd, FS_MAX_FILE_SIZE + 1U) != FS_ERR_INVAL) {
+        printf("越过文件大小上限的写入没有被拒绝\n");
+        bad++;
+    }
+    // 读取截到文件末尾，末尾之后读出0字节
+    if (fs_pread(fs, fd, (char*)check, 200, tail + 8) != 8 || memcmp(check, data + 8, 8) != 0 ||
+        fs_pread(fs, fd, (char*)check, 200, 0xFFFFFFF0U) != 0 ||
+        fs_pread(fs, fd, (char*)check, 16, tail - 16) != 16 || check[0] != 0 || check[15] != 0) {
+        printf("文件末尾附近的读取不正确\n");
+        bad++;
+    }
+    // 顺序读写的接口能到达同样的范围
+    if (fs_lseek(fs, fd, 0, MY_SEEK_END) != (int)FS_MAX_FILE_SIZE ||
+        fs_lseek(fs, fd, -16, MY_SEEK_END) != (int)tail ||
+        fs_read(fs, fd, (char*)check, sizeof(check)) != 16 || memcmp(check, data, 16) != 0 ||
+        fs_lseek(fs, fd, 1, MY_SEEK_END) != FS_ERR_INVAL) {
+        printf("lseek和read不能到达文件末尾\n");
+        bad++;
+    }
+    fs_close(fs, fd);
+    return bad == 0 ? 0 : -1;
+}
+
+// 模型模式：每一步之后都对照全部文件，快照时保存模型的副本，回滚时恢复
+int run_model(const char* image, int steps, unsigned int seed) {
+    fs_instance* fs;
+    int flags = FS_MOUNT_SPARSE;
+    int ret = fs_mount(&fs, image, STRESS_JOURNAL, flags);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+    if ((ret = fs_format(fs, LAYOUT_EXTENT, 1024, 16384, 0)) != FS_OK || (ret = fs_mkdir(fs, "/m")) != FS_OK) {
+        printf("准备测试卷失败：%s！\n", fs_strerror(ret));
+        fs_unmount(fs);
+        return -1;
+    }
+
+    ModelFile files[MODEL_FILES];
+    ModelFile saved[MODEL_FILES];
+    bool has_snapshot = false;
+    unsigned char* buffer = (unsigned char*)malloc(MODEL_MAX_WRITE);
+    for (int i = 0; i < MODEL_FILES; i++) {
+        snprintf(files[i].path, sizeof(files[i].path), "/m/f%d", i);
+        files[i].data = (unsigned char*)calloc(1, MODEL_MAX_SIZE);
+        files[i].size = 0;
+        saved[i].data = (unsigned char*)calloc(1, MODEL_MAX_SIZE);
+        saved[i].size = 0;
+        if (files[i].data == NULL || saved[i].data == NULL || buffer == NULL) {
+            printf("内存分配失败！\n");
+            return -1;
+        }
+        fs_create(fs, files[i].path, (i & 1) ? LAYOUT_FAT : LAYOUT_EXTENT);
+    }
+
+    int errors = model_large(fs, true) != 0 ? 1 : 0;
+    const char* op = "";
+    unsigned int first_seed = seed;
+    for (int step = 0; step < steps && errors == 0; step++) {
+        ModelFile* f = &files[rand_r(&seed) % MODEL_FILES];
+        int r = rand_r(&seed) % 100;
+        ret = FS_OK;
+        if (r < 60) {
+            // 写入：随机位置和长度（包括0字节和越过末尾留下空洞），内容是随机字节、全零或与其他块相同的样式
+            op = "pwrite";
+            unsigned int offset = rand_r(&seed) % (MODEL_MAX_SIZE - MODEL_MAX_WRITE);
+            unsigned int length = rand_r(&seed) % 8 == 0 ? 0 : rand_r(&seed) % MODEL_MAX_WRITE;
+            int kind = rand_r(&seed) % 3;
+            for (unsigned int i = 0; i < length; i++) {
+                buffer[i] = kind == 0 ? (unsigned char)rand_r(&seed) : kind == 1 ? 0 : pattern_byte(1, (offset + i) % 1024);
+            }
+            int fd = fs_open(fs, f->path, 'a');
+            int got = fd >= 0 ? fs_pwrite(fs, fd, (const char*)buffer, length, offset) : fd;
+            if (fd >= 0) {
+                fs_close(fs, fd);
+            }
+            if (got != (int)length) {
+                printf("第 %d 步 pwrite %s %u@%u 返回 %d\n", step, f->path, length, offset, got);
+                errors++;
+            } else if (length > 0) {
+                memcpy(f->data + offset, buffer, length);
+                if (offset + length > f->size) {
+                    f->size = offset + length;
+                }
+            }
+        } else if (r < 70) {
+            op = "fallocate";
+            int fd = fs_open(fs, f->path, 'a');
+            ret = fd >= 0 ? fs_fallocate(fs, fd, rand_r(&seed) % MODEL_MAX_SIZE) : fd;
+            if (fd >= 0) {
+                fs_close(fs, fd);
+            }
+        } else if (r < 78) {
+            // 以写模式打开即截断为空
+            op = "truncate";
+            int fd = fs_open(fs, f->path, 'w');
+            ret = fd >= 0 ? fs_close(fs, fd) : fd;
+            memset(f->data, 0, f->size);
+            f->size = 0;
+        } else if (r < 83) {
+            op = "defrag";
+            unsigned int moved;
+            ret = fs_defrag(fs, &moved);
+        } else if (r < 88) {
+            op = "dedup";
+            FsDedupStat ds;
+            ret = fs_dedup(fs, &ds);
+        } else if (r < 92) {
+            op = "snapshot";
+            if (has_snapshot) {
+                fs_snapshot_delete(fs, "s");
+            }
+            ret = fs_snapshot_create(fs, "s");
+            has_snapshot = ret == FS_OK;
+            for (int i = 0; i < MODEL_FILES && has_snapshot; i++) {
+                memcpy(saved[i].data, files[i].data, MODEL_MAX_SIZE);
+                saved[i].size = files[i].size;
+            }
+        } else if (r < 95) {
+            op = "rollback";
+            if (has_snapshot) {
+                ret = fs_snapshot_rollback(fs, "s");
+                for (int i = 0; i < MODEL_FILES && ret == FS_OK; i++) {
+                    memcpy(files[i].data, saved[i].data, MODEL_MAX_SIZE);
+                    files[i].size = saved[i].size;
+                }
+            }
+        } else {
+            op = "remount";
+            ret = fs_unmount(fs);
+            if (ret == FS_OK) {
+                ret = fs_mount(&fs, image, STRESS_JOURNAL, flags);
+                if (ret != FS_OK) {
+                    printf("第 %d 步重新挂载失败：%s！\n", step, fs_strerror(ret));
+                    errors++;
+                    break;
+                }
+            }
+        }
+        if (ret != FS_OK) {
+            printf("第 %d 步 %s 失败：%s\n", step, op, fs_strerror(ret));
+            errors++;
+        }
+        if (errors == 0 && model_verify(fs, files) != 0) {
+            printf("第 %d 步 %s 之后内容不一致\n", step, op);
+            errors++;
+        }
+        if (errors == 0 && step % 200 == 199 && check_fsck(fs, "模型测试中") != 0) {
+            errors++;
+        }
+    }
+
+    if (errors == 0 && model_large(fs, false) != 0) {
+        errors++;
+    }
+    if (errors == 0 && check_fsck(fs, "模型测试后") != 0) {
+        errors++;
+    }
+    printf("模型测试 %d 步（种子 %u）：%s\n", steps, first_seed, errors == 0 ? "通过" : "失败");
+    fs_unmount(fs);
+    for (int i = 0; i < MODEL_FILES; i++) {
+        free(files[i].data);
+        free(saved[i].data);
+    }
+    free(buffer);
+    return errors == 0 ? 0 : -1;
+}
+
+/* 崩溃模式 */
+
+int collect_names(const FsDirent* entry, void* arg) {
+    NameList* list = (NameList*)arg;
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+        return 0;
+    }
+    if (list->count == (int)(sizeof(list->sizes) / sizeof(list->sizes[0]))) {
+        return 1;
+    }
+    strcpy(list->names[list->count], entry->name);
+    list->sizes[list->count] = entry->size;
+    list->dirs[list->count] = entry->is_dir;
+    list->count++;
+    return 0;
+}
+
+// 校验文件的长度与目录项一致，内容是该路径对应的样式
+int verify_pattern_file(fs_instance* fs, const char* path, unsigned int size) {
+    unsigned char* check = (unsigned char*)malloc(CRASH_MAX_SIZE + 1);
+    int fd = fs_open(fs, path, 'r');
+    int got = fd >= 0 && check != NULL ? fs_read(fs, fd, (char*)check, CRASH_MAX_SIZE + 1) : fd;
+    if (fd >= 0) {
+        fs_close(fs, fd);
+    }
+    bool ok = got == (int)size;
+    unsigned int id = path_id(path);
+    for (int i = 0; ok && i < got; i++) {
+        ok = check[i] == pattern_byte(id, i);
+    }
+    if (!ok) {
+        printf("%s 内容不一致（读出 %d 字节，目录项为 %u）\n", path, got, size);
+    }
+    free(check);
+    return ok ? 0 : -1;
+}
+
+// 写入线程：在自己的目录下不断新建文件，分若干次追加样式内容，只保留最近CRASH_KEEP个
+void* crash_thread(void* arg) {
+    fs_instance* fs = ((StressThread*)arg)->fs;
+    int id = ((StressThread*)arg)->id;
+    unsigned char* buffer = (unsigned char*)malloc(CRASH_MAX_SIZE);
+    unsigned int seed = (unsigned int)getpid() * 31u + id;
+    char dir[MAX_FILENAME_LENGTH * 2];
+    char path[MAX_PATH_LENGTH];
+    time_t start = time(NULL);
+
+    snprintf(dir, sizeof(dir), "/p%dt%d", (int)getpid(), id);
+    fs_mkdir(fs, dir);
+    for (int k = 0; buffer != NULL && time(NULL) - start < CRASH_SECONDS; k++) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, k);
+        if (fs_create(fs, path, (id & 1) ? LAYOUT_EXTENT : LAYOUT_FAT) != FS_OK) {
+            continue;
+        }
+        unsigned int size = rand_r(&seed) % CRASH_MAX_SIZE;
+        fill_pattern(buffer, path_id(path), 0, size);
+        int fd = fs_open(fs, path, 'w');
+        for (unsigned int done = 0; fd >= 0 && done < size; ) {
+            unsigned int n = 1 + rand_r(&seed) % 8192;
+            n = n < size - done ? n : size - done;
+            if (fs_write(fs, fd, (const char*)buffer + done, n) != (int)n) {
+                break;
+            }
+            done += n;
+        }
+        if (fd >= 0) {
+            fs_close(fs, fd);
+        }
+        if (k >= CRASH_KEEP) {
+            snprintf(path, sizeof(path), "%s/f%d", dir, k - CRASH_KEEP);
+            fs_unlink(fs, path);
+        }
+        if (k % 50 == 49) {
+            fs_sync(fs);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// 崩溃模式的写入端：先删掉上次被杀死的进程留下的目录，再开始写入
+int run_crash_writer(const char* image, const char* journal) {
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal, 0);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+    FsStat info;
+    fs_statfs(fs, &info);
+    if (info.mount_state != FS_MOUNT_LOADED) {
+        fs_format(fs, LAYOUT_FAT, 1024, 32768, 0);
+    }
+
+    NameList* top = (NameList*)calloc(1, sizeof(NameList));
+    NameList* list = (NameList*)calloc(1, sizeof(NameList));
+    if (top != NULL && list != NULL) {
+        fs_listdir(fs, "/", collect_names, top);
+        for (int i = 0; i < top->count; i++) {
+            char dir[MAX_FILENAME_LENGTH + 1];
+            char path[MAX_PATH_LENGTH];
+            snprintf(dir, sizeof(dir), "/%s", top->names[i]);
+            list->count = 0;
+            fs_listdir(fs, dir, collect_names, list);
+            for (int j = 0; j < list->count; j++) {
+                snprintf(path, sizeof(path), "%s/%s", dir, list->names[j]);
+                fs_unlink(fs, path);
+            }
+            fs_rmdir(fs, dir);
+        }
+    }
+    free(top);
+    free(list);
+
+    fs_set_writeback(fs, 50, 0);
+    pthread_t tids[CRASH_THREADS];
+    StressThread args[CRASH_THREADS];
+    for (int t = 0; t < CRASH_THREADS; t++) {
+        args[t].fs = fs;
+        args[t].id = t;
+        pthread_create(&tids[t], NULL, crash_thread, &args[t]);
+    }
+    for (int t = 0; t < CRASH_THREADS; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    return fs_unmount(fs) == FS_OK ? 0 : -1;
+}
+
+// 崩溃模式的检查端：重放日志后一致性检查没有问题，且每个文件都是写入时的样式（可以只写了一部分）
+int run_crash_verify(const char* image, const char* journal) {
+    fs_instance* fs;
+    int ret = fs_mount(&fs, image, journal, 0);
+    if (ret != FS_OK) {
+        printf("加载文件系统失败：%s！\n", fs_strerror(ret));
+        return -1;
+    }
+    FsStat info;
+    fs_statfs(fs, &info);
+    if (info.mount_state != FS_MOUNT_LOADED) {
+        printf("映像文件 %s 无效！\n", image);
+        return -1;
+    }
+
+    int errors = check_fsck(fs, "重放日志后") != 0 ? 1 : 0;
+    int files = 0;
+    NameList* top = (NameList*)calloc(1, sizeof(NameList));
+    NameList* list = (NameList*)calloc(1, sizeof(NameList));
+    if (top == NULL || list == NULL) {
+        errors++;
+    } else {
+        fs_listdir(fs, "/", collect_names, top);
+        for (int i = 0; i < top->count; i++) {
+            char dir[MAX_FILENAME_LENGTH + 1];
+            char path[MAX_PATH_LENGTH];
+            snprintf(dir, sizeof(dir), "/%s", top->names[i]);
+            list->count = 0;
+            fs_listdir(fs, dir, collect_names, list);
+            for (int j = 0; j < list->count; j++) {
+                snprintf(path, sizeof(path), "%s/%s", dir, list->names[j]);
+                if (!list->dirs[j] && verify_pattern_file(fs, path, list->sizes[j]) != 0) {
+                    errors++;
+                }
+                files++;
+            }
+        }
+    }
+    free(top);
+    free(list);
+    printf("重放 %u 个事务，校验 %d 个文件：%s\n", info.replayed, files, errors == 0 ? "通过" : "失败");
+    fs_unmount(fs);
+    return errors == 0 ? 0 : -1;
+}
+
+// 主函数
+// 用法: fs_stress [-t 线程数] [-n 轮数] [-m] [映像文件]      并发模式
+//       fs_stress -r [-n 步数] [-S 种子] [映像文件]          模型模式
+//       fs_stress -k|-v 映像文件 日志文件                    崩溃模式的写入端和检查端
+int main(int argc, char* argv[]) {
+    int threads = DEFAULT_THREADS;
+    int count = 0;
+    int flags = 0;
+    char mode = 's';
+    unsigned int seed = 1;
+    const char* image = STRESS_IMAGE;
+    const char* journal = NULL;
+    int positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "-v") == 0) {
+            mode = argv[i][1];
+        } else if (argv[i][0] != '-' && positional == 0) {
+            image = argv[i];
+            positional++;
+        } else if (argv[i][0] != '-' && positional == 1) {
+            journal = argv[i];
+            positional++;
+        } else {
+            printf("用法: %s [-t 线程数] [-n 轮数] [-m] [映像文件]\n"
+                   "      %s -r [-n 步数] [-S 种子] [映像文件]\n"
+                   "      %s -k|-v 映像文件 日志文件\n", argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    int ret;
+    if (mode == 'k' || mode == 'v') {
+        if (journal == NULL) {
+            printf("崩溃模式需要指定映像文件和日志文件\n");
+            return 1;
+        }
+        ret = mode == 'k' ? run_crash_writer(image, journal) : run_crash_verify(image, journal);
+        return ret == 0 ? 0 : 1;
+    }
+
+    if (mode == 'r') {
+        ret = run_model(image, count > 0 ? count : DEFAULT_STEPS, seed);
+    } else {
+        // 每个线程同时最多打开一个文件
+        threads = threads < 1 ? 1 : threads > MAX_OPEN_FILES ? MAX_OPEN_FILES : threads;
+        ret = run_stress(image, flags, threads, count > 0 ? count : DEFAULT_ROUNDS);
+    }
+    unlink(image);
+    unlink(STRESS_JOURNAL);
+    return ret == 0 ? 0 : 1;
+}